@@ -76,6 +76,25 @@ enum LoadFlag { NO_LOAD, NEW_EPHEMERAL_KEY, LEAVE, NEW_SECRET_SHARE };
 
 const std::string c_np1sec_protocol_name(":o3np1sec:");
 const DTShort c_np1sec_protocol_version = 0x0001;
+// in-session messages with sid index instead of sid, varint ids, no
+// nonce (the sender's message counter is unique already) and possibly
+// truncated transcript hash
+const DTShort c_np1sec_compact_protocol_version = 0x0002;
+const size_t c_truncated_transcript_hash_length = 8;
+// every this many user messages a compact sender still sends the full hash
+const uint32_t c_full_transcript_hash_period = 8;
+// PARTICIPANTS_INFO of a session whose participants all take session
+// views as deltas against the parent session. Only these carry deltas
+const DTShort c_np1sec_delta_views_protocol_version = 0x0003;
+// PARTICIPANTS_INFO deltas a joiner keeps till it gets the full view
+const size_t c_max_deferred_session_views = 1024;
+// largest user message we send in fragments or reassemble from them
+const size_t c_max_reassembled_message_size = 1 << 20;
+// streamed transfers: random id, largest chunk we send and how many
+// transfers we follow at once per session
+const size_t c_transfer_id_length = 16;
+const size_t c_transfer_chunk_size = 1 << 16;
+const size_t c_max_incoming_transfers = 64;
 const std::string c_np1sec_delim(":o3"); // because http://en.wikipedia.org/wiki/Man%27s_best_friend_(phrase)
 const std::string c_subfield_delim(":"); // needed by ParticipantId defined in interface.h
 
@@ -31,6 +31,7 @@
 #include "src/crypt.h"
 #include "src/exceptions.h"
 #include "src/logger.h"
+#include "src/profiler.h"
 #include "common.h"
 #include "crypt.h"
 #include "exceptions.h"
@@ -170,7 +171,7 @@ std::string hash_to_string_buff(const HashBlock hash_block)
  */
 const uint8_t* strbuff_to_hash(std::string& hash_block_buffer)
 {
-    logger.assert_or_die(hash_block_buffer.size() == sizeof(HashBlock), "Hash block doesn't have std size");
+    NP1SEC_ASSERT_OR_DIE(hash_block_buffer.size() == sizeof(HashBlock), "Hash block doesn't have std size");
     return reinterpret_cast<const uint8_t*>(hash_block_buffer.c_str());
 }
 
@@ -310,6 +311,11 @@ void release_crypto_resource(gcry_sexp_t crypto_resource)
     }
 }
 
+SharedPublicKey share_crypto_resource(gcry_sexp_t crypto_resource)
+{
+    return SharedPublicKey(crypto_resource, release_crypto_resource);
+}
+
 gcry_sexp_t copy_crypto_resource(gcry_sexp_t crypto_resource)
 {
     gcry_sexp_t copied_resource;
@@ -345,6 +351,7 @@ gcry_sexp_t copy_crypto_resource(gcry_sexp_t crypto_resource)
 void Cryptic::triple_ed_dh(PublicKey peer_ephemeral_key, PublicKey peer_long_term_key,
                            AsymmetricKey my_long_term_key, bool peer_is_first, Token* teddh_token)
 {
+    NP1SEC_PROBE(PROBE_TRIPLE_ED_DH);
     gcry_error_t err = 0;
     bool failed = true;
     // we need to call
@@ -430,6 +437,7 @@ leave:
 
 void Cryptic::sign(unsigned char** sigp, size_t* siglenp, std::string plain_text)
 {
+    NP1SEC_PROBE(PROBE_CRYPTIC_SIGN);
     const char *r, *s;
     gcry_error_t err = 0;
     gcry_sexp_t plain_sexp = nullptr, sigs = nullptr, eddsa = nullptr, rs = nullptr, ss = nullptr;
@@ -489,7 +497,7 @@ void Cryptic::sign(unsigned char** sigp, size_t* siglenp, std::string plain_text
     s = gcry_sexp_nth_data(ss, 1, &ns);
     memset(*sigp, 0, magic_number);
 
-    logger.assert_or_die(nr == 32 && ns == 32, "wrong signature length");
+    NP1SEC_ASSERT_OR_DIE(nr == 32 && ns == 32, "wrong signature length");
 
     memcpy(*sigp, r, nr);
     memcpy((*sigp) + half_magic_number, s, ns);
@@ -498,7 +506,7 @@ void Cryptic::sign(unsigned char** sigp, size_t* siglenp, std::string plain_text
     gcry_sexp_release(ss);
 
     // it seems that we have assumed this
-    logger.assert_or_die(magic_number == nr + ns, "signature length is wrong", __FUNCTION__);
+    NP1SEC_ASSERT_OR_DIE(magic_number == nr + ns, "signature length is wrong", __FUNCTION__);
     *siglenp = magic_number;
 
     return;
@@ -512,6 +520,7 @@ err:
 
 bool Cryptic::verify(std::string plain_text, const unsigned char* sigbuf, PublicKey signer_ephemeral_pub_key)
 {
+    NP1SEC_PROBE(PROBE_CRYPTIC_VERIFY);
     gcry_error_t err;
     gcry_sexp_t datas = nullptr, sigs = nullptr;
     static const uint32_t nr = 32, ns = 32;
@@ -540,7 +549,7 @@ bool Cryptic::verify(std::string plain_text, const unsigned char* sigbuf, Public
     gcry_sexp_release(sigs);
     gcry_sexp_release(datas);
     if (err == GPG_ERR_NO_ERROR) {
-        logger.debug("good signature", __FUNCTION__);
+        NP1SEC_LOG_DEBUG("good signature", __FUNCTION__);
         return true;
 
     } else if (err == GPG_ERR_BAD_SIGNATURE) {
@@ -588,6 +597,7 @@ err:
 
 std::string Cryptic::Encrypt(std::string plain_text)
 {
+    NP1SEC_PROBE(PROBE_CRYPTIC_ENCRYPT);
     std::string crypt_text = plain_text;
     gcry_error_t err = 0;
     gcry_cipher_hd_t hd = OpenCipher(); // TODO: we shouldn't need to open cipher all the time
@@ -622,6 +632,7 @@ err:
 
 std::string Cryptic::Decrypt(std::string encrypted_text)
 {
+    NP1SEC_PROBE(PROBE_CRYPTIC_DECRYPT);
     gcry_error_t err = 0;
     gcry_cipher_hd_t hd = OpenCipher();
 
@@ -651,13 +662,363 @@ err:
     throw CryptoException();
 }
 
+ChunkCipher::ChunkCipher(const np1secSymmetricKey session_key, const std::string& transfer_context)
+{
+    std::string key_material(reinterpret_cast<const char*>(session_key), sizeof(np1secSymmetricKey));
+    key_material += transfer_context;
+    hash(key_material, transfer_key, true);
+    secure_wipe(const_cast<char*>(key_material.data()), key_material.size());
+}
+
+gcry_cipher_hd_t ChunkCipher::open_chunk_cipher(uint32_t chunk_index, bool last_chunk)
+{
+    gcry_error_t err = 0;
+    gcry_cipher_hd_t hd = nullptr;
+    // the index followed by the last flag, used both as nonce and
+    // associated data
+    uint8_t chunk_nonce[c_chunk_nonce_length] = {};
+    memcpy(chunk_nonce, &chunk_index, sizeof(chunk_index));
+    chunk_nonce[sizeof(chunk_index)] = last_chunk ? 1 : 0;
+
+    err = gcry_cipher_open(&hd, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_GCM, 0);
+    if (err) {
+        logger.error("Failed to create GCM block cipher", __FUNCTION__);
+        goto err;
+    }
+
+    err = gcry_cipher_setkey(hd, transfer_key, sizeof(np1secSymmetricKey));
+    if (!err)
+        err = gcry_cipher_setiv(hd, chunk_nonce, c_chunk_nonce_length);
+    if (!err)
+        err = gcry_cipher_authenticate(hd, chunk_nonce, c_chunk_nonce_length);
+    if (err) {
+        logger.error("Failed to set up the chunk cipher", __FUNCTION__);
+        goto err;
+    }
+
+    return hd;
+
+err:
+    if (hd)
+        gcry_cipher_close(hd);
+    logger.error("Failure: " + (std::string)gcry_strsource(err) + ": " + (std::string)gcry_strerror(err), __FUNCTION__);
+    throw CryptoException();
+}
+
+std::string ChunkCipher::seal(uint32_t chunk_index, bool last_chunk, const std::string& chunk)
+{
+    gcry_cipher_hd_t hd = open_chunk_cipher(chunk_index, last_chunk);
+    std::string sealed_chunk(chunk.size() + c_chunk_tag_length, '\0');
+
+    gcry_error_t err = gcry_cipher_encrypt(hd, &sealed_chunk[0], chunk.size(), chunk.data(), chunk.size());
+    if (!err)
+        err = gcry_cipher_gettag(hd, &sealed_chunk[chunk.size()], c_chunk_tag_length);
+
+    gcry_cipher_close(hd);
+    if (err) {
+        logger.error("Encryption of chunk failed", __FUNCTION__);
+        logger.error("Failure: " + (std::string)gcry_strsource(err) + ": " + (std::string)gcry_strerror(err));
+        throw CryptoException();
+    }
+
+    return sealed_chunk;
+}
+
+bool ChunkCipher::open(uint32_t chunk_index, bool last_chunk, const std::string& sealed_chunk, std::string& chunk)
+{
+    if (sealed_chunk.size() < c_chunk_tag_length)
+        return false;
+
+    size_t chunk_length = sealed_chunk.size() - c_chunk_tag_length;
+    gcry_cipher_hd_t hd = open_chunk_cipher(chunk_index, last_chunk);
+    std::string opened_chunk(chunk_length, '\0');
+
+    gcry_error_t err = gcry_cipher_decrypt(hd, &opened_chunk[0], chunk_length, sealed_chunk.data(), chunk_length);
+    if (!err)
+        err = gcry_cipher_checktag(hd, sealed_chunk.data() + chunk_length, c_chunk_tag_length);
+
+    gcry_cipher_close(hd);
+    if (err) {
+        logger.warn("chunk failed authentication", __FUNCTION__);
+        return false;
+    }
+
+    chunk.swap(opened_chunk);
+    return true;
+}
+
+TreeNodeKey::TreeNodeKey(const HashStdBlock& path_secret)
+{
+    std::string key_material(path_secret + "node key");
+    hash(key_material, node_secret, true);
+    secure_wipe(const_cast<char*>(key_material.data()), key_material.size());
+}
+
+std::string TreeNodeKey::multiply(const HashBlock scalar_secret, const std::string& point)
+{
+    const size_t coordinate_length = c_tree_node_key_length / 2;
+    gcry_error_t err = 0;
+    gcry_ctx_t curve = nullptr;
+    gcry_mpi_t scalar = nullptr, x = nullptr, y = nullptr;
+    gcry_mpi_point_t multiplicand = nullptr, product = nullptr;
+    uint8_t scalar_buffer[c_hash_length];
+    uint8_t coordinate_buffer[coordinate_length];
+    size_t coordinate_size = 0;
+    std::string encoded_product;
+    bool failed = true;
+
+    // clamped as an ed25519 secret scalar, so the cofactor is cleared,
+    // and turned big endian for gcrypt
+    for (size_t i = 0; i < c_hash_length; i++)
+        scalar_buffer[i] = scalar_secret[c_hash_length - 1 - i];
+    scalar_buffer[c_hash_length - 1] &= 248;
+    scalar_buffer[0] &= 127;
+    scalar_buffer[0] |= 64;
+
+    err = gcry_mpi_ec_new(&curve, nullptr, "Ed25519");
+    if (!err)
+        err = gcry_mpi_scan(&scalar, GCRYMPI_FMT_USG, scalar_buffer, c_hash_length, nullptr);
+    secure_wipe(scalar_buffer, c_hash_length);
+    if (err) {
+        logger.error("Failure: " + (std::string)gcry_strsource(err) + ": " + (std::string)gcry_strerror(err),
+                     __FUNCTION__);
+        goto leave;
+    }
+
+    if (point.empty()) {
+        multiplicand = gcry_mpi_ec_get_point("g", curve, 1);
+    } else {
+        if (point.size() != c_tree_node_key_length ||
+            gcry_mpi_scan(&x, GCRYMPI_FMT_USG, point.data(), coordinate_length, nullptr) ||
+            gcry_mpi_scan(&y, GCRYMPI_FMT_USG, point.data() + coordinate_length, coordinate_length, nullptr)) {
+            logger.warn("malformed tree node key", __FUNCTION__);
+            goto leave;
+        }
+
+        multiplicand = gcry_mpi_point_set(nullptr, x, y, GCRYMPI_CONST_ONE);
+        if (!gcry_mpi_ec_curve_point(multiplicand, curve)) {
+            logger.warn("tree node key is not on the curve", __FUNCTION__);
+            goto leave;
+        }
+    }
+
+    product = gcry_mpi_point_new(0);
+    gcry_mpi_ec_mul(product, scalar, multiplicand, curve);
+
+    gcry_mpi_release(x);
+    gcry_mpi_release(y);
+    x = gcry_mpi_new(0);
+    y = gcry_mpi_new(0);
+    // the neutral element is all a small order point leads to
+    if (gcry_mpi_ec_get_affine(x, y, product, curve) || !gcry_mpi_cmp_ui(x, 0)) {
+        logger.warn("tree node key of small order", __FUNCTION__);
+        goto leave;
+    }
+
+    for (gcry_mpi_t coordinate : {x, y}) {
+        err = gcry_mpi_print(GCRYMPI_FMT_USG, coordinate_buffer, coordinate_length, &coordinate_size, coordinate);
+        if (err)
+            goto leave;
+        encoded_product += std::string(coordinate_length - coordinate_size, '\0');
+        encoded_product += std::string(reinterpret_cast<char*>(coordinate_buffer), coordinate_size);
+    }
+
+    failed = false;
+
+leave:
+    secure_wipe(coordinate_buffer, coordinate_length);
+    gcry_mpi_release(scalar);
+    gcry_mpi_release(x);
+    gcry_mpi_release(y);
+    gcry_mpi_point_release(multiplicand);
+    gcry_mpi_point_release(product);
+    gcry_ctx_release(curve);
+
+    if (failed)
+        throw CryptoException();
+
+    return encoded_product;
+}
+
+std::string TreeNodeKey::seal(const std::string& node_public_key, const HashStdBlock& path_secret,
+                              const std::string& context)
+{
+    if (path_secret.size() != c_hash_length)
+        throw CryptoException();
+
+    HashBlock ephemeral_secret;
+    gcry_randomize(ephemeral_secret, c_hash_length, GCRY_STRONG_RANDOM);
+    std::string sealed_secret = multiply(ephemeral_secret, "");
+    std::string key_material = multiply(ephemeral_secret, node_public_key);
+    secure_wipe(ephemeral_secret, c_hash_length);
+
+    HashBlock pad;
+    key_material += sealed_secret + context;
+    hash(key_material, pad, true);
+    secure_wipe(const_cast<char*>(key_material.data()), key_material.size());
+
+    sealed_secret += path_secret;
+    for (size_t i = 0; i < c_hash_length; i++)
+        sealed_secret[c_tree_node_key_length + i] ^= pad[i];
+    secure_wipe(pad, c_hash_length);
+
+    return sealed_secret;
+}
+
+bool TreeNodeKey::open(const std::string& sealed_secret, const std::string& context, HashStdBlock& path_secret)
+{
+    if (sealed_secret.size() != c_sealed_path_secret_length)
+        return false;
+
+    std::string ephemeral_public_key = sealed_secret.substr(0, c_tree_node_key_length);
+    std::string key_material;
+    try {
+        key_material = multiply(node_secret, ephemeral_public_key);
+    } catch (CryptoException&) {
+        return false;
+    }
+
+    HashBlock pad;
+    key_material += ephemeral_public_key + context;
+    hash(key_material, pad, true);
+    secure_wipe(const_cast<char*>(key_material.data()), key_material.size());
+
+    path_secret = sealed_secret.substr(c_tree_node_key_length);
+    for (size_t i = 0; i < c_hash_length; i++)
+        path_secret[i] ^= pad[i];
+    secure_wipe(pad, c_hash_length);
+
+    return true;
+}
+
+void MessageKeyRatchet::init(const np1secSymmetricKey session_key, uint32_t no_of_senders, uint32_t my_index)
+{
+    std::string seed(reinterpret_cast<const char*>(session_key), sizeof(np1secSymmetricKey));
+    receiving_chains.resize(no_of_senders);
+    for (uint32_t sender_index = 0; sender_index < no_of_senders; sender_index++) {
+        std::string sender_seed = seed + std::string(reinterpret_cast<char*>(&sender_index), sizeof(uint32_t));
+        receiving_chains[sender_index].derived_chain.chain_key = hash(sender_seed + "chain", true);
+        secure_wipe(&sender_seed[0], sender_seed.size());
+    }
+
+    secure_wipe(&seed[0], seed.size());
+    sending_chain = receiving_chains[my_index].derived_chain;
+}
+
+bool MessageKeyRatchet::move_to(Chain& chain, uint32_t position)
+{
+    if (position < chain.position || position - chain.position > c_max_skipped_message_keys ||
+        (position == chain.position && chain.message_key.empty()))
+        return false;
+
+    for (; chain.position < position; chain.position++) {
+        HashStdBlock next_chain_key = hash(chain.chain_key + "chain", true);
+        wipe(chain);
+        chain.message_key = hash(chain.chain_key + "message", true);
+        secure_wipe(&chain.chain_key[0], chain.chain_key.size());
+        chain.chain_key = next_chain_key;
+        secure_wipe(&next_chain_key[0], next_chain_key.size());
+    }
+
+    return true;
+}
+
+HashStdBlock MessageKeyRatchet::message_key(ReceivingChain& chain, uint32_t position)
+{
+    if (position > chain.derived_chain.position) {
+        if (position - chain.forgotten_up_to > c_max_skipped_message_keys)
+            return HashStdBlock();
+
+        while (chain.derived_chain.position < position) {
+            move_to(chain.derived_chain, chain.derived_chain.position + 1);
+            chain.message_keys[chain.derived_chain.position] = chain.derived_chain.message_key;
+        }
+        wipe(chain.derived_chain);
+    }
+
+    auto key = chain.message_keys.find(position);
+    return key == chain.message_keys.end() ? HashStdBlock() : key->second;
+}
+
+void MessageKeyRatchet::wipe(Chain& chain)
+{
+    if (!chain.message_key.empty())
+        secure_wipe(&chain.message_key[0], chain.message_key.size());
+    chain.message_key.clear();
+}
+
+void MessageKeyRatchet::wipe(ReceivingChain& chain)
+{
+    wipe(chain.derived_chain);
+    if (!chain.derived_chain.chain_key.empty())
+        secure_wipe(&chain.derived_chain.chain_key[0], chain.derived_chain.chain_key.size());
+
+    for (auto& cur_key : chain.message_keys)
+        secure_wipe(&cur_key.second[0], cur_key.second.size());
+    chain.message_keys.clear();
+}
+
+std::string MessageKeyRatchet::encrypt(uint32_t position, const std::string& plain_text)
+{
+    if (!move_to(sending_chain, position)) {
+        logger.error("message key of position " + std::to_string(position) + " is gone", __FUNCTION__);
+        throw CryptoException();
+    }
+
+    Cryptic message_cipher;
+    message_cipher.set_session_key(reinterpret_cast<const uint8_t*>(sending_chain.message_key.data()));
+    return message_cipher.Encrypt(plain_text);
+}
+
+bool MessageKeyRatchet::decrypt(uint32_t sender_index, uint32_t position, const std::string& encrypted_text,
+                                std::string& plain_text)
+{
+    if (sender_index >= receiving_chains.size())
+        return false;
+
+    HashStdBlock key = message_key(receiving_chains[sender_index], position);
+    if (key.empty())
+        return false;
+
+    Cryptic message_cipher;
+    message_cipher.set_session_key(reinterpret_cast<const uint8_t*>(key.data()));
+    plain_text = message_cipher.Decrypt(encrypted_text);
+
+    secure_wipe(&key[0], key.size());
+    return true;
+}
+
+void MessageKeyRatchet::forget_up_to(uint32_t sender_index, uint32_t position)
+{
+    if (sender_index >= receiving_chains.size())
+        return;
+
+    // the key of position stays for the rest of the fragments of its message
+    ReceivingChain& chain = receiving_chains[sender_index];
+    for (auto key = chain.message_keys.begin(); key != chain.message_keys.end() && key->first < position;) {
+        secure_wipe(&key->second[0], key->second.size());
+        key = chain.message_keys.erase(key);
+    }
+    chain.forgotten_up_to = std::max(chain.forgotten_up_to, position);
+}
+
+MessageKeyRatchet::~MessageKeyRatchet()
+{
+    for (auto& cur_chain : receiving_chains)
+        wipe(cur_chain);
+
+    wipe(sending_chain);
+    if (!sending_chain.chain_key.empty())
+        secure_wipe(&sending_chain.chain_key[0], sending_chain.chain_key.size());
+}
+
 Cryptic::~Cryptic()
 {
     gcry_sexp_release(ephemeral_key);
     gcry_sexp_release(ephemeral_pub_key);
     gcry_sexp_release(ephemeral_prv_key);
     secure_wipe(session_key, c_hash_length);
-    logger.debug("Wiped session_key from Cryptic instance");
+    NP1SEC_LOG_DEBUG("Wiped session_key from Cryptic instance");
 }
 
 } // namespace np1sec
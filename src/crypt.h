@@ -21,6 +21,9 @@
 
 #include <string>
 #include <cstring>
+#include <map>
+#include <memory>
+#include <vector>
 
 #include "src/common.h"
 #include "src/exceptions.h"
@@ -43,6 +46,10 @@ typedef HashBlock np1secSymmetricKey;
 const unsigned int c_ephemeral_key_length = 32;
 const unsigned int c_key_share = c_hash_length;
 const unsigned int c_iv_length = 16;
+const unsigned int c_chunk_nonce_length = 12;
+const unsigned int c_chunk_tag_length = 16;
+const unsigned int c_tree_node_key_length = 64; // affine x, y of an ed25519 point
+const unsigned int c_sealed_path_secret_length = c_tree_node_key_length + c_hash_length;
 
 typedef uint8_t IVBlock[c_iv_length];
 
@@ -72,6 +79,18 @@ void release_crypto_resource(gcry_sexp_t crypto_resource);
 
 gcry_sexp_t copy_crypto_resource(gcry_sexp_t crypto_resource);
 
+/**
+ * A key which is shared, rather than copied, by whoever copies it. Only
+ * for keys which never change once made.
+ */
+typedef std::shared_ptr<gcry_sexp> SharedPublicKey;
+
+/**
+ * takes the ownership of the crypto resource, it gets released with its
+ * last copy
+ */
+SharedPublicKey share_crypto_resource(gcry_sexp_t crypto_resource);
+
 gcry_error_t hash(const HashBlock** superblob, size_t num_blocks, HashBlock to_write, bool secure);
 
 gcry_error_t hash(const void* buffer, size_t buffer_len, HashBlock hb);
@@ -143,6 +162,21 @@ class Cryptic
         set_session_key(rhs.session_key);
     }
 
+    Cryptic& operator=(const Cryptic& rhs)
+    {
+        if (this != &rhs) {
+            release_crypto_resource(ephemeral_key);
+            release_crypto_resource(ephemeral_pub_key);
+            release_crypto_resource(ephemeral_prv_key);
+            ephemeral_key = copy_crypto_resource(rhs.ephemeral_key);
+            ephemeral_pub_key = copy_crypto_resource(rhs.ephemeral_pub_key);
+            ephemeral_prv_key = copy_crypto_resource(rhs.ephemeral_prv_key);
+            set_session_key(rhs.session_key);
+        }
+
+        return *this;
+    }
+
     /**
      * Access function for ephemeral pub key
      * (Access is need for meta works like computing the session id  which are
@@ -230,6 +264,180 @@ class Cryptic
     ~Cryptic();
 };
 
+/**
+ * AES-GCM over the chunks of a streamed transfer. The key is derived from
+ * the session key and the transfer context, so it is only used for one
+ * transfer and the chunk index can serve as the nonce. The tag of each
+ * chunk also covers its index and whether it is the last one, so the
+ * receiver can process the chunks as they come and still notices
+ * reordering or truncation.
+ */
+class ChunkCipher
+{
+  protected:
+    np1secSymmetricKey transfer_key;
+
+    /**
+     * runs GCM over the chunk in place, authenticating its index and last
+     * flag as associated data. The handle needs to be closed by caller.
+     */
+    gcry_cipher_hd_t open_chunk_cipher(uint32_t chunk_index, bool last_chunk);
+
+  public:
+    /**
+     * @param session_key the key of the session the transfer belongs to
+     * @param transfer_context makes the key unique to the transfer, e.g.
+     *        sender nick and transfer id
+     */
+    ChunkCipher(const np1secSymmetricKey session_key, const std::string& transfer_context);
+
+    ChunkCipher(const ChunkCipher& rhs) { memcpy(transfer_key, rhs.transfer_key, sizeof(np1secSymmetricKey)); }
+
+    /**
+     * @return the encrypted chunk followed by its tag
+     */
+    std::string seal(uint32_t chunk_index, bool last_chunk, const std::string& chunk);
+
+    /**
+     * decrypts and authenticates a sealed chunk
+     *
+     * @return false if the chunk, its index or last flag has been tampered
+     *         with, in which case chunk is left untouched
+     */
+    bool open(uint32_t chunk_index, bool last_chunk, const std::string& sealed_chunk, std::string& chunk);
+
+    ~ChunkCipher() { secure_wipe(transfer_key, sizeof(np1secSymmetricKey)); }
+};
+
+/**
+ * The key pair of a node of the ratchet tree. The private scalar is
+ * derived from the path secret of the node, so whoever is given the path
+ * secret also holds the node key. Path secrets are sealed to a node by an
+ * ephemeral DH against its public key.
+ */
+class TreeNodeKey
+{
+  protected:
+    HashBlock node_secret;
+
+    /**
+     * multiplies the point by the scalar derived from scalar_secret and
+     * returns the product encoded as c_tree_node_key_length bytes. The
+     * point is the base point if empty.
+     *
+     * throws CryptoException if the point is not on the curve
+     */
+    static std::string multiply(const HashBlock scalar_secret, const std::string& point);
+
+  public:
+    explicit TreeNodeKey(const HashStdBlock& path_secret);
+
+    std::string public_key() { return multiply(node_secret, ""); }
+
+    /**
+     * encrypts the path secret so only the holder of the private key of
+     * node_public_key can recover it. context binds the sealed secret to
+     * e.g. the session it is sent in.
+     *
+     * @return the ephemeral public key followed by the encrypted secret
+     */
+    static std::string seal(const std::string& node_public_key, const HashStdBlock& path_secret,
+                            const std::string& context);
+
+    /**
+     * @return false if the sealed secret is malformed, in which case
+     *         path_secret is left untouched. A secret sealed to another
+     *         key opens to garbage, the caller has to check it against
+     *         the public key it is supposed to lead to.
+     */
+    bool open(const std::string& sealed_secret, const std::string& context, HashStdBlock& path_secret);
+
+    ~TreeNodeKey() { secure_wipe(node_secret, c_hash_length); }
+};
+
+/**
+ * Per sender hash chains the keys of the in-session messages come from.
+ * The chain of each sender is seeded by the session key and moves on by a
+ * hash with every message the sender sends. The keys it moves past are
+ * wiped, so whoever gets hold of the chains later on can't read the
+ * messages before.
+ *
+ * All fragments of a message share its position, hence its key.
+ */
+class MessageKeyRatchet
+{
+  protected:
+    struct Chain {
+        HashStdBlock chain_key;
+        uint32_t position = 0; // of message_key, 0 before the first message
+        HashStdBlock message_key;
+    };
+
+    /**
+     * the ids of received messages are only authenticated once they are
+     * decrypted, so we keep the keys we derive for them till the sender
+     * has been heard from. That way a forged id makes us hash a chain at
+     * most once.
+     */
+    struct ReceivingChain {
+        Chain derived_chain; // as far as any message made us derive it
+        uint32_t forgotten_up_to = 0; // the keys of earlier positions are gone
+        std::map<uint32_t, HashStdBlock> message_keys; // indexed by position
+    };
+
+    Chain sending_chain;
+    std::vector<ReceivingChain> receiving_chains; // indexed by sender index
+
+    /**
+     * moves the chain forward to the message key of position
+     *
+     * @return false if the chain is past the position already or the
+     *         position is too far ahead to be legitimate
+     */
+    static bool move_to(Chain& chain, uint32_t position);
+
+    /**
+     * @return the message key of position, deriving the keys up to it if
+     *         they are not derived yet, or empty if the key is gone or
+     *         the position is too far ahead to be legitimate
+     */
+    static HashStdBlock message_key(ReceivingChain& chain, uint32_t position);
+
+    static void wipe(Chain& chain);
+    static void wipe(ReceivingChain& chain);
+
+  public:
+    // messages can get lost, but not more than this many in a row
+    static const uint32_t c_max_skipped_message_keys = 64;
+
+    void init(const np1secSymmetricKey session_key, uint32_t no_of_senders, uint32_t my_index);
+
+    bool is_initialized() const { return !receiving_chains.empty(); }
+
+    /**
+     * encrypts our message of position, throws CryptoException if we have
+     * sent a later one already
+     */
+    std::string encrypt(uint32_t position, const std::string& plain_text);
+
+    /**
+     * decrypts the message without forgetting the earlier keys of the
+     * sender, which is up to the caller once the message has proven
+     * authentic
+     *
+     * @return false if the key of the message is gone or out of reach
+     */
+    bool decrypt(uint32_t sender_index, uint32_t position, const std::string& encrypted_text,
+                 std::string& plain_text);
+
+    /**
+     * wipes the keys of the sender up to the one of position
+     */
+    void forget_up_to(uint32_t sender_index, uint32_t position);
+
+    ~MessageKeyRatchet();
+};
+
 class LongTermIDKey
 {
   protected:
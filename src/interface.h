@@ -28,12 +28,15 @@
 #include <string>
 
 #include "src/crypt.h"
+#include "src/timer_wheel.h"
 
 namespace np1sec
 {
 
 typedef void (*timeout_callback)(void*);
 
+struct SessionMetrics;
+
 /**
  * Calls from np1sec to the application.
  */
@@ -47,6 +50,78 @@ struct AppOps {
     uint32_t c_consistency_failure_interval;
     uint32_t c_send_receive_interval;
 
+    // protocol version of the in-session messages we send. Set it to
+    // c_np1sec_compact_protocol_version to save bandwidth, we receive
+    // both versions anyway
+    DTShort c_in_session_protocol_version = c_np1sec_protocol_version;
+
+    // the largest message the transport carries in one stanza, longer user
+    // messages are sent in fragments. 0 means no limit
+    size_t c_max_message_size = 0;
+
+    // queue the messages we send to a room while handling a call from the
+    // app (or a timer) and send them bundled in as few transport messages
+    // as c_max_message_size allows when the call returns. Peers need to
+    // understand BUNDLE, which is why it is off by default
+    bool c_bundle_outbound_messages = false;
+
+    // answer joins with PARTICIPANTS_INFO carrying the session view as a
+    // delta against the parent session, and tell the room in our join
+    // request that we take such views. Deltas are only sent into sessions
+    // whose participants have all told so, the rest get full views
+    bool c_delta_session_views = false;
+
+    // sessions of at least this many participants agree on their key by a
+    // ratchet tree, where a join, leave or rekey takes a single commit of
+    // O(log n) keys instead of a share from everybody. Everybody in the
+    // room needs the same threshold. 0 keeps every room on the ring
+    size_t c_tree_key_agreement_threshold = 0;
+
+    // join requests arriving within this interval (in milliseconds) of the
+    // first pending one are admitted together by a single session. Joiners
+    // arriving while an admission is under way are folded into it anyway,
+    // the interval only spares the sessions bred in between. 0 breeds at
+    // every request
+    uint32_t c_join_batch_interval = 0;
+
+    // leaves within this interval (in milliseconds) of the first one are
+    // handled by a single session without all of the leavers, rather than
+    // a session per leaver. 0 shrinks at every leave
+    uint32_t c_leave_batch_interval = 0;
+
+    // once a session has lived c_session_life_span, everybody piggybacks
+    // their share of the next session key on their next message or ack and
+    // the room moves on to it without a GROUP_SHARE and SESSION_CONFIRMATION
+    // round. Everybody in the room needs the same setting. Sessions which
+    // agree on their key by the ratchet tree resession as before
+    bool c_in_band_resession = false;
+
+    // encrypt each in-session message under a key of its own, hashed
+    // forward from the session key along a chain per sender and wiped once
+    // used, so a key leaked mid-session does not open the messages before
+    // it. Everybody in the room needs the same setting. Transfers are still
+    // keyed per session
+    bool c_ratchet_message_keys = false;
+
+    // the transcript of a session is checkpointed at the last message
+    // everybody has acked. Past this many blocks we checkpoint at the
+    // latest ones anyway and give up checking the consistency of the
+    // messages before them. 0 leaves the unacked blocks be
+    size_t c_max_transcript_blocks = 0;
+
+    // arm the timers of the library on this wheel rather than through
+    // set_timer. A wheel can be shared by any number of users, the app
+    // either ticks it or lets it drive itself on a single host timer
+    TimerWheel* timer_wheel = nullptr;
+
+    // the BROADCAST_LATENCY the intervals were given an allowance of twice
+    // over. With c_adaptive_intervals that allowance is replaced by the
+    // time our own messages take to come back to us in each room, once we
+    // have seen one, so the ack, consistency and rejoin deadlines follow
+    // the load of the server
+    uint32_t c_broadcast_latency = 0;
+    bool c_adaptive_intervals = false;
+
     AppOps(){};
 
     AppOps(uint32_t ACK_GRACE_INTERVAL, uint32_t REKEY_GRACE_INTERVAL, uint32_t INTERACTION_GRACE_INTERVAL,
@@ -56,7 +131,8 @@ struct AppOps {
           c_unresponsive_ergo_non_sum_interval(INTERACTION_GRACE_INTERVAL + 2 * (BROADCAST_LATENCY)),
           c_ack_interval(ACK_GRACE_INTERVAL),
           c_consistency_failure_interval(ACK_GRACE_INTERVAL + 2 * (BROADCAST_LATENCY)),
-          c_send_receive_interval(INTERACTION_GRACE_INTERVAL + 2 * (BROADCAST_LATENCY))
+          c_send_receive_interval(INTERACTION_GRACE_INTERVAL + 2 * (BROADCAST_LATENCY)),
+          c_broadcast_latency(BROADCAST_LATENCY)
     {
     }
 
@@ -106,6 +182,22 @@ struct AppOps {
      */
     void (*validate_long_term_key)(std::string nickname, PublicKey fingerprint, void* aux_data);
 
+    /**
+     * hands the app the next chunk of a transfer streamed by a peer. The
+     * chunks of a transfer arrive in order, a transfer whose chunk fails
+     * authentication or goes missing is dropped and never reaches
+     * last_chunk.
+     */
+    void (*receive_chunk)(std::string room_name, std::string sender_nick, std::string transfer_id,
+                          uint32_t chunk_index, std::string chunk, bool last_chunk, void* aux_data) = nullptr;
+
+    /**
+     * optional, tells the app a session of the room has been activated,
+     * with the time it took to reach each phase of its handshake and what
+     * it sent, received and computed meanwhile
+     */
+    void (*session_activated)(std::string room_name, const SessionMetrics& metrics, void* aux_data) = nullptr;
+
     /**
      * it needs to set a timer which calls timer_callback function after
      * interval
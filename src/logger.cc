@@ -50,6 +50,8 @@ void Logger::initiate_textual_conversions()
     message_type_to_text[Message::GROUP_SHARE] = "GROUP_SHARE";
     message_type_to_text[Message::SESSION_CONFIRMATION] = "SESSION_CONFIRMATION";
     message_type_to_text[Message::IN_SESSION_MESSAGE] = "IN_SESSION_MESSAGE";
+    message_type_to_text[Message::TRANSFER_CHUNK] = "TRANSFER_CHUNK";
+    message_type_to_text[Message::BUNDLE] = "BUNDLE";
     message_type_to_text[Message::INADMISSIBLE] = "INADMISSIBLE";
 }
 
@@ -102,13 +104,14 @@ void Logger::set_threshold(log_level_t level)
 }
 
 // Standard log function. Prints nice colors for each level.
-void Logger::log(log_level_t level, std::string msg, std::string function_name, std::string user_nick)
+void Logger::log(log_level_t level, const std::string& message, const std::string& function_name,
+                 const std::string& user_nick)
 {
     if (level < SILLY || level > ABORT || level < threshold) {
         return;
     }
 
-    msg = (user_nick.empty()) ? msg : user_nick + ": " + msg;
+    std::string msg = (user_nick.empty()) ? message : user_nick + ": " + message;
     msg = (function_name.empty()) ? msg : function_name + ": " + msg;
 
     switch (level) {
@@ -144,43 +147,44 @@ void Logger::log(log_level_t level, std::string msg, std::string function_name,
 
 // Convenience methods
 
-void Logger::silly(std::string msg, std::string function_name, std::string user_nick)
+void Logger::silly(const std::string& msg, const std::string& function_name, const std::string& user_nick)
 {
     log(SILLY, msg, function_name, user_nick);
 }
 
-void Logger::debug(std::string msg, std::string function_name, std::string user_nick)
+void Logger::debug(const std::string& msg, const std::string& function_name, const std::string& user_nick)
 {
     log(DEBUG, msg, function_name, user_nick);
 }
 
-void Logger::verbose(std::string msg, std::string function_name, std::string user_nick)
+void Logger::verbose(const std::string& msg, const std::string& function_name, const std::string& user_nick)
 {
     log(VERBOSE, msg, function_name, user_nick);
 }
 
-void Logger::info(std::string msg, std::string function_name, std::string user_nick)
+void Logger::info(const std::string& msg, const std::string& function_name, const std::string& user_nick)
 {
     log(INFO, msg, function_name, user_nick);
 }
 
-void Logger::warn(std::string msg, std::string function_name, std::string user_nick)
+void Logger::warn(const std::string& msg, const std::string& function_name, const std::string& user_nick)
 {
     log(WARN, msg, function_name, user_nick);
 }
 
-void Logger::error(std::string msg, std::string function_name, std::string user_nick)
+void Logger::error(const std::string& msg, const std::string& function_name, const std::string& user_nick)
 {
     log(ERROR, msg, function_name, user_nick);
 }
 
-void Logger::abort(std::string msg, std::string function_name, std::string user_nick)
+void Logger::abort(const std::string& msg, const std::string& function_name, const std::string& user_nick)
 {
     log(ABORT, msg, function_name, user_nick);
     exit(1);
 }
 
-void Logger::assert_or_die(bool expr, std::string failure_message, std::string function_name, std::string user_nick)
+void Logger::assert_or_die(bool expr, const std::string& failure_message, const std::string& function_name,
+                           const std::string& user_nick)
 {
     if (!expr)
         abort(failure_message, function_name, user_nick);
@@ -18,6 +18,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <string>
 
 /* #include "src/common.h" */
 /* #include "src/crypt.h" */
@@ -35,6 +36,14 @@ enum log_level_t { SILLY, DEBUG, VERBOSE, INFO, WARN, ERROR, ABORT };
 
 const log_level_t default_log_level = DEBUG;
 
+// Calls below this level are compiled out by the NP1SEC_LOG macros,
+// e.g. -DNP1SEC_MIN_LOG_LEVEL=INFO strips the debug logs of a release
+// build. configure sets it by --with-min-log-level.
+#ifndef NP1SEC_MIN_LOG_LEVEL
+#define NP1SEC_MIN_LOG_LEVEL SILLY
+#endif
+const log_level_t c_min_log_level = NP1SEC_MIN_LOG_LEVEL;
+
 class Logger
 {
   protected:
@@ -61,19 +70,59 @@ class Logger
 
     void config(bool log_stderr, bool log_file, std::string fname);
     void set_threshold(log_level_t level);
-    void log(log_level_t level, std::string msg, std::string function_name = "", std::string user_nick = "");
-    void silly(std::string msg, std::string function_name = "", std::string user_nick = "");
-    void debug(std::string msg, std::string function_name = "", std::string user_nick = "");
-    void verbose(std::string msg, std::string function_name = "", std::string user_nick = "");
-    void info(std::string msg, std::string function_name = "", std::string user_nick = "");
-    void warn(std::string msg, std::string function_name = "", std::string user_nick = "");
-    void error(std::string msg, std::string function_name = "", std::string user_nick = "");
-    void abort(std::string msg, std::string function_name = "", std::string user_nick = "");
-
-    void assert_or_die(bool expr, std::string failure_message, std::string function_name = "",
-                       std::string user_nick = "");
+
+    /**
+     * whether a message of the level would be logged, so the caller can
+     * skip making it otherwise
+     */
+    bool enabled(log_level_t level) const { return level >= c_min_log_level && level >= threshold; }
+
+    void log(log_level_t level, const std::string& msg, const std::string& function_name = "",
+             const std::string& user_nick = "");
+    void silly(const std::string& msg, const std::string& function_name = "", const std::string& user_nick = "");
+    void debug(const std::string& msg, const std::string& function_name = "", const std::string& user_nick = "");
+    void verbose(const std::string& msg, const std::string& function_name = "", const std::string& user_nick = "");
+    void info(const std::string& msg, const std::string& function_name = "", const std::string& user_nick = "");
+    void warn(const std::string& msg, const std::string& function_name = "", const std::string& user_nick = "");
+    void error(const std::string& msg, const std::string& function_name = "", const std::string& user_nick = "");
+    void abort(const std::string& msg, const std::string& function_name = "", const std::string& user_nick = "");
+
+    void assert_or_die(bool expr, const std::string& failure_message, const std::string& function_name = "",
+                       const std::string& user_nick = "");
 };
 
+extern Logger logger;
+
+/**
+ * Log through these rather than the Logger methods on the hot paths: the
+ * message and the rest of the arguments are only evaluated when the level
+ * is enabled, and not compiled at all below c_min_log_level.
+ *
+ *   NP1SEC_LOG_DEBUG("own ctr before send: " + std::to_string(own_message_counter), __FUNCTION__, nick);
+ */
+#define NP1SEC_LOG(level, ...)                                                                                         \
+    do {                                                                                                               \
+        if (np1sec::logger.enabled(level))                                                                             \
+            np1sec::logger.log(level, __VA_ARGS__);                                                                    \
+    } while (0)
+
+#define NP1SEC_LOG_SILLY(...) NP1SEC_LOG(np1sec::SILLY, __VA_ARGS__)
+#define NP1SEC_LOG_DEBUG(...) NP1SEC_LOG(np1sec::DEBUG, __VA_ARGS__)
+#define NP1SEC_LOG_VERBOSE(...) NP1SEC_LOG(np1sec::VERBOSE, __VA_ARGS__)
+#define NP1SEC_LOG_INFO(...) NP1SEC_LOG(np1sec::INFO, __VA_ARGS__)
+#define NP1SEC_LOG_WARN(...) NP1SEC_LOG(np1sec::WARN, __VA_ARGS__)
+#define NP1SEC_LOG_ERROR(...) NP1SEC_LOG(np1sec::ERROR, __VA_ARGS__)
+
+/**
+ * Logger::assert_or_die which only makes the failure message when the
+ * assertion fails
+ */
+#define NP1SEC_ASSERT_OR_DIE(expr, ...)                                                                                \
+    do {                                                                                                               \
+        if (!(expr))                                                                                                   \
+            np1sec::logger.abort(__VA_ARGS__);                                                                         \
+    } while (0)
+
 } // namespace np1sec
 
 #endif // SRC_LOGGER_H_
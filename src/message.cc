@@ -19,11 +19,14 @@
 #ifndef SRC_MESSAGE_CC_
 #define SRC_MESSAGE_CC_
 
+#include <algorithm>
 #include <iostream>
 
 #include "src/message.h"
 #include "src/userstate.h"
 #include "src/exceptions.h"
+#include "src/profiler.h"
+#include "src/tracepoints.h"
 
 namespace np1sec
 {
@@ -46,11 +49,14 @@ std::string Message::encode_opaque_data(const std::string& data)
  *  return a pairs of strings, first with the opaque data (without length)
  *  second the rest of the string
  */
-std::pair<std::string, std::string> Message::decode_opaque_field(std::string opaque_data)
+ParseResult<std::pair<std::string, std::string>> Message::decode_opaque_field(const std::string& opaque_data)
 {
+    if (opaque_data.size() < sizeof(uint32_t))
+        return PARSE_MALFORMED;
+
     uint32_t opaque_string_size(*(reinterpret_cast<const uint32_t*>(opaque_data.data())));
-    if (opaque_string_size > opaque_data.size())
-        throw MessageFormatException();
+    if (opaque_string_size > opaque_data.size() - sizeof(uint32_t))
+        return PARSE_MALFORMED;
 
     std::string opaque_string_data(opaque_data.data() + sizeof(uint32_t), opaque_string_size);
     std::string the_rest = opaque_data.substr(opaque_string_data.size() + sizeof(uint32_t));
@@ -58,13 +64,48 @@ std::pair<std::string, std::string> Message::decode_opaque_field(std::string opa
     return std::pair<std::string, std::string>(opaque_string_data, the_rest);
 }
 
+ParseStatus Message::decode_share_and_key_tree_update(const std::string& share_and_update)
+{
+    if (share_and_update.size() < c_hash_length)
+        return PARSE_MALFORMED;
+
+    z_sender = share_and_update.substr(0, c_hash_length);
+    if (share_and_update.size() == c_hash_length)
+        return PARSE_OK;
+
+    ParseResult<std::pair<std::string, std::string>> update_and_rest =
+        decode_opaque_field(share_and_update.substr(c_hash_length));
+    if (!update_and_rest.ok() || !update_and_rest.value.second.empty())
+        return PARSE_MALFORMED;
+
+    key_tree_update = update_and_rest.value.first;
+    return PARSE_OK;
+}
+
 Message::Message(Cryptic* cryptic) : cryptic(cryptic) {}
 
 Message::Message(std::string raw_message, Cryptic* cryptic, size_t no_of_participants)
     : cryptic(cryptic), no_of_participants(no_of_participants)
 {
+    switch (parse(raw_message)) {
+    case PARSE_OK:
+        break;
+    case PARSE_VERSION_MISMATCH:
+        throw VersionMismatchException();
+    default:
+        throw MessageFormatException();
+    }
+}
+
+ParseStatus Message::parse(const std::string& raw_message)
+{
+    NP1SEC_PROBE(PROBE_MESSAGE_PARSE);
     final_whole_message = raw_message;
-    unwrap_generic_message(check_and_chop_protocol_tag(raw_message));
+    ParseResult<std::string> b64ed_message = check_and_chop_protocol_tag(raw_message);
+    if (!b64ed_message.ok())
+        return b64ed_message.status;
+
+    return unwrap_generic_message(b64ed_message.value);
 }
 
 /**
@@ -74,7 +115,7 @@ Message::Message(std::string raw_message, Cryptic* cryptic, size_t no_of_partici
  */
 const UnauthenticatedParticipantList& Message::get_session_view()
 {
-    if (message_type != PARTICIPANTS_INFO || session_view.empty())
+    if (message_type != PARTICIPANTS_INFO || session_view.empty() || has_delta_view())
         throw MessageFormatException();
     // if the message is of participant info then session_view
     // get filled on construction
@@ -96,21 +137,30 @@ std::string Message::session_view_as_string()
     return output;
 }
 
-void Message::string_to_session_view(std::string sv_string)
+ParseStatus Message::string_to_session_view(std::string sv_string)
 {
     while (sv_string.size()) {
-        std::pair<std::string, std::string> pid_and_rest = decode_opaque_field(sv_string);
-        this->session_view.push_back(UnauthenticatedParticipant(pid_and_rest.first));
-        sv_string = pid_and_rest.second;
+        ParseResult<std::pair<std::string, std::string>> pid_and_rest = decode_opaque_field(sv_string);
+        // nick (possibly empty), fingerprint, ephemeral key and authenticated flag
+        if (!pid_and_rest.ok() ||
+            pid_and_rest.value.first.size() <
+                ParticipantId::c_fingerprint_length + c_ephemeral_key_length + sizeof(DTByte))
+            return PARSE_MALFORMED;
+
+        this->session_view.push_back(UnauthenticatedParticipant(pid_and_rest.value.first));
+        sv_string = pid_and_rest.value.second;
     }
+
+    return PARSE_OK;
 }
 
 void Message::create_participant_info_msg(SessionId session_id, UnauthenticatedParticipantList& session_view_list,
-                                                std::string key_confirmation, HashStdBlock z_sender)
+                                          std::string key_confirmation, HashStdBlock z_sender,
+                                          std::string key_tree_update)
 {
 
     // data verification
-    logger.assert_or_die(session_id.get(), "can not create participant info message for id-less session");
+    NP1SEC_ASSERT_OR_DIE(session_id.get(), "can not create participant info message for id-less session");
 
     this->message_type = PARTICIPANTS_INFO;
     this->session_id.set(session_id.get());
@@ -119,11 +169,84 @@ void Message::create_participant_info_msg(SessionId session_id, UnauthenticatedP
     sys_message = encode_opaque_data(session_view_as_string());
     sys_message += encode_opaque_data(key_confirmation);
     sys_message += z_sender;
+    if (!key_tree_update.empty())
+        sys_message += encode_opaque_data(key_tree_update);
 
     append_msg_end();
 }
 
-void Message::create_group_share_msg(SessionId session_id, std::string z_sender)
+/**
+ * the delta view is marked by an empty full view and followed by
+ *
+ *   parent sid, Opaque(Opaque(departed nick)...), Opaque(changed participants)
+ */
+void Message::create_participant_info_delta_msg(SessionId session_id, SessionId parent_session_id,
+                                                UnauthenticatedParticipantList& changed_participants,
+                                                const std::vector<std::string>& departed_nicks,
+                                                std::string key_confirmation, HashStdBlock z_sender)
+{
+    NP1SEC_ASSERT_OR_DIE(session_id.get() && parent_session_id.get(),
+                         "can not create participant info delta without both session ids");
+
+    this->message_type = PARTICIPANTS_INFO;
+    protocol_version = c_np1sec_delta_views_protocol_version;
+    this->session_id.set(session_id.get());
+    this->parent_session_id.set(parent_session_id.get());
+    this->session_view = changed_participants;
+    this->departed_nicks = departed_nicks;
+
+    std::string departed_nicks_string;
+    for (auto& cur_nick : departed_nicks)
+        departed_nicks_string += encode_opaque_data(cur_nick);
+
+    sys_message = encode_opaque_data("");
+    sys_message += this->parent_session_id.get_as_stringbuff();
+    sys_message += encode_opaque_data(departed_nicks_string);
+    sys_message += encode_opaque_data(session_view.empty() ? "" : session_view_as_string());
+    sys_message += encode_opaque_data(key_confirmation);
+    sys_message += z_sender;
+
+    append_msg_end();
+}
+
+bool Message::apply_session_view_delta(const UnauthenticatedParticipantList& parent_view)
+{
+    std::map<std::string, UnauthenticatedParticipant> expanded_view;
+    for (auto& cur_participant : parent_view)
+        expanded_view.insert(std::make_pair(cur_participant.participant_id.nickname, cur_participant));
+
+    for (auto& cur_nick : departed_nicks)
+        expanded_view.erase(cur_nick);
+
+    for (auto& cur_participant : session_view) {
+        expanded_view.erase(cur_participant.participant_id.nickname);
+        expanded_view.insert(std::make_pair(cur_participant.participant_id.nickname, cur_participant));
+    }
+
+    if (expanded_view.empty())
+        return false;
+
+    // the sid is the hash of the view so it tells us if we have got the same
+    // parent view as the sender
+    ParticipantMap expanded_plist;
+    for (auto& cur_participant : expanded_view)
+        expanded_plist.insert(std::make_pair(cur_participant.first, Participant(cur_participant.second)));
+
+    SessionId expanded_session_id(expanded_plist);
+    if (!(expanded_session_id == session_id))
+        return false;
+
+    session_view.clear();
+    for (auto& cur_participant : expanded_view)
+        session_view.push_back(cur_participant.second);
+
+    parent_session_id = SessionId();
+    departed_nicks.clear();
+
+    return true;
+}
+
+void Message::create_group_share_msg(SessionId session_id, std::string z_sender, std::string key_tree_update)
 {
     // data verification
     if (!session_id.get())
@@ -132,19 +255,69 @@ void Message::create_group_share_msg(SessionId session_id, std::string z_sender)
     this->message_type = GROUP_SHARE;
     this->session_id.set(session_id.get());
     sys_message += z_sender;
+    if (!key_tree_update.empty())
+        sys_message += encode_opaque_data(key_tree_update);
 
     append_msg_end();
 }
 
+void Message::create_transfer_chunk_msg(SessionId session_id, std::string transfer_id, DTLength chunk_index,
+                                        bool last_chunk, std::string sealed_chunk)
+{
+    // data verification
+    if (!session_id.get() || transfer_id.size() != c_transfer_id_length)
+        throw InvalidDataException();
+
+    this->message_type = TRANSFER_CHUNK;
+    this->session_id.set(session_id.get());
+    this->transfer_id = transfer_id;
+    this->chunk_index = chunk_index;
+    this->last_chunk = last_chunk;
+    this->sealed_chunk = sealed_chunk;
+
+    sys_message = transfer_id + data_to_string(chunk_index) + data_to_string((DTByte)last_chunk) + sealed_chunk;
+
+    append_msg_end();
+}
+
+void Message::create_bundle_msg(const std::vector<std::string>& frames)
+{
+    this->message_type = BUNDLE;
+    for (auto& cur_frame : frames) {
+        // we carry the frames decoded, so they are only base64ed once
+        ParseResult<std::string> b64ed_frame = check_and_chop_protocol_tag(cur_frame);
+        if (!b64ed_frame.ok())
+            throw InvalidDataException();
+
+        sys_message += encode_opaque_data(base64_decode(b64ed_frame.value));
+    }
+    bundled_frames = frames;
+
+    // no need to be signed
+    append_msg_end(false);
+}
+
+size_t Message::bundle_length(size_t no_of_frames, size_t frames_length)
+{
+    // decoded, each frame loses its tag and a quarter of the rest, but
+    // gains its length field
+    size_t raw_length = sizeof(DTShort) + sizeof(DTByte) + no_of_frames * sizeof(DTLength) +
+                        (frames_length - no_of_frames * c_np1sec_protocol_name.size()) * 3 / 4;
+    return c_np1sec_protocol_name.size() + ((raw_length + 2) / 3) * 4;
+}
+
 void Message::create_session_confirmation_msg(SessionId session_id, std::string session_key_confirmation,
-                                                    std::string next_session_ephemeral_key)
+                                              std::string next_session_ephemeral_key,
+                                              std::string next_session_leaf_key)
 {
     // data verification
-    logger.assert_or_die(session_id.get(), "can not create confirmation message for id-less session");
+    NP1SEC_ASSERT_OR_DIE(session_id.get(), "can not create confirmation message for id-less session");
 
     this->session_id.set(session_id.get());
     this->message_type = SESSION_CONFIRMATION;
     sys_message = session_key_confirmation + next_session_ephemeral_key;
+    if (!next_session_leaf_key.empty())
+        sys_message += encode_opaque_data(next_session_leaf_key);
     append_msg_end();
 }
 
@@ -158,16 +331,19 @@ void Message::create_join_request_msg(UnauthenticatedParticipant joiner)
     append_msg_end(false);
 }
 
-void Message::create_joiner_auth_msg(SessionId session_id, std::string key_confirmation, std::string z_sender)
+void Message::create_joiner_auth_msg(SessionId session_id, std::string key_confirmation, std::string z_sender,
+                                     std::string key_tree_update)
 {
 
     // data verification
-    logger.assert_or_die(session_id.get(), "can not create joiner auth message for id-less session");
+    NP1SEC_ASSERT_OR_DIE(session_id.get(), "can not create joiner auth message for id-less session");
 
     this->message_type = JOINER_AUTH;
     this->session_id.set(session_id.get());
     sys_message = encode_opaque_data(key_confirmation);
     sys_message += z_sender;
+    if (!key_tree_update.empty())
+        sys_message += encode_opaque_data(key_tree_update);
 
     append_msg_end();
 }
@@ -185,15 +361,28 @@ void Message::create_joiner_auth_msg(SessionId session_id, std::string key_confi
 
 // }
 
-void Message::append_msg_end(bool need_to_be_signed)
+std::string Message::clear_header()
 {
     std::string clear_message =
-        data_to_string(c_np1sec_protocol_version) + data_to_string((DTByte)(this->message_type));
+        data_to_string(protocol_version) + data_to_string((DTByte)(this->message_type));
 
-    if (this->session_id.get() != nullptr) {
+    if (is_compact()) {
+        clear_message += data_to_string(session_index);
+    } else if (this->session_id.get() != nullptr) {
         clear_message += this->session_id.get_as_stringbuff();
     }
 
+    if (message_type == IN_SESSION_MESSAGE && key_ratchet)
+        clear_message += is_compact() ? encode_varint(sender_index) + encode_varint(sender_message_id)
+                                      : data_to_string(sender_index) + data_to_string(sender_message_id);
+
+    return clear_message;
+}
+
+void Message::append_msg_end(bool need_to_be_signed)
+{
+    std::string clear_message = clear_header();
+
     if (need_to_be_signed) // If we fail to sign a message we can't do much
         signature = sign_message(clear_message + sys_message);
 
@@ -211,7 +400,7 @@ void Message::append_msg_end(bool need_to_be_signed)
     final_whole_message = sys_message;
 }
 
-void Message::unwrap_generic_message(std::string b64ed_message)
+ParseStatus Message::unwrap_generic_message(std::string b64ed_message)
 {
     std::string message = base64_decode(b64ed_message);
 
@@ -219,13 +408,22 @@ void Message::unwrap_generic_message(std::string b64ed_message)
     // protocol version
 
     // check version
-    if (!check_version_validity(message))
-        throw VersionMismatchException();
+    ParseStatus version_validity = check_version_validity(message);
+    if (version_validity != PARSE_OK)
+        return version_validity;
 
     message_type = (MessageType)(*reinterpret_cast<DTByte*>(&message[c_message_type_offset]));
+    if (message_type == UNKNOWN || message_type >= TOTAL_NO_OF_MESSAGE_TYPE)
+        return PARSE_MALFORMED;
+
+    // only in-session messages have compact form, only session views the
+    // delta form
+    if ((is_compact() && message_type != IN_SESSION_MESSAGE) ||
+        (is_delta_view_capable() && message_type != PARTICIPANTS_INFO))
+        return PARSE_MALFORMED;
 
     size_t current_offset = c_message_type_offset + sizeof(DTByte);
-    logger.debug("received message of type " + logger.message_type_to_text[message_type], __FUNCTION__);
+    NP1SEC_LOG_DEBUG("received message of type " + logger.message_type_to_text[message_type], __FUNCTION__);
 
     switch (message_type) {
     case JOIN_REQUEST:
@@ -233,29 +431,73 @@ void Message::unwrap_generic_message(std::string b64ed_message)
         this->joiner_info = message.substr(current_offset);
         break;
 
+    case BUNDLE: {
+        // and BUNDLE which only carries other messages
+        std::string frames_string = message.substr(current_offset);
+        while (frames_string.size()) {
+            ParseResult<std::pair<std::string, std::string>> frame_and_rest = decode_opaque_field(frames_string);
+            if (!frame_and_rest.ok())
+                return PARSE_MALFORMED;
+            bundled_frames.push_back(c_np1sec_protocol_name + base64_encode(frame_and_rest.value.first));
+            frames_string = frame_and_rest.value.second;
+        }
+        break;
+    }
+
     default:
         // the message should have
-        // now we get the session id
-        if (message.size() < current_offset + c_hash_length)
-            throw MessageFormatException();
+        // now we get the session id, or only its index if compact
+        if (is_compact()) {
+            if (message.size() < current_offset + sizeof(DTLength))
+                return PARSE_MALFORMED;
+
+            session_index = string_to_length(&message[current_offset]);
+            current_offset += sizeof(DTLength);
+        } else {
+            if (message.size() < current_offset + c_hash_length)
+                return PARSE_MALFORMED;
 
-        this->session_id.set(reinterpret_cast<uint8_t*>(&message[current_offset]));
-        current_offset += c_hash_length;
+            this->session_id.set(reinterpret_cast<uint8_t*>(&message[current_offset]));
+            current_offset += c_hash_length;
+        }
 
         if (message_type == IN_SESSION_MESSAGE) {
+            // the position of the message key in the chain of the sender
+            if (key_ratchet) {
+                if (is_compact()) {
+                    ParseResult<uint32_t> cur_id = decode_varint(message, current_offset);
+                    if (!cur_id.ok())
+                        return PARSE_MALFORMED;
+                    sender_index = cur_id.value;
+
+                    cur_id = decode_varint(message, current_offset);
+                    if (!cur_id.ok())
+                        return PARSE_MALFORMED;
+                    sender_message_id = cur_id.value;
+                } else {
+                    if (message.size() < current_offset + 2 * sizeof(DTLength))
+                        return PARSE_MALFORMED;
+
+                    sender_index = string_to_length(&message[current_offset]);
+                    current_offset += sizeof(DTLength);
+                    sender_message_id = string_to_length(&message[current_offset]);
+                    current_offset += sizeof(DTLength);
+                }
+            }
+
             // this is an encrypted message and we can't do more before
             // decryption. If we don't have the session key then we stop here
             // the first part of signed message
             signed_message = message.substr(0, current_offset);
             encrypted_part_of_message = message.substr(current_offset);
             if (cryptic)
-                unwrap_in_session_message(encrypted_part_of_message);
+                return unwrap_in_session_message(encrypted_part_of_message);
 
         } else {
 
             // at least we need to have a signature size
             if (message.length() < current_offset + c_signature_length)
-                throw MessageFormatException();
+                return PARSE_MALFORMED;
 
             // we only store these values so the session later calls the verify function
             // because we don't keep track of the sender public key we are unable to
@@ -266,57 +508,123 @@ void Message::unwrap_generic_message(std::string b64ed_message)
             // from now on we deal with the messages separately
             switch (message_type) {
             case PARTICIPANTS_INFO: {
-                std::pair<std::string, std::string> sv_and_rest =
+                ParseResult<std::pair<std::string, std::string>> sv_and_rest =
                     decode_opaque_field(signed_message.substr(current_offset));
-                string_to_session_view(sv_and_rest.first);
-
-                std::pair<std::string, std::string> confirmation_and_share = decode_opaque_field(sv_and_rest.second);
-                key_confirmation = confirmation_and_share.first;
-                z_sender = confirmation_and_share.second;
-                if (z_sender.size() != c_hash_length)
-                    throw MessageFormatException();
+                if (!sv_and_rest.ok() || string_to_session_view(sv_and_rest.value.first) != PARSE_OK)
+                    return PARSE_MALFORMED;
+
+                if (session_view.empty()) { // delta against the parent session
+                    if (!is_delta_view_capable() || sv_and_rest.value.second.size() < c_hash_length)
+                        return PARSE_MALFORMED;
+                    parent_session_id.set(reinterpret_cast<const uint8_t*>(sv_and_rest.value.second.data()));
+
+                    ParseResult<std::pair<std::string, std::string>> departed_and_rest =
+                        decode_opaque_field(sv_and_rest.value.second.substr(c_hash_length));
+                    if (!departed_and_rest.ok())
+                        return PARSE_MALFORMED;
+
+                    std::string departed_nicks_string = departed_and_rest.value.first;
+                    while (departed_nicks_string.size()) {
+                        ParseResult<std::pair<std::string, std::string>> nick_and_rest =
+                            decode_opaque_field(departed_nicks_string);
+                        if (!nick_and_rest.ok())
+                            return PARSE_MALFORMED;
+                        departed_nicks.push_back(nick_and_rest.value.first);
+                        departed_nicks_string = nick_and_rest.value.second;
+                    }
+
+                    sv_and_rest = decode_opaque_field(departed_and_rest.value.second);
+                    if (!sv_and_rest.ok() || string_to_session_view(sv_and_rest.value.first) != PARSE_OK)
+                        return PARSE_MALFORMED;
+                }
+
+                ParseResult<std::pair<std::string, std::string>> confirmation_and_share =
+                    decode_opaque_field(sv_and_rest.value.second);
+                if (!confirmation_and_share.ok())
+                    return PARSE_MALFORMED;
+
+                // a view admitting several joiners confirms to each of them
+                key_confirmation = confirmation_and_share.value.first;
+                if (key_confirmation.size() != sizeof(Token) && build_authentication_table() != PARSE_OK)
+                    return PARSE_MALFORMED;
+
+                if (decode_share_and_key_tree_update(confirmation_and_share.value.second) != PARSE_OK)
+                    return PARSE_MALFORMED;
 
                 break;
             }
 
             case JOINER_AUTH: {
-                std::pair<std::string, std::string> confirmation_and_share =
+                ParseResult<std::pair<std::string, std::string>> confirmation_and_share =
                     decode_opaque_field(signed_message.substr(current_offset));
+                if (!confirmation_and_share.ok())
+                    return PARSE_MALFORMED;
 
-                key_confirmation = confirmation_and_share.first;
-                build_authentication_table();
+                key_confirmation = confirmation_and_share.value.first;
+                if (build_authentication_table() != PARSE_OK)
+                    return PARSE_MALFORMED;
 
-                z_sender = confirmation_and_share.second;
-                if (z_sender.size() != c_hash_length)
-                    throw MessageFormatException();
+                if (decode_share_and_key_tree_update(confirmation_and_share.value.second) != PARSE_OK)
+                    return PARSE_MALFORMED;
 
                 break;
             }
 
             case GROUP_SHARE:
-                z_sender = signed_message.substr(current_offset);
-                if (z_sender.size() != c_hash_length)
-                    throw MessageFormatException();
+                if (decode_share_and_key_tree_update(signed_message.substr(current_offset)) != PARSE_OK)
+                    return PARSE_MALFORMED;
 
                 break;
 
-            case SESSION_CONFIRMATION:
-                current_offset =
-                    move_offset_or_throw_up(signed_message, current_offset, 0, c_hash_length); // don't move just check
-                session_key_confirmation = signed_message.substr(current_offset, c_hash_length);
-                current_offset =
-                    move_offset_or_throw_up(signed_message, current_offset, c_hash_length, c_ephemeral_key_length);
-                next_session_ephemeral_key = signed_message.substr(current_offset, c_hash_length);
-                // Should we throw up if there is garbage hanging at the end of
-                // legit part?
+            case TRANSFER_CHUNK: {
+                // transfer id, chunk index, last flag and the sealed chunk
+                ParseResult<size_t> sealed_chunk_offset = move_offset(
+                    signed_message, current_offset, c_transfer_id_length + sizeof(DTLength) + sizeof(DTByte));
+                if (!sealed_chunk_offset.ok())
+                    return PARSE_MALFORMED;
+
+                transfer_id = signed_message.substr(current_offset, c_transfer_id_length);
+                current_offset += c_transfer_id_length;
+                chunk_index = string_to_length(&signed_message[current_offset]);
+                current_offset += sizeof(DTLength);
+                last_chunk = string_to_byte(&signed_message[current_offset]);
+                sealed_chunk = signed_message.substr(sealed_chunk_offset.value);
                 break;
+            }
+
+            case SESSION_CONFIRMATION: {
+                ParseResult<size_t> key_confirmation_offset =
+                    move_offset(signed_message, current_offset, 0, c_hash_length); // don't move just check
+                if (!key_confirmation_offset.ok())
+                    return PARSE_MALFORMED;
+                session_key_confirmation = signed_message.substr(key_confirmation_offset.value, c_hash_length);
+
+                ParseResult<size_t> ephemeral_key_offset =
+                    move_offset(signed_message, key_confirmation_offset.value, c_hash_length, c_ephemeral_key_length);
+                if (!ephemeral_key_offset.ok())
+                    return PARSE_MALFORMED;
+                next_session_ephemeral_key = signed_message.substr(ephemeral_key_offset.value, c_hash_length);
+
+                // followed by our leaf key if the room is large enough to
+                // agree on its key by the ratchet tree
+                if (signed_message.size() > ephemeral_key_offset.value + c_hash_length) {
+                    ParseResult<std::pair<std::string, std::string>> leaf_key_and_rest =
+                        decode_opaque_field(signed_message.substr(ephemeral_key_offset.value + c_hash_length));
+                    if (!leaf_key_and_rest.ok() || leaf_key_and_rest.value.first.size() != c_tree_node_key_length)
+                        return PARSE_MALFORMED;
+                    next_session_leaf_key = leaf_key_and_rest.value.first;
+                }
+                break;
+            }
 
             default:
                 // we exhausted all type possibility
-                throw MessageFormatException();
+                return PARSE_MALFORMED;
             }
         }
     }
+
+    return PARSE_OK;
 }
 
 std::string Message::ustate_values(std::vector<std::string> pstates)
@@ -330,12 +638,12 @@ std::string Message::ustate_values(std::vector<std::string> pstates)
     return ustates;
 }
 
-void Message::build_authentication_table()
+ParseStatus Message::build_authentication_table()
 {
     std::string remaining_confirmations = key_confirmation;
     while (remaining_confirmations.size()) {
         if (remaining_confirmations.size() < sizeof(DTLength) + sizeof(DTHash))
-            throw MessageFormatException();
+            return PARSE_MALFORMED;
 
         authentication_table.insert(std::pair<DTLength, std::string>(
             string_to_length(remaining_confirmations.data()),
@@ -343,6 +651,8 @@ void Message::build_authentication_table()
 
         remaining_confirmations.erase(0, sizeof(DTLength) + sizeof(DTHash));
     }
+
+    return PARSE_OK;
 }
 
 /**
@@ -367,52 +677,155 @@ std::string Message::create_in_session_msg(SessionId session_id, uint32_t sender
                                                  uint32_t parent_id, HashStdBlock transcript_chain_hash,
                                                  MessageSubType message_sub_type, std::string user_message)
 {
+    cook_in_session_msg(session_id, sender_index, sender_own_id, parent_id, transcript_chain_hash, message_sub_type,
+                        user_message);
+
+    append_msg_end(true);
+
+    return final_whole_message;
+}
+
+void Message::cook_in_session_msg(SessionId session_id, uint32_t sender_index, uint32_t sender_own_id,
+                                  uint32_t parent_id, HashStdBlock transcript_chain_hash,
+                                  MessageSubType message_sub_type, const std::string& user_message)
+{
 
     if (!cryptic) // you can't make a user message without cryptic being set
         throw InsufficientCredentialException();
 
     message_type = IN_SESSION_MESSAGE;
-    logger.assert_or_die(session_id.get(), "can not create in-session message for id-less session");
+    this->sender_index = sender_index;
+    sender_message_id = sender_own_id;
+    NP1SEC_ASSERT_OR_DIE(session_id.get(), "can not create in-session message for id-less session");
     this->session_id.set(session_id.get());
     std::string base_message;
     // first we cook the meta part
 
-    MessageBuffer buffer;
-    gcry_randomize(buffer, c_hash_length, GCRY_STRONG_RANDOM);
-
-    base_message = data_to_string(sender_index);
-    base_message += data_to_string(sender_own_id);
-    base_message += data_to_string(parent_id);
-    base_message += transcript_chain_hash;
-    base_message += hash_to_string_buff(buffer);
+    if (is_compact()) {
+        session_index = this->session_id.get_index();
+        base_message = encode_varint(sender_index);
+        base_message += encode_varint(sender_own_id);
+        base_message += encode_varint(parent_id);
+        base_message += data_to_string(static_cast<DTByte>(transcript_chain_hash.size()));
+        base_message += transcript_chain_hash;
+    } else {
+        MessageBuffer buffer;
+        gcry_randomize(buffer, c_hash_length, GCRY_STRONG_RANDOM);
+
+        base_message = data_to_string(sender_index);
+        base_message += data_to_string(sender_own_id);
+        base_message += data_to_string(parent_id);
+        base_message += transcript_chain_hash;
+        base_message += hash_to_string_buff(buffer);
+    }
 
     switch (message_sub_type) {
     case USER_MESSAGE:
         base_message += data_to_string((DTShort)message_sub_type);
         base_message += encode_opaque_data(user_message);
         break;
+    case USER_MESSAGE_FRAGMENT:
+        base_message += data_to_string((DTShort)message_sub_type);
+        base_message += data_to_string(fragment_index);
+        base_message += data_to_string(no_of_fragments);
+        base_message += encode_opaque_data(user_message);
+        break;
     case LEAVE_MESSAGE:
         base_message += data_to_string((DTShort)message_sub_type);
 
     case JUST_ACK:
         // nothing more to be done
         break;
+
+    default:
+        logger.abort("the next session material can't be sent on its own", __FUNCTION__);
+    }
+
+    if (!next_session_ephemeral_key.empty()) {
+        base_message += data_to_string((DTShort)EPHEMERAL_KEY);
+        base_message += encode_opaque_data(next_session_ephemeral_key);
+    }
+
+    if (!next_session_key_share.empty()) {
+        base_message += data_to_string((DTShort)KEY_SHARE);
+        base_message += encode_opaque_data(next_session_key_share);
     }
 
     sys_message = base_message;
+}
 
-    append_msg_end(true);
+size_t Message::sealed_length()
+{
+    // the signature and the iv are of fixed length and GCM doesn't pad
+    size_t sealed_message_length = clear_header().size() + sys_message.size() + c_signature_length + c_iv_length;
+    return c_np1sec_protocol_name.size() + ((sealed_message_length + 2) / 3) * 4;
+}
 
-    return final_whole_message;
+bool Message::peek_header(const std::string& raw_message)
+{
+    const size_t c_clear_header_length = sizeof(DTShort) + sizeof(DTByte) + c_hash_length;
+    const size_t c_b64_clear_header_length = ((c_clear_header_length + 2) / 3) * 4;
+
+    if (raw_message.compare(0, c_np1sec_protocol_name.size(), c_np1sec_protocol_name))
+        return false;
+
+    // only whole quads are decodable
+    size_t b64_length = std::min(raw_message.size() - c_np1sec_protocol_name.size(), c_b64_clear_header_length);
+    b64_length -= b64_length % 4;
+
+    unsigned char header[(c_b64_clear_header_length / 4) * 3];
+    size_t header_length =
+        otrl_base64_decode(header, raw_message.data() + c_np1sec_protocol_name.size(), b64_length);
+
+    size_t c_message_type_offset = sizeof(DTShort);
+    if (header_length < c_message_type_offset + sizeof(DTByte))
+        return false;
+
+    protocol_version = *reinterpret_cast<const DTShort*>(header);
+    DTByte header_message_type = header[c_message_type_offset];
+    if (protocol_version != c_np1sec_protocol_version &&
+        !(protocol_version == c_np1sec_compact_protocol_version && header_message_type == IN_SESSION_MESSAGE) &&
+        !(protocol_version == c_np1sec_delta_views_protocol_version && header_message_type == PARTICIPANTS_INFO))
+        return false;
+
+    message_type = static_cast<MessageType>(header[c_message_type_offset]);
+    if (message_type == UNKNOWN || message_type >= TOTAL_NO_OF_MESSAGE_TYPE)
+        return false;
+
+    size_t c_sid_offset = c_message_type_offset + sizeof(DTByte);
+    if (is_compact()) {
+        if (header_length < c_sid_offset + sizeof(DTLength))
+            return false;
+
+        session_index = string_to_length(reinterpret_cast<const char*>(header) + c_sid_offset);
+    } else if (message_type != JOIN_REQUEST && message_type != BUNDLE) {
+        if (header_length < c_clear_header_length)
+            return false;
+
+        session_id.set(header + c_sid_offset);
+    }
+
+    return true;
 }
 
-void Message::unwrap_in_session_message(std::string u_message)
+ParseStatus Message::unwrap_in_session_message(std::string u_message)
 {
     std::string encrypted_message, phased_message, temp_store;
 
-    phased_message = decrypt_message(u_message);
+    // there should be at least the iv
+    if (u_message.size() < c_iv_length)
+        return PARSE_MALFORMED;
+
+    // the encrypted ids have to match the ones the key was chosen by
+    DTLength key_sender_index = sender_index;
+    MessageId key_position = sender_message_id;
+    if (!key_ratchet)
+        phased_message = decrypt_message(u_message);
+    else if (!key_ratchet->decrypt(key_sender_index, key_position, u_message, phased_message))
+        return PARSE_MALFORMED;
+
     if (phased_message.size() < c_signature_length)
-        throw MessageFormatException();
+        return PARSE_MALFORMED;
 
     std::string signed_encrypted_part = phased_message.substr(0, phased_message.size() - c_signature_length);
     signed_message += signed_encrypted_part;
@@ -421,48 +834,108 @@ void Message::unwrap_in_session_message(std::string u_message)
     //  if (verify_message(signed_message, signature)) { //we can't verify
     // we are not keeping track of pub keys
 
-    // sender_index: DTLength
-    size_t current_offset = move_offset_or_throw_up(signed_encrypted_part, 0, 0, sizeof(DTLength));
-    sender_index = string_to_length(&signed_encrypted_part[current_offset]);
-
-    // sender_own_id: DTLength
-    current_offset = move_offset_or_throw_up(signed_encrypted_part, current_offset, sizeof(DTLength), sizeof(DTLength));
-    sender_message_id = string_to_length(&signed_encrypted_part[current_offset]);
-
-    // parent_id: DTLength
-    current_offset = move_offset_or_throw_up(signed_encrypted_part, current_offset, sizeof(DTLength), sizeof(DTLength));
-    parent_id = string_to_length(&signed_encrypted_part[current_offset]);
-
-    // transcript hash: DTLength
-    current_offset = move_offset_or_throw_up(signed_encrypted_part, current_offset, sizeof(DTLength), sizeof(DTHash));
-    transcript_chain_hash = signed_encrypted_part.substr(current_offset, sizeof(DTHash));
+    size_t current_offset = 0;
+    if (is_compact()) {
+        // sender_index, sender_own_id, parent_id: varint
+        // transcript hash: DTByte length followed by the (truncated) hash
+        ParseResult<uint32_t> cur_id = decode_varint(signed_encrypted_part, current_offset);
+        if (!cur_id.ok())
+            return PARSE_MALFORMED;
+        sender_index = cur_id.value;
+
+        cur_id = decode_varint(signed_encrypted_part, current_offset);
+        if (!cur_id.ok())
+            return PARSE_MALFORMED;
+        sender_message_id = cur_id.value;
+
+        cur_id = decode_varint(signed_encrypted_part, current_offset);
+        if (!cur_id.ok())
+            return PARSE_MALFORMED;
+        parent_id = cur_id.value;
+
+        if (current_offset >= signed_encrypted_part.size())
+            return PARSE_MALFORMED;
+        size_t transcript_hash_length = string_to_byte(&signed_encrypted_part[current_offset]);
+        if (transcript_hash_length > c_hash_length ||
+            !move_offset(signed_encrypted_part, current_offset, sizeof(DTByte), transcript_hash_length).ok())
+            return PARSE_MALFORMED;
+        current_offset += sizeof(DTByte);
+
+        transcript_chain_hash = signed_encrypted_part.substr(current_offset, transcript_hash_length);
+        current_offset += transcript_hash_length;
+
+    } else {
+        // the fixed part: sender_index, sender_own_id, parent_id: DTLength
+        // transcript hash, nonce: DTHash
+        if (!move_offset(signed_encrypted_part, 0, 3 * sizeof(DTLength) + 2 * sizeof(DTHash)).ok())
+            return PARSE_MALFORMED;
+
+        sender_index = string_to_length(&signed_encrypted_part[current_offset]);
+        current_offset += sizeof(DTLength);
+
+        sender_message_id = string_to_length(&signed_encrypted_part[current_offset]);
+        current_offset += sizeof(DTLength);
+
+        parent_id = string_to_length(&signed_encrypted_part[current_offset]);
+        current_offset += sizeof(DTLength);
+
+        transcript_chain_hash = signed_encrypted_part.substr(current_offset, sizeof(DTHash));
+        current_offset += sizeof(DTHash);
+
+        nonce = signed_encrypted_part.substr(current_offset, sizeof(DTHash));
+        current_offset += sizeof(DTHash);
+    }
 
-    // nonce DTHash
-    current_offset = move_offset_or_throw_up(signed_encrypted_part, current_offset, sizeof(DTHash), sizeof(DTHash));
-    nonce = signed_encrypted_part.substr(current_offset, sizeof(DTHash));
+    if (key_ratchet && (sender_index != key_sender_index || sender_message_id != key_position))
+        return PARSE_MALFORMED;
 
     // now we recover the TVs
-    current_offset = move_offset_or_throw_up(signed_encrypted_part, current_offset, sizeof(DTHash));
     std::string sub_messages_remainder = signed_encrypted_part.substr(current_offset);
 
     // if the message has no TVs then it is just an ACK
+    message_sub_type = JUST_ACK;
 
     while (sub_messages_remainder.size()) {
         // message sub type hash: DTLength
-        current_offset = move_offset_or_throw_up(sub_messages_remainder, 0, 0,
-                                                 sizeof(DTShort)); // just checking to have valid length
+        if (sub_messages_remainder.size() < sizeof(DTShort))
+            return PARSE_MALFORMED;
+
         MessageSubType current_sub_message_type =
-            static_cast<MessageSubType>(string_to_short(&sub_messages_remainder[current_offset]));
-        current_offset = move_offset_or_throw_up(sub_messages_remainder, current_offset, sizeof(DTShort));
+            static_cast<MessageSubType>(string_to_short(&sub_messages_remainder[0]));
+        current_offset = sizeof(DTShort);
 
         switch (current_sub_message_type) {
         case USER_MESSAGE: {
             message_sub_type = USER_MESSAGE;
-            std::pair<std::string, std::string> user_message_and_rest =
+            ParseResult<std::pair<std::string, std::string>> user_message_and_rest =
                 decode_opaque_field(sub_messages_remainder.substr(current_offset));
-            user_message = user_message_and_rest.first;
-            sub_messages_remainder = user_message_and_rest.second;
-            current_offset = 0;
+            if (!user_message_and_rest.ok())
+                return PARSE_MALFORMED;
+
+            user_message = user_message_and_rest.value.first;
+            sub_messages_remainder = user_message_and_rest.value.second;
+            break;
+        }
+
+        case USER_MESSAGE_FRAGMENT: {
+            message_sub_type = USER_MESSAGE_FRAGMENT;
+            if (!move_offset(sub_messages_remainder, current_offset, 2 * sizeof(DTShort)).ok())
+                return PARSE_MALFORMED;
+
+            fragment_index = string_to_short(&sub_messages_remainder[current_offset]);
+            current_offset += sizeof(DTShort);
+            no_of_fragments = string_to_short(&sub_messages_remainder[current_offset]);
+            current_offset += sizeof(DTShort);
+            if (fragment_index >= no_of_fragments)
+                return PARSE_MALFORMED;
+
+            ParseResult<std::pair<std::string, std::string>> fragment_and_rest =
+                decode_opaque_field(sub_messages_remainder.substr(current_offset));
+            if (!fragment_and_rest.ok())
+                return PARSE_MALFORMED;
+
+            user_message = fragment_and_rest.value.first;
+            sub_messages_remainder = fragment_and_rest.value.second;
             break;
         }
 
@@ -471,23 +944,38 @@ void Message::unwrap_in_session_message(std::string u_message)
             sub_messages_remainder = sub_messages_remainder.substr(current_offset);
             break;
 
-        default: // this is about in session forward secracy
-            logger.warn("received a sub-message of type " + std::to_string(current_sub_message_type) +
-                        " but do not know what to do with it");
-            // throw NotImplementedException();
+        // in session forward secrecy, they don't change the sub type of the
+        // message they ride on
+        case EPHEMERAL_KEY:
+        case KEY_SHARE: {
+            ParseResult<std::pair<std::string, std::string>> key_and_rest =
+                decode_opaque_field(sub_messages_remainder.substr(current_offset));
+            if (!key_and_rest.ok())
+                return PARSE_MALFORMED;
+
+            if (current_sub_message_type == EPHEMERAL_KEY)
+                next_session_ephemeral_key = key_and_rest.value.first;
+            else
+                next_session_key_share = key_and_rest.value.first;
+            sub_messages_remainder = key_and_rest.value.second;
+            break;
+        }
+
+        default:
+            // we don't know the length of the sub-message so we can't skip it
+            return PARSE_MALFORMED;
         }
     };
 
     // message_id = compute_message_id(user_message);
+    return PARSE_OK;
 }
 
 uint32_t Message::compute_message_id() const { return message_id; }
 
 void Message::send(std::string room_name, UserState* us)
 {
-    us->ops->send_bare(room_name, sys_message, us->ops->bare_sender_data); // This is not cool
-    // message just should ask us to send and then us is the only one which has
-    // access to ops internals
+    us->send_frame(room_name, sys_message);
 }
 
 std::string Message::base64_encode(std::string message)
@@ -540,8 +1028,14 @@ std::string Message::sign_message(std::string message)
 
 bool Message::verify_message(PublicKey sender_ephemeral_key)
 {
-    if (cryptic->verify(signed_message, (unsigned char*)signature.c_str(), sender_ephemeral_key)) {
-        logger.debug("massage bears a valid signature from " + sender_nick, __FUNCTION__);
+    NP1SEC_TRACE3(verify_begin, trace_session_id(session_id.get()), static_cast<int>(message_type),
+                  signed_message.size());
+    bool verified = cryptic->verify(signed_message, (unsigned char*)signature.c_str(), sender_ephemeral_key);
+    NP1SEC_TRACE3(verify_end, trace_session_id(session_id.get()), static_cast<int>(message_type),
+                  static_cast<int>(verified));
+
+    if (verified) {
+        NP1SEC_LOG_DEBUG("massage bears a valid signature from " + sender_nick, __FUNCTION__);
         return true;
     }
 
@@ -549,7 +1043,13 @@ bool Message::verify_message(PublicKey sender_ephemeral_key)
     return false;
 }
 
-std::string Message::encrypt_message(std::string signed_message) { return cryptic->Encrypt(signed_message); }
+std::string Message::encrypt_message(std::string signed_message)
+{
+    if (key_ratchet)
+        return key_ratchet->encrypt(sender_message_id, signed_message);
+
+    return cryptic->Encrypt(signed_message);
+}
 
 HashStdBlock Message::compute_hash()
 {
@@ -33,6 +33,32 @@ namespace np1sec
 
 class UserState;
 
+/**
+ * Outcome of parsing an inbound message. The parser reports malformed
+ * input through these instead of throwing, so a flood of garbage costs
+ * a return code per message rather than an exception unwinding.
+ */
+enum ParseStatus {
+    PARSE_OK,
+    PARSE_NOT_NP1SEC, // missing protocol tag
+    PARSE_VERSION_MISMATCH,
+    PARSE_MALFORMED // truncated fields, bad lengths, unknown type
+};
+
+/**
+ * Either a parsed value or the status explaining why there is none.
+ */
+template <typename T>
+struct ParseResult {
+    ParseStatus status;
+    T value;
+
+    ParseResult(const T& value) : status(PARSE_OK), value(value) {}
+    ParseResult(ParseStatus status) : status(status), value() {}
+
+    bool ok() const { return status == PARSE_OK; }
+};
+
 class Message
 {
   protected:
@@ -68,17 +94,13 @@ class Message
     /**
      * move the current offset to point to the next token, it checks that
      * we won't exceed the expected length of next token
-     * otherwise throw message format exception
+     * otherwise returns PARSE_MALFORMED
      */
-    size_t move_offset_or_throw_up(const std::string& parsed_string, size_t current_offset, size_t move_window,
-                                   size_t expected_field_length = 0)
+    ParseResult<size_t> move_offset(const std::string& parsed_string, size_t current_offset, size_t move_window,
+                                    size_t expected_field_length = 0)
     {
-        if (parsed_string.size() < current_offset + move_window + expected_field_length) {
-            logger.error("invalid length: total: " + std::to_string(parsed_string.size()) + " cur: " +
-                         std::to_string(current_offset) + " f1: " + std::to_string(move_window) + " f2: " +
-                         std::to_string(expected_field_length));
-            throw MessageFormatException();
-        }
+        if (parsed_string.size() < current_offset + move_window + expected_field_length)
+            return PARSE_MALFORMED;
 
         return current_offset + move_window;
     }
@@ -115,10 +137,40 @@ class Message
 
     uint8_t string_to_byte(const char* data) { return uint8_t(*reinterpret_cast<const uint8_t*>(data)); }
 
-    std::string check_and_chop_protocol_tag(const std::string& raw_message)
+    /**
+     * LEB128 encoding of the ids in compact in-session messages, the
+     * small ids of a session mostly fit in one byte
+     */
+    std::string encode_varint(uint32_t data)
+    {
+        std::string varint;
+        for (; data >= 0x80; data >>= 7)
+            varint += static_cast<char>((data & 0x7f) | 0x80);
+        varint += static_cast<char>(data);
+
+        return varint;
+    }
+
+    /**
+     * reads a varint starting at offset and moves the offset after it
+     */
+    ParseResult<uint32_t> decode_varint(const std::string& parsed_string, size_t& offset)
     {
-        if (raw_message.substr(0, c_np1sec_protocol_name.size()) != c_np1sec_protocol_name)
-            throw MessageFormatException();
+        uint32_t data = 0;
+        for (unsigned int shift = 0; shift < 32 && offset < parsed_string.size(); shift += 7) {
+            uint8_t cur_byte = parsed_string[offset++];
+            data |= static_cast<uint32_t>(cur_byte & 0x7f) << shift;
+            if (!(cur_byte & 0x80))
+                return data;
+        }
+
+        return PARSE_MALFORMED;
+    }
+
+    ParseResult<std::string> check_and_chop_protocol_tag(const std::string& raw_message)
+    {
+        if (raw_message.compare(0, c_np1sec_protocol_name.size(), c_np1sec_protocol_name))
+            return PARSE_NOT_NP1SEC;
         // TODO:: do something intelligent here
         // should we warn the user about unencrypted message
         // and then return everything as the plain text?
@@ -140,14 +192,26 @@ class Message
      *  return a pairs of strings, first with the opaque data (without length)
      *  second the rest of the string
      */
-    std::pair<std::string, std::string> decode_opaque_field(std::string opaque_data);
+    ParseResult<std::pair<std::string, std::string>> decode_opaque_field(const std::string& opaque_data);
 
-    bool check_version_validity(std::string& raw_protocol_less_message)
+    /**
+     * reads z_sender and the key tree update which may follow it at the
+     * end of PARTICIPANTS_INFO, JOINER_AUTH and GROUP_SHARE messages
+     */
+    ParseStatus decode_share_and_key_tree_update(const std::string& share_and_update);
+
+    ParseStatus check_version_validity(const std::string& raw_protocol_less_message)
     {
-        if (raw_protocol_less_message.size() < sizeof(DTShort))
-            throw MessageFormatException();
+        // we need the message type after the version as well
+        if (raw_protocol_less_message.size() < sizeof(DTShort) + sizeof(DTByte))
+            return PARSE_MALFORMED;
+
+        protocol_version = *(reinterpret_cast<const DTShort*>(raw_protocol_less_message.data()));
+        if (protocol_version != c_np1sec_protocol_version && protocol_version != c_np1sec_compact_protocol_version &&
+            protocol_version != c_np1sec_delta_views_protocol_version)
+            return PARSE_VERSION_MISMATCH;
 
-        return (*(reinterpret_cast<const DTShort*>(raw_protocol_less_message.data())) == c_np1sec_protocol_version);
+        return PARSE_OK;
     }
 
   public:
@@ -159,6 +223,8 @@ class Message
         GROUP_SHARE = 0x0d,
         SESSION_CONFIRMATION = 0x0e, // In session messages
         IN_SESSION_MESSAGE = 0x10,
+        TRANSFER_CHUNK = 0x11,
+        BUNDLE = 0x12, // several messages sent in one transport message
         INADMISSIBLE = 0x20,
         TOTAL_NO_OF_MESSAGE_TYPE // This should be always the last message type
 
@@ -168,13 +234,16 @@ class Message
         JUST_ACK,
         USER_MESSAGE,
         LEAVE_MESSAGE,
-        // EPHEMERAL_KEY,
-        // KEY_SHARE,
+        USER_MESSAGE_FRAGMENT,
+        EPHEMERAL_KEY, // the next session material, rides along any of the above
+        KEY_SHARE,
         // CONTRIBUTION_STATE
     };
 
+    DTShort protocol_version = c_np1sec_protocol_version;
     MessageType message_type;
     SessionId session_id;
+    DTLength session_index = 0; // replaces session_id in compact messages
     DTLength sender_index;
     std::string sender_nick;
     MessageId message_id;
@@ -183,6 +252,8 @@ class Message
     HashBlock session_id_buffer;
     MessageSubType message_sub_type;
     std::string user_message;
+    DTShort fragment_index = 0; // position of the user message fragment in the whole message
+    DTShort no_of_fragments = 0;
     std::string sys_message;
     LoadFlag meta_load_flag;
     HashStdBlock transcript_chain_hash;
@@ -192,9 +263,19 @@ class Message
     std::string key_confirmation;
     std::string session_key_confirmation;
     std::string next_session_ephemeral_key;
+    std::string next_session_leaf_key; // our key in the ratchet tree of the next session
+    std::string next_session_key_share; // our z_sender in the next session, piggybacked on in-session messages
+    std::string key_tree_update; // public ratchet tree or a commit to it, follows z_sender
     std::string joiner_info;
+    SessionId parent_session_id; // set if session_view only lists the changes against the parent session
+    std::vector<std::string> departed_nicks;
     std::vector<std::string> pstates;
-    size_t no_of_participants;
+    size_t no_of_participants = 0;
+    std::string transfer_id;
+    DTLength chunk_index = 0;
+    bool last_chunk = false;
+    std::string sealed_chunk; // the chunk encrypted under the transfer key
+    std::vector<std::string> bundled_frames; // whole np1sec messages in a BUNDLE
 
     /** signature stuff */
     std::string signed_message; // we store the part of message
@@ -216,6 +297,11 @@ class Message
     UserState* us;
     std::string room_name;
 
+    // if set, in-session messages are encrypted under the message key of
+    // the sender at its own message id instead of the session key, and the
+    // two are sent in clear so the receiver knows which key to use
+    MessageKeyRatchet* key_ratchet = nullptr;
+
     /*
      * Construct a new Message based on a set of message components
      * as input
@@ -225,32 +311,81 @@ class Message
     /*
      * Construct a new Message based on a set of message components
      * based on an encrypted message as input
+     *
+     * throws MessageFormatException or VersionMismatchException if the
+     * message can not be parsed, use parse() to avoid the exception
      */
     Message(std::string raw_message, Cryptic* cryptic = nullptr, size_t no_of_participants = 0);
 
+    /**
+     * Parses a received raw message into this message without throwing
+     * on malformed input. If cryptic is set, the encrypted part of an in
+     * session message is decrypted and parsed as well.
+     *
+     * @return PARSE_OK on success, otherwise the reason of rejection
+     */
+    ParseStatus parse(const std::string& raw_message);
+
     /**
      * @return if the message is of type PARTICIPANTS_INFO it returns
      *         the list of participants with their ephemerals
-     *         (session view)otherwise
-     *         throw an exception
+     *         (session view)otherwise (or if the view is an unapplied
+     *         delta) throw an exception
      */
     const UnauthenticatedParticipantList& get_session_view();
 
     std::string session_view_as_string();
 
     /**
-     * Create PARTICIPANT_INFO system message
+     * returns true if the session view of the PARTICIPANTS_INFO message is
+     * a delta against the parent session which needs to be applied before
+     * the view is usable
+     */
+    bool has_delta_view() { return (parent_session_id.get() != nullptr); }
+
+    /**
+     * turns the delta session view into the full one by applying the
+     * departures and changed participants to the view of the parent
+     * session.
      *
+     * @param parent_view the view of the parent session with the ephemeral
+     *        keys its participants have committed to for the next session
+     *
+     * @return false if the resulting view doesn't hash to the message sid,
+     *         in that case the message is left untouched
+     */
+    bool apply_session_view_delta(const UnauthenticatedParticipantList& parent_view);
+
+    /**
+     * Create PARTICIPANT_INFO system message, in
+     * c_np1sec_delta_views_protocol_version if protocol_version is set to
+     * it because everybody in the view takes delta views
+     *
+     * @param key_tree_update the public ratchet tree for the joiner to
+     *        commit against, if the session agrees on its key by the tree
      */
     void create_participant_info_msg(SessionId session_id, UnauthenticatedParticipantList& session_view_list,
-                                     std::string key_confirmation, HashStdBlock z_sender);
+                                     std::string key_confirmation, HashStdBlock z_sender,
+                                     std::string key_tree_update = "");
+
+    /**
+     * Create PARTICIPANT_INFO system message whose session view only lists
+     * the participants which have left or changed since the parent session.
+     * It is in c_np1sec_delta_views_protocol_version, which only the
+     * participants taking delta views understand.
+     */
+    void create_participant_info_delta_msg(SessionId session_id, SessionId parent_session_id,
+                                           UnauthenticatedParticipantList& changed_participants,
+                                           const std::vector<std::string>& departed_nicks,
+                                           std::string key_confirmation, HashStdBlock z_sender);
 
     /**
      * create session_confirmation system message
      *
      */
     void create_session_confirmation_msg(SessionId session_id, std::string session_key_confirmation,
-                                         std::string next_session_ephemeral_key);
+                                         std::string next_session_ephemeral_key,
+                                         std::string next_session_leaf_key = "");
 
     /**
      * create JOIN_REQUEST system message
@@ -261,14 +396,42 @@ class Message
     /**
      * create JOINER_AUTH system message
      *
+     * @param key_tree_update the commit of the joiner to the ratchet tree
      */
-    void create_joiner_auth_msg(SessionId session_id, std::string key_confirmation, std::string z_sender);
+    void create_joiner_auth_msg(SessionId session_id, std::string key_confirmation, std::string z_sender,
+                                std::string key_tree_update = "");
 
     /**
      * create GROUP_SHARE system message
      *
+     * @param key_tree_update the commit of the sponsor to the ratchet tree
+     */
+    void create_group_share_msg(SessionId session_id, std::string z_sender, std::string key_tree_update = "");
+
+    /**
+     * create TRANSFER_CHUNK message. The chunk is already sealed by the
+     * ChunkCipher of the transfer, the message only signs it.
+     */
+    void create_transfer_chunk_msg(SessionId session_id, std::string transfer_id, DTLength chunk_index,
+                                   bool last_chunk, std::string sealed_chunk);
+
+    /**
+     * create BUNDLE message out of whole np1sec messages. Each of them is
+     * still signed on its own, so the bundle itself isn't
+     */
+    void create_bundle_msg(const std::vector<std::string>& frames);
+
+    /**
+     * @return the length of the BUNDLE message made of frames whose
+     *         lengths add up to frames_length
+     */
+    static size_t bundle_length(size_t no_of_frames, size_t frames_length);
+
+    /**
+     * the clear part of the message preceding the signed and, for
+     * in-session messages, encrypted part
      */
-    void create_group_share_msg(SessionId session_id, std::string z_sender);
+    std::string clear_header();
 
     /**
      * Append standard message end for system messages
@@ -279,18 +442,52 @@ class Message
     /**
      * Create USER_MESSAGE
      *
+     * in compact format if protocol_version is set to
+     * c_np1sec_compact_protocol_version, in which case the transcript
+     * chain hash can be truncated. For USER_MESSAGE_FRAGMENT, user_message
+     * is the fragment and fragment_index and no_of_fragments need to be set.
+     * If next_session_ephemeral_key and next_session_key_share are set they
+     * are appended as EPHEMERAL_KEY and KEY_SHARE sub-messages.
      */
     std::string create_in_session_msg(SessionId session_id, uint32_t sender_index, uint32_t sender_own_id,
                                       uint32_t parent_id, HashStdBlock transcript_chain_hash,
                                       MessageSubType message_sub_type, std::string user_message = "");
 
-    void string_to_session_view(std::string sv_string);
+    /**
+     * cooks the in-session message of create_in_session_msg into
+     * sys_message without signing, encrypting or encoding it, so its
+     * sealed_length can be known before paying for the crypto
+     */
+    void cook_in_session_msg(SessionId session_id, uint32_t sender_index, uint32_t sender_own_id, uint32_t parent_id,
+                             HashStdBlock transcript_chain_hash, MessageSubType message_sub_type,
+                             const std::string& user_message);
+
+    /**
+     * @return the length final_whole_message will have once the cooked
+     *         in-session message is sealed by append_msg_end
+     */
+    size_t sealed_length();
+
+    ParseStatus string_to_session_view(std::string sv_string);
 
     /**
      * returns true if session_id is set
      */
     bool has_sid() { return (session_id.get() != nullptr); }
 
+    /**
+     * returns true if the message is in compact in-session format and
+     * so only carries the session index, until the room resolves it
+     * to the session id
+     */
+    bool is_compact() const { return protocol_version == c_np1sec_compact_protocol_version; }
+
+    /**
+     * returns true if the message is a PARTICIPANTS_INFO telling that all
+     * the participants of its session take delta session views
+     */
+    bool is_delta_view_capable() const { return protocol_version == c_np1sec_delta_views_protocol_version; }
+
     /**
      * Compute a unique globally ordered id from the time stamped message,
      * ultimately this function should be overridable by the client.
@@ -356,9 +553,21 @@ class Message
      * Unwrap p_info message into its constituent components
      *
      */
-    void unwrap_generic_message(std::string b64ed_message);
+    ParseStatus unwrap_generic_message(std::string b64ed_message);
 
-    void unwrap_in_session_message(std::string u_message);
+    ParseStatus unwrap_in_session_message(std::string u_message);
+
+    /**
+     * Decodes only as many base64 quads of a raw message as needed to
+     * read its clear header: version, message type and session id.
+     * It is meant for discarding the messages we have no use for
+     * before paying for the full decode and parse.
+     *
+     * @return false if the message is not an np1sec message of our
+     *         version with a known type, otherwise true and message_type
+     *         and session_id (if the type has one) are set.
+     */
+    bool peek_header(const std::string& raw_message);
 
     /**
      * Format Meta message for inclusion with standard message or for
@@ -380,10 +589,10 @@ class Message
     std::string ustate_values(std::vector<std::string> pstates);
 
     /**
-     * chop the key_confirmation from joiner auth and make a
-     * table out of it.
+     * chop the key_confirmation from joiner auth (or from a participant
+     * info admitting several joiners) and make a table out of it.
      */
-    void build_authentication_table();
+    ParseStatus build_authentication_table();
 
     /**
      * Destructor
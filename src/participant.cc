@@ -123,14 +123,117 @@ void Participant::compute_p2p_private(AsymmetricKey thread_user_id_key, Cryptic*
                                      sort_by_long_term_pub_key(this->long_term_pub_key, thread_user_id_key), &p2p_key);
 }
 
+ParticipantMap::ParticipantMap(const UnauthenticatedParticipantList& session_view)
+{
+    // we sort pointers to the view entries so each participant is only
+    // constructed once, in place
+    std::vector<const UnauthenticatedParticipant*> sorted_view;
+    for (auto& cur_entry : session_view)
+        sorted_view.push_back(&cur_entry);
+    std::sort(sorted_view.begin(), sorted_view.end(),
+              [](const UnauthenticatedParticipant* lhs, const UnauthenticatedParticipant* rhs) {
+                  return lhs->participant_id.nickname < rhs->participant_id.nickname;
+              });
+
+    sorted_participants.reserve(sorted_view.size());
+    for (auto cur_entry : sorted_view) {
+        if (!sorted_participants.empty() && sorted_participants.back().first == cur_entry->participant_id.nickname)
+            continue; // like std::map, the first one stays
+
+        sorted_participants.emplace_back(cur_entry->participant_id.nickname, Participant(*cur_entry));
+        sorted_participants.back().second.authenticated = cur_entry->authenticated;
+    }
+
+    reindex();
+}
+
+void ParticipantMap::reindex(size_t first)
+{
+    for (size_t i = first; i < sorted_participants.size(); i++) {
+        sorted_participants[i].second.index = i;
+        nick_index[sorted_participants[i].first] = i;
+    }
+}
+
+ParticipantMap::iterator ParticipantMap::find(const std::string& nickname)
+{
+    auto participant_index = nick_index.find(nickname);
+    return participant_index == nick_index.end() ? end() : begin() + participant_index->second;
+}
+
+ParticipantMap::const_iterator ParticipantMap::find(const std::string& nickname) const
+{
+    auto participant_index = nick_index.find(nickname);
+    return participant_index == nick_index.end() ? end() : begin() + participant_index->second;
+}
+
+Participant& ParticipantMap::operator[](const std::string& nickname)
+{
+    auto participant_index = nick_index.find(nickname);
+    NP1SEC_ASSERT_OR_DIE(participant_index != nick_index.end(), nickname + " is not a participant", __FUNCTION__);
+
+    return sorted_participants[participant_index->second].second;
+}
+
+std::pair<ParticipantMap::iterator, bool> ParticipantMap::insert(const value_type& participant)
+{
+    iterator position = find(participant.first);
+    if (position != end())
+        return std::make_pair(position, false);
+
+    position = std::lower_bound(begin(), end(), participant,
+                                [](const value_type& lhs, const value_type& rhs) { return lhs.first < rhs.first; });
+    size_t inserted_index = position - begin();
+    sorted_participants.insert(position, participant);
+    reindex(inserted_index);
+
+    return std::make_pair(begin() + inserted_index, true);
+}
+
+size_t ParticipantMap::erase(const std::string& nickname)
+{
+    auto participant_index = nick_index.find(nickname);
+    if (participant_index == nick_index.end())
+        return 0;
+
+    size_t erased_index = participant_index->second;
+    nick_index.erase(participant_index);
+    sorted_participants.erase(begin() + erased_index);
+    reindex(erased_index);
+
+    return 1;
+}
+
+std::vector<std::string> ParticipantMap::nicknames() const
+{
+    std::vector<std::string> nicknames;
+    for (auto& cur_participant : sorted_participants)
+        nicknames.push_back(cur_participant.first);
+
+    return nicknames;
+}
+
 /**
  *  this is basically the merge function
  */
 ParticipantMap operator+(const ParticipantMap& lhs, const ParticipantMap& rhs)
 {
-    ParticipantMap result(lhs);
+    ParticipantMap result;
+    result.sorted_participants.reserve(lhs.size() + rhs.size());
+
+    auto lhs_it = lhs.begin();
+    auto rhs_it = rhs.begin();
+    while (lhs_it != lhs.end() || rhs_it != rhs.end()) {
+        if (rhs_it == rhs.end() || (lhs_it != lhs.end() && lhs_it->first <= rhs_it->first)) {
+            if (rhs_it != rhs.end() && lhs_it->first == rhs_it->first)
+                rhs_it++;
+            result.sorted_participants.push_back(*lhs_it++);
+        } else {
+            result.sorted_participants.push_back(*rhs_it++);
+        }
+    }
 
-    result.insert(rhs.begin(), rhs.end());
+    result.reindex();
     return result;
 }
 
@@ -141,8 +244,15 @@ ParticipantMap operator-(const ParticipantMap& lhs, const ParticipantMap& rhs)
 {
     ParticipantMap difference;
 
-    std::set_difference(lhs.begin(), lhs.end(), rhs.begin(), rhs.end(), std::inserter(difference, difference.end()));
+    for (auto& cur_participant : lhs) {
+        auto rhs_participant = rhs.find(cur_participant.first);
+        if (rhs_participant == rhs.end() ||
+            memcmp(rhs_participant->second.id.fingerprint, cur_participant.second.id.fingerprint,
+                   ParticipantId::c_fingerprint_length))
+            difference.sorted_participants.push_back(cur_participant);
+    }
 
+    difference.reindex();
     return difference;
 }
 
@@ -22,6 +22,9 @@
 #include <string>
 #include <list>
 #include <map>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "exceptions.h"
 #include "src/crypt.h"
@@ -101,13 +104,23 @@ struct ParticipantId {
         memcpy(fingerprint, lhs.fingerprint, c_fingerprint_length);
     }
 
+    /**
+     * copy assignment, ParticipantMap assigns participants in place
+     */
+    ParticipantId& operator=(const ParticipantId& rhs)
+    {
+        nickname = rhs.nickname;
+        memcpy(fingerprint, rhs.fingerprint, c_fingerprint_length);
+        return *this;
+    }
+
     /**
      * Destructor
      */
     ~ParticipantId()
     {
       secure_wipe(fingerprint, c_fingerprint_length);
-      logger.debug("Wiping fingerprint from ParticipantID");
+      NP1SEC_LOG_DEBUG("Wiping fingerprint from ParticipantID");
     }
 
     /**
@@ -130,6 +143,13 @@ struct UnauthenticatedParticipant {
     uint8_t ephemeral_pub_key[c_ephemeral_key_length]; // This should be in some convienient
     // Format
     bool authenticated;
+    // only told by a joiner in its JOIN_REQUEST, whose last byte the
+    // receivers don't read as authentication, so older peers ignore it
+    bool takes_delta_views = false;
+
+    // the bits of the last byte
+    static const uint8_t c_authenticated_flag = 1;
+    static const uint8_t c_takes_delta_views_flag = 2;
 
     /**
     * constructor
@@ -150,7 +170,8 @@ struct UnauthenticatedParticipant {
      * Default copy constructor
      */
     UnauthenticatedParticipant(const UnauthenticatedParticipant& rhs)
-        : participant_id(rhs.participant_id), authenticated(rhs.authenticated)
+        : participant_id(rhs.participant_id), authenticated(rhs.authenticated),
+          takes_delta_views(rhs.takes_delta_views)
     {
         memcpy(this->ephemeral_pub_key, rhs.ephemeral_pub_key, c_ephemeral_key_length);
     }
@@ -176,14 +197,17 @@ struct UnauthenticatedParticipant {
                                                                               c_ephemeral_key_length - sizeof(DTByte));
 
         memcpy(this->ephemeral_pub_key, ephemeral_pub_key.c_str(), c_ephemeral_key_length);
-        authenticated = (participant_id_and_ephmeralkey.back() == 1);
+        uint8_t flags = participant_id_and_ephmeralkey.back();
+        authenticated = flags & c_authenticated_flag;
+        takes_delta_views = flags & c_takes_delta_views_flag;
     };
 
     std::string unauthed_participant_to_stringbuffer()
     {
         std::string string_id(participant_id.id_to_stringbuffer());
         string_id += std::string(reinterpret_cast<char*>(ephemeral_pub_key), c_ephemeral_key_length);
-        string_id += static_cast<char>(authenticated ? 1 : 0);
+        string_id += static_cast<char>((authenticated ? c_authenticated_flag : 0) |
+                                       (takes_delta_views ? c_takes_delta_views_flag : 0));
         return string_id;
     }
 };
@@ -206,14 +230,22 @@ class Participant
     // TODO: this is actually shouldn't be stored by this user, the private key
     // just to be provided when participant wants to compute the p2p key
 
+    // the keys never change once made, so the copies of the participant in
+    // the sessions bred from ours share them rather than rebuild them. The
+    // plain key members below just point into these.
+    SharedPublicKey shared_long_term_pub_key;
+    SharedPublicKey shared_ephemeral_key;
+    SharedPublicKey shared_future_ephemeral_key;
+
   public:
     ParticipantId id;
     PublicKey long_term_pub_key;
     PublicKey ephemeral_key = nullptr;
-    MessageId last_acked_message_id;
+    MessageId last_acked_message_id = 0;
     void* send_ack_timer = nullptr;
     edCurvePublicKey raw_ephemeral_key = {};
     edCurvePublicKey future_raw_ephemeral_key = {};
+    std::string future_leaf_key; // in the ratchet tree of the next session
     // MessageDigest message_digest;
 
     np1secKeyShare cur_keyshare;
@@ -222,10 +254,11 @@ class Participant
     bool authed_to = false;
     bool key_share_contributed;
     bool leaving = false;
+    bool takes_delta_views = false; // PARTICIPANTS_INFO carrying a delta session view
 
-    uint32_t index; // keep the place of the partcipant in sorted peers array
+    uint32_t index; // keep the place of the partcipant in the sorted ParticipantMap
     /* this is the i in U_i and we have
-                                 participants[peers[i]].index == i
+                                 participants.by_index(i).index == i
                                  tautology
 
                                  sorry we barely have space for half
@@ -237,17 +270,49 @@ class Participant
 
     // Participant* thread_user_as_participant;
 
-    // default copy constructor
+    // default copy constructor, shares the keys
     Participant(const Participant& rhs)
-        : id(rhs.id), long_term_pub_key(rhs.long_term_pub_key), authenticated(rhs.authenticated),
-          authed_to(rhs.authed_to), key_share_contributed(rhs.key_share_contributed), index(rhs.index)
+        : shared_long_term_pub_key(rhs.shared_long_term_pub_key), shared_ephemeral_key(rhs.shared_ephemeral_key),
+          shared_future_ephemeral_key(rhs.shared_future_ephemeral_key), id(rhs.id),
+          long_term_pub_key(rhs.long_term_pub_key), ephemeral_key(rhs.ephemeral_key),
+          future_leaf_key(rhs.future_leaf_key), authenticated(rhs.authenticated), authed_to(rhs.authed_to),
+          key_share_contributed(rhs.key_share_contributed), takes_delta_views(rhs.takes_delta_views),
+          index(rhs.index)
+
+    {
+        memcpy(raw_ephemeral_key, rhs.raw_ephemeral_key, sizeof(edCurvePublicKey));
+        memcpy(future_raw_ephemeral_key, rhs.future_raw_ephemeral_key, sizeof(edCurvePublicKey));
+        memcpy(p2p_key, rhs.p2p_key, sizeof(np1secSymmetricKey));
+        memcpy(cur_keyshare, rhs.cur_keyshare, sizeof(np1secKeyShare));
+    }
 
+    // copies what the copy constructor does, as the participants are moved
+    // around in ParticipantMap
+    Participant& operator=(const Participant& rhs)
     {
-        long_term_pub_key = copy_crypto_resource(rhs.long_term_pub_key);
-        set_ephemeral_key(rhs.raw_ephemeral_key);
+        if (this == &rhs)
+            return *this;
+
+        shared_long_term_pub_key = rhs.shared_long_term_pub_key;
+        shared_ephemeral_key = rhs.shared_ephemeral_key;
+        shared_future_ephemeral_key = rhs.shared_future_ephemeral_key;
+        id = rhs.id;
+        long_term_pub_key = rhs.long_term_pub_key;
+        ephemeral_key = rhs.ephemeral_key;
+        future_leaf_key = rhs.future_leaf_key;
+        authenticated = rhs.authenticated;
+        authed_to = rhs.authed_to;
+        key_share_contributed = rhs.key_share_contributed;
+        takes_delta_views = rhs.takes_delta_views;
+        index = rhs.index;
+        send_ack_timer = nullptr;
+        leaving = false;
+        memcpy(raw_ephemeral_key, rhs.raw_ephemeral_key, sizeof(edCurvePublicKey));
         memcpy(future_raw_ephemeral_key, rhs.future_raw_ephemeral_key, sizeof(edCurvePublicKey));
         memcpy(p2p_key, rhs.p2p_key, sizeof(np1secSymmetricKey));
         memcpy(cur_keyshare, rhs.cur_keyshare, sizeof(np1secKeyShare));
+
+        return *this;
     }
 
     enum ForwardSecracyContribution { NONE, EPHEMERAL, KEY_SHARE };
@@ -267,11 +332,45 @@ class Participant
      */
     void set_ephemeral_key(const edCurvePublicKey raw_ephemeral_key)
     {
-        release_crypto_resource(this->ephemeral_key);
         // delete [] this->raw_ephemeral_key; doesn't make sense to delete const length array
         memcpy(this->raw_ephemeral_key, raw_ephemeral_key, sizeof(edCurvePublicKey));
-        ephemeral_key = reconstruct_public_key_sexp(
-            std::string(reinterpret_cast<const char*>(raw_ephemeral_key), c_ephemeral_key_length));
+        shared_ephemeral_key = share_crypto_resource(reconstruct_public_key_sexp(
+            std::string(reinterpret_cast<const char*>(raw_ephemeral_key), c_ephemeral_key_length)));
+        ephemeral_key = shared_ephemeral_key.get();
+    }
+
+    /**
+     * sets the ephemeral key the participant has committed to for the
+     * next session. Its s-expression is only made when a session is
+     * bred with it.
+     */
+    void set_future_ephemeral_key(const edCurvePublicKey raw_future_ephemeral_key)
+    {
+        memcpy(future_raw_ephemeral_key, raw_future_ephemeral_key, sizeof(edCurvePublicKey));
+        shared_future_ephemeral_key.reset();
+    }
+
+    /**
+     * makes the s-expression of the future ephemeral key unless it is
+     * already made, so the copies made afterwards share it
+     */
+    void make_future_ephemeral_key()
+    {
+        if (!shared_future_ephemeral_key)
+            shared_future_ephemeral_key = share_crypto_resource(reconstruct_public_key_sexp(
+                std::string(reinterpret_cast<const char*>(future_raw_ephemeral_key), c_ephemeral_key_length)));
+    }
+
+    /**
+     * turns the future ephemeral key into the current one, for the
+     * participant's copy in the next session
+     */
+    void adopt_future_ephemeral_key()
+    {
+        make_future_ephemeral_key();
+        memcpy(raw_ephemeral_key, future_raw_ephemeral_key, sizeof(edCurvePublicKey));
+        shared_ephemeral_key = shared_future_ephemeral_key;
+        ephemeral_key = shared_ephemeral_key.get();
     }
 
     /**
@@ -324,10 +423,11 @@ class Participant
     }
 
     Participant(const UnauthenticatedParticipant& unauth_participant)
-        : id(unauth_participant.participant_id),
-          long_term_pub_key(reconstruct_public_key_sexp(
-              hash_to_string_buff(unauth_participant.participant_id.fingerprint))),
-          authenticated(false), authed_to(false), key_share_contributed(false)
+        : shared_long_term_pub_key(share_crypto_resource(
+              reconstruct_public_key_sexp(hash_to_string_buff(unauth_participant.participant_id.fingerprint)))),
+          id(unauth_participant.participant_id), long_term_pub_key(shared_long_term_pub_key.get()),
+          authenticated(false), authed_to(false), key_share_contributed(false),
+          takes_delta_views(unauth_participant.takes_delta_views)
     {
         set_ephemeral_key(unauth_participant.ephemeral_pub_key);
     }
@@ -335,9 +435,7 @@ class Participant
     // destructor
     ~Participant()
     {
-        // release gcrypt stuff
-        release_crypto_resource(this->ephemeral_key);
-        release_crypto_resource(this->long_term_pub_key);
+        // the gcrypt stuff is released with the last copy of the shared keys
         // TODO - Verify with Vmon that these are necessary
         //secure_wipe(ephemeral_key, c_hash_length);
         //secure_wipe(raw_ephemeral_key, c_hash_length);
@@ -347,12 +445,85 @@ class Participant
         //logger.debug("Wiped ephemeral_key from Participant");
         //logger.debug("Wiped raw_ephemeral_key from Participant");
         //logger.debug("Wiped cur_keyshare from Participant");
-        logger.debug("Wiped future_raw_ephemeral_key from Participant");
-        logger.debug("Wiped p2p_key from Participant");
+        NP1SEC_LOG_DEBUG("Wiped future_raw_ephemeral_key from Participant");
+        NP1SEC_LOG_DEBUG("Wiped p2p_key from Participant");
     }
 };
 
-typedef std::map<std::string, Participant> ParticipantMap;
+/**
+ * The participants of a session keyed by nickname. They are kept in one
+ * vector sorted by nickname, so a participant's position is its index
+ * in the session (the i in U_i) and the nick index makes lookups by
+ * nickname constant time. Participants are only added or removed while
+ * the session is being bred, but they are looked up for every message.
+ *
+ * Adding or removing participants invalidates references to the others.
+ *
+ * Each table owns its participants; copies of a participant only share
+ * its keys. Every session writes the key share, acks and authentication
+ * of each of its participants in its first round, so shared entries
+ * would all be cloned by then anyway.
+ */
+class ParticipantMap
+{
+  public:
+    typedef std::pair<std::string, Participant> value_type;
+    typedef std::vector<value_type>::iterator iterator;
+    typedef std::vector<value_type>::const_iterator const_iterator;
+
+  protected:
+    std::vector<value_type> sorted_participants;
+    std::unordered_map<std::string, uint32_t> nick_index;
+
+    /**
+     * updates the index of the participants from position first on
+     */
+    void reindex(size_t first = 0);
+
+  public:
+    ParticipantMap() {}
+
+    /**
+     * makes the participants of the session view, in whatever order the
+     * view lists them
+     */
+    explicit ParticipantMap(const UnauthenticatedParticipantList& session_view);
+
+    iterator begin() { return sorted_participants.begin(); }
+    iterator end() { return sorted_participants.end(); }
+    const_iterator begin() const { return sorted_participants.begin(); }
+    const_iterator end() const { return sorted_participants.end(); }
+
+    size_t size() const { return sorted_participants.size(); }
+    bool empty() const { return sorted_participants.empty(); }
+
+    iterator find(const std::string& nickname);
+    const_iterator find(const std::string& nickname) const;
+
+    /**
+     * unlike std::map, the participant has to be there already
+     */
+    Participant& operator[](const std::string& nickname);
+
+    Participant& by_index(uint32_t index) { return sorted_participants[index].second; }
+    const Participant& by_index(uint32_t index) const { return sorted_participants[index].second; }
+
+    /**
+     * adds the participant unless somebody with the same nickname is
+     * already there
+     */
+    std::pair<iterator, bool> insert(const value_type& participant);
+
+    size_t erase(const std::string& nickname);
+
+    /**
+     * @return the nicknames in the order of the participants' indices
+     */
+    std::vector<std::string> nicknames() const;
+
+    friend ParticipantMap operator+(const ParticipantMap& lhs, const ParticipantMap& rhs);
+    friend ParticipantMap operator-(const ParticipantMap& lhs, const ParticipantMap& rhs);
+};
 
 /**
  * To be used in std::sort to sort the particpant list
@@ -370,12 +541,14 @@ bool sort_by_long_term_pub_key(const AsymmetricKey lhs, const AsymmetricKey rhs)
 bool operator<(const Participant& rhs, const Participant& lhs);
 
 /**
- *  this is basically the merge function
+ *  this is basically the merge function, lhs wins if both have the
+ *  participant
  */
 ParticipantMap operator+(const ParticipantMap& lhs, const ParticipantMap& rhs);
 
 /**
- * this is basically the difference function
+ * this is basically the difference function. A participant stays if rhs
+ * doesn't have them, or has them with a different long term key
  */
 ParticipantMap operator-(const ParticipantMap& lhs, const ParticipantMap& rhs);
 
@@ -0,0 +1,205 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2014, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+
+#include "src/profiler.h"
+
+namespace np1sec
+{
+
+const char* const c_probe_names[TOTAL_NO_OF_PROBES] = {"Session::receive",
+                                                        "Room::receive_handler",
+                                                        "Message::parse",
+                                                        "Cryptic::sign",
+                                                        "Cryptic::verify",
+                                                        "Cryptic::Encrypt",
+                                                        "Cryptic::Decrypt",
+                                                        "Cryptic::triple_ed_dh",
+                                                        "Session::group_enc",
+                                                        "Session::group_dec"};
+
+const unsigned LatencyHistogram::c_sub_bucket_bits;
+const unsigned LatencyHistogram::c_sub_bucket_count;
+const unsigned LatencyHistogram::c_max_value_bits;
+const unsigned LatencyHistogram::c_bucket_count;
+
+void LatencyHistogram::merge(const LatencyHistogram& rhs)
+{
+    for (unsigned i = 0; i < c_bucket_count; i++)
+        buckets[i].store(buckets[i].load(std::memory_order_relaxed) + rhs.buckets[i].load(std::memory_order_relaxed),
+                         std::memory_order_relaxed);
+
+    uint64_t rhs_max = rhs.max.load(std::memory_order_relaxed);
+    if (rhs_max > max.load(std::memory_order_relaxed))
+        max.store(rhs_max, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::reset()
+{
+    for (auto& cur_bucket : buckets)
+        cur_bucket.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+}
+
+LatencySummary LatencyHistogram::summary() const
+{
+    LatencySummary latency_summary;
+    uint64_t counts[c_bucket_count];
+    for (unsigned i = 0; i < c_bucket_count; i++) {
+        counts[i] = buckets[i].load(std::memory_order_relaxed);
+        latency_summary.count += counts[i];
+    }
+
+    latency_summary.max = max.load(std::memory_order_relaxed);
+    if (!latency_summary.count)
+        return latency_summary;
+
+    // the rank of each percentile, rounded up so p999 of a few samples
+    // is their max
+    const uint64_t permilles[] = {500, 990, 999};
+    uint64_t* percentiles[] = {&latency_summary.p50, &latency_summary.p99, &latency_summary.p999};
+    uint64_t seen = 0;
+    unsigned next_percentile = 0;
+    for (unsigned i = 0; i < c_bucket_count && next_percentile < 3; i++) {
+        seen += counts[i];
+        while (next_percentile < 3 && seen * 1000 >= latency_summary.count * permilles[next_percentile]) {
+            *percentiles[next_percentile] = std::min(bucket_ceiling(i), latency_summary.max);
+            next_percentile++;
+        }
+    }
+
+    return latency_summary;
+}
+
+unsigned LatencyHistogram::bucket_of(uint64_t latency)
+{
+    if (latency < c_sub_bucket_count)
+        return static_cast<unsigned>(latency);
+
+    if (latency >> c_max_value_bits)
+        return c_bucket_count - 1;
+
+    unsigned msb = 63 - __builtin_clzll(latency);
+    unsigned shift = msb - c_sub_bucket_bits;
+    return (shift + 1) * c_sub_bucket_count + static_cast<unsigned>((latency >> shift) - c_sub_bucket_count);
+}
+
+uint64_t LatencyHistogram::bucket_ceiling(unsigned bucket)
+{
+    if (bucket < c_sub_bucket_count)
+        return bucket;
+
+    unsigned shift = bucket / c_sub_bucket_count - 1;
+    uint64_t sub_bucket = c_sub_bucket_count + bucket % c_sub_bucket_count;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+#ifdef NP1SEC_PROFILING
+
+namespace
+{
+
+struct ThreadProbes;
+
+/**
+ * the histograms of the live threads and what the exited ones have left
+ */
+struct ProbeRegistry {
+    std::mutex registry_mutex;
+    std::set<ThreadProbes*> live_threads;
+    LatencyHistogram exited_threads[TOTAL_NO_OF_PROBES];
+};
+
+ProbeRegistry& probe_registry()
+{
+    // never destroyed, threads may exit after the statics are gone
+    static ProbeRegistry* registry = new ProbeRegistry;
+    return *registry;
+}
+
+struct ThreadProbes {
+    LatencyHistogram histograms[TOTAL_NO_OF_PROBES];
+
+    ThreadProbes()
+    {
+        std::lock_guard<std::mutex> registry_lock(probe_registry().registry_mutex);
+        probe_registry().live_threads.insert(this);
+    }
+
+    ~ThreadProbes()
+    {
+        std::lock_guard<std::mutex> registry_lock(probe_registry().registry_mutex);
+        for (unsigned i = 0; i < TOTAL_NO_OF_PROBES; i++)
+            probe_registry().exited_threads[i].merge(histograms[i]);
+        probe_registry().live_threads.erase(this);
+    }
+};
+
+thread_local ThreadProbes thread_probes;
+
+} // namespace
+
+void record_probe_latency(ProbeId probe, uint64_t latency) { thread_probes.histograms[probe].record(latency); }
+
+LatencySummary probe_summary(ProbeId probe)
+{
+    std::unique_ptr<LatencyHistogram> all_threads(new LatencyHistogram);
+    std::lock_guard<std::mutex> registry_lock(probe_registry().registry_mutex);
+    all_threads->merge(probe_registry().exited_threads[probe]);
+    for (auto cur_thread : probe_registry().live_threads)
+        all_threads->merge(cur_thread->histograms[probe]);
+
+    return all_threads->summary();
+}
+
+std::string profile_report()
+{
+    std::stringstream report;
+    report << std::fixed << std::setprecision(1);
+    for (unsigned i = 0; i < TOTAL_NO_OF_PROBES; i++) {
+        LatencySummary latency_summary = probe_summary(static_cast<ProbeId>(i));
+        if (!latency_summary.count)
+            continue;
+
+        report << c_probe_names[i] << ": count " << latency_summary.count << " p50 " << latency_summary.p50 / 1000.0
+               << "us p99 " << latency_summary.p99 / 1000.0 << "us p999 " << latency_summary.p999 / 1000.0
+               << "us max " << latency_summary.max / 1000.0 << "us\n";
+    }
+
+    return report.str();
+}
+
+void reset_profile()
+{
+    std::lock_guard<std::mutex> registry_lock(probe_registry().registry_mutex);
+    for (unsigned i = 0; i < TOTAL_NO_OF_PROBES; i++) {
+        probe_registry().exited_threads[i].reset();
+        for (auto cur_thread : probe_registry().live_threads)
+            cur_thread->histograms[i].reset();
+    }
+}
+
+#endif // NP1SEC_PROFILING
+
+} // namespace np1sec
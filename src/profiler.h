@@ -0,0 +1,171 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2014, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef SRC_PROFILER_H_
+#define SRC_PROFILER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace np1sec
+{
+
+/**
+ * The hot functions of the library we time when it is configured with
+ * --enable-profiling, which defines NP1SEC_PROFILING. Otherwise the
+ * probes compile to nothing.
+ */
+enum ProbeId {
+    PROBE_SESSION_RECEIVE,
+    PROBE_ROOM_RECEIVE_HANDLER,
+    PROBE_MESSAGE_PARSE,
+    PROBE_CRYPTIC_SIGN,
+    PROBE_CRYPTIC_VERIFY,
+    PROBE_CRYPTIC_ENCRYPT,
+    PROBE_CRYPTIC_DECRYPT,
+    PROBE_TRIPLE_ED_DH,
+    PROBE_GROUP_ENC,
+    PROBE_GROUP_DEC,
+    TOTAL_NO_OF_PROBES // This should be always the last probe
+};
+
+extern const char* const c_probe_names[TOTAL_NO_OF_PROBES];
+
+struct LatencySummary {
+    uint64_t count = 0;
+    uint64_t p50 = 0; // nanoseconds
+    uint64_t p99 = 0;
+    uint64_t p999 = 0;
+    uint64_t max = 0;
+};
+
+/**
+ * A histogram of latencies in nanoseconds in the manner of HdrHistogram:
+ * a bucket per 1/32 of each power of two, so any percentile is off by at
+ * most about 3%, over a range up to about 18 minutes (longer latencies
+ * go to the last bucket).
+ *
+ * Only one thread records into a histogram, with plain relaxed loads and
+ * stores and no read-modify-write, while any thread may read it.
+ */
+class LatencyHistogram
+{
+  public:
+    static const unsigned c_sub_bucket_bits = 5;
+    static const unsigned c_sub_bucket_count = 1 << c_sub_bucket_bits;
+    static const unsigned c_max_value_bits = 40;
+    static const unsigned c_bucket_count = (c_max_value_bits - c_sub_bucket_bits + 1) * c_sub_bucket_count;
+
+    LatencyHistogram() { reset(); }
+
+    void record(uint64_t latency)
+    {
+        std::atomic<uint64_t>& bucket = buckets[bucket_of(latency)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (latency > max.load(std::memory_order_relaxed))
+            max.store(latency, std::memory_order_relaxed);
+    }
+
+    /**
+     * adds the counts of rhs to this histogram, which nobody else may be
+     * recording into meanwhile
+     */
+    void merge(const LatencyHistogram& rhs);
+
+    void reset();
+
+    LatencySummary summary() const;
+
+    /**
+     * @return the bucket latency falls in, exact under c_sub_bucket_count
+     */
+    static unsigned bucket_of(uint64_t latency);
+
+    /**
+     * @return the highest latency which falls in the bucket
+     */
+    static uint64_t bucket_ceiling(unsigned bucket);
+
+  protected:
+    std::atomic<uint64_t> buckets[c_bucket_count];
+    std::atomic<uint64_t> max;
+};
+
+#ifdef NP1SEC_PROFILING
+
+/**
+ * records the latency in the histogram of the probe of the calling thread
+ */
+void record_probe_latency(ProbeId probe, uint64_t latency);
+
+/**
+ * times the scope it lives in and records it under its probe
+ */
+class ScopedTimer
+{
+  public:
+    explicit ScopedTimer(ProbeId probe) : probe(probe), started_at(std::chrono::steady_clock::now()) {}
+
+    ~ScopedTimer()
+    {
+        record_probe_latency(probe, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                        std::chrono::steady_clock::now() - started_at).count());
+    }
+
+  protected:
+    ProbeId probe;
+    std::chrono::steady_clock::time_point started_at;
+};
+
+#define NP1SEC_PROBE_CONCAT_(a, b) a##b
+#define NP1SEC_PROBE_NAME_(line) NP1SEC_PROBE_CONCAT_(np1sec_scoped_timer_, line)
+#define NP1SEC_PROBE(probe) np1sec::ScopedTimer NP1SEC_PROBE_NAME_(__LINE__)(np1sec::probe)
+
+/**
+ * @return the latencies of the probe recorded by all threads, those
+ *         which have exited included
+ */
+LatencySummary probe_summary(ProbeId probe);
+
+/**
+ * @return a line of count, p50, p99, p999 and max (in microseconds) per
+ *         probe which has been hit
+ */
+std::string profile_report();
+
+/**
+ * forgets the latencies recorded so far, to be called while none of the
+ * threads recording are in the library
+ */
+void reset_profile();
+
+#else
+
+#define NP1SEC_PROBE(probe)
+
+inline LatencySummary probe_summary(ProbeId) { return LatencySummary(); }
+inline std::string profile_report() { return std::string(); }
+inline void reset_profile() {}
+
+#endif // NP1SEC_PROFILING
+
+} // namespace np1sec
+
+#endif // SRC_PROFILER_H_
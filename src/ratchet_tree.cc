@@ -0,0 +1,301 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2014, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <algorithm>
+
+#include "src/ratchet_tree.h"
+
+namespace np1sec
+{
+
+/**
+ * length prefixed field, the same as the opaque fields of the messages
+ */
+static std::string encode_tree_field(const std::string& data)
+{
+    DTLength data_length = data.size();
+    return std::string(reinterpret_cast<const char*>(&data_length), sizeof(DTLength)) + data;
+}
+
+/**
+ * reads the field at offset and moves the offset after it
+ *
+ * @return false if the field is truncated
+ */
+static bool decode_tree_field(const std::string& encoded, size_t& offset, std::string& data)
+{
+    if (encoded.size() < offset + sizeof(DTLength))
+        return false;
+
+    DTLength data_length = *reinterpret_cast<const DTLength*>(encoded.data() + offset);
+    offset += sizeof(DTLength);
+    if (data_length > encoded.size() - offset)
+        return false;
+
+    data = encoded.substr(offset, data_length);
+    offset += data_length;
+    return true;
+}
+
+uint32_t RatchetTree::leaf_node(const std::string& nick) const
+{
+    auto leaf = std::find(leaf_nicks.begin(), leaf_nicks.end(), nick);
+    if (nick.empty() || leaf == leaf_nicks.end())
+        return c_blank_node;
+
+    return 2 * (leaf - leaf_nicks.begin());
+}
+
+std::vector<uint32_t> RatchetTree::direct_path(uint32_t node) const
+{
+    std::vector<uint32_t> ancestors;
+    for (; node != root(); node = parent(node))
+        ancestors.push_back(parent(node));
+
+    return ancestors;
+}
+
+std::vector<uint32_t> RatchetTree::resolution(uint32_t node) const
+{
+    if (!node_keys[node].empty())
+        return std::vector<uint32_t>(1, node);
+
+    if (!level(node))
+        return std::vector<uint32_t>();
+
+    std::vector<uint32_t> covering_nodes = resolution(left(node));
+    std::vector<uint32_t> right_covering_nodes = resolution(right(node));
+    covering_nodes.insert(covering_nodes.end(), right_covering_nodes.begin(), right_covering_nodes.end());
+
+    return covering_nodes;
+}
+
+void RatchetTree::blank_direct_path(uint32_t node)
+{
+    for (auto ancestor : direct_path(node)) {
+        node_keys[ancestor].clear();
+        path_secrets.erase(ancestor);
+    }
+}
+
+void RatchetTree::add_leaf(const std::string& nick, const std::string& leaf_key)
+{
+    auto blank_leaf = std::find(leaf_nicks.begin(), leaf_nicks.end(), "");
+    uint32_t new_leaf = blank_leaf - leaf_nicks.begin();
+    if (blank_leaf == leaf_nicks.end()) {
+        // the old tree becomes the left subtree of the new root
+        leaf_nicks.resize(width() ? 2 * width() : 1);
+        node_keys.resize(2 * width() - 1);
+    }
+
+    leaf_nicks[new_leaf] = nick;
+    node_keys[2 * new_leaf] = leaf_key;
+    path_secrets.erase(2 * new_leaf);
+    blank_direct_path(2 * new_leaf);
+}
+
+void RatchetTree::remove_leaf(const std::string& nick)
+{
+    uint32_t node = leaf_node(nick);
+    if (node == c_blank_node)
+        return;
+
+    leaf_nicks[node / 2].clear();
+    node_keys[node].clear();
+    path_secrets.erase(node);
+    blank_direct_path(node);
+
+    while (width() > 1 &&
+           static_cast<size_t>(std::count(leaf_nicks.begin() + width() / 2, leaf_nicks.end(), "")) == width() / 2) {
+        for (uint32_t dropped_node = width() - 1; dropped_node < node_keys.size(); dropped_node++)
+            path_secrets.erase(dropped_node);
+        leaf_nicks.resize(width() / 2);
+        node_keys.resize(2 * width() - 1);
+    }
+}
+
+void RatchetTree::set_leaf_key(const std::string& nick, const std::string& leaf_key, const HashStdBlock& leaf_secret)
+{
+    uint32_t node = leaf_node(nick);
+    if (node == c_blank_node)
+        return;
+
+    node_keys[node] = leaf_key;
+    if (leaf_secret.empty())
+        path_secrets.erase(node);
+    else
+        path_secrets[node] = leaf_secret;
+}
+
+std::string RatchetTree::commit(const std::string& committer, const std::string& context)
+{
+    uint32_t child = leaf_node(committer);
+    NP1SEC_ASSERT_OR_DIE(child != c_blank_node, committer + " can not commit without a leaf", __FUNCTION__);
+
+    HashStdBlock path_secret(c_hash_length, '\0');
+    gcry_randomize(&path_secret[0], c_hash_length, GCRY_STRONG_RANDOM);
+    node_keys[child] = TreeNodeKey(path_secret).public_key();
+    path_secrets[child] = path_secret;
+
+    std::string update = encode_tree_field(node_keys[child]);
+    for (auto ancestor : direct_path(child)) {
+        path_secret = next_path_secret(path_secret);
+
+        std::string sealed_secrets;
+        for (auto covering_node : resolution(sibling(child)))
+            sealed_secrets += TreeNodeKey::seal(node_keys[covering_node], path_secret, context);
+
+        node_keys[ancestor] = TreeNodeKey(path_secret).public_key();
+        path_secrets[ancestor] = path_secret;
+        update += encode_tree_field(node_keys[ancestor]) + encode_tree_field(sealed_secrets);
+        child = ancestor;
+    }
+
+    secure_wipe(&path_secret[0], c_hash_length);
+    return update;
+}
+
+bool RatchetTree::apply_commit(const std::string& committer, const std::string& myself, const std::string& update,
+                               const std::string& context)
+{
+    size_t offset = 0;
+    std::string leaf_key;
+    if (!decode_tree_field(update, offset, leaf_key) || leaf_key.size() != c_tree_node_key_length)
+        return false;
+
+    // we work on a copy so a bogus update leaves us as we were
+    RatchetTree updated_tree(*this);
+    if (!updated_tree.has_leaf(committer))
+        updated_tree.add_leaf(committer, leaf_key);
+
+    uint32_t child = updated_tree.leaf_node(committer);
+    uint32_t my_leaf = updated_tree.leaf_node(myself);
+    if (my_leaf == c_blank_node)
+        return false;
+
+    updated_tree.node_keys[child] = leaf_key;
+
+    HashStdBlock path_secret;
+    for (auto ancestor : updated_tree.direct_path(child)) {
+        std::string node_key, sealed_secrets;
+        if (!decode_tree_field(update, offset, node_key) || !decode_tree_field(update, offset, sealed_secrets) ||
+            node_key.size() != c_tree_node_key_length)
+            return false;
+
+        if (!path_secret.empty()) {
+            path_secret = next_path_secret(path_secret);
+        } else if (is_under(my_leaf, ancestor)) {
+            // the lowest common ancestor: its secret is sealed to the node
+            // of our side we know the secret of
+            std::vector<uint32_t> covering_nodes = updated_tree.resolution(sibling(child));
+            if (sealed_secrets.size() != covering_nodes.size() * c_sealed_path_secret_length)
+                return false;
+
+            for (size_t i = 0; i < covering_nodes.size(); i++) {
+                auto our_secret = updated_tree.path_secrets.find(covering_nodes[i]);
+                if (our_secret != updated_tree.path_secrets.end()) {
+                    TreeNodeKey(our_secret->second)
+                        .open(sealed_secrets.substr(i * c_sealed_path_secret_length, c_sealed_path_secret_length),
+                              context, path_secret);
+                    break;
+                }
+            }
+
+            if (path_secret.empty())
+                return false;
+        }
+
+        if (!path_secret.empty()) {
+            if (TreeNodeKey(path_secret).public_key() != node_key)
+                return false;
+            updated_tree.path_secrets[ancestor] = path_secret;
+        }
+
+        updated_tree.node_keys[ancestor] = node_key;
+        child = ancestor;
+    }
+
+    if (offset != update.size() || path_secret.empty())
+        return false;
+
+    secure_wipe(&path_secret[0], c_hash_length);
+
+    std::swap(leaf_nicks, updated_tree.leaf_nicks);
+    std::swap(node_keys, updated_tree.node_keys);
+    std::swap(path_secrets, updated_tree.path_secrets);
+    return true;
+}
+
+std::string RatchetTree::public_tree() const
+{
+    std::string encoded_leaves;
+    for (auto& cur_nick : leaf_nicks)
+        encoded_leaves += encode_tree_field(cur_nick);
+
+    std::string encoded_keys;
+    for (DTLength node = 0; node < node_keys.size(); node++)
+        if (!node_keys[node].empty())
+            encoded_keys += std::string(reinterpret_cast<const char*>(&node), sizeof(DTLength)) + node_keys[node];
+
+    return encode_tree_field(encoded_leaves) + encode_tree_field(encoded_keys);
+}
+
+bool RatchetTree::adopt_public_tree(const std::string& encoded_tree)
+{
+    size_t offset = 0;
+    std::string encoded_leaves, encoded_keys;
+    if (!decode_tree_field(encoded_tree, offset, encoded_leaves) ||
+        !decode_tree_field(encoded_tree, offset, encoded_keys) || offset != encoded_tree.size())
+        return false;
+
+    std::vector<std::string> adopted_nicks;
+    for (size_t leaf_offset = 0; leaf_offset < encoded_leaves.size();) {
+        adopted_nicks.push_back(std::string());
+        if (!decode_tree_field(encoded_leaves, leaf_offset, adopted_nicks.back()))
+            return false;
+    }
+
+    // the width has to be a power of two
+    if (adopted_nicks.empty() || (adopted_nicks.size() & (adopted_nicks.size() - 1)))
+        return false;
+
+    std::vector<std::string> adopted_keys(2 * adopted_nicks.size() - 1);
+    const size_t c_node_entry_length = sizeof(DTLength) + c_tree_node_key_length;
+    if (encoded_keys.size() % c_node_entry_length)
+        return false;
+
+    for (size_t key_offset = 0; key_offset < encoded_keys.size(); key_offset += c_node_entry_length) {
+        DTLength node = *reinterpret_cast<const DTLength*>(encoded_keys.data() + key_offset);
+        if (node >= adopted_keys.size())
+            return false;
+        adopted_keys[node] = encoded_keys.substr(key_offset + sizeof(DTLength), c_tree_node_key_length);
+    }
+
+    leaf_nicks.swap(adopted_nicks);
+    node_keys.swap(adopted_keys);
+    path_secrets.clear();
+    return true;
+}
+
+RatchetTree::~RatchetTree()
+{
+    for (auto& cur_secret : path_secrets)
+        secure_wipe(&cur_secret.second[0], cur_secret.second.size());
+}
+
+} // namespace np1sec
@@ -0,0 +1,188 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2014, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef SRC_RATCHET_TREE_H_
+#define SRC_RATCHET_TREE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "src/common.h"
+#include "src/crypt.h"
+
+namespace np1sec
+{
+
+/**
+ * Key agreement for large rooms. The participants are the leaves of a
+ * binary tree and each node has a key pair derived from its path secret,
+ * which is known exactly to the participants under the node. The secret
+ * of the root is hence shared by everybody.
+ *
+ * A participant rekeys by committing a fresh path from its leaf to the
+ * root: the secret of each node on the path is sealed to the resolution
+ * of the copath node, i.e. to the subtree which has not got it. Everybody
+ * else opens one sealed secret and hashes their way up to the root, so a
+ * change of membership costs O(log n) DHs and a message of O(log n) keys
+ * as long as the tree is populated.
+ *
+ * The width of the tree is a power of two. Leaf i is node 2i and a node
+ * at level k has its k lowest bits set, so the nodes keep their numbers
+ * when the tree grows.
+ */
+class RatchetTree
+{
+  protected:
+    std::vector<std::string> leaf_nicks; // an empty nick marks a blank leaf
+    std::vector<std::string> node_keys; // an empty key marks a blank node
+
+    /**
+     * path secrets of the non blank nodes we are under, indexed by node
+     */
+    std::map<uint32_t, HashStdBlock> path_secrets;
+
+    static uint32_t level(uint32_t node)
+    {
+        uint32_t node_level = 0;
+        for (; node & 1; node >>= 1)
+            node_level++;
+        return node_level;
+    }
+
+    static uint32_t parent(uint32_t node)
+    {
+        uint32_t node_level = level(node);
+        return (node | (1 << node_level)) & ~(1 << (node_level + 1));
+    }
+
+    static uint32_t left(uint32_t node) { return node ^ (1 << (level(node) - 1)); }
+
+    static uint32_t right(uint32_t node) { return node ^ (3 << (level(node) - 1)); }
+
+    static uint32_t sibling(uint32_t node)
+    {
+        uint32_t node_parent = parent(node);
+        return node < node_parent ? right(node_parent) : left(node_parent);
+    }
+
+    static bool is_under(uint32_t node, uint32_t ancestor)
+    {
+        uint32_t span = 1 << level(ancestor);
+        return node + span > ancestor && node < ancestor + span;
+    }
+
+    uint32_t root() const { return leaf_nicks.size() - 1; }
+
+    /**
+     * @return the node of the leaf of nick or c_blank_node if nick has no
+     *         leaf
+     */
+    uint32_t leaf_node(const std::string& nick) const;
+
+    /**
+     * the ancestors of the node from its parent to the root
+     */
+    std::vector<uint32_t> direct_path(uint32_t node) const;
+
+    /**
+     * the nodes whose keys cover the subtree of the node: the node itself
+     * unless it is blank, otherwise the resolution of its children
+     */
+    std::vector<uint32_t> resolution(uint32_t node) const;
+
+    void blank_direct_path(uint32_t node);
+
+    static HashStdBlock next_path_secret(const HashStdBlock& path_secret) { return hash(path_secret + "path", true); }
+
+  public:
+    static const uint32_t c_blank_node = 0xffffffff;
+
+    size_t width() const { return leaf_nicks.size(); }
+
+    const std::vector<std::string>& leaves() const { return leaf_nicks; }
+
+    bool has_leaf(const std::string& nick) const { return leaf_node(nick) != c_blank_node; }
+
+    /**
+     * puts nick in the first blank leaf, doubling the width of the tree if
+     * there is none. The ancestors of the leaf are blanked as nick does not
+     * know their secrets.
+     */
+    void add_leaf(const std::string& nick, const std::string& leaf_key);
+
+    /**
+     * blanks the leaf of nick and all nodes whose secret nick knows, and
+     * halves the tree while its right half is empty
+     */
+    void remove_leaf(const std::string& nick);
+
+    /**
+     * replaces the key of the leaf of nick, the secret is only given for
+     * our own leaf
+     */
+    void set_leaf_key(const std::string& nick, const std::string& leaf_key,
+                      const HashStdBlock& leaf_secret = HashStdBlock());
+
+    /**
+     * generates a fresh path from the leaf of the committer, who must have
+     * a leaf already, to the root.
+     *
+     * @param context what the sealed secrets are bound to
+     *
+     * @return the update to be sent to everybody else: the new keys of the
+     *         path and the secrets sealed to the copath
+     */
+    std::string commit(const std::string& committer, const std::string& context);
+
+    /**
+     * applies the update committed by the committer, giving it a leaf
+     * first if it hasn't got one.
+     *
+     * @return false if the update is malformed or does not lead to the
+     *         keys it claims, in which case the tree is left untouched
+     */
+    bool apply_commit(const std::string& committer, const std::string& myself, const std::string& update,
+                      const std::string& context);
+
+    bool knows_root_secret() const
+    {
+        return width() && !node_keys[root()].empty() && path_secrets.find(root()) != path_secrets.end();
+    }
+
+    const HashStdBlock& root_secret() const { return path_secrets.at(root()); }
+
+    /**
+     * @return the leaves and the public keys of the tree, for a joiner to
+     *         commit against
+     */
+    std::string public_tree() const;
+
+    /**
+     * replaces the tree with the public tree sent by a peer
+     *
+     * @return false if encoded_tree is malformed
+     */
+    bool adopt_public_tree(const std::string& encoded_tree);
+
+    ~RatchetTree();
+};
+
+} // namespace np1sec
+
+#endif // SRC_RATCHET_TREE_H_
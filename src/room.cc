@@ -19,6 +19,8 @@
 #include "src/message.h"
 #include "userstate.h"
 #include "src/room.h"
+#include "src/profiler.h"
+#include "src/tracepoints.h"
 
 namespace np1sec
 {
@@ -33,6 +35,7 @@ Room::Room(std::string room_name, UserState* user_state,
     : name(room_name), user_state(user_state), user_in_room_state(JOINING)
 {
     np1sec_ephemeral_crypto.init(); // generate intitial ephemeral keys for join
+    retired_metrics.counters.key_generations++;
     //room_size = participants_in_the_room.size(); //we should not rely on the server for room size?
     this->room_size = room_size; //this really should be changed to lonely_room
 
@@ -47,7 +50,7 @@ Room::Room(std::string room_name, UserState* user_state,
 void Room::solitary_join()
 {
     // simply faking the particpant inf message
-    logger.assert_or_die(user_in_room_state == JOINING, "only can be called in joining stage", __FUNCTION__,
+    NP1SEC_ASSERT_OR_DIE(user_in_room_state == JOINING, "only can be called in joining stage", __FUNCTION__,
                          user_state->myself->nickname);
 
     // UnauthenticatedParticipantList session_view;
@@ -83,7 +86,7 @@ void Room::solitary_join()
  */
 void Room::join()
 {
-    logger.assert_or_die(user_in_room_state == JOINING, "only can be called in joining stage", __FUNCTION__,
+    NP1SEC_ASSERT_OR_DIE(user_in_room_state == JOINING, "only can be called in joining stage", __FUNCTION__,
                          user_state->myself->nickname); // no double join but we need a
     //We should not die. in particular we already know that one participant is in the room.
     if (room_size == 0) {
@@ -92,25 +95,29 @@ void Room::join()
       room_size = 1;
     }
 
-    logger.debug("currently " + std::to_string(room_size) + " partcipants in the room", __FUNCTION__,
-                 user_state->myself->nickname);
+    NP1SEC_LOG_DEBUG("currently " + std::to_string(room_size) + " partcipants in the room", __FUNCTION__,
+                     user_state->myself->nickname);
     // if ((user_state->ops->am_i_alone)(name, user_state->ops->bare_sender_data)) {
     if (room_size == 1) {
-        logger.info("creating room " + name + "...", __FUNCTION__, user_state->myself->nickname);
+        NP1SEC_LOG_INFO("creating room " + name + "...", __FUNCTION__, user_state->myself->nickname);
         solitary_join();
 
     } else {
-        logger.info("joining room " + name + "...", __FUNCTION__, user_state->myself->nickname);
+        NP1SEC_LOG_INFO("joining room " + name + "...", __FUNCTION__, user_state->myself->nickname);
 
         // more humane way of doing this
         // turening sexp to stirng buffer.
         UnauthenticatedParticipant me(
             *(user_state->myself), public_key_to_stringbuff(np1sec_ephemeral_crypto.get_ephemeral_pub_key()),
             true);
+        me.takes_delta_views = user_state->ops->c_delta_session_views;
         Message join_message;
 
         join_message.create_join_request_msg(me);
         join_message.send(name, user_state);
+        retired_metrics.counters.count_sent(Message::JOIN_REQUEST, JOIN_REQUESTED_PHASE,
+                                            join_message.sys_message.size());
+        join_requested_at = std::chrono::steady_clock::now();
     }
     //TODO: what are we going to do if we fail to join?
            //what does it mean to fail to joi?
@@ -145,6 +152,77 @@ void Room::try_rejoin()
     }
 }
 
+bool Room::expand_session_view(Message& delta_view_message)
+{
+    auto parent_session = session_universe.find(delta_view_message.parent_session_id.get_as_stringbuff());
+    if (parent_session == session_universe.end())
+        return false;
+
+    if (!delta_view_message.apply_session_view_delta(parent_session->second->future_session_view())) {
+        logger.warn("session view delta from " + delta_view_message.sender_nick + " doesn't match our parent view",
+                    __FUNCTION__, user_state->myself->nickname);
+        return false;
+    }
+
+    return true;
+}
+
+void Room::replay_deferred_session_views(Session* new_session)
+{
+    for (auto deferred_view = deferred_session_views.begin(); deferred_view != deferred_session_views.end();) {
+        if (!(deferred_view->session_id == new_session->my_session_id())) {
+            deferred_view++;
+            continue;
+        }
+
+        try {
+            new_session->state_handler(*deferred_view);
+        } catch (std::exception& e) {
+            logger.warn(e.what(), __FUNCTION__, user_state->myself->nickname);
+        }
+        deferred_view = deferred_session_views.erase(deferred_view);
+    }
+}
+
+bool Room::resolve_session_index(Message& compact_message)
+{
+    if (!compact_message.is_compact() || compact_message.has_sid())
+        return compact_message.has_sid();
+
+    for (auto& cur_session : session_universe) {
+        if (cur_session.second->session_id.get_index() == compact_message.session_index) {
+            compact_message.session_id.set(cur_session.second->session_id.get());
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool Room::is_relevant(Message& header)
+{
+    if (header.is_compact() && !resolve_session_index(header))
+        return false;
+
+    if (!header.has_sid())
+        return user_in_room_state == CURRENT_USER && header.message_type == Message::JOIN_REQUEST;
+
+    if (limbo_seeds.find(header.session_id.get_as_stringbuff()) != limbo_seeds.end())
+        return true;
+
+    auto message_session = session_universe.find(header.session_id.get_as_stringbuff());
+    if (message_session != session_universe.end()) {
+        if (message_session->second->get_state() != Session::DEAD || user_in_room_state == CURRENT_USER)
+            return message_session->second->has_transitor_for(header.message_type);
+    }
+
+    if (user_in_room_state == JOINING)
+        return header.message_type == Message::PARTICIPANTS_INFO ||
+               header.message_type == Message::SESSION_CONFIRMATION;
+
+    return header.message_type == Message::PARTICIPANTS_INFO;
+}
+
 /**
  * manages the finite state machine of the sid part of the message
  * based on sid (or absence of it), it decides what to do with the
@@ -181,14 +259,42 @@ void Room::try_rejoin()
  */
 void Room::receive_handler(Message received_message)
 {
+    NP1SEC_PROBE(PROBE_ROOM_RECEIVE_HANDLER);
     // If the user is not in the session, we can do nothing with
     // session less messages, we are joining and we need info
     // about the room
     RoomAction action_to_take = c_no_room_action;
 
-    logger.info("room " + name + " handling message " + logger.message_type_to_text[received_message.message_type] +
-                    " from " + received_message.sender_nick,
-                __FUNCTION__, user_state->myself->nickname);
+    if (received_message.is_compact() && !resolve_session_index(received_message)) {
+        NP1SEC_LOG_DEBUG("compact message for unknown session index", __FUNCTION__, user_state->myself->nickname);
+        return;
+    }
+
+    // a refreshed session in limbo is only made once somebody talks to it
+    if (received_message.has_sid())
+        grow_limbo_session(received_message.session_id.get_as_stringbuff());
+
+    // a delta view is only needed (and usable) if we are to make a session
+    // out of it
+    if (received_message.message_type == Message::PARTICIPANTS_INFO && received_message.has_delta_view()) {
+        auto message_session = session_universe.find(received_message.session_id.get_as_stringbuff());
+        if ((message_session == session_universe.end() ||
+             (user_in_room_state == JOINING && message_session->second->get_state() == Session::DEAD)) &&
+            !expand_session_view(received_message)) {
+            if (user_in_room_state == JOINING) {
+                if (deferred_session_views.size() >= c_max_deferred_session_views)
+                    deferred_session_views.pop_front();
+                deferred_session_views.push_back(received_message);
+            }
+            NP1SEC_LOG_DEBUG("no parent view for session view delta from " + received_message.sender_nick, __FUNCTION__,
+                             user_state->myself->nickname);
+            return;
+        }
+    }
+
+    NP1SEC_LOG_INFO("room " + name + " handling message " + logger.message_type_to_text[received_message.message_type] +
+                        " from " + received_message.sender_nick,
+                    __FUNCTION__, user_state->myself->nickname);
 
     //   The principale:
 
@@ -209,7 +315,7 @@ void Room::receive_handler(Message received_message)
     // - Confirmed: move session.
 
     if (user_in_room_state == JOINING) {
-        logger.debug("in JOINING state", __FUNCTION__, user_state->myself->nickname);
+        NP1SEC_LOG_DEBUG("in JOINING state", __FUNCTION__, user_state->myself->nickname);
         if (received_message.has_sid()) {
             auto message_session = session_universe.find(received_message.session_id.get_as_stringbuff());
             if (message_session != session_universe.end() &&
@@ -229,11 +335,14 @@ void Room::receive_handler(Message received_message)
                             // till we get a reviving mechanisim
                             if (message_session != session_universe.end() &&
                                 (message_session->second->get_state() == Session::DEAD)) {
+                                retired_ack_counters += message_session->second->get_ack_counters();
+                                retired_metrics += message_session->second->get_metrics();
                                 delete message_session->second;
                                 session_universe.erase(message_session->first);
                             }
                             session_universe.insert(std::pair<std::string, Session*>(
                                 received_message.session_id.get_as_stringbuff(), new_session));
+                            replay_deferred_session_views(new_session);
                         }
                     } catch (std::exception& e) {
                         logger.warn(e.what(), __FUNCTION__, user_state->myself->nickname);
@@ -244,11 +353,14 @@ void Room::receive_handler(Message received_message)
                     // confirmed. If we haven't sent any confirmation, then we should die
                     // if we have sent a confirmation then what? still we die
                     // these are going to die by themselves
+                    // unless it is one of those joining along with us, who
+                    // might have confirmed a superseded admission
                     for (auto& cur_session : session_universe)
                         if (cur_session.second->get_state() != Session::DEAD &&
-                            cur_session.second->nobody_confirmed()) {
-                            logger.debug("somebody else is confirming session, need to rejoin", __FUNCTION__,
-                                         user_state->myself->nickname);
+                            cur_session.second->nobody_confirmed() &&
+                            !cur_session.second->joins_along(received_message.sender_nick)) {
+                            NP1SEC_LOG_DEBUG("somebody else is confirming session, need to rejoin", __FUNCTION__,
+                                             user_state->myself->nickname);
                             cur_session.second->commit_suicide(); // we know the action is either death or nothing in
                                                                   // both case we don't need to do anything
                         }
@@ -260,9 +372,9 @@ void Room::receive_handler(Message received_message)
         // else just ignore it, it is probably another user's join that we don't
         // care.
     } else if (user_in_room_state == CURRENT_USER) {
-        logger.debug("in CURRENT_USER state", __FUNCTION__, user_state->myself->nickname);
+        NP1SEC_LOG_DEBUG("in CURRENT_USER state", __FUNCTION__, user_state->myself->nickname);
         // if we are current user we must have active_session
-        logger.assert_or_die(active_session.get() &&
+        NP1SEC_ASSERT_OR_DIE(active_session.get() &&
                                  session_universe.find(active_session.get_as_stringbuff()) != session_universe.end(),
                              "CURRENT_USER without active session! something doesn't make sense");
         if (received_message.has_sid()) {
@@ -302,7 +414,7 @@ void Room::receive_handler(Message received_message)
                 }
 
                 // delete action_to_take.bred_session; //:( TODO: room needs to create the session.
-                // new_session_it.firs->keep_peers_in_order_spot_myself(); //to update pointer
+                // new_session_it.firs->spot_myself(); //to update pointer
                 // //to thread user as participant is not valid anymore. This is obviously digusting
                 // //we need a respectable copy constructor for Session
             } else {
@@ -314,9 +426,9 @@ void Room::receive_handler(Message received_message)
             }
         } // has sid or not
 
-        logger.debug("room state: " + std::to_string(user_in_room_state) + " requested action: " +
-                         std::to_string(action_to_take.action_type),
-                     __FUNCTION__, user_state->myself->nickname); // just for test to make sure we don't end up here
+        NP1SEC_LOG_DEBUG("room state: " + std::to_string(user_in_room_state) + " requested action: " +
+                             std::to_string(action_to_take.action_type),
+                         __FUNCTION__, user_state->myself->nickname); // just for test to make sure we don't end up here
 
         // if the action resulted in new session we need to add it to session universe
         if (action_to_take.action_type == RoomAction::NEW_SESSION ||
@@ -326,10 +438,21 @@ void Room::receive_handler(Message received_message)
                 action_to_take.bred_session->my_session_id().get_as_stringbuff(), action_to_take.bred_session));
         }
 
+        if (action_to_take.action_type == RoomAction::NEW_SESSION)
+            supersede_admissions(action_to_take.bred_session);
+
         if (action_to_take.action_type == RoomAction::NEW_PRIORITY_SESSION ||
             action_to_take.action_type == RoomAction::PRESUME_HEIR) {
             stale_in_limbo_sessions_presume_heir(action_to_take.bred_session->session_id);
         } // else { //user state in the room
+
+        // a resession agreed on in band is born in session
+        if (action_to_take.action_type == RoomAction::NEW_PRIORITY_SESSION &&
+            action_to_take.bred_session->get_state() == Session::IN_SESSION) {
+            user_state->ops->join(name, action_to_take.bred_session->participants.nicknames(),
+                                  user_state->ops->bare_sender_data);
+            activate_session(action_to_take.bred_session->session_id);
+        }
         // else just ignore it
 
     } // State in the room
@@ -345,7 +468,8 @@ void Room::receive_handler(Message received_message)
         if (message_session != session_universe.end()) {
             if (active_session.get_as_stringbuff() != received_message.session_id.get_as_stringbuff()) {
                 if (message_session->second->get_state() == Session::IN_SESSION) {
-                    user_state->ops->join(name, message_session->second->peers, user_state->ops->bare_sender_data);
+                    user_state->ops->join(name, message_session->second->participants.nicknames(),
+                                          user_state->ops->bare_sender_data);
                     activate_session(received_message.session_id.get());
                 }
             }
@@ -403,7 +527,7 @@ void Room::activate_session(SessionId newly_activated_session)
 {
     SessionId dying_session = active_session;
     if (dying_session.get()) {
-        logger.assert_or_die(newly_activated_session == next_in_activation_line,
+        NP1SEC_ASSERT_OR_DIE(newly_activated_session == next_in_activation_line,
                              "some illigitimate session got activated", __FUNCTION__);
 
         refresh_stale_in_limbo_sessions(newly_activated_session);
@@ -413,8 +537,12 @@ void Room::activate_session(SessionId newly_activated_session)
         session_universe[active_session.get_as_stringbuff()]->commit_suicide();
     } else {
         user_in_room_state = CURRENT_USER; // in case it is our first session
-        // TODO: we probably need to kill all other sessions in limbo.
-        // considering max-one-new-participant-at-the-time prinicipal
+        deferred_session_views.clear();
+        // the other admissions we have been negotiating are moot now
+        for (auto& cur_session : session_universe)
+            if (!(cur_session.second->session_id == newly_activated_session) &&
+                cur_session.second->get_state() != Session::DEAD)
+                cur_session.second->commit_suicide();
 
         // I think when a session is freshly activated it should actually be also
         // the session for the next join/leave, we have already assert this in
@@ -423,6 +551,18 @@ void Room::activate_session(SessionId newly_activated_session)
     }
 
     active_session = newly_activated_session;
+
+    if (join_requested_at.time_since_epoch().count() && !retired_metrics.join_latency)
+        retired_metrics.join_latency = static_cast<uint32_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - join_requested_at)
+                .count());
+
+    auto activated_session = session_universe.find(active_session.get_as_stringbuff());
+    NP1SEC_TRACE3(session_activate, name.c_str(), trace_session_id(active_session.get()),
+                  activated_session != session_universe.end() ? activated_session->second->participants.size() : 0);
+    if (user_state->ops->session_activated && activated_session != session_universe.end())
+        user_state->ops->session_activated(name, activated_session->second->get_metrics(),
+                                           user_state->ops->bare_sender_data);
 }
 
 /**
@@ -433,7 +573,7 @@ void Room::activate_session(SessionId newly_activated_session)
  */
 void Room::stale_in_limbo_sessions_presume_heir(SessionId new_successor)
 {
-    logger.debug("changing the next session in activation line", __FUNCTION__, user_state->myself->nickname);
+    NP1SEC_LOG_DEBUG("changing the next session in activation line", __FUNCTION__, user_state->myself->nickname);
     // make new parent the one breed new sessions from now on
     next_in_activation_line = new_successor;
 
@@ -458,13 +598,22 @@ void Room::refresh_stale_in_limbo_sessions(SessionId new_parent_session_id)
 {
     auto new_parent_session = session_universe.find(new_parent_session_id.get_as_stringbuff());
     // make sure the new parent actually exists
-    logger.assert_or_die(new_parent_session != session_universe.end(),
+    NP1SEC_ASSERT_OR_DIE(new_parent_session != session_universe.end(),
                          "new parental session doesn't exists in the session universe", __FUNCTION__,
                          user_state->myself->nickname);
-    logger.assert_or_die(new_parent_session->second->get_state() != Session::DEAD,
+    NP1SEC_ASSERT_OR_DIE(new_parent_session->second->get_state() != Session::DEAD,
                          "can't breed out of a dead parent", __FUNCTION__, user_state->myself->nickname);
 
     SessionMap refreshed_sessions;
+    ParticipantMap pending_joiners;
+
+    // seeds nobody has talked to are refreshed the same way, without ever
+    // having been sessions
+    std::vector<ParticipantMap> refreshed_deltas;
+    for (auto& cur_seed : limbo_seeds)
+        refreshed_deltas.push_back(cur_seed.second.delta_plist);
+    limbo_seeds.clear();
+
     for (SessionMap::iterator session_it = session_universe.begin(); session_it != session_universe.end();
          /*session_it++ we do it in the for case by case (due to erasing)*/) {
         // first we need to check if such a session in limbo currently exists
@@ -488,42 +637,30 @@ void Room::refresh_stale_in_limbo_sessions(SessionId new_parent_session_id)
             (session_it->second->session_id.get_as_stringbuff() !=
              new_parent_session_id
                  .get_as_stringbuff())) { // basically only the stale sessions, we can make that explicit
-            logger.debug("refreshing " + logger.state_to_text[session_it->second->get_state()] + " session with: " +
-                             participants_to_string(session_it->second->participants) + " as new active session has: " +
-                             participants_to_string(new_parent_session->second->future_participants()),
-                         __FUNCTION__, user_state->myself->nickname);
+            // admissions are merged into one after the loop
+            if (session_it->second->parent_session_id.get()) {
+                session_it->second->commit_suicide();
+                pending_joiners = pending_joiners + session_it->second->delta_plist();
+                session_it++;
+                continue;
+            }
 
-            session_it->second->commit_suicide();
-            // Session *born_session = nullptr;
-            ParticipantMap new_participant_list =
-                session_it->second->delta_plist() + new_parent_session->second->future_participants();
+            NP1SEC_LOG_DEBUG("refreshing " + logger.state_to_text[session_it->second->get_state()] +
+                                 " session with: " + participants_to_string(session_it->second->participants) +
+                                 " as new active session has: " +
+                                 participants_to_string(new_parent_session->second->future_participants()),
+                             __FUNCTION__, user_state->myself->nickname);
 
-            logger.debug("creating new session in limbo with participants: " +
-                             participants_to_string(new_participant_list),
-                         __FUNCTION__, user_state->myself->nickname);
-            //*born_session  = session_it->second + session_universe[active_session.get_as_stringbuff()];
-            // check if the session already exists
-            SessionId to_be_born_session_id(new_participant_list);
-
-            // if (session_universe.find(to_be_born_session_id.get_as_stringbuff()) == session_universe.end()) {
-            try {
-                // XXX/redwire
-                // This is an awfully fishy use of `new`!!!
-                refreshed_sessions.insert(std::pair<std::string, Session*>(
-                    to_be_born_session_id.get_as_stringbuff(),
-                    new Session(Session::ACCEPTOR, user_state, name,
-                                      &new_parent_session->second->future_cryptic, new_participant_list,
-                                      new_parent_session->second->future_participants())));
-            } catch (std::exception& e) {
-                logger.error(e.what());
-            }
+            session_it->second->commit_suicide();
+            refreshed_deltas.push_back(session_it->second->delta_plist());
             session_it++;
 
-            //}
         } else if (session_it->second->get_state() == Session::DEAD) { // anything that was dead before
             SessionMap::iterator to_erase =
                 session_it; // TODO: is it the best way? we still not sure what to do with dead session
             session_it++;
+            retired_ack_counters += to_erase->second->get_ack_counters();
+            retired_metrics += to_erase->second->get_metrics();
             delete to_erase->second;
             session_universe.erase(to_erase);
         } else {
@@ -531,10 +668,121 @@ void Room::refresh_stale_in_limbo_sessions(SessionId new_parent_session_id)
         }
     }
 
+    // constructing a refreshed session costs a key share and a broadcast
+    // which are wasted if it is refreshed again before anybody answers, so
+    // we only sow them. One of us still has to tell the joiners about the
+    // sessions, which makes the rest of us grow theirs
+    std::vector<std::string> sown_session_ids;
+    for (auto& cur_delta : refreshed_deltas)
+        sown_session_ids.push_back(sow_limbo_session(cur_delta, new_parent_session->second));
+
+    ParticipantMap parent_view = new_parent_session->second->future_participants();
+    if (!parent_view.empty() && parent_view.begin()->first == user_state->myself->nickname)
+        for (auto& cur_session_id : sown_session_ids)
+            grow_limbo_session(cur_session_id);
+
+    // everybody who was waiting to join, and hasn't joined by the new
+    // parent, is admitted by a single session
+    pending_joiners = pending_joiners - new_parent_session->second->future_participants();
+    new_parent_session->second->pending_joiners = pending_joiners;
+    if (!pending_joiners.empty()) {
+        try {
+            Session* admission_session = new_parent_session->second->breed_admission_session(nullptr);
+            if (admission_session)
+                refreshed_sessions.insert(std::pair<std::string, Session*>(
+                    admission_session->my_session_id().get_as_stringbuff(), admission_session));
+        } catch (std::exception& e) {
+            logger.error(e.what());
+        }
+    }
+
     // now merge the refreshed sessions
     session_universe.insert(refreshed_sessions.begin(), refreshed_sessions.end());
 }
 
+std::string Room::sow_limbo_session(const ParticipantMap& delta_plist, Session* parent_session)
+{
+    ParticipantMap new_participant_list = delta_plist + parent_session->future_participants();
+    SessionId to_be_born_session_id(new_participant_list);
+    std::string session_id = to_be_born_session_id.get_as_stringbuff();
+
+    // we may have the session already, e.g. the stale one itself if the
+    // new parent has added nobody to it
+    if (session_universe.find(session_id) == session_universe.end()) {
+        NP1SEC_LOG_DEBUG("sowing session in limbo with participants: " + participants_to_string(new_participant_list),
+                         __FUNCTION__, user_state->myself->nickname);
+        limbo_seeds[session_id] = LimboSeed{delta_plist, parent_session->session_id};
+        retired_metrics.limbo_sessions_sown++;
+    }
+
+    return session_id;
+}
+
+Session* Room::grow_limbo_session(const std::string& session_id)
+{
+    auto seed = limbo_seeds.find(session_id);
+    if (seed == limbo_seeds.end() || !(seed->second.parent_session_id == next_in_activation_line))
+        return nullptr;
+
+    auto parent_session = session_universe.find(seed->second.parent_session_id.get_as_stringbuff());
+    ParticipantMap delta_plist = seed->second.delta_plist;
+    limbo_seeds.erase(seed);
+    if (parent_session == session_universe.end() || parent_session->second->get_state() == Session::DEAD ||
+        session_universe.find(session_id) != session_universe.end())
+        return nullptr;
+
+    Session* parent = parent_session->second;
+    ParticipantMap new_participant_list = delta_plist + parent->future_participants();
+    NP1SEC_LOG_DEBUG("creating new session in limbo with participants: " + participants_to_string(new_participant_list),
+                     __FUNCTION__, user_state->myself->nickname);
+
+    Session* born_session = nullptr;
+    try {
+        born_session = new Session(Session::ACCEPTOR, user_state, name, &parent->future_cryptic, new_participant_list,
+                                   parent->future_participants(), nullptr, parent->session_id,
+                                   parent->future_key_tree());
+    } catch (std::exception& e) {
+        logger.error(e.what());
+        return nullptr;
+    }
+
+    session_universe[session_id] = born_session;
+    retired_metrics.limbo_sessions_grown++;
+    return born_session;
+}
+
+void Room::insert_priority_session(Session* priority_session)
+{
+    insert_session(priority_session);
+    stale_in_limbo_sessions_presume_heir(priority_session->session_id);
+}
+
+void Room::abandon_session(SessionId& session_id)
+{
+    auto abandoned_session = session_universe.find(session_id.get_as_stringbuff());
+    if (abandoned_session != session_universe.end() &&
+        abandoned_session->second->get_state() != Session::IN_SESSION &&
+        abandoned_session->second->get_state() != Session::DEAD)
+        abandoned_session->second->commit_suicide();
+}
+
+void Room::supersede_admissions(Session* admission_session)
+{
+    for (auto& cur_session : session_universe) {
+        if (cur_session.second == admission_session || cur_session.second->get_state() == Session::DEAD ||
+            cur_session.second->get_state() == Session::IN_SESSION ||
+            !(cur_session.second->parent_session_id == admission_session->parent_session_id))
+            continue;
+
+        if ((cur_session.second->delta_plist() - admission_session->participants).empty()) {
+            NP1SEC_LOG_DEBUG("admission of " + participants_to_string(cur_session.second->delta_plist()) +
+                                 " is superseded",
+                             __FUNCTION__, user_state->myself->nickname);
+            cur_session.second->commit_suicide();
+        }
+    }
+}
+
 /**
  *  sends user message given in plain text by the client to the
  *  active session of the room
@@ -559,6 +807,26 @@ void Room::send_user_message(std::string plain_message)
     }
 }
 
+Session* Room::active_session_for_transfer()
+{
+    if (!active_session.get()) {
+        logger.error("trying to transfer to a room " + name + " with no active session", __FUNCTION__,
+                     user_state->myself->nickname);
+        throw InvalidRoomException();
+    }
+
+    return session_universe[active_session.get_as_stringbuff()];
+}
+
+std::string Room::begin_transfer() { return active_session_for_transfer()->begin_transfer(); }
+
+void Room::write_transfer(std::string transfer_id, std::string data)
+{
+    active_session_for_transfer()->write_transfer(transfer_id, data);
+}
+
+void Room::finish_transfer(std::string transfer_id) { active_session_for_transfer()->finish_transfer(transfer_id); }
+
 // Session* Room::retrieve_session(std::string room_name) {
 //   Session *cur_session = nullptr;
 //   session_room_map::iterator it = session_in_a_room.find(room_name);
@@ -586,7 +854,7 @@ void Room::leave()
         // if you have confirmed your session or not. However, as long as
         // the session hasn't been started then we don't need to check for
         // consistency. In any case we can just let it shrink
-        logger.debug("nothing to do; leaving from a room we haven't joined");
+        NP1SEC_LOG_DEBUG("nothing to do; leaving from a room we haven't joined");
     }
 }
 
@@ -597,17 +865,17 @@ void Room::leave()
 void Room::increment_size()
 {
     room_size++;
-    logger.debug("currently " + std::to_string(room_size) + " partcipants in the room", __FUNCTION__,
-                 user_state->myself->nickname);
+    NP1SEC_LOG_DEBUG("currently " + std::to_string(room_size) + " partcipants in the room", __FUNCTION__,
+                     user_state->myself->nickname);
 }
 
 void Room::shrink(std::string leaving_nick)
 {
     // room_size--;
-    logger.debug("currently " + std::to_string(room_size) + " partcipants in the room", __FUNCTION__,
-                 user_state->myself->nickname);
+    NP1SEC_LOG_DEBUG("currently " + std::to_string(room_size) + " partcipants in the room", __FUNCTION__,
+                     user_state->myself->nickname);
     if (user_in_room_state == JOINING) {
-        logger.debug("somebody left, before we can join, starting from the begining", __FUNCTION__);
+        NP1SEC_LOG_DEBUG("somebody left, before we can join, starting from the begining", __FUNCTION__);
         try_rejoin(); // it helps because although the active session
         // of current occupants still contatins the leaver, the new
         // session will be born without zombies
@@ -616,9 +884,9 @@ void Room::shrink(std::string leaving_nick)
         // we need to detect if we have already generated the shrunk
         // session or not.
         // first we get the plist of active session, if the leaving use
-        logger.assert_or_die(active_session.get(), "shrinking while we have no active sessions");
+        NP1SEC_ASSERT_OR_DIE(active_session.get(), "shrinking while we have no active sessions");
         auto active_session_element = session_universe.find(active_session.get_as_stringbuff());
-        logger.assert_or_die(active_session_element != session_universe.end(),
+        NP1SEC_ASSERT_OR_DIE(active_session_element != session_universe.end(),
                              "Internal error: the active session is not in session universe.");
 
         Session* active_np1sec_session = active_session_element->second;
@@ -693,6 +961,8 @@ void Room::shrink(std::string leaving_nick)
                     // if (old_shrank_session->second.my_state = np1sec::DEAD) { //should we check and erease only if
                     // DEAD?
                     old_shrank_session->second->commit_suicide();
+                    retired_ack_counters += old_shrank_session->second->get_ack_counters();
+                    retired_metrics += old_shrank_session->second->get_metrics();
                     delete old_shrank_session->second;
                     session_universe.erase(old_shrank_session->first);
                 }
@@ -701,9 +971,9 @@ void Room::shrink(std::string leaving_nick)
                 stale_in_limbo_sessions_presume_heir(action_to_take.bred_session->my_session_id());
             } else {
                 // Already FAREWELLED: TODO you should check the zombie list actually
-                logger.assert_or_die(action_to_take.action_type == RoomAction::NO_ACTION,
+                NP1SEC_ASSERT_OR_DIE(action_to_take.action_type == RoomAction::NO_ACTION,
                                      "shrink should result in priority session or nothing"); // sanity check
-                logger.debug("no need to shrink. Already farewelled.");
+                NP1SEC_LOG_DEBUG("no need to shrink. Already farewelled.");
                 // otherwise we already have made the
                 // shrank session don't worry about it
             }
@@ -721,7 +991,7 @@ void Room::shrink(std::string leaving_nick)
 
 void Room::insert_session(Session* new_session)
 {
-    logger.assert_or_die(new_session->get_state() != Session::DEAD, "trying to adding a dead session?!",
+    NP1SEC_ASSERT_OR_DIE(new_session->get_state() != Session::DEAD, "trying to adding a dead session?!",
                          __FUNCTION__, user_state->myself->nickname);
 
     auto old_session = session_universe.find(new_session->my_session_id().get_as_stringbuff());
@@ -730,6 +1000,8 @@ void Room::insert_session(Session* new_session)
             logger.warn("trying to erase a live session? killing the session...", __FUNCTION__,
                         user_state->myself->nickname); // we need to check and commit suicide in case it is alive
             old_session->second->commit_suicide();
+            retired_ack_counters += old_session->second->get_ack_counters();
+            retired_metrics += old_session->second->get_metrics();
             delete old_session->second;
             session_universe.erase(old_session->first);
         }
@@ -739,6 +1011,41 @@ void Room::insert_session(Session* new_session)
         std::pair<std::string, Session*>(new_session->my_session_id().get_as_stringbuff(), new_session));
 }
 
+AckCounters Room::ack_counters()
+{
+    AckCounters room_ack_counters = retired_ack_counters;
+    for (auto& cur_session : session_universe)
+        room_ack_counters += cur_session.second->get_ack_counters();
+
+    return room_ack_counters;
+}
+
+RoomMetrics Room::metrics()
+{
+    RoomMetrics room_metrics = retired_metrics;
+    for (auto& cur_session : session_universe)
+        room_metrics += cur_session.second->get_metrics();
+
+    return room_metrics;
+}
+
+SessionMetrics Room::active_session_metrics()
+{
+    auto cur_active_session = session_universe.find(active_session.get_as_stringbuff());
+    if (!active_session.get() || cur_active_session == session_universe.end())
+        return SessionMetrics();
+
+    return cur_active_session->second->get_metrics();
+}
+
+size_t Room::transcript_footprint()
+{
+    if (!active_session.get())
+        return 0;
+
+    return session_universe[active_session.get_as_stringbuff()]->transcript_footprint();
+}
+
 /**
  * Destructor need to clean up the session universe
  */
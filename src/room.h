@@ -22,6 +22,7 @@
 //#error I am here
 
 #include <string>
+#include <list>
 #include <map>
 
 #include "src/common.h"
@@ -84,6 +85,33 @@ class Room
     // forward serecy procedure can update it consequently.
     SessionMap session_universe;
 
+    // ack counters of the sessions which are already deleted
+    AckCounters retired_ack_counters;
+
+    // metrics of the sessions which are already deleted and of what the
+    // room did outside of its sessions
+    RoomMetrics retired_metrics;
+    std::chrono::steady_clock::time_point join_requested_at;
+
+    // how long our messages take to come back, across sessions
+    BroadcastLatencyEstimator broadcast_latency;
+
+    // delta PARTICIPANTS_INFO which reached us, the joiner, before the
+    // full view of their session
+    std::list<Message> deferred_session_views;
+
+    /**
+     * what it takes to make a refreshed session in limbo: the participants
+     * it adds to the view of its parent
+     */
+    struct LimboSeed {
+        ParticipantMap delta_plist;
+        SessionId parent_session_id;
+    };
+
+    // refreshed sessions in limbo nobody has talked to yet, indexed by sid
+    std::map<std::string, LimboSeed> limbo_seeds;
+
     // list of sessions in limbo, they need to give birth to new
     // sessions in-limbo in case a user join or leave.
     // std::list<Session*> limbo; //no need for this limbo every
@@ -117,9 +145,50 @@ class Room
      *  key session.
      * if somebody leaves, as soon as they live you need to update them cause
      * they are useless and the leaving person aren't going to confirmed any of them
+     *
+     * the joiners of all admission sessions in limbo are admitted together
+     * by one new session
      */
     void refresh_stale_in_limbo_sessions(SessionId new_parent_session_id);
 
+    /**
+     * records the session the delta plist makes with the future view of
+     * the parent as a seed, unless we have the session already
+     *
+     * @return the sid of the seed
+     */
+    std::string sow_limbo_session(const ParticipantMap& delta_plist, Session* parent_session);
+
+    /**
+     * constructs the session of a seed once a message reaches it, or once
+     * it is ours to tell the joiners about it. Seeds whose parent is not
+     * next in the activation line wait for the next refresh, as their
+     * sessions would be stale.
+     *
+     * @return the session or nullptr if there is no seed to grow
+     */
+    Session* grow_limbo_session(const std::string& session_id);
+
+    /**
+     * turns the delta view of a PARTICIPANTS_INFO message into the full
+     * one using the future view of its parent session.
+     *
+     * @return false if we don't have the parent session or our view of
+     *         it doesn't match the sender's
+     */
+    bool expand_session_view(Message& delta_view_message);
+
+    /**
+     * feeds the deferred delta views of a newly created session to it
+     */
+    void replay_deferred_session_views(Session* new_session);
+
+    /**
+     * @return the active session to stream transfers to, throws if the
+     *         room has none
+     */
+    Session* active_session_for_transfer();
+
   public:
     /**
      * constructor: sets room name, make the user status joing
@@ -139,9 +208,14 @@ class Room
         : name(rhs.name), // room name given in creation by user_state
           user_state(rhs.user_state), myself(rhs.myself), room_size(rhs.room_size),
           user_in_room_state(rhs.user_in_room_state), np1sec_ephemeral_crypto(rhs.np1sec_ephemeral_crypto),
-          active_session(rhs.active_session), next_in_activation_line(rhs.next_in_activation_line)
+          retired_ack_counters(rhs.retired_ack_counters), retired_metrics(rhs.retired_metrics),
+          join_requested_at(rhs.join_requested_at), broadcast_latency(rhs.broadcast_latency),
+          deferred_session_views(rhs.deferred_session_views),
+          limbo_seeds(rhs.limbo_seeds),
+          active_session(rhs.active_session),
+          next_in_activation_line(rhs.next_in_activation_line)
     {
-        logger.debug("copying room object");
+        NP1SEC_LOG_DEBUG("copying room object");
         for (auto& cur_session : rhs.session_universe) {
             Session* new_copy = new Session(*cur_session.second);
             // if rejoin timer is still active we need to activate in the copy
@@ -191,6 +265,28 @@ class Room
      */
     void receive_handler(Message received_message);
 
+    /**
+     * decides, only based on the type and sid of a message, whether
+     * receive_handler can make any use of it. This follows the same
+     * delegation rules as receive_handler:
+     *
+     * - sid of a live session -> only if the session's FSM can handle the type.
+     * - unknown (or dead while joining) sid -> only messages that can start a session.
+     * - no sid -> only join requests while we are a current user.
+     *
+     * @param header a message with only its clear header peeked
+     */
+    bool is_relevant(Message& header);
+
+    /**
+     * compact in-session messages only carry the index of their
+     * session. Looks up the session with that index among our sessions
+     * and fills in the message's sid.
+     *
+     * @return false if none of our sessions has the index
+     */
+    bool resolve_session_index(Message& compact_message);
+
     /**
      *  sends user message given in plain text by the client to the
      *  active session of the room
@@ -202,6 +298,17 @@ class Room
      */
     void send_user_message(std::string plain_message);
 
+    /**
+     * begins, continues and finishes a transfer streamed to the active
+     * session of the room. See Session::begin_transfer
+     *
+     * throw exception if no active session is established for the current
+     * room or the transfer has begun in another session
+     */
+    std::string begin_transfer();
+    void write_transfer(std::string transfer_id, std::string data);
+    void finish_transfer(std::string transfer_id);
+
     /**
      * Just sends a message for closing the transcript consistency
      * this also initiate the new session creation for other users
@@ -227,6 +334,67 @@ class Room
      */
     void insert_session(Session* new_session);
 
+    /**
+     * @return true if we have a session with the sid, dead or alive
+     */
+    bool has_session(SessionId& session_id)
+    {
+        return session_universe.find(session_id.get_as_stringbuff()) != session_universe.end();
+    }
+
+    /**
+     * kills the sessions in limbo bred by the same parent for admitting
+     * some of the joiners admission_session admits. Only the largest batch
+     * goes on to agree on a key.
+     */
+    void supersede_admissions(Session* admission_session);
+
+    /**
+     * for Session when it breeds the session without the leavers out of
+     * a message handler: it becomes the next in the activation line
+     */
+    void insert_priority_session(Session* priority_session);
+
+    /**
+     * kills the session with the sid unless it is in session already
+     */
+    void abandon_session(SessionId& session_id);
+
+    /**
+     * sum of the ack counters of all sessions this room has had
+     */
+    AckCounters ack_counters();
+
+    /**
+     * sum of the metrics of all sessions this room has had and what the
+     * room did outside of them
+     */
+    RoomMetrics metrics();
+
+    /**
+     * the metrics of the active session, or of a session which has not
+     * started if the room has none
+     */
+    SessionMetrics active_session_metrics();
+
+    /**
+     * see Session::transcript_footprint, of the active session or 0 if
+     * the room has none
+     */
+    size_t transcript_footprint();
+
+    /**
+     * the time our own messages take to come back to us in this room
+     */
+    const BroadcastLatencyEstimator& get_broadcast_latency() const { return broadcast_latency; }
+
+    /**
+     * called by the sessions of the room when our message comes back
+     *
+     * @param round_trip milliseconds since we sent it
+     */
+    void add_broadcast_latency_sample(uint32_t round_trip) { broadcast_latency.add_sample(round_trip); }
+
     /**
      * Destructor need to clean up the session universe
      */
@@ -17,16 +17,23 @@
  */
 
 #include <assert.h>
+#include <algorithm>
+#include <limits>
 #include <stdlib.h>
 #include <string>
 
 #include "src/session.h"
 #include "src/exceptions.h"
+#include "src/profiler.h"
+#include "src/tracepoints.h"
 #include "src/userstate.h"
 
 namespace np1sec
 {
 
+// the directive of a message of ours which never came back to us
+const std::string c_own_message_lost_message = "we did not receive our own sent message";
+
 /**
  * To be used in std::sort to sort the particpant list
  * in a way that is consistent way between all participants
@@ -36,15 +43,24 @@ bool compare_creation_priority(const RaisonDEtre& lhs, const RaisonDEtre& rhs) {
 void cb_re_session(void* arg)
 {
     Session* session = (static_cast<Session*>(arg));
-    logger.assert_or_die(session->my_state != Session::DEAD, "postmortem racheting?");
+    NP1SEC_TRACE3(timer_fire, session->room_name.c_str(), trace_session_id(session->session_id.get()), "re_session");
+    OutboundFlush flush(session->us);
+    NP1SEC_ASSERT_OR_DIE(session->my_state != Session::DEAD, "postmortem racheting?");
+
+    NP1SEC_LOG_INFO("RESESSION: forward secrecy ratcheting", __FUNCTION__, session->myself.nickname);
 
-    logger.info("RESESSION: forward secrecy ratcheting", __FUNCTION__, session->myself.nickname);
+    if (session->ratchets_in_band()) {
+        session->session_life_timer = nullptr;
+        session->prepare_successor();
+        return;
+    }
 
-    Session* new_child_session = new Session(Session::PEER, session->us, session->room_name,
-                                                         &session->future_cryptic, session->future_participants());
+    Session* new_child_session =
+        new Session(Session::PEER, session->us, session->room_name, &session->future_cryptic,
+                    session->future_participants(), ParticipantMap(), nullptr, SessionId(), session->future_key_tree());
 
     try {
-        logger.assert_or_die(session->us->chatrooms.find(session->room_name) != session->us->chatrooms.end(),
+        NP1SEC_ASSERT_OR_DIE(session->us->chatrooms.find(session->room_name) != session->us->chatrooms.end(),
                              "np1sec can not add session to room " + session->room_name +
                                  " which apparenly doesn't exists",
                              __FUNCTION__, session->myself.nickname);
@@ -57,36 +73,89 @@ void cb_re_session(void* arg)
     session->session_life_timer = nullptr;
 }
 
-void cb_ack_not_received(void* arg)
+/**
+ * the leave batch window is over, makes the session without everybody who
+ * has left meanwhile
+ */
+void cb_shrink_zombies(void* arg)
 {
-    // Construct message for ack
-    AckTimerOps* ack_timer_ops = static_cast<AckTimerOps*>(arg);
+    Session* session = (static_cast<Session*>(arg));
+    NP1SEC_TRACE3(timer_fire, session->room_name.c_str(), trace_session_id(session->session_id.get()),
+                  "shrink_zombies");
+    OutboundFlush flush(session->us);
 
-    if (ack_timer_ops->session->my_state == Session::DEAD)
-        logger.debug("postmortem consistency chcek", __FUNCTION__, ack_timer_ops->session->myself.nickname);
+    session->leave_batch_timer = nullptr;
 
-    std::string ack_failure_message = ack_timer_ops->participant->id.nickname + " failed to ack";
-    ack_timer_ops->session->us->ops->display_message(ack_timer_ops->session->room_name, "np1sec directive",
-                                                     ack_failure_message, ack_timer_ops->session->us);
-    logger.warn(ack_failure_message + " in room " + ack_timer_ops->session->room_name, __FUNCTION__,
-                ack_timer_ops->session->myself.nickname);
+    auto session_room = session->us->chatrooms.find(session->room_name);
+    NP1SEC_ASSERT_OR_DIE(session_room != session->us->chatrooms.end(),
+                         "the room which the ssession belongs you has disappeared", __FUNCTION__,
+                         session->myself.nickname);
 
-    // this is object (not pointer) in the message chain
-    // it gets destroyed when the chain get destroyed
-    // delete ack_timer_ops;
+    try {
+        session_room->second.insert_priority_session(session->breed_shrunk_session().bred_session);
+    } catch (std::exception& e) {
+        logger.error("Failed to shrink the session", __FUNCTION__, session->myself.nickname);
+    }
+}
+
+/**
+ * the join batch window is over, admits everybody who has asked to join
+ * meanwhile
+ */
+void cb_admit_joiners(void* arg)
+{
+    Session* session = (static_cast<Session*>(arg));
+    NP1SEC_TRACE3(timer_fire, session->room_name.c_str(), trace_session_id(session->session_id.get()), "admit_joiners");
+    OutboundFlush flush(session->us);
+
+    session->join_batch_timer = nullptr;
+
+    auto session_room = session->us->chatrooms.find(session->room_name);
+    NP1SEC_ASSERT_OR_DIE(session_room != session->us->chatrooms.end(),
+                         "the room which the ssession belongs you has disappeared", __FUNCTION__,
+                         session->myself.nickname);
+
+    try {
+        Session* admission_session = session->breed_admission_session(nullptr);
+        if (admission_session) {
+            session_room->second.insert_session(admission_session);
+            session_room->second.supersede_admissions(admission_session);
+        }
+    } catch (std::exception& e) {
+        logger.error("Failed to admit the pending joiners", __FUNCTION__, session->myself.nickname);
+    }
+}
+
+void cb_ack_not_received(void* arg)
+{
+    Session* session = (static_cast<Session*>(arg));
+    NP1SEC_TRACE3(timer_fire, session->room_name.c_str(), trace_session_id(session->session_id.get()),
+                  "ack_not_received");
+    session->ack_deadline_timer = nullptr;
+
+    if (session->my_state == Session::DEAD)
+        NP1SEC_LOG_DEBUG("postmortem consistency chcek", __FUNCTION__, session->myself.nickname);
+
+    session->expire_ack_deadlines();
 }
 
 void cb_send_ack(void* arg)
 {
     // Construct message with p.id
     Session* session = (static_cast<Session*>(arg));
+    NP1SEC_TRACE3(timer_fire, session->room_name.c_str(), trace_session_id(session->session_id.get()), "send_ack");
+    OutboundFlush flush(session->us);
 
     if (session->my_state == Session::DEAD)
-        logger.debug("postmortem consistency chcek", __FUNCTION__, session->myself.nickname);
+        NP1SEC_LOG_DEBUG("postmortem consistency chcek", __FUNCTION__, session->myself.nickname);
 
     session->send_ack_timer = nullptr;
 
-    logger.debug("long time, no messege! acknowledging received messages", __FUNCTION__, session->myself.nickname);
+    // a message we sent meanwhile has already acked everything
+    if (!session->unacked_user_messages && (!session->successor_prepared || session->successor_material_sent))
+        return;
+
+    NP1SEC_LOG_DEBUG("long time, no messege! acknowledging received messages", __FUNCTION__, session->myself.nickname);
 
     session->send("", Message::JUST_ACK);
 }
@@ -98,15 +167,24 @@ void cb_send_ack(void* arg)
  */
 void cb_ack_not_sent(void* arg)
 {
-    // Construct message with p.id
-    AckTimerOps* ack_timer_ops = static_cast<AckTimerOps*>(arg);
+    Session* session = (static_cast<Session*>(arg));
+    NP1SEC_TRACE3(timer_fire, session->room_name.c_str(), trace_session_id(session->session_id.get()), "ack_not_sent");
 
-    if (ack_timer_ops->session->my_state == Session::DEAD)
-        logger.debug("postmortem consistency chcek", __FUNCTION__, ack_timer_ops->session->myself.nickname);
+    if (session->my_state == Session::DEAD)
+        NP1SEC_LOG_DEBUG("postmortem consistency chcek", __FUNCTION__, session->myself.nickname);
 
-    std::string ack_failure_message = "we did not receive our own sent message";
-    ack_timer_ops->session->us->ops->display_message(ack_timer_ops->session->room_name, "np1sec directive",
-                                                     ack_failure_message, ack_timer_ops->session->us);
+    // the timers are armed in the order we send, so the one going off is
+    // the oldest armed one. Disarmed, its block isn't reported again once a
+    // later message of ours comes back
+    for (auto& cur_block : session->sent_transcript_chain) {
+        if (cur_block.second.consistency_timer) {
+            cur_block.second.consistency_timer = nullptr;
+            break;
+        }
+    }
+
+    session->us->ops->display_message(session->room_name, "np1sec directive", c_own_message_lost_message,
+                                      session->us);
 }
 
 /**
@@ -116,6 +194,7 @@ void cb_ack_not_sent(void* arg)
 void cb_leave(void* arg)
 {
     Session* session = (static_cast<Session*>(arg));
+    NP1SEC_TRACE3(timer_fire, session->room_name.c_str(), trace_session_id(session->session_id.get()), "leave");
 
     session->check_leave_transcript_consistency();
     session->commit_suicide();
@@ -128,16 +207,18 @@ void cb_leave(void* arg)
 void cb_rejoin(void* arg)
 {
     Session* session = (static_cast<Session*>(arg));
+    NP1SEC_TRACE3(timer_fire, session->room_name.c_str(), trace_session_id(session->session_id.get()), "rejoin");
+    OutboundFlush flush(session->us);
 
     // just kill myself and ask the room to rejoin
     session->commit_suicide();
 
     auto session_room = session->us->chatrooms.find(session->room_name);
-    logger.assert_or_die(session_room != session->us->chatrooms.end(),
+    NP1SEC_ASSERT_OR_DIE(session_room != session->us->chatrooms.end(),
                          "the room which the ssession belongs you has disappeared", __FUNCTION__,
                          session->myself.nickname);
 
-    logger.debug("joining session timed out, trying to rejoin", __FUNCTION__, session->myself.nickname);
+    NP1SEC_LOG_DEBUG("joining session timed out, trying to rejoin", __FUNCTION__, session->myself.nickname);
 
     session_room->second.try_rejoin();
 
@@ -177,40 +258,57 @@ void cb_rejoin(void* arg)
 */
 Session::Session(SessionConceiverCondition conceiver, UserState* us, std::string room_name,
                              Cryptic* current_ephemeral_crypto, const ParticipantMap& current_participants,
-                             const ParticipantMap& parent_plist, Message* conceiving_message)
+                             const ParticipantMap& parent_plist, Message* conceiving_message,
+                             const SessionId& parent_session_id, const RatchetTree& parent_key_tree)
     : us(us), room_name(room_name), myself(*us->myself), cryptic(*current_ephemeral_crypto),
-      participants(current_participants), parental_participants(parent_plist)
+      participants(current_participants), parental_participants(parent_plist), parent_session_id(parent_session_id),
+      key_tree(parent_key_tree)
 // conceiving_message(&(*conceiving_message)) //forcing copying, we need a fresh copy
 {
     engrave_state_machine_graph();
+    max_fragment_size = us->ops->c_max_message_size;
 
-    logger.info("constructing new session for room " + room_name + " with " + std::to_string(participants.size()) +
-                    " participants",
-                __FUNCTION__, myself.nickname);
+    NP1SEC_LOG_INFO("constructing new session for room " + room_name + " with " + std::to_string(participants.size()) +
+                        " participants",
+                    __FUNCTION__, myself.nickname);
 
     // Joiner is the only one who can't compute session id at creation so we
     // need give them a specail treatement
     if (conceiver == JOINER) {
-        logger.assert_or_die(conceiving_message && conceiving_message->message_type == Message::PARTICIPANTS_INFO,
+        NP1SEC_ASSERT_OR_DIE(conceiving_message && conceiving_message->message_type == Message::PARTICIPANTS_INFO,
                              "wrong message type is provided to the joiner " + myself.nickname +
                                  " to establish a session. Message type " +
                                  std::to_string(Message::PARTICIPANTS_INFO) + " was expected but type " +
                                  std::to_string(conceiving_message->message_type) + " was provided.",
                              __FUNCTION__, myself.nickname);
         my_state = JOIN_REQUESTED;
+        mark_phase();
+        metrics.count_received(conceiving_message->message_type, conceiving_message->final_whole_message.size());
+
+        // the view only tells whether all of the participants take delta
+        // views, which is all we need to know to send them
+        populate_participants(conceiving_message->get_session_view());
+        for (auto& cur_participant : participants) {
+            cur_participant.second.takes_delta_views = conceiving_message->is_delta_view_capable();
+            if (!cur_participant.second.authenticated && cur_participant.first != myself.nickname)
+                fellow_joiners.insert(cur_participant.first);
+        }
 
-        populate_participants_and_peers(conceiving_message->get_session_view());
+        // we only get the tree if the room agrees on its key by it
+        if (!conceiving_message->key_tree_update.empty() &&
+            !key_tree.adopt_public_tree(conceiving_message->key_tree_update))
+            throw MessageFormatException();
 
     } else {
         switch (conceiver) {
         case CREATOR:
-            logger.assert_or_die(participants.size() == 1, "initiated a room by more than a one participants",
+            NP1SEC_ASSERT_OR_DIE(participants.size() == 1, "initiated a room by more than a one participants",
                                  __FUNCTION__, myself.nickname);
             break;
 
         case ACCEPTOR: {
             if (conceiving_message) {
-                logger.assert_or_die(
+                NP1SEC_ASSERT_OR_DIE(
                     (conceiving_message->message_type == Message::JOIN_REQUEST ||
                      conceiving_message->message_type == Message::PARTICIPANTS_INFO),
                     "Acceptor message should be of type " + logger.message_type_to_text[Message::JOIN_REQUEST] +
@@ -235,6 +333,7 @@ Session::Session(SessionConceiverCondition conceiver, UserState* us, std::string
         }
 
         case PEER:
+        case RATCHETER:
             raisons_detre.push_back(RaisonDEtre(RaisonDEtre::RESESSION));
             break;
 
@@ -243,46 +342,48 @@ Session::Session(SessionConceiverCondition conceiver, UserState* us, std::string
 
         } // switch
 
-        populate_peers_from_participants();
+        index_participants();
         my_state = RE_SHARED;
+        mark_phase();
 
     } // end of else (i.e !=  JOINER)
 
+    choose_key_agreement(conceiver);
+
     // common ritual after getting the participants filled up (or down) as requested
     if (conceiver == CREATOR) {
         send_view_auth_and_share();
         arm_rejoin_timer();
     } else if (conceiver == JOINER) {
-        logger.assert_or_die(conceiving_message, "conceiving message missing to create new session", __FUNCTION__,
+        NP1SEC_ASSERT_OR_DIE(conceiving_message, "conceiving message missing to create new session", __FUNCTION__,
                              myself.nickname);
         Message to_send = *conceiving_message;
 
         verify_peers_signature(to_send); // check message authenticity before going forward
         joiner_send_auth_and_share();
         my_state = auth_and_reshare(to_send).first;
+        mark_phase();
         arm_rejoin_timer();
     } else if (conceiver == ACCEPTOR) {
-        std::string joiner_id;
-        if (conceiving_message && conceiving_message->message_type == Message::JOIN_REQUEST) {
-            joiner_id = UnauthenticatedParticipant(conceiving_message->joiner_info).participant_id.nickname;
-        } else if (!delta_plist().empty()) {
-            logger.assert_or_die(delta_plist().size() <= 1, "this is n+1sec, one addition at time", __FUNCTION__,
-                                 myself.nickname);
-            joiner_id = delta_plist().begin()->second.id.nickname;
-        }
+        // everybody who wasn't in the parent session is joining by this one
+        std::vector<std::string> joiner_ids;
+        for (auto& cur_joiner : delta_plist())
+            joiner_ids.push_back(cur_joiner.first);
 
         if (conceiving_message && conceiving_message->message_type == Message::PARTICIPANTS_INFO) {
             confirm_auth_add_update_share_repo(*conceiving_message);
         }
 
-        send_view_auth_and_share(joiner_id);
+        send_view_auth_and_share(joiner_ids);
     } else if (conceiver == PEER || conceiver == STAYER) // just anything else
         send_new_share_message();
+    else if (conceiver == RATCHETER) // our share is piggybacked by the parent
+        group_enc();
     else
         logger.abort("invalid session conceiver", __FUNCTION__, myself.nickname);
 
-    logger.info("session constructed with FSM new state: " + logger.state_to_text[my_state], __FUNCTION__,
-                myself.nickname);
+    NP1SEC_LOG_INFO("session constructed with FSM new state: " + logger.state_to_text[my_state], __FUNCTION__,
+                    myself.nickname);
 }
 
 /**
@@ -293,7 +394,7 @@ Session::Session(SessionConceiverCondition conceiver, UserState* us, std::string
  */
 void Session::compute_session_id()
 {
-    logger.assert_or_die(!session_id.get(), "session id is unchangable"); // if session id isn't set we have to set it
+    NP1SEC_ASSERT_OR_DIE(!session_id.get(), "session id is unchangable"); // if session id isn't set we have to set it
     session_id.compute(participants);
 }
 
@@ -304,7 +405,7 @@ void Session::compute_session_id()
  */
 void Session::setup_session_view(Message session_view_message)
 {
-    populate_participants_and_peers(session_view_message.get_session_view());
+    populate_participants(session_view_message.get_session_view());
     compute_session_id();
 
     if (session_id.get() == nullptr)
@@ -312,6 +413,35 @@ void Session::setup_session_view(Message session_view_message)
 
 }
 
+void Session::choose_key_agreement(SessionConceiverCondition conceiver)
+{
+    if (conceiver != JOINER && (!us->ops->c_tree_key_agreement_threshold ||
+                                participants.size() < us->ops->c_tree_key_agreement_threshold))
+        return;
+
+    // whoever has left the room since the tree was grown is pruned
+    std::vector<std::string> tree_leaves = key_tree.leaves();
+    for (auto& cur_nick : tree_leaves)
+        if (!cur_nick.empty() && participants.find(cur_nick) == participants.end())
+            key_tree.remove_leaf(cur_nick);
+
+    std::vector<std::string> newcomers;
+    for (auto& cur_participant : participants)
+        if (!key_tree.has_leaf(cur_participant.first))
+            newcomers.push_back(cur_participant.first);
+
+    // a room which has just grown past the threshold has no tree yet and
+    // keeps the ring for another session
+    size_t expected_newcomers = (conceiver == JOINER || conceiver == ACCEPTOR) ? 1 : 0;
+    if (!key_tree.width() || newcomers.size() != expected_newcomers)
+        return;
+
+    tree_key_agreement = true;
+    key_tree_sponsor = newcomers.empty()
+                           ? participants.by_index(session_id.get_index() % participants.size()).id.nickname
+                           : newcomers.front();
+}
+
 void Session::compute_session_confirmation()
 {
     std::string to_be_hashed = hash_to_string_buff(session_key);
@@ -332,13 +462,31 @@ void Session::account_for_session_and_key_consistency()
     add_message_to_transcript(hash_to_string_buff(key_sid_hash), last_received_message_id);
 }
 
+void Session::start_message_key_ratchet()
+{
+    if (!us->ops->c_ratchet_message_keys)
+        return;
+
+    message_key_ratchet.init(session_key, participants.size(), my_index);
+
+    HashBlock transfer_key;
+    hash(hash_to_string_buff(session_key) + "transfer", transfer_key, true);
+    memcpy(session_key, transfer_key, c_hash_length);
+    secure_wipe(transfer_key, c_hash_length);
+
+    // nothing is encrypted under the session key any more
+    HashBlock no_key = {0};
+    cryptic.set_session_key(no_key);
+}
+
 bool Session::validate_session_confirmation(Message confirmation_message)
 {
     HashBlock expected_hash;
 
     // set the future ephemeral key for the user
-    memcpy(participants[confirmation_message.sender_nick].future_raw_ephemeral_key,
-           confirmation_message.next_session_ephemeral_key.data(), c_ephemeral_key_length);
+    participants[confirmation_message.sender_nick].set_future_ephemeral_key(
+        reinterpret_cast<const uint8_t*>(confirmation_message.next_session_ephemeral_key.data()));
+    participants[confirmation_message.sender_nick].future_leaf_key = confirmation_message.next_session_leaf_key;
 
     std::string to_be_hashed = hash_to_string_buff(session_key);
     to_be_hashed += confirmation_message.sender_nick;
@@ -356,24 +504,60 @@ bool Session::validate_session_confirmation(Message confirmation_message)
 void Session::secret_share_on(int32_t side, HashBlock hb)
 {
     assert(side == c_my_left || side == c_my_right);
-    uint32_t positive_side = side + ((side < 0) ? peers.size() : 0);
-    unsigned int my_neighbour = (my_index + positive_side) % peers.size();
+    uint32_t positive_side = side + ((side < 0) ? participants.size() : 0);
+    Participant& my_neighbour = participants.by_index((my_index + positive_side) % participants.size());
 
     // we can't compute the secret if we don't know the neighbour ephemeral key
-    assert(participants[peers[my_neighbour]].ephemeral_key);
-    participants[peers[my_neighbour]].compute_p2p_private(us->long_term_key_pair.get_key_pair().first, &cryptic);
+    assert(my_neighbour.ephemeral_key);
+    my_neighbour.compute_p2p_private(us->long_term_key_pair.get_key_pair().first, &cryptic);
+    metrics.counters.triple_dhs++;
 
     // compute p2p_key + session_id.session_id_raw
     size_t num_bytes = c_hash_length + c_hash_length;
     uint8_t bytes[num_bytes];
-    memcpy(bytes, participants[peers[my_neighbour]].p2p_key, c_hash_length);
+    memcpy(bytes, my_neighbour.p2p_key, c_hash_length);
     memcpy(bytes + (sizeof(uint8_t) * c_hash_length), session_id.get(), c_hash_length);
     hash((void*)bytes, num_bytes, hb, true);
     secure_wipe(bytes, c_hash_length + c_hash_length);
 }
 
+void Session::broadcast(Message& outbound)
+{
+    metrics.count_sent(outbound.message_type, outbound.sys_message.size());
+    outbound.send(room_name, us);
+}
+
+void Session::mark_phase()
+{
+    switch (my_state) {
+    case JOIN_REQUESTED:
+        metrics.reach(JOIN_REQUESTED_PHASE);
+        break;
+    case RE_SHARED:
+        metrics.reach(RE_SHARED_PHASE);
+        break;
+    case GROUP_KEY_GENERATED:
+        metrics.reach(GROUP_KEY_GENERATED_PHASE);
+        break;
+    case IN_SESSION:
+        metrics.reach(IN_SESSION_PHASE);
+        break;
+    default:
+        // leaving or dead, the handshake is over one way or the other
+        break;
+    }
+}
+
 void Session::group_enc()
 {
+    NP1SEC_PROBE(PROBE_GROUP_ENC);
+    // the key tree makes the shares redundant
+    if (tree_key_agreement) {
+        HashBlock no_share = {};
+        participants.by_index(my_index).set_key_share(no_share);
+        return;
+    }
+
     HashBlock hbr, hbl;
     secret_share_on(c_my_right, hbr);
     secret_share_on(c_my_left, hbl);
@@ -382,35 +566,44 @@ void Session::group_enc()
         hbr[i] ^= hbl[i];
     }
 
-    participants[myself.nickname].set_key_share(hbr);
+    participants.by_index(my_index).set_key_share(hbr);
     secure_wipe(hbr, c_hash_length);
     secure_wipe(hbl, c_hash_length);
 }
 
 void Session::group_dec()
 {
+    NP1SEC_PROBE(PROBE_GROUP_DEC);
+    if (tree_key_agreement) {
+        std::string to_be_hashed = key_tree.root_secret() + session_id.get_as_stringbuff();
+        hash(to_be_hashed, session_key, true);
+        secure_wipe(&to_be_hashed[0], to_be_hashed.size());
+        cryptic.set_session_key(session_key);
+        return;
+    }
+
     HashBlock hbr;
-    HashBlock all_r[peers.size() + 1];
+    HashBlock all_r[participants.size() + 1];
    
     secret_share_on(c_my_right, hbr);
     memcpy(all_r[my_index], hbr, c_hash_length);
 
-    for (uint32_t counter = 0; counter < peers.size(); counter++) {
+    for (uint32_t counter = 0; counter < participants.size(); counter++) {
         // memcpy(all_r[my_right], last_hbr, sizeof(HashBlock));
-        size_t current_peer = (my_index + counter) % peers.size();
-        size_t peer_on_the_right = (current_peer + 1) % peers.size();
+        size_t current_peer = (my_index + counter) % participants.size();
+        size_t peer_on_the_right = (current_peer + 1) % participants.size();
         memcpy(all_r[current_peer], hbr, c_hash_length);
         for (unsigned i = 0; i < sizeof(HashBlock); i++) {
-            hbr[i] ^= participants[peers[peer_on_the_right]].cur_keyshare[i];
+            hbr[i] ^= participants.by_index(peer_on_the_right).cur_keyshare[i];
         }
     }
     
-    memcpy(all_r[peers.size()], session_id.get(), c_hash_length);
-    hash(all_r, peers.size() + 1, session_key, true);
+    memcpy(all_r[participants.size()], session_id.get(), c_hash_length);
+    hash(all_r, participants.size() + 1, session_key, true);
     cryptic.set_session_key(session_key);
     
     secure_wipe(hbr, c_hash_length);
-    for (size_t i = 0; i < peers.size() + 1; i++) {
+    for (size_t i = 0; i < participants.size() + 1; i++) {
         secure_wipe(all_r[i], c_hash_length);
     }
 }
@@ -418,10 +611,10 @@ void Session::group_dec()
 bool Session::everybody_authenticated_and_contributed()
 {
     for (ParticipantMap::iterator it = participants.begin(); it != participants.end(); it++)
-        if (!it->second.authenticated || !it->second.key_share_contributed)
+        if (!it->second.authenticated || (!tree_key_agreement && !it->second.key_share_contributed))
             return false;
 
-    return true;
+    return !tree_key_agreement || key_tree_committed;
 }
 
 bool Session::everybody_confirmed()
@@ -453,10 +646,11 @@ void Session::joiner_send_auth_and_share()
     Token cur_auth_token;
     std::string auth_batch;
 
-    for (uint32_t i = 0; i < peers.size(); i++) {
-        if (!participants[peers[i]].authed_to) {
-            participants[peers[i]].authenticate_to(cur_auth_token, us->long_term_key_pair.get_key_pair().first,
-                                                   &cryptic);
+    for (uint32_t i = 0; i < participants.size(); i++) {
+        if (!participants.by_index(i).authed_to) {
+            participants.by_index(i).authenticate_to(cur_auth_token, us->long_term_key_pair.get_key_pair().first,
+                                                     &cryptic);
+            metrics.counters.triple_dhs++;
             auth_batch.append(reinterpret_cast<char*>(&i), sizeof(uint32_t));
             auth_batch.append(reinterpret_cast<char*>(cur_auth_token), sizeof(Token));
         }
@@ -466,8 +660,9 @@ void Session::joiner_send_auth_and_share()
 
     outbound.create_joiner_auth_msg(
         session_id, auth_batch,
-        std::string(reinterpret_cast<char*>(participants[myself.nickname].cur_keyshare), sizeof(np1secKeyShare)));
-    outbound.send(room_name, us);
+        std::string(reinterpret_cast<char*>(participants[myself.nickname].cur_keyshare), sizeof(np1secKeyShare)),
+        tree_key_agreement ? commit_to_key_tree() : std::string());
+    broadcast(outbound);
 }
 
 /**
@@ -479,16 +674,21 @@ void Session::joiner_send_auth_and_share()
  */
 void Session::send_new_share_message()
 {
-    logger.assert_or_die(session_id.get(), "can't send share message witouh session id");
+    NP1SEC_ASSERT_OR_DIE(session_id.get(), "can't send share message witouh session id");
+    // with the key tree only the sponsor has something to say
+    if (tree_key_agreement && key_tree_sponsor != myself.nickname)
+        return;
+
     group_enc(); // compute my share for group key
 
     Message outboundmessage(&cryptic);
 
     outboundmessage.create_group_share_msg(
         session_id,
-        std::string(reinterpret_cast<char*>(participants[myself.nickname].cur_keyshare), sizeof(np1secKeyShare)));
+        std::string(reinterpret_cast<char*>(participants[myself.nickname].cur_keyshare), sizeof(np1secKeyShare)),
+        tree_key_agreement ? commit_to_key_tree() : std::string());
 
-    outboundmessage.send(room_name, us);
+    broadcast(outboundmessage);
 }
 
 /**
@@ -498,37 +698,90 @@ void Session::send_new_share_message()
     and others
 i    sid, ((U_1,y_i)...(U_{n+1},y_{i+1}), kc, z_joiner
 */
-void Session::send_view_auth_and_share(std::string joiner_id)
+void Session::send_view_auth_and_share(const std::vector<std::string>& joiner_ids)
 {
-    logger.assert_or_die(session_id.get(), "can not share view  when session id is missing");
+    NP1SEC_ASSERT_OR_DIE(session_id.get(), "can not share view  when session id is missing");
     group_enc(); // compute my share for group key
 
-    Token cur_auth_token;
-    if (!joiner_id.empty()) {
-        if (participants.find(joiner_id) == participants.end()) {
-            logger.error("can't authenticate to non-member joining participant " + joiner_id, __FUNCTION__,
+    Token cur_auth_token = {};
+    std::string auth_batch;
+    for (auto& cur_joiner_id : joiner_ids) {
+        if (participants.find(cur_joiner_id) == participants.end()) {
+            logger.error("can't authenticate to non-member joining participant " + cur_joiner_id, __FUNCTION__,
                          myself.nickname);
             throw InvalidParticipantException();
         }
 
-        participants[joiner_id].authenticate_to(cur_auth_token, us->long_term_key_pair.get_key_pair().first, &cryptic);
+        participants[cur_joiner_id].authenticate_to(cur_auth_token, us->long_term_key_pair.get_key_pair().first,
+                                                    &cryptic);
+        metrics.counters.triple_dhs++;
+        uint32_t joiner_index = participants[cur_joiner_id].index;
+        auth_batch.append(reinterpret_cast<char*>(&joiner_index), sizeof(uint32_t));
+        auth_batch.append(reinterpret_cast<char*>(cur_auth_token), sizeof(Token));
     }
 
-    UnauthenticatedParticipantList session_view_list = session_view();
     Message outboundmessage(&cryptic);
+    std::string key_confirmation = joiner_ids.size() > 1
+                                       ? auth_batch
+                                       : std::string(reinterpret_cast<char*>(cur_auth_token), sizeof(Token));
+    std::string z_sender(reinterpret_cast<char*>(participants[myself.nickname].cur_keyshare), sizeof(np1secKeyShare));
 
     try {
-        outboundmessage.create_participant_info_msg(
-            session_id, session_view_list, std::string(reinterpret_cast<char*>(cur_auth_token), sizeof(Token)),
-            std::string(reinterpret_cast<char*>(participants[myself.nickname].cur_keyshare), sizeof(np1secKeyShare)));
+        bool delta_views = sends_delta_views();
+        if (delta_views && !sends_full_view()) {
+            UnauthenticatedParticipantList changed_participants;
+            std::vector<std::string> departed_nicks;
+            for (auto& cur_participant : participants) {
+                auto parental_record = parental_participants.find(cur_participant.first);
+                if (parental_record == parental_participants.end() ||
+                    view_entry(parental_record->second).unauthed_participant_to_stringbuffer() !=
+                        view_entry(cur_participant.second).unauthed_participant_to_stringbuffer())
+                    changed_participants.push_back(view_entry(cur_participant.second));
+            }
+
+            for (auto& cur_participant : parental_participants)
+                if (participants.find(cur_participant.first) == participants.end())
+                    departed_nicks.push_back(cur_participant.first);
+
+            outboundmessage.create_participant_info_delta_msg(session_id, parent_session_id, changed_participants,
+                                                              departed_nicks, key_confirmation, z_sender);
+        } else {
+            UnauthenticatedParticipantList session_view_list = session_view();
+            if (delta_views)
+                outboundmessage.protocol_version = c_np1sec_delta_views_protocol_version;
+            // the joiner commits against the tree, it only gets it from us
+            outboundmessage.create_participant_info_msg(session_id, session_view_list, key_confirmation, z_sender,
+                                                        tree_key_agreement ? key_tree.public_tree() : std::string());
+        }
 
     } catch (CryptoException()) {
         logger.error("unable to create participant info message due to cryptographic failure");
         throw;
     }
 
-    logger.debug("sending participant info message");
-    outboundmessage.send(room_name, us);
+    NP1SEC_LOG_DEBUG("sending participant info message");
+    broadcast(outboundmessage);
+}
+
+bool Session::sends_delta_views()
+{
+    if (!us->ops->c_delta_session_views || !parent_session_id.get())
+        return false;
+
+    for (auto& cur_participant : participants)
+        if (!cur_participant.second.takes_delta_views && cur_participant.first != myself.nickname)
+            return false;
+
+    return true;
+}
+
+bool Session::sends_full_view()
+{
+    for (auto& cur_peer : participants)
+        if (parental_participants.find(cur_peer.first) != parental_participants.end())
+            return cur_peer.first == myself.nickname;
+
+    return true;
 }
 
 /**
@@ -541,12 +794,13 @@ void Session::send_view_auth_and_share(std::string joiner_id)
  */
 RoomAction Session::state_handler(Message received_message)
 {
-    logger.info("handling state: " + logger.state_to_text[my_state] + " message_type:" +
-                    logger.message_type_to_text[received_message.message_type],
-                __FUNCTION__, myself.nickname);
+    NP1SEC_LOG_INFO("handling state: " + logger.state_to_text[my_state] + " message_type:" +
+                        logger.message_type_to_text[received_message.message_type],
+                    __FUNCTION__, myself.nickname);
+    metrics.count_received(received_message.message_type, received_message.final_whole_message.size());
     if (!this->np1secFSMGraphTransitionMatrix[my_state][received_message.message_type]) {
-        logger.debug("lose state transitor, don't know where to go on FSM. ignoring message", __FUNCTION__,
-                     myself.nickname);
+        NP1SEC_LOG_DEBUG("lose state transitor, don't know where to go on FSM. ignoring message", __FUNCTION__,
+                         myself.nickname);
 
     } else {
         // JOIN_REQUEST has no singnature
@@ -557,8 +811,12 @@ RoomAction Session::state_handler(Message received_message)
             verify_peers_signature(received_message);
         StateAndAction result =
             (this->*np1secFSMGraphTransitionMatrix[my_state][received_message.message_type])(received_message);
+        NP1SEC_TRACE5(state_transition, room_name.c_str(), trace_session_id(session_id.get()),
+                      static_cast<int>(my_state), static_cast<int>(result.first),
+                      static_cast<int>(received_message.message_type));
         my_state = result.first;
-        logger.info("FSM new state: " + logger.state_to_text[my_state], __FUNCTION__, myself.nickname);
+        mark_phase();
+        NP1SEC_LOG_INFO("FSM new state: " + logger.state_to_text[my_state], __FUNCTION__, myself.nickname);
         return result.second;
     }
 
@@ -590,8 +848,18 @@ Session::StateAndAction Session::auth_and_reshare(Message received_message)
     if (participants.find(received_message.sender_nick) == participants.end())
         throw InvalidParticipantException();
 
+    // we might be one of several joiners, each with their own confirmation
+    std::string key_confirmation = received_message.key_confirmation;
+    if (!received_message.authentication_table.empty()) {
+        auto my_confirmation = received_message.authentication_table.find(my_index);
+        if (my_confirmation == received_message.authentication_table.end())
+            throw AuthenticationException();
+        key_confirmation = my_confirmation->second;
+    }
+
+    metrics.counters.triple_dhs++;
     participants[received_message.sender_nick].be_authenticated(
-        myself.id_to_stringbuffer(), reinterpret_cast<const uint8_t*>(received_message.key_confirmation.c_str()),
+        myself.id_to_stringbuffer(), reinterpret_cast<const uint8_t*>(key_confirmation.c_str()),
         us->long_term_key_pair.get_key_pair().first, &cryptic);
 
     // keep participant's z_share if they passes authentication
@@ -686,7 +954,7 @@ Session::StateAndAction Session::init_a_session_with_new_user(Message received_m
 
     RoomAction new_session_action;
 
-    logger.assert_or_die(received_message.message_type == Message::JOIN_REQUEST,
+    NP1SEC_ASSERT_OR_DIE(received_message.message_type == Message::JOIN_REQUEST,
                          "wrong message type is provided to the accetpor " + myself.nickname +
                              " to establish a session. Message type " + std::to_string(Message::JOIN_REQUEST) +
                              " was expected but type " + std::to_string(received_message.message_type) +
@@ -700,16 +968,23 @@ Session::StateAndAction Session::init_a_session_with_new_user(Message received_m
 
     ParticipantMap live_participants = future_participants();
     if (live_participants.find(joiner.participant_id.nickname) == live_participants.end()) {
-        logger.info("creating a session with new participant " + joiner.participant_id.nickname);
-        live_participants.insert(
+        // a joiner asking again has got new keys
+        pending_joiners.erase(joiner.participant_id.nickname);
+        pending_joiners.insert(
             std::pair<std::string, Participant>(joiner.participant_id.nickname, Participant(joiner)));
 
-        Session* new_child_session = new Session(
-            ACCEPTOR, us, room_name, &future_cryptic, live_participants, future_participants(), &received_message);
+        if (us->ops->c_join_batch_interval) {
+            if (!join_batch_timer)
+                join_batch_timer = us->set_timer(cb_admit_joiners, this, us->ops->c_join_batch_interval);
+        } else {
+            Session* new_child_session = breed_admission_session(&received_message);
 
-        // if it fails it throw exception catched by the room
-        new_session_action.action_type = RoomAction::NEW_SESSION;
-        new_session_action.bred_session = new_child_session;
+            // if it fails it throw exception catched by the room
+            if (new_child_session) {
+                new_session_action.action_type = RoomAction::NEW_SESSION;
+                new_session_action.bred_session = new_child_session;
+            }
+        }
 
         // This broadcast not happens in session constructor because sometime we want just to make
         // a session object and not tell the whole world about it.
@@ -727,6 +1002,26 @@ Session::StateAndAction Session::init_a_session_with_new_user(Message received_m
     return StateAndAction(my_state, new_session_action);
 }
 
+Session* Session::breed_admission_session(Message* conceiving_message)
+{
+    if (pending_joiners.empty())
+        return nullptr;
+
+    ParticipantMap live_participants = future_participants() + pending_joiners;
+
+    // somebody else's view of the same batch has made us the session already
+    SessionId admission_session_id(live_participants);
+    auto session_room = us->chatrooms.find(room_name);
+    if (session_room != us->chatrooms.end() && session_room->second.has_session(admission_session_id))
+        return nullptr;
+
+    NP1SEC_LOG_INFO("creating a session admitting " + participants_to_string(pending_joiners), __FUNCTION__,
+                    myself.nickname);
+
+    return new Session(ACCEPTOR, us, room_name, &future_cryptic, live_participants, future_participants(),
+                       conceiving_message, session_id, future_key_tree());
+}
+
 //*****Current participant state transitors*****
 /**
      For the current user, calls it when receive PARTICIPANT_INFO which
@@ -749,7 +1044,7 @@ RoomAction Session::init_a_session_with_plist(Message received_message)
 
     RoomAction new_session_action;
 
-    logger.assert_or_die(received_message.message_type == Message::PARTICIPANTS_INFO,
+    NP1SEC_ASSERT_OR_DIE(received_message.message_type == Message::PARTICIPANTS_INFO,
                          "wrong message type is provided to the accetpor " + myself.nickname +
                              " to establish a session. Message type " +
                              logger.message_type_to_text[Message::PARTICIPANTS_INFO] + " was expected but type " +
@@ -764,6 +1059,7 @@ RoomAction Session::init_a_session_with_plist(Message received_message)
     PublicKey temp_future_pub_key = reconstruct_public_key_sexp(
         hash_to_string_buff(participants[received_message.sender_nick].future_raw_ephemeral_key));
 
+    metrics.counters.signature_verifications++;
     if (!received_message.verify_message(temp_future_pub_key)) {
         release_crypto_resource(temp_future_pub_key);
         logger.warn("failed to verify signature of PARTICIPANT_INFO message.");
@@ -772,7 +1068,7 @@ RoomAction Session::init_a_session_with_plist(Message received_message)
 
     release_crypto_resource(temp_future_pub_key);
 
-    ParticipantMap live_participants = participants_list_to_map(received_message.get_session_view());
+    ParticipantMap live_participants = ParticipantMap(received_message.get_session_view());
 
     if (live_participants.find(myself.nickname) == live_participants.end()) {
         logger.warn("rejecting participant info message which myself am not part of");
@@ -791,8 +1087,9 @@ RoomAction Session::init_a_session_with_plist(Message received_message)
         }
     }
 
-    Session* new_child_session = new Session(ACCEPTOR, us, room_name, &future_cryptic, live_participants,
-                                                         future_participants(), &received_message);
+    Session* new_child_session =
+        new Session(ACCEPTOR, us, room_name, &future_cryptic, live_participants, future_participants(),
+                    &received_message, session_id, future_key_tree());
 
     // if it fails it throw exception catched by the room
     new_session_action.action_type = RoomAction::NEW_SESSION;
@@ -812,13 +1109,17 @@ RoomAction Session::shrink(std::string leaving_nick)
     // make a fake intention to leave message but don't send ack
     RoomAction new_session_action;
 
+    // a joiner who leaves before being admitted is not waited for
+    pending_joiners.erase(leaving_nick);
+
     auto leaver = participants.find(leaving_nick);
     if (leaver == participants.end()) {
         logger.warn("participant " + leaving_nick + " is not part of the active session of the room " + room_name +
                     " from which they are trying to leave, already parted?");
     } else if (zombies.find(leaving_nick) != zombies.end()) { // we haven already shrunk and made a session
-        logger.debug("shrunk session for leaving user " + leaving_nick + " has already been generated. nothing to do",
-                     __FUNCTION__, myself.nickname);
+        NP1SEC_LOG_DEBUG("shrunk session for leaving user " + leaving_nick +
+                             " has already been generated. nothing to do",
+                         __FUNCTION__, myself.nickname);
     } else { // shrink now
         // if everything is ok add the leaver to the zombie list and make a
         // session without zombies
@@ -826,22 +1127,42 @@ RoomAction Session::shrink(std::string leaving_nick)
 
         // raison_detre.insert(RaisonDEtre(LEAVE, leaver->id));
 
-        Session* new_child_session =
-            new Session(PEER, us, room_name, &future_cryptic, future_participants());
-
-        new_session_action.action_type = RoomAction::NEW_PRIORITY_SESSION;
-        new_session_action.bred_session = new_child_session;
+        // the others dropping out with the leaver are shrunk out together
+        if (us->ops->c_leave_batch_interval) {
+            if (!leave_batch_timer)
+                leave_batch_timer = us->set_timer(cb_shrink_zombies, this, us->ops->c_leave_batch_interval);
+            return c_no_room_action;
+        }
 
         // we are as we have farewelled
         // my_state = FAREWELLED; //We shouldn't change here and it is not clear why we
         // we need this stage, not to accept join? why? join will fail by non confirmation
         // of the leavers
-        return new_session_action;
+        return breed_shrunk_session();
     }
 
     return c_no_room_action;
 }
 
+RoomAction Session::breed_shrunk_session()
+{
+    RoomAction new_session_action;
+
+    // nobody is going to confirm the session with the previous leavers
+    auto session_room = us->chatrooms.find(room_name);
+    if (shrunk_session_id.get() && session_room != us->chatrooms.end())
+        session_room->second.abandon_session(shrunk_session_id);
+
+    Session* new_child_session = new Session(PEER, us, room_name, &future_cryptic, future_participants(),
+                                             ParticipantMap(), nullptr, SessionId(), future_key_tree());
+    shrunk_session_id = new_child_session->session_id;
+
+    new_session_action.action_type = RoomAction::NEW_PRIORITY_SESSION;
+    new_session_action.bred_session = new_child_session;
+
+    return new_session_action;
+}
+
 /**
  * Move the session from DEAD to
  */
@@ -854,6 +1175,93 @@ RoomAction Session::shrink(std::string leaving_nick)
 
 // }
 
+/**
+ * the next session is agreed on by the material piggybacked on the
+ * in-session messages instead of a handshake
+ */
+bool Session::ratchets_in_band()
+{
+    return us->ops->c_in_band_resession && my_state == IN_SESSION && zombies.empty() && !tree_key_agreement &&
+           (!us->ops->c_tree_key_agreement_threshold ||
+            participants.size() < us->ops->c_tree_key_agreement_threshold);
+}
+
+void Session::prepare_successor()
+{
+    if (successor_prepared)
+        return;
+
+    successor_future_cryptic.init();
+    metrics.counters.key_generations++;
+    Session* successor = breed_successor();
+    successor_key_share = std::string(reinterpret_cast<char*>(successor->participants[myself.nickname].cur_keyshare),
+                                      sizeof(np1secKeyShare));
+    delete successor;
+
+    successor_prepared = true;
+    successor_material_sent = false;
+
+    // in a quiet room an ack carries it
+    start_acking_timer();
+}
+
+Session* Session::breed_successor()
+{
+    Session* successor = new Session(RATCHETER, us, room_name, &future_cryptic, future_participants(),
+                                     ParticipantMap(), nullptr, SessionId(), future_key_tree());
+    successor->future_cryptic = successor_future_cryptic;
+
+    return successor;
+}
+
+RoomAction Session::receive_successor_material(const Message& received_message)
+{
+    if (!ratchets_in_band() || received_message.next_session_ephemeral_key.size() != c_ephemeral_key_length ||
+        received_message.next_session_key_share.size() != sizeof(np1secKeyShare)) {
+        logger.warn("ignoring successor material from " + received_message.sender_nick, __FUNCTION__,
+                    myself.nickname);
+        return c_no_room_action;
+    }
+
+    successor_material[received_message.sender_nick] =
+        SuccessorMaterial{received_message.next_session_ephemeral_key, received_message.next_session_key_share};
+
+    // the life timer of the sender has gone off before ours
+    prepare_successor();
+
+    for (auto& cur_participant : participants)
+        if (successor_material.find(cur_participant.first) == successor_material.end())
+            return c_no_room_action;
+
+    // everybody sees the last piece of material at the same point of the
+    // transcript, so everybody moves on here
+    RoomAction ratchet_action(RoomAction::NEW_PRIORITY_SESSION);
+    ratchet_action.bred_session = breed_successor();
+    ratchet_action.bred_session->establish_in_band(successor_material);
+    successor_material.clear();
+
+    return ratchet_action;
+}
+
+void Session::establish_in_band(const std::map<std::string, SuccessorMaterial>& material)
+{
+    for (auto& cur_participant : participants) {
+        const SuccessorMaterial& cur_material = material.at(cur_participant.first);
+        cur_participant.second.set_key_share(reinterpret_cast<const uint8_t*>(cur_material.key_share.data()));
+        cur_participant.second.set_future_ephemeral_key(
+            reinterpret_cast<const uint8_t*>(cur_material.ephemeral_key.data()));
+    }
+
+    group_dec();
+    account_for_session_and_key_consistency();
+    start_message_key_ratchet();
+    confirmed_peers.assign(participants.size(), true);
+    my_state = IN_SESSION;
+    mark_phase();
+
+    session_life_timer = us->set_timer(cb_re_session, this, adapted_interval(us->ops->c_session_life_span));
+}
+
 /**
    For the current user, calls it when receive JOINER_AUTH
 
@@ -877,14 +1285,28 @@ RoomAction Session::shrink(std::string leaving_nick)
 Session::StateAndAction Session::confirm_auth_add_update_share_repo(Message received_message)
 {
     if (received_message.message_type == Message::JOINER_AUTH) {
-        if (received_message.authentication_table.find(my_index) != received_message.authentication_table.end())
+        if (received_message.authentication_table.find(my_index) != received_message.authentication_table.end()) {
+            metrics.counters.triple_dhs++;
             participants[received_message.sender_nick].be_authenticated(
                 myself.id_to_stringbuffer(), strbuff_to_hash(received_message.authentication_table[my_index]),
                 us->long_term_key_pair.get_key_pair().first, &cryptic);
+        }
     }
 
     participants[received_message.sender_nick].set_key_share(strbuff_to_hash(received_message.z_sender));
 
+    // we have applied our own commit already
+    if (tree_key_agreement && received_message.sender_nick == key_tree_sponsor &&
+        received_message.sender_nick != myself.nickname &&
+        received_message.message_type != Message::PARTICIPANTS_INFO) {
+        if (key_tree.apply_commit(received_message.sender_nick, myself.nickname, received_message.key_tree_update,
+                                  session_id.get_as_stringbuff()))
+            key_tree_committed = true;
+        else
+            logger.warn("invalid key tree commit from " + received_message.sender_nick, __FUNCTION__,
+                        myself.nickname);
+    }
+
     return send_session_confirmation_if_everybody_is_contributed();
     // else { //assuming the message is PARTICIPANT_INFO from other in
     // session people
@@ -906,14 +1328,23 @@ Session::StateAndAction Session::send_session_confirmation_if_everybody_is_contr
         compute_session_confirmation();
         // we need our future ephemeral key to attach to the message
         future_cryptic.init();
+        metrics.counters.key_generations++;
+        // and our future leaf if the next session might agree by the tree
+        std::string future_leaf_key;
+        if (us->ops->c_tree_key_agreement_threshold &&
+            participants.size() + 1 >= us->ops->c_tree_key_agreement_threshold) {
+            future_leaf_secret.assign(c_hash_length, '\0');
+            gcry_randomize(&future_leaf_secret[0], c_hash_length, GCRY_STRONG_RANDOM);
+            future_leaf_key = TreeNodeKey(future_leaf_secret).public_key();
+        }
         // now send the confirmation messagbe
         Message outboundmessage(&cryptic);
 
         outboundmessage.create_session_confirmation_msg(
             session_id, hash_to_string_buff(session_confirmation),
-            public_key_to_stringbuff(future_cryptic.get_ephemeral_pub_key()));
+            public_key_to_stringbuff(future_cryptic.get_ephemeral_pub_key()), future_leaf_key);
 
-        outboundmessage.send(room_name, us);
+        broadcast(outboundmessage);
 
         RoomAction re_limbo_action;
 
@@ -959,18 +1390,18 @@ Session::StateAndAction Session::mark_confirmed_and_may_move_session(Message rec
     if (everybody_confirmed()) {
         // kill the rejoin timer
         if (rejoin_timer)
-            us->ops->axe_timer(rejoin_timer, us->ops->bare_sender_data);
+            us->axe_timer(rejoin_timer);
         rejoin_timer = nullptr;
 
         // activate(); it is matter of changing to IN_SESSION
         // we also need to initiate the transcript chain with
         account_for_session_and_key_consistency();
+        start_message_key_ratchet();
 
         // flush the raison d'etre because we have fullfield it
         /// raison_detre.clear();
         // start the session life timer
-        session_life_timer =
-            us->ops->set_timer(cb_re_session, this, us->ops->c_session_life_span, us->ops->bare_sender_data);
+        session_life_timer = us->set_timer(cb_re_session, this, adapted_interval(us->ops->c_session_life_span));
 
         return StateAndAction(IN_SESSION, c_no_room_action);
     }
@@ -1001,13 +1432,13 @@ Session::StateAndAction Session::send_farewell_and_reshare(Message received_mess
     send("", Message::JUST_ACK); // no point to send FS loads as the session is
     // ending anyway
     // return init_a_session_with_new_plist(received_message);
-    logger.assert_or_die(received_message.message_type == Message::IN_SESSION_MESSAGE &&
+    NP1SEC_ASSERT_OR_DIE(received_message.message_type == Message::IN_SESSION_MESSAGE &&
                              received_message.message_sub_type == Message::LEAVE_MESSAGE,
                          "wrong message type is provided to the stayer " + myself.nickname +
                              " to establish a session. Leave messaage is expected.",
                          __FUNCTION__, myself.nickname);
 
-    logger.info(received_message.sender_nick + " waves goodbye.", __FUNCTION__, myself.nickname);
+    NP1SEC_LOG_INFO(received_message.sender_nick + " waves goodbye.", __FUNCTION__, myself.nickname);
 
     return StateAndAction(my_state, shrink(received_message.sender_nick));
     // FAREWELL doesn't make sense. we act normally till a new
@@ -1048,23 +1479,21 @@ void Session::leave()
     // if you are the only person in the session then
     // just leave
     // TODO:: is it good to call the ops directly?
-    logger.debug("leaving the session", __FUNCTION__, myself.nickname);
+    NP1SEC_LOG_DEBUG("leaving the session", __FUNCTION__, myself.nickname);
     if (participants.size() == 1) {
-        logger.debug("last person in the session, not waiting for farewell", __FUNCTION__, myself.nickname);
+        NP1SEC_LOG_DEBUG("last person in the session, not waiting for farewell", __FUNCTION__, myself.nickname);
 
-        logger.assert_or_die(my_index == 0 && peers.size() == 1, "peers is not sync with participants");
-        peers.pop_back();
-        us->ops->leave(room_name, peers, us->ops->bare_sender_data);
+        NP1SEC_ASSERT_OR_DIE(my_index == 0, "my index is not sync with participants");
+        us->ops->leave(room_name, std::vector<std::string>(), us->ops->bare_sender_data);
         commit_suicide();
     }
 
     // otherwise, inform others in the room about your leaving the room
-    logger.debug("informing other, waiting for farewell", __FUNCTION__, myself.nickname);
+    NP1SEC_LOG_DEBUG("informing other, waiting for farewell", __FUNCTION__, myself.nickname);
     leave_parent = last_received_message_id;
     send("", Message::LEAVE_MESSAGE);
 
-    farewell_deadline_timer =
-        us->ops->set_timer(cb_leave, this, us->ops->c_inactive_ergo_non_sum_interval, us->ops->bare_sender_data);
+    farewell_deadline_timer = us->set_timer(cb_leave, this, us->ops->c_inactive_ergo_non_sum_interval);
     my_state = LEAVE_REQUESTED;
 }
 
@@ -1074,25 +1503,67 @@ void Session::leave()
  */
 void Session::start_ack_timers(const Message& received_message)
 {
-    for (ParticipantMap::iterator it = participants.begin(); it != participants.end(); ++it) {
-        // we accumulate the timers, when we receive ack, we drop what we
-        // have before
-        if ((received_message.sender_nick != (*it).second.id.nickname) &&
-            (received_message.sender_nick != myself.nickname)) // not for the sender and not
-        // for myself
-        {
-            received_transcript_chain[received_message.message_id][(*it).second.index].ack_timer_ops.session = this;
-            received_transcript_chain[received_message.message_id][(*it).second.index].ack_timer_ops.participant =
-                &(it->second);
-            received_transcript_chain[received_message.message_id][(*it).second.index].ack_timer_ops.message_id =
-                received_message.message_id;
-            received_transcript_chain[received_message.message_id][(*it).second.index].consistency_timer =
-                us->ops->set_timer(
-                    cb_ack_not_received,
-                    &(received_transcript_chain[received_message.message_id][(*it).second.index].ack_timer_ops),
-                    us->ops->c_consistency_failure_interval, us->ops->bare_sender_data);
+    // not for the sender and not for myself
+    if (received_message.sender_nick == myself.nickname)
+        return;
+
+    auto received_block = received_transcript_chain.find(received_message.message_id);
+    if (received_block == received_transcript_chain.end())
+        return;
+
+    ConsistencyBlock& consistency_block = received_block->second;
+    size_t sender_index = participants[received_message.sender_nick].index;
+    for (size_t i = 0; i < consistency_block.size(); i++)
+        if (i != sender_index && i != my_index)
+            consistency_block.expect_ack(i);
+
+    // we accumulate the deadlines, when we receive ack, we drop the
+    // participant from the blocks before
+    if (consistency_block.acks_pending()) {
+        ack_deadlines.push(AckDeadline(
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(consistency_failure_interval()),
+            received_message.message_id));
+        expire_ack_deadlines();
+    }
+}
+
+void Session::expire_ack_deadlines()
+{
+    auto now = std::chrono::steady_clock::now();
+    while (!ack_deadlines.empty()) {
+        auto due_block = received_transcript_chain.find(ack_deadlines.top().second);
+        bool acks_pending = due_block != received_transcript_chain.end() && due_block->second.acks_pending();
+        if (acks_pending && ack_deadlines.top().first > now)
+            break;
+
+        for (uint32_t i = 0; acks_pending && i < due_block->second.size(); i++) {
+            if (!due_block->second.ack_pending(i))
+                continue;
+
+            std::string ack_failure_message = participants.by_index(i).id.nickname + " failed to ack";
+            us->ops->display_message(room_name, "np1sec directive", ack_failure_message, us);
+            logger.warn(ack_failure_message + " in room " + room_name, __FUNCTION__, myself.nickname);
+            metrics.counters.ack_failures++;
         }
+
+        ack_deadlines.pop();
     }
+
+    if (ack_deadlines.empty())
+        return;
+
+    // an earlier timer fires anyway and moves on to this deadline
+    if (ack_deadline_timer) {
+        if (ack_deadline_timer_due <= ack_deadlines.top().first)
+            return;
+
+        us->axe_timer(ack_deadline_timer);
+    }
+
+    ack_deadline_timer_due = ack_deadlines.top().first;
+    // rounded up, so the deadline has passed when the timer fires
+    auto interval = std::chrono::duration_cast<std::chrono::milliseconds>(ack_deadline_timer_due - now).count() + 1;
+    ack_deadline_timer = us->set_timer(cb_ack_not_received, this, static_cast<uint32_t>(interval));
 }
 
 // void Session::start_conditional_send_ack_timer() {
@@ -1109,8 +1580,8 @@ void Session::start_ack_timers(const Message& received_message)
 void Session::start_acking_timer()
 {
     if (!send_ack_timer) {
-        logger.debug("arming send ack timer01");
-        send_ack_timer = us->ops->set_timer(cb_send_ack, this, us->ops->c_ack_interval, us->ops->bare_sender_data);
+        NP1SEC_LOG_DEBUG("arming send ack timer01");
+        send_ack_timer = us->set_timer(cb_send_ack, this, ack_interval());
     }
     // for (std::map<std::string, Participant>::iterator
     //      it = participants.begin();
@@ -1126,8 +1597,8 @@ void Session::start_acking_timer()
 void Session::stop_acking_timer()
 {
     if (send_ack_timer) {
-        logger.debug("disarming send ack timer01");
-        us->ops->axe_timer(send_ack_timer, us->ops->bare_sender_data);
+        NP1SEC_LOG_DEBUG("disarming send ack timer01");
+        us->axe_timer(send_ack_timer);
         send_ack_timer = nullptr;
     }
     // for (std::map<std::string, Participant>::iterator
@@ -1141,18 +1612,87 @@ void Session::stop_acking_timer()
     // }
 }
 
-void Session::stop_timer_receive(std::string acknowledger_id, MessageId message_id)
+uint32_t Session::ack_interval()
 {
+    uint32_t room_size_factor = 1;
+    for (size_t others = participants.size() > 1 ? participants.size() - 1 : 0; others > 1; others >>= 1)
+        room_size_factor++;
+
+    return us->ops->c_ack_interval * room_size_factor;
+}
+
+uint32_t Session::consistency_failure_interval()
+{
+    return adapted_interval(us->ops->c_consistency_failure_interval) + ack_interval() - us->ops->c_ack_interval;
+}
+
+uint32_t Session::adapted_interval(uint32_t configured_interval)
+{
+    if (!us->ops->c_adaptive_intervals)
+        return configured_interval;
+
+    auto session_room = us->chatrooms.find(room_name);
+    if (session_room == us->chatrooms.end() || !session_room->second.get_broadcast_latency().sample_count)
+        return configured_interval;
+
+    uint32_t configured_allowance = std::min(configured_interval, 2 * us->ops->c_broadcast_latency);
+    return configured_interval - configured_allowance + session_room->second.get_broadcast_latency().allowance();
+}
 
-    for (MessageId i = participants[acknowledger_id].last_acked_message_id + 1; i <= message_id; i++) {
-        if (received_transcript_chain[message_id][participants[acknowledger_id].index].consistency_timer)
-            us->ops->axe_timer(
-                received_transcript_chain[message_id][participants[acknowledger_id].index].consistency_timer,
-                us->ops->bare_sender_data);
-        received_transcript_chain[message_id][participants[acknowledger_id].index].consistency_timer = nullptr;
+/**
+ * An ack covers the whole prefix of the transcript up to message_id,
+ * so all timers waiting on the acknowledger up to there are defused
+ */
+void Session::stop_timer_receive(std::string acknowledger_id, MessageId message_id)
+{
+    size_t acknowledger_index = participants[acknowledger_id].index;
+    for (auto acked_block = received_transcript_chain.upper_bound(participants[acknowledger_id].last_acked_message_id);
+         acked_block != received_transcript_chain.end() && acked_block->first <= message_id; ++acked_block) {
+        acked_block->second.clear_ack(acknowledger_index);
     }
 
-    participants[acknowledger_id].last_acked_message_id = message_id;
+    if (message_id > participants[acknowledger_id].last_acked_message_id)
+        participants[acknowledger_id].last_acked_message_id = message_id;
+
+    checkpoint_transcript();
+}
+
+void Session::checkpoint_transcript()
+{
+    if (received_transcript_chain.empty())
+        return;
+
+    // the farewells are checked against the transcript as of our leave
+    MessageId checkpoint = my_state == LEAVE_REQUESTED ? leave_parent : received_transcript_chain.rbegin()->first;
+    for (auto& cur_participant : participants)
+        if (cur_participant.first != myself.nickname)
+            checkpoint = std::min(checkpoint, cur_participant.second.last_acked_message_id);
+
+    received_transcript_chain.erase(received_transcript_chain.begin(),
+                                    received_transcript_chain.lower_bound(checkpoint));
+
+    size_t max_transcript_blocks = us->ops->c_max_transcript_blocks;
+    if (!max_transcript_blocks || received_transcript_chain.size() <= max_transcript_blocks)
+        return;
+
+    logger.warn("transcript reached " + std::to_string(max_transcript_blocks) +
+                    " blocks, dropping unacked ones as of " + std::to_string(received_transcript_chain.begin()->first),
+                __FUNCTION__, myself.nickname);
+    // their deadlines are skipped once the blocks are gone
+    while (received_transcript_chain.size() > max_transcript_blocks)
+        received_transcript_chain.erase(received_transcript_chain.begin());
+}
+
+size_t Session::transcript_footprint() const
+{
+    size_t footprint = 0;
+    for (auto& cur_block : received_transcript_chain)
+        footprint += sizeof(cur_block.first) + cur_block.second.footprint();
+
+    for (auto& cur_block : sent_transcript_chain)
+        footprint += sizeof(cur_block);
+
+    return footprint;
 }
 
 /**
@@ -1161,14 +1701,12 @@ void Session::stop_timer_receive(std::string acknowledger_id, MessageId message_
  */
 void Session::update_send_transcript_chain(MessageId own_message_id, std::string message)
 {
-    HashBlock hb;
-    hash(message, hb, true);
-    sent_transcript_chain[own_message_id].transcript_hash = hash_to_string_buff(hb);
-    sent_transcript_chain[own_message_id].ack_timer_ops = AckTimerOps(this, nullptr, own_message_id);
+    SentConsistencyBlock& sent_block = sent_transcript_chain[own_message_id];
+    hash(message, sent_block.transcript_hash, true);
+    sent_block.sent_at = std::chrono::steady_clock::now();
 
-    sent_transcript_chain[own_message_id].consistency_timer =
-        us->ops->set_timer(cb_ack_not_sent, &(sent_transcript_chain[own_message_id].ack_timer_ops),
-                           us->ops->c_send_receive_interval, us->ops->bare_sender_data);
+    sent_block.consistency_timer =
+        us->set_timer(cb_ack_not_sent, this, adapted_interval(us->ops->c_send_receive_interval));
 }
 
 /**
@@ -1181,17 +1719,43 @@ void Session::perform_received_consisteny_tasks(Message received_message)
 {
     // defuse the "I didn't get my own message timer
     if (received_message.sender_nick == myself.nickname) {
-        logger.debug("own ctr of received message: " + std::to_string(own_message_counter), __FUNCTION__,
-                     myself.nickname);
-        if (sent_transcript_chain[received_message.sender_message_id]
-                .consistency_timer) { // the timer might legitemately has been killed due to suicide
-            us->ops->axe_timer(sent_transcript_chain[received_message.sender_message_id].consistency_timer,
-                               us->ops->bare_sender_data);
-            sent_transcript_chain[received_message.sender_message_id].consistency_timer = nullptr;
+        NP1SEC_LOG_DEBUG("own ctr of received message: " + std::to_string(own_message_counter), __FUNCTION__,
+                         myself.nickname);
+        auto sent_block = sent_transcript_chain.find(received_message.sender_message_id);
+        if (sent_block != sent_transcript_chain.end()) {
+            if (sent_block->second.consistency_timer) { // the timer might legitemately has been killed due to suicide
+                us->axe_timer(sent_block->second.consistency_timer);
+                sent_block->second.consistency_timer = nullptr;
+            }
+
+            // the round trip of the broadcast, which the intervals adapt to
+            auto session_room = us->chatrooms.find(room_name);
+            if (session_room != us->chatrooms.end())
+                session_room->second.add_broadcast_latency_sample(static_cast<uint32_t>(
+                    std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                                                          sent_block->second.sent_at)
+                        .count()));
+        }
+
+        // our messages come back in order, so an earlier one whose timer is
+        // still armed is never coming back. We report it now rather than
+        // when its timer would have gone off, as disarm_all_timers won't
+        // see the timers of the dropped blocks
+        auto returned_blocks_end = sent_transcript_chain.lower_bound(received_message.sender_message_id);
+        for (auto cur_block = sent_transcript_chain.begin(); cur_block != returned_blocks_end; cur_block++) {
+            if (cur_block->second.consistency_timer) {
+                us->axe_timer(cur_block->second.consistency_timer);
+                us->ops->display_message(room_name, "np1sec directive", c_own_message_lost_message, us);
+                logger.error(c_own_message_lost_message + " " + std::to_string(cur_block->first), __FUNCTION__,
+                             myself.nickname);
+                metrics.counters.consistency_failures++;
+            }
         }
+        sent_transcript_chain.erase(sent_transcript_chain.begin(), returned_blocks_end);
     }
 
     add_message_to_transcript(received_message.final_whole_message, received_message.message_id);
+    checkpoint_transcript();
 
     // it needs to be called after add as it assumes it is already added
     start_ack_timers(received_message);
@@ -1203,20 +1767,27 @@ void Session::perform_received_consisteny_tasks(Message received_message)
  */
 void Session::check_parent_message_consistency(Message received_message)
 {
-    received_transcript_chain[received_message.parent_id][participants[received_message.sender_nick].index]
-        .transcript_hash = received_message.transcript_chain_hash;
+    // the parent is before our time in the session or checkpointed away,
+    // nothing to compare with but it still acks what we have
+    auto parent_block = received_transcript_chain.find(received_message.parent_id);
+    if (parent_block == received_transcript_chain.end()) {
+        stop_timer_receive(received_message.sender_nick, received_message.parent_id);
+        return;
+    }
+
+    size_t sender_index = participants[received_message.sender_nick].index;
+    parent_block->second.set_hash(sender_index, received_message.transcript_chain_hash);
 
-    if (received_transcript_chain[received_message.parent_id][my_index].transcript_hash !=
-        received_transcript_chain[received_message.parent_id][participants[received_message.sender_nick].index]
-            .transcript_hash) {
+    if (!parent_block->second.hash_matches(my_index, sender_index)) {
         std::string consistency_failure_message = received_message.sender_nick +
                                                   " transcript doesn't match ours as of " +
                                                   std::to_string(received_message.parent_id);
         us->ops->display_message(room_name, "np1sec directive", consistency_failure_message, us);
         logger.error(consistency_failure_message, __FUNCTION__, myself.nickname);
+        metrics.counters.consistency_failures++;
     }
 
-    stop_timer_receive(received_message.sender_nick, received_message.message_id);
+    stop_timer_receive(received_message.sender_nick, received_message.parent_id);
 }
 
 /**
@@ -1225,23 +1796,25 @@ void Session::check_parent_message_consistency(Message received_message)
 bool Session::check_leave_transcript_consistency()
 {
     uint32_t no_of_peers_farewelled = 0;
-    if (received_transcript_chain.find(leave_parent) != received_transcript_chain.end()) {
-        for (uint32_t i = 0; i < peers.size(); i++) {
+    auto leave_block = received_transcript_chain.find(leave_parent);
+    if (leave_block != received_transcript_chain.end()) {
+        for (uint32_t i = 0; i < leave_block->second.size(); i++) {
 
             // we need to check if we have already got the farewell from this peer
-            if (!received_transcript_chain[leave_parent][i].transcript_hash.empty()) {
+            if (leave_block->second.has_hash(i)) {
                 no_of_peers_farewelled++;
-                if (received_transcript_chain[leave_parent][i].transcript_hash !=
-                    received_transcript_chain[leave_parent][my_index].transcript_hash) {
-                    std::string consistency_failure_message = peers[i] + " transcript doesn't match ours";
+                if (!leave_block->second.hash_matches(my_index, i)) {
+                    std::string consistency_failure_message =
+                        participants.by_index(i).id.nickname + " transcript doesn't match ours";
                     us->ops->display_message(room_name, "np1sec directive", consistency_failure_message, us);
                     logger.error(consistency_failure_message, __FUNCTION__, myself.nickname);
+                    metrics.counters.consistency_failures++;
                 } // not equal
             } // not empty
         } // for
     } // we got it already
 
-    return (no_of_peers_farewelled == peers.size());
+    return (no_of_peers_farewelled == participants.size());
 }
 
 void Session::add_message_to_transcript(std::string message, MessageId message_id)
@@ -1251,7 +1824,7 @@ void Session::add_message_to_transcript(std::string message, MessageId message_i
     std::string pointlessconversion;
 
     if (received_transcript_chain.size() > 0) {
-        ss << received_transcript_chain.rbegin()->second[my_index].transcript_hash;
+        ss << received_transcript_chain.rbegin()->second.hash(my_index);
         ss >> pointlessconversion;
         pointlessconversion += c_np1sec_delim + message;
 
@@ -1261,13 +1834,9 @@ void Session::add_message_to_transcript(std::string message, MessageId message_i
 
     hash(pointlessconversion, hb);
 
-    if (received_transcript_chain.find(message_id) == received_transcript_chain.end()) {
-        ConsistencyBlockVector chain_block(participants.size());
-        received_transcript_chain.insert(std::pair<MessageId, ConsistencyBlockVector>(message_id, chain_block));
-    }
-
-    (received_transcript_chain[message_id])[my_index].transcript_hash = hash_to_string_buff(hb);
-    received_transcript_chain[message_id][my_index].consistency_timer = nullptr;
+    auto chain_block =
+        received_transcript_chain.emplace(message_id, ConsistencyBlock(participants.size())).first;
+    chain_block->second.set_hash(my_index, hb);
 }
 
 void Session::send(std::string message, Message::MessageSubType message_type)
@@ -1279,72 +1848,354 @@ void Session::send(std::string message, Message::MessageSubType message_type)
     }
 
     Message outbound(&cryptic);
-    logger.debug("own ctr before send: " + std::to_string(own_message_counter), __FUNCTION__, myself.nickname);
+    outbound.protocol_version = us->ops->c_in_session_protocol_version;
+    use_message_keys(outbound);
+    NP1SEC_LOG_DEBUG("own ctr before send: " + std::to_string(own_message_counter), __FUNCTION__, myself.nickname);
+
+    // compact user messages carry the head of the transcript hash except
+    // every c_full_transcript_hash_period one. Acks and leaves are what the
+    // consistency checks rely on, so they always carry the full hash.
+    HashStdBlock transcript_hash = received_transcript_chain.rbegin()->second.hash(my_index);
+    bool truncates_transcript_hash = outbound.is_compact() && message_type == Message::USER_MESSAGE &&
+                                     truncated_hashes_since_full_hash + 1 < c_full_transcript_hash_period;
+    if (truncates_transcript_hash)
+        transcript_hash.resize(std::min(transcript_hash.size(), c_truncated_transcript_hash_length));
+
+    // the successor material rides on whatever we say next
+    if (successor_prepared && !successor_material_sent &&
+        (message_type == Message::USER_MESSAGE || message_type == Message::JUST_ACK)) {
+        outbound.next_session_ephemeral_key =
+            public_key_to_stringbuff(successor_future_cryptic.get_ephemeral_pub_key());
+        outbound.next_session_key_share = successor_key_share;
+    }
 
-    outbound.create_in_session_msg(session_id, my_index, own_message_counter + 1, last_received_message_id,
-                                   received_transcript_chain.rbegin()->second[my_index].transcript_hash, message_type,
-                                   message
-                                   // no in session forward secrecy for now
-                                   );
+    // we only seal the message once we know it doesn't need fragmenting,
+    // so oversized messages aren't encrypted and signed twice
+    outbound.cook_in_session_msg(session_id, my_index, own_message_counter + 1, last_received_message_id,
+                                 transcript_hash, message_type, message);
 
-    // us->ops->send_bare(room_name, outbound);
-    outbound.send(room_name, us);
+    std::string transcript_entry;
+    if (message_type == Message::USER_MESSAGE && max_fragment_size && outbound.sealed_length() > max_fragment_size) {
+        // the material waits for a message which is not fragmented
+        transcript_entry = send_fragmented(message, transcript_hash);
+    } else {
+        outbound.append_msg_end(true);
+        // us->ops->send_bare(room_name, outbound);
+        broadcast(outbound);
+        transcript_entry = outbound.compute_hash();
+        successor_material_sent = successor_material_sent || !outbound.next_session_key_share.empty();
+    }
 
     // if everything went well add the counter
     own_message_counter++;
 
-    logger.info("own ctr after send: " + std::to_string(own_message_counter), __FUNCTION__, myself.nickname);
+    if (truncates_transcript_hash) {
+        truncated_hashes_since_full_hash++;
+    } else if (outbound.is_compact() && message_type == Message::USER_MESSAGE) {
+        truncated_hashes_since_full_hash = 0;
+        metrics.counters.full_transcript_hashes_sent++;
+    }
+
+    // the parent id of any message acks everything we have received so far
+    if (message_type == Message::JUST_ACK) {
+        ack_counters.standalone_acks_sent++;
+    } else if (message_type == Message::USER_MESSAGE) {
+        ack_counters.user_messages_sent++;
+        if (unacked_user_messages)
+            ack_counters.piggybacked_acks++;
+    }
+    unacked_user_messages = 0;
+
+    NP1SEC_LOG_INFO("own ctr after send: " + std::to_string(own_message_counter), __FUNCTION__, myself.nickname);
 
-    update_send_transcript_chain(own_message_counter, outbound.compute_hash());
+    update_send_transcript_chain(own_message_counter, transcript_entry);
     // As we're sending a new message we are no longer required to ack
     // any received messages till we receive a new message
     stop_acking_timer();
 }
 
+std::string Session::send_fragmented(const std::string& message, const HashStdBlock& transcript_hash)
+{
+    if (message.size() > c_max_reassembled_message_size) {
+        logger.error("user message of " + std::to_string(message.size()) + " bytes is too long to be reassembled",
+                     __FUNCTION__, myself.nickname);
+        throw InvalidDataException();
+    }
+
+    // the fragment overhead doesn't depend on the fragment, so we measure
+    // it on an empty one, which needn't be sealed for that. GCM doesn't
+    // pad so only base64 rounds it up.
+    Message empty_fragment(&cryptic);
+    empty_fragment.protocol_version = us->ops->c_in_session_protocol_version;
+    use_message_keys(empty_fragment);
+    empty_fragment.no_of_fragments = 1;
+    empty_fragment.cook_in_session_msg(session_id, my_index, own_message_counter + 1, last_received_message_id,
+                                       transcript_hash, Message::USER_MESSAGE_FRAGMENT, "");
+
+    size_t fragment_overhead = empty_fragment.sealed_length();
+    size_t fragment_capacity =
+        fragment_overhead < max_fragment_size ? 3 * ((max_fragment_size - fragment_overhead) / 4) : 0;
+    if (!fragment_capacity ||
+        (message.size() + fragment_capacity - 1) / fragment_capacity > std::numeric_limits<DTShort>::max()) {
+        logger.error("max message size " + std::to_string(max_fragment_size) + " is too small to fragment into",
+                     __FUNCTION__, myself.nickname);
+        throw InvalidDataException();
+    }
+
+    DTShort no_of_fragments = (message.size() + fragment_capacity - 1) / fragment_capacity;
+    std::string fragment_hashes;
+    for (DTShort i = 0; i < no_of_fragments; i++) {
+        Message fragment(&cryptic);
+        fragment.protocol_version = us->ops->c_in_session_protocol_version;
+        use_message_keys(fragment);
+        fragment.fragment_index = i;
+        fragment.no_of_fragments = no_of_fragments;
+        fragment.create_in_session_msg(session_id, my_index, own_message_counter + 1, last_received_message_id,
+                                       transcript_hash, Message::USER_MESSAGE_FRAGMENT,
+                                       message.substr(i * fragment_capacity, fragment_capacity));
+        broadcast(fragment);
+        fragment_hashes += fragment.compute_hash();
+    }
+
+    NP1SEC_LOG_DEBUG("sent user message in " + std::to_string(no_of_fragments) + " fragments", __FUNCTION__,
+                     myself.nickname);
+    return fragment_hashes;
+}
+
+bool Session::reassemble(Message& fragment)
+{
+    FragmentReassembly& reassembly = reassembly_buffers[fragment.sender_index];
+    if (fragment.fragment_index == 0) {
+        if (reassembly.no_of_fragments)
+            logger.warn("dropping incomplete message from " + fragment.sender_nick, __FUNCTION__, myself.nickname);
+        reassembly = FragmentReassembly();
+        reassembly.sender_message_id = fragment.sender_message_id;
+        reassembly.no_of_fragments = fragment.no_of_fragments;
+    }
+
+    if (reassembly.sender_message_id != fragment.sender_message_id ||
+        reassembly.no_of_fragments != fragment.no_of_fragments ||
+        reassembly.next_fragment_index != fragment.fragment_index ||
+        reassembly.user_message.size() + fragment.user_message.size() > c_max_reassembled_message_size) {
+        logger.warn("dropping out of order or oversized fragment from " + fragment.sender_nick, __FUNCTION__,
+                    myself.nickname);
+        reassembly_buffers.erase(fragment.sender_index);
+        return false;
+    }
+
+    reassembly.user_message += fragment.user_message;
+    reassembly.fragment_hashes += fragment.compute_hash();
+    if (++reassembly.next_fragment_index < reassembly.no_of_fragments)
+        return false;
+
+    fragment.message_sub_type = Message::USER_MESSAGE;
+    fragment.user_message = reassembly.user_message;
+    fragment.final_whole_message = reassembly.fragment_hashes;
+    reassembly_buffers.erase(fragment.sender_index);
+
+    return true;
+}
+
+size_t Session::transfer_chunk_size()
+{
+    if (!max_fragment_size)
+        return c_transfer_chunk_size;
+
+    // as with fragments, we measure the overhead on an empty chunk, which
+    // is sealed into just the tag
+    Message empty_chunk(&cryptic);
+    empty_chunk.create_transfer_chunk_msg(session_id, std::string(c_transfer_id_length, '\0'), 0, false,
+                                          std::string(c_chunk_tag_length, '\0'));
+
+    size_t chunk_overhead = empty_chunk.final_whole_message.size();
+    if (chunk_overhead >= max_fragment_size) {
+        logger.error("max message size " + std::to_string(max_fragment_size) + " is too small to send chunks in",
+                     __FUNCTION__, myself.nickname);
+        throw InvalidDataException();
+    }
+
+    return std::min(c_transfer_chunk_size, 3 * ((max_fragment_size - chunk_overhead) / 4));
+}
+
+OutgoingTransfer& Session::outgoing_transfer(const std::string& transfer_id)
+{
+    auto transfer = outgoing_transfers.find(transfer_id);
+    if (my_state != IN_SESSION || transfer == outgoing_transfers.end()) {
+        // most likely the session has changed since the transfer began
+        logger.error("no such transfer in the session", __FUNCTION__, myself.nickname);
+        throw InvalidDataException();
+    }
+
+    return transfer->second;
+}
+
+void Session::send_chunk(const std::string& transfer_id, OutgoingTransfer& transfer, bool last_chunk,
+                         const std::string& chunk)
+{
+    Message outbound(&cryptic);
+    outbound.create_transfer_chunk_msg(session_id, transfer_id, transfer.next_chunk_index, last_chunk,
+                                       transfer.cipher.seal(transfer.next_chunk_index, last_chunk, chunk));
+    broadcast(outbound);
+    transfer.next_chunk_index++;
+}
+
+std::string Session::begin_transfer()
+{
+    if (my_state != IN_SESSION) {
+        logger.error("you can't begin a transfer in a session which is not established", __FUNCTION__,
+                     myself.nickname);
+        throw InvalidSessionStateException();
+    }
+
+    std::string transfer_id(c_transfer_id_length, '\0');
+    gcry_randomize(&transfer_id[0], c_transfer_id_length, GCRY_STRONG_RANDOM);
+    outgoing_transfers.emplace(transfer_id, OutgoingTransfer(ChunkCipher(session_key, myself.nickname + transfer_id),
+                                                             transfer_chunk_size()));
+
+    return transfer_id;
+}
+
+void Session::write_transfer(const std::string& transfer_id, const std::string& data)
+{
+    OutgoingTransfer& transfer = outgoing_transfer(transfer_id);
+    transfer.pending += data;
+
+    // a full chunk is held back till there is more, as it might be the
+    // last one
+    size_t sent = 0;
+    for (; transfer.pending.size() - sent > transfer.chunk_size; sent += transfer.chunk_size)
+        send_chunk(transfer_id, transfer, false, transfer.pending.substr(sent, transfer.chunk_size));
+
+    transfer.pending.erase(0, sent);
+}
+
+void Session::finish_transfer(const std::string& transfer_id)
+{
+    OutgoingTransfer& transfer = outgoing_transfer(transfer_id);
+    send_chunk(transfer_id, transfer, true, transfer.pending);
+    outgoing_transfers.erase(transfer_id);
+}
+
+Session::StateAndAction Session::receive_transfer_chunk(Message received_message)
+{
+    // the signature is already verified by state_handler. Our own chunks
+    // only come back to us
+    if (received_message.sender_nick == myself.nickname)
+        return StateAndAction(my_state, c_no_room_action);
+
+    std::string transfer_context = received_message.sender_nick + received_message.transfer_id;
+    auto transfer = incoming_transfers.find(transfer_context);
+    if (transfer == incoming_transfers.end()) {
+        if (received_message.chunk_index || incoming_transfers.size() >= c_max_incoming_transfers) {
+            logger.warn("dropping chunk of unknown transfer from " + received_message.sender_nick, __FUNCTION__,
+                        myself.nickname);
+            return StateAndAction(my_state, c_no_room_action);
+        }
+
+        transfer =
+            incoming_transfers.emplace(transfer_context, IncomingTransfer(ChunkCipher(session_key, transfer_context)))
+                .first;
+    }
+
+    std::string chunk;
+    if (received_message.chunk_index != transfer->second.next_chunk_index ||
+        !transfer->second.cipher.open(received_message.chunk_index, received_message.last_chunk,
+                                      received_message.sealed_chunk, chunk)) {
+        logger.warn("dropping transfer from " + received_message.sender_nick + " with out of order or forged chunk",
+                    __FUNCTION__, myself.nickname);
+        incoming_transfers.erase(transfer);
+        return StateAndAction(my_state, c_no_room_action);
+    }
+
+    transfer->second.next_chunk_index++;
+    if (received_message.last_chunk)
+        incoming_transfers.erase(transfer);
+
+    if (us->ops->receive_chunk)
+        us->ops->receive_chunk(room_name, received_message.sender_nick, received_message.transfer_id,
+                               received_message.chunk_index, chunk, received_message.last_chunk,
+                               us->ops->bare_sender_data);
+
+    return StateAndAction(my_state, c_no_room_action);
+}
+
 Session::StateAndAction Session::receive(Message encrypted_message)
 {
+    NP1SEC_PROBE(PROBE_SESSION_RECEIVE);
 
     // we need to receive it again, as now we have the encryption key
-    Message received_message(encrypted_message.final_whole_message, &cryptic, participants.size());
+    Message received_message(&cryptic);
+    received_message.no_of_participants = participants.size();
+    use_message_keys(received_message);
+    if (received_message.parse(encrypted_message.final_whole_message) != PARSE_OK) {
+        logger.warn("dropping malformed in session message", __FUNCTION__, myself.nickname);
+        return StateAndAction(my_state, c_no_room_action);
+    }
 
     // check signature if not valid, just ignore the message
     // first we need to get the correct ephemeral key
-    if (received_message.sender_index < peers.size()) {
-        if (received_message.verify_message(participants[peers[received_message.sender_index]].ephemeral_key)) {
+    if (received_message.sender_index < participants.size()) {
+        Participant& sender = participants.by_index(received_message.sender_index);
+        metrics.counters.signature_verifications++;
+        if (received_message.verify_message(sender.ephemeral_key)) {
+            // the key of the message has served its purpose
+            if (received_message.key_ratchet)
+                message_key_ratchet.forget_up_to(received_message.sender_index, received_message.sender_message_id);
+
+            // a fragment only counts once the whole message is there
+            received_message.sender_nick = sender.id.nickname;
+            if (received_message.message_sub_type == Message::USER_MESSAGE_FRAGMENT && !reassemble(received_message))
+                return StateAndAction(my_state, c_no_room_action);
+
             // only messages with valid signature are concidered received
             // for any matters including consistency chcek
             last_received_message_id++;
+            // the transcript is indexed by our session local order, the same
+            // order which the parent id of the messages refer to
+            received_message.message_id = last_received_message_id;
             received_message.sender_nick =
-                peers[received_message.sender_index]; // just to keep the message structure consistent, and for the use
-                                                      // in new session (like session resulted from leave) otherwise in
-                                                      // the session we should just use the index
+                sender.id.nickname; // just to keep the message structure consistent, and for the use
+                                    // in new session (like session resulted from leave) otherwise in
+                                    // the session we should just use the index
             perform_received_consisteny_tasks(received_message);
+            if (received_message.sender_nick != myself.nickname)
+                check_parent_message_consistency(received_message);
+
             if (my_state == LEAVE_REQUESTED) {
                 if (check_leave_transcript_consistency()) { // we are done we can leave
                     // stop the farewell deadline timer
                     if (farewell_deadline_timer) {
-                        us->ops->axe_timer(farewell_deadline_timer, us->ops->bare_sender_data);
+                        us->axe_timer(farewell_deadline_timer);
                         farewell_deadline_timer = nullptr;
                     }
 
-                    peers.pop_back();
-                    us->ops->leave(room_name, peers, us->ops->bare_sender_data);
+                    std::vector<std::string> staying_nicks = participants.nicknames();
+                    staying_nicks.erase(staying_nicks.begin() + my_index);
+                    us->ops->leave(room_name, staying_nicks, us->ops->bare_sender_data);
                     commit_suicide();
                     StateAndAction(DEAD, c_no_room_action);
                 }
             }
             // if it is user message, display content
             else if (received_message.message_sub_type == Message::USER_MESSAGE) {
-                us->ops->display_message(room_name, participants[peers[received_message.sender_index]].id.nickname,
+                us->ops->display_message(room_name, sender.id.nickname,
                                          received_message.user_message, us->ops->bare_sender_data);
 
-                start_acking_timer(); // if we don't send any message for a while we'll
-                // ack all messages
+                // our own message needs no ack from us, for others' if we don't
+                // send any message for a while we'll ack all messages at once
+                if (received_message.sender_nick != myself.nickname) {
+                    ack_counters.user_messages_received++;
+                    unacked_user_messages++;
+                    start_acking_timer();
+                }
             } else if ((received_message.message_sub_type == Message::LEAVE_MESSAGE) &&
                        (received_message.sender_nick != myself.nickname) && my_state != DEAD) {
                 return send_farewell_and_reshare(received_message);
             }
 
+            if (!received_message.next_session_key_share.empty())
+                return StateAndAction(my_state, receive_successor_material(received_message));
+
         } else
             received_message.message_type = Message::INADMISSIBLE;
 
@@ -1360,13 +2211,52 @@ Session::StateAndAction Session::receive(Message encrypted_message)
  */
 ParticipantMap Session::future_participants()
 {
+    // the future keys are made once, all the sessions we breed share them
+    for (auto& cur_participant : participants)
+        cur_participant.second.make_future_ephemeral_key();
+
     ParticipantMap live_participants = participants - zombies;
     for (auto& cur_participant : live_participants)
-        cur_participant.second.set_ephemeral_key(cur_participant.second.future_raw_ephemeral_key);
+        cur_participant.second.adopt_future_ephemeral_key();
 
     return live_participants;
 }
 
+RatchetTree Session::future_key_tree()
+{
+    RatchetTree future_tree(key_tree);
+    for (auto& cur_zombie : zombies)
+        future_tree.remove_leaf(cur_zombie.first);
+
+    for (auto& cur_participant : participants) {
+        if (zombies.find(cur_participant.first) != zombies.end())
+            continue;
+
+        const std::string& leaf_key = cur_participant.second.future_leaf_key;
+        if (leaf_key.empty()) {
+            future_tree.remove_leaf(cur_participant.first);
+            continue;
+        }
+
+        if (!future_tree.has_leaf(cur_participant.first))
+            future_tree.add_leaf(cur_participant.first, leaf_key);
+
+        future_tree.set_leaf_key(cur_participant.first, leaf_key,
+                                 cur_participant.first == myself.nickname ? future_leaf_secret : HashStdBlock());
+    }
+
+    return future_tree;
+}
+
+std::string Session::commit_to_key_tree()
+{
+    if (!key_tree.has_leaf(myself.nickname))
+        key_tree.add_leaf(myself.nickname, "");
+
+    key_tree_committed = true;
+    return key_tree.commit(myself.nickname, session_id.get_as_stringbuff());
+}
+
 /**
  * returns participants - parental_participants
  * it shows what is the session suppose to add or
@@ -1384,6 +2274,7 @@ void Session::commit_suicide()
     // we try to send a last ack, if it fails no big deal
 
     disarm_all_timers();
+    successor_material.clear();
     my_state = DEAD;
 }
 
@@ -1393,25 +2284,28 @@ void Session::commit_suicide()
 void Session::disarm_all_timers()
 {
     if (farewell_deadline_timer)
-        us->ops->axe_timer(farewell_deadline_timer, us->ops->bare_sender_data);
+        us->axe_timer(farewell_deadline_timer);
     if (send_ack_timer)
-        us->ops->axe_timer(send_ack_timer, us->ops->bare_sender_data);
+        us->axe_timer(send_ack_timer);
 
     if (rejoin_timer)
-        us->ops->axe_timer(rejoin_timer, us->ops->bare_sender_data);
+        us->axe_timer(rejoin_timer);
 
     if (session_life_timer)
-        us->ops->axe_timer(session_life_timer, us->ops->bare_sender_data);
+        us->axe_timer(session_life_timer);
 
-    for (auto& cur_block : received_transcript_chain)
-        for (auto& cur_participant : cur_block.second)
-            if (cur_participant.consistency_timer) {
-                us->ops->axe_timer(cur_participant.consistency_timer, us->ops->bare_sender_data);
-            }
+    if (join_batch_timer)
+        us->axe_timer(join_batch_timer);
+
+    if (leave_batch_timer)
+        us->axe_timer(leave_batch_timer);
+
+    if (ack_deadline_timer)
+        us->axe_timer(ack_deadline_timer);
 
     for (auto& cur_block : sent_transcript_chain)
         if (cur_block.second.consistency_timer) {
-            us->ops->axe_timer(cur_block.second.consistency_timer, us->ops->bare_sender_data);
+            us->axe_timer(cur_block.second.consistency_timer);
         }
 
     clear_all_timers();
@@ -1427,10 +2321,10 @@ void Session::clear_all_timers()
     send_ack_timer = nullptr;
     rejoin_timer = nullptr;
     session_life_timer = nullptr;
+    join_batch_timer = nullptr;
+    leave_batch_timer = nullptr;
 
-    for (auto& cur_block : received_transcript_chain)
-        for (auto& cur_participant : cur_block.second)
-            cur_participant.consistency_timer = nullptr;
+    ack_deadline_timer = nullptr;
 
     for (auto& cur_block : sent_transcript_chain)
         cur_block.second.consistency_timer = nullptr;
@@ -1441,11 +2335,10 @@ void Session::clear_all_timers()
  */
 void Session::arm_rejoin_timer()
 {
-    logger.assert_or_die(!rejoin_timer, "no re-arming the rejoin timer!", __FUNCTION__,
+    NP1SEC_ASSERT_OR_DIE(!rejoin_timer, "no re-arming the rejoin timer!", __FUNCTION__,
                          myself.nickname); // we shouldn't rearm rejoin timer
-    logger.debug("arming rejoin timer, in case we can't join successfully", __FUNCTION__, myself.nickname);
-    rejoin_timer =
-        us->ops->set_timer(cb_rejoin, this, us->ops->c_unresponsive_ergo_non_sum_interval, us->ops->bare_sender_data);
+    NP1SEC_LOG_DEBUG("arming rejoin timer, in case we can't join successfully", __FUNCTION__, myself.nickname);
+    rejoin_timer = us->set_timer(cb_rejoin, this, adapted_interval(us->ops->c_unresponsive_ergo_non_sum_interval));
 }
 
 Session::~Session()
@@ -1454,9 +2347,13 @@ Session::~Session()
     secure_wipe(session_key_secret_share, c_hash_length);
     secure_wipe(session_key, c_hash_length);
     secure_wipe(session_confirmation, c_hash_length);
-    logger.debug("Wiped session_key_secret_share from Session");
-    logger.debug("Wiped session_key from Session");
-    logger.debug("Wiped session_confirmation from Session");
+    if (!future_leaf_secret.empty())
+        secure_wipe(&future_leaf_secret[0], future_leaf_secret.size());
+    if (!successor_key_share.empty())
+        secure_wipe(&successor_key_share[0], successor_key_share.size());
+    NP1SEC_LOG_DEBUG("Wiped session_key_secret_share from Session");
+    NP1SEC_LOG_DEBUG("Wiped session_key from Session");
+    NP1SEC_LOG_DEBUG("Wiped session_confirmation from Session");
 
     // commit_suicide(); //just to kill all timers
     // we can't commit suicide because our copy constructor
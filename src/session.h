@@ -19,8 +19,11 @@
 #ifndef SRC_SESSION_H_
 #define SRC_SESSION_H_
 
+#include <chrono>
 #include <iostream>
 #include <map>
+#include <queue>
+#include <set>
 #include <string>
 #include <vector>
 #include <utility>
@@ -32,6 +35,8 @@
 #include "src/message.h"
 #include "src/crypt.h"
 #include "src/session_id.h"
+#include "src/ratchet_tree.h"
+#include "src/session_metrics.h"
 
 #include "src/transcript_consistency.h"
 
@@ -122,6 +127,44 @@ struct RaisonDEtre {
     }
 };
 
+/**
+ * Collects the fragments of the user message a peer is in the middle of
+ * sending. A peer sends the fragments of a message back to back, so one
+ * buffer per peer is enough.
+ */
+struct FragmentReassembly {
+    MessageId sender_message_id = 0;
+    DTShort next_fragment_index = 0;
+    DTShort no_of_fragments = 0;
+    std::string user_message;
+    std::string fragment_hashes; // the transcript entry of the whole message
+};
+
+/**
+ * A transfer we are streaming to the session. Whatever is written to it
+ * is sent in chunks of chunk_size, the remainder waits for more data or
+ * for the transfer to be finished.
+ */
+struct OutgoingTransfer {
+    ChunkCipher cipher;
+    size_t chunk_size;
+    DTLength next_chunk_index = 0;
+    std::string pending;
+
+    OutgoingTransfer(const ChunkCipher& cipher, size_t chunk_size) : cipher(cipher), chunk_size(chunk_size) {}
+};
+
+/**
+ * A transfer a peer is streaming to the session, of which we have
+ * delivered the chunks before next_chunk_index.
+ */
+struct IncomingTransfer {
+    ChunkCipher cipher;
+    DTLength next_chunk_index = 0;
+
+    explicit IncomingTransfer(const ChunkCipher& cipher) : cipher(cipher) {}
+};
+
 // Defining essential types
 typedef uint8_t np1secBareMessage[];
 
@@ -156,7 +199,7 @@ class Session
     /**
      * Stores Transcritp chain hashes indexed by received message id
      */
-    std::map<MessageId, ConsistencyBlockVector> received_transcript_chain;
+    std::map<MessageId, ConsistencyBlock> received_transcript_chain;
 
     /**
      * Stores the Transcript chain of hashes of all sent messages by the
@@ -168,7 +211,14 @@ class Session
      * We also update message id, and we check for the consistency for
      * the orders of own_message_id and the message_id
      */
-    std::map<MessageId, ParticipantConsistencyBlock> sent_transcript_chain;
+    std::map<MessageId, SentConsistencyBlock> sent_transcript_chain;
+
+    /**
+     * The ack deadlines of the received messages, earliest first. They
+     * are not removed when the acks come in, the host timer just skips
+     * the ones which are no longer pending when it gets to them.
+     */
+    std::priority_queue<AckDeadline, std::vector<AckDeadline>, std::greater<AckDeadline>> ack_deadlines;
 
     /**
      * Inserts a block in the send transcript chain and start a
@@ -211,17 +261,10 @@ class Session
     ParticipantMap parental_participants;
 
     /**
-     * Keeps the list of the live participants in the room and their current/new
-     * keys/shares, last heartbeat, etc. The correct way of uisng this array is
-     * participants[peers[i]]
-     *
-     * let change the name to peer_id
-     *
-     * sorting of this list by LongTermId,peer_id is important because
-     * it determines the order of the room which affect the session key
-     * computation.
+     * sid of the session which bred us, the PARTICIPANTS_INFO we send may be
+     * a delta against its view. Unset if we are not bred by a current session.
      */
-    std::vector<std::string> peers;
+    SessionId parent_session_id;
 
     /**
      * Checkoff confirmed participant indexed by participant index
@@ -250,11 +293,18 @@ class Session
     time_t key_freshness_time_stamp;
 
     /**
-      * Generate acknowledgement timers for all other participants
-      *
+      * Expect an ack of the message from all other participants by
+      * consistency_failure_interval() from now
       */
     void start_ack_timers(const Message& received_message);
 
+    /**
+     * Warns about the participants who have not acked the messages whose
+     * deadline has passed and arms ack_deadline_timer for the earliest
+     * deadline still pending, unless it is already armed for it.
+     */
+    void expire_ack_deadlines();
+
     /**
       * Construct and start timers for acking received messages
       */
@@ -265,11 +315,40 @@ class Session
      */
     void stop_acking_timer();
 
+    /**
+     * How long we stay silent before sending a standalone ack. It grows
+     * with the logarithm of the room size, so in bigger rooms it is
+     * more likely that the ack rides on a user message.
+     */
+    uint32_t ack_interval();
+
+    /**
+     * How long we wait for a peer's ack before warning about it. It is
+     * extended by the same amount as ack_interval() so peers which delay
+     * their ack are not blamed for it.
+     */
+    uint32_t consistency_failure_interval();
+
+    /**
+     * the configured interval with its allowance of twice the
+     * BROADCAST_LATENCY replaced by the one measured in the room, if the
+     * app asked for c_adaptive_intervals and we have measured it
+     */
+    uint32_t adapted_interval(uint32_t configured_interval);
+
     /**
      * End ack timer on for given acknowledgeing participants
      */
     void stop_timer_receive(std::string acknowledger_id, MessageId message_id);
 
+    /**
+     * drops the transcript blocks before the last message everybody has
+     * acked, or before the last c_max_transcript_blocks ones. The hash of
+     * the oldest block left is chained over all the dropped ones, so it
+     * serves as the checkpoint of the transcript.
+     */
+    void checkpoint_transcript();
+
     /*
      * Stop ack to send timers when user sends new message before timer expires
      *
@@ -281,13 +360,79 @@ class Session
     HashBlock session_key;
     HashBlock session_confirmation;
 
+    // the message keys of the session if c_ratchet_message_keys is set
+    MessageKeyRatchet message_key_ratchet;
+
+    /**
+     * Rooms of at least c_tree_key_agreement_threshold participants agree
+     * on the session key by the ratchet tree instead of the ring of
+     * shares: only the sponsor commits to the tree and everybody else
+     * applies its commit.
+     */
+    RatchetTree key_tree;
+    bool tree_key_agreement = false;
+    bool key_tree_committed = false; // the root secret is fresh for this session
+    std::string key_tree_sponsor;
+    HashStdBlock future_leaf_secret; // of our leaf in the sessions bred by this one
+
+    /**
+     * joiners we have bred an admission session for which has not been
+     * confirmed yet. A new join request is admitted together with them by
+     * a session which supersedes the previous one.
+     */
+    ParticipantMap pending_joiners;
+
+    /**
+     * if we are joining, those joining along with us. Unlike the others
+     * they might confirm a session which was superseded before we got to
+     * it.
+     */
+    std::set<std::string> fellow_joiners;
+
     void* send_ack_timer = nullptr; // to send an ack to acknowledge all messages up to now
     void* farewell_deadline_timer = nullptr; // wait till you get everybody's hash to check before leave actually
     void* rejoin_timer = nullptr; // try to rejoin
     void* session_life_timer = nullptr; // start new session with the same participant but different keys
+    void* join_batch_timer = nullptr; // admit the pending joiners
+    void* leave_batch_timer = nullptr; // shrink the zombies out
+    void* ack_deadline_timer = nullptr; // the earliest ack we are waiting for is due
+    std::chrono::steady_clock::time_point ack_deadline_timer_due; // when ack_deadline_timer fires
+    SessionId shrunk_session_id; // the last session we have bred without the zombies
+
+    /**
+     * what a participant has piggybacked on its in-session messages for
+     * the session which succeeds this one
+     */
+    struct SuccessorMaterial {
+        std::string ephemeral_key; // for the session after the successor
+        std::string key_share;
+    };
+    std::map<std::string, SuccessorMaterial> successor_material; // indexed by nickname
+
+    // our own material, which goes out with our next in-session message
+    // once we have prepared the successor
+    bool successor_prepared = false;
+    bool successor_material_sent = false;
+    Cryptic successor_future_cryptic;
+    HashStdBlock successor_key_share;
 
     MessageId last_received_message_id = 0;
     MessageId own_message_counter = 0; // sent message counter
+    uint32_t unacked_user_messages = 0; // received from others since our last send
+    // compact user messages sent with the head of the transcript hash
+    // since the last one which carried all of it
+    uint32_t truncated_hashes_since_full_hash = 0;
+
+    // user messages whose in-session message would exceed this size are
+    // sent in fragments, 0 means no limit
+    size_t max_fragment_size = 0;
+    std::map<DTLength, FragmentReassembly> reassembly_buffers; // indexed by sender index
+
+    std::map<std::string, OutgoingTransfer> outgoing_transfers; // indexed by transfer id
+    std::map<std::string, IncomingTransfer> incoming_transfers; // indexed by sender nick + transfer id
+
+    AckCounters ack_counters;
+    SessionMetrics metrics;
     MessageId leave_parent = 0;
     // Depricated in favor of raison detr.
     // tree structure seems to be insufficient. because
@@ -329,108 +474,110 @@ class Session
      */
     void secret_share_on(int32_t side, HashBlock hb);
 
-    ParticipantMap participants_list_to_map(const UnauthenticatedParticipantList& session_view)
-    {
-        ParticipantMap converted_map;
-
-        for (UnauthenticatedParticipantList::const_iterator view_it = session_view.begin();
-             view_it != session_view.end(); view_it++) {
-            converted_map.insert(
-                std::pair<std::string, Participant>(view_it->participant_id.nickname, Participant(*view_it)));
-            converted_map[view_it->participant_id.nickname].authenticated = view_it->authenticated;
-        }
+    /**
+     * sends the message to the room and counts it in the metrics of the
+     * session
+     */
+    void broadcast(Message& outbound);
 
-        return converted_map;
-    }
+    /**
+     * stamps the handshake phase my_state corresponds to in the metrics
+     */
+    void mark_phase();
 
     /**
-     * reading the particpant_in_the_room list, it populate the
-     * particpants
-     * reading the particpant map, it populate the
-     * peers vector then find the index of thread runner
+     * reading the session view, it populates the participants then finds
+     * the index of thread runner
      */
-    void populate_participants_and_peers(const UnauthenticatedParticipantList& session_view)
+    void populate_participants(const UnauthenticatedParticipantList& session_view)
     {
-        /* for(UnauthenticatedParticipantList::const_iterator view_it = session_view.begin(); view_it !=
-         * session_view.end();  view_it++) { */
-        /*   participants.insert(std::pair<std::string, Participant>(view_it->participant_id.nickname,
-         * Participant(*view_it))); */
-        /*   participants[view_it->participant_id.nickname].authenticated = view_it->authenticated; */
-        /*   peers.push_back(view_it->participant_id.nickname); */
-
-        /* } */
-        participants = participants_list_to_map(session_view);
-        populate_peers_from_participants();
-
-        /*keep_peers_in_order_spot_myself();
-          compute_session_id();*/
+        participants = ParticipantMap(session_view);
+        index_participants();
     }
 
-    void populate_peers_from_participants()
+    void index_participants()
     {
-        peers.clear();
-        for (ParticipantMap::iterator it = participants.begin(); it != participants.end(); it++) {
-            peers.push_back(it->first);
-        }
-
-        keep_peers_in_order_spot_myself();
-        // session id doesn't need peers vector to be computed
+        spot_myself();
+        // session id doesn't need the participant indices to be computed
         // so we just check if it is not set, it is the time to be computed
         if (!session_id.get())
             compute_session_id();
     }
 
+    /**
+     * the entry of a participant in the session view
+     */
+    UnauthenticatedParticipant view_entry(Participant& participant)
+    {
+        return UnauthenticatedParticipant(participant.id, hash_to_string_buff(participant.raw_ephemeral_key),
+                                          participant.authenticated);
+    }
+
     /**
      * generate a session view by iterating over session_view
      */
     UnauthenticatedParticipantList session_view()
     {
         UnauthenticatedParticipantList session_view;
-        for (size_t i = 0; i < peers.size(); i++) {
-            session_view.push_back(UnauthenticatedParticipant(
-                participants[peers[i]].id, hash_to_string_buff(participants[peers[i]].raw_ephemeral_key),
-                participants[peers[i]].authenticated));
-        }
+        for (auto& cur_participant : participants)
+            session_view.push_back(view_entry(cur_participant.second));
 
         return session_view;
     }
 
     /**
-     * everytime that peers are modified we need to call this function to
-     * to keep it in order
-     *
-     * @return if we can't spot ourselves the session isn't meant for us
-     *
+     * the session view which the sessions bred by this session start
+     * from, i.e. the view of future_participants()
      */
-    void keep_peers_in_order_spot_myself()
+    UnauthenticatedParticipantList future_session_view()
     {
+        UnauthenticatedParticipantList future_view;
+        ParticipantMap live_participants = future_participants();
+        for (auto& cur_participant : live_participants)
+            future_view.push_back(view_entry(cur_participant.second));
 
-        std::sort(peers.begin(), peers.end());
+        return future_view;
+    }
+
+    /**
+     * @return true if we send our session view as a delta, which needs
+     *         all of the other participants to take delta views
+     */
+    bool sends_delta_views();
+
+    /**
+     * Only the joiner lacks the parent session, so only one member sends
+     * the full view: the first peer which was also in the parent session.
+     * The rest send the delta against the parent.
+     */
+    bool sends_full_view();
 
-        std::vector<std::string>::iterator my_entry = std::find(peers.begin(), peers.end(), myself.nickname);
-        if (my_entry == peers.end()) {
-            logger.debug("the message wasn't meant to us", __FUNCTION__, myself.nickname);
+    /**
+     * everytime that participants are modified we need to call this
+     * function to find ourselves among them. The participants are in the
+     * order of the room, which affects the session key computation.
+     *
+     * throws if we can't spot ourselves, the session isn't meant for us
+     *
+     */
+    void spot_myself()
+    {
+        ParticipantMap::iterator my_entry = participants.find(myself.nickname);
+        if (my_entry == participants.end()) {
+            NP1SEC_LOG_DEBUG("the message wasn't meant to us", __FUNCTION__, myself.nickname);
             throw InvalidRoomException(); // The idea is that if we got an invalid room
             // then we don't go for creating session;
         }
 
-        my_index = std::distance(peers.begin(), my_entry);
+        my_index = my_entry->second.index;
 
         // we trust ourselves so no need to auth ourselves neither be_authed_to
-        participants[peers[my_index]].authenticated = true;
-        participants[peers[my_index]].authed_to = true;
-
-        for (size_t i = 0; i < peers.size(); i++) {
-            // participants[peers[i]].thread_user_as_participant = &participants[peers[my_index]];
-            // if we copy the session the pointer
-            // //to thread user as participant is not valid anymore. This is obviously digusting
-            // //we need a respectable copy constructor for Session
-            participants[peers[i]].index = i;
-        }
+        my_entry->second.authenticated = true;
+        my_entry->second.authed_to = true;
 
         // flush the confirmation
         confirmed_peers.clear();
-        confirmed_peers.resize(peers.size());
+        confirmed_peers.resize(participants.size());
     }
 
     /**
@@ -439,6 +586,21 @@ class Session
      */
     ParticipantMap future_participants();
 
+    /**
+     * the ratchet tree of the sessions bred by this session: the leaves
+     * of the zombies are dropped and everybody else's leaf gets the key
+     * they have confirmed this session with
+     */
+    RatchetTree future_key_tree();
+
+    /**
+     * commits a fresh path of ours to the key tree, getting a leaf first
+     * if we are joining
+     *
+     * @return the commit to be sent to the others
+     */
+    std::string commit_to_key_tree();
+
     /**
      * returns participants - parental_participants
      * it shows what is the session suppose to add or
@@ -464,6 +626,22 @@ class Session
      */
     void account_for_session_and_key_consistency();
 
+    /**
+     * once the key is confirmed, seeds the message key chains with the
+     * session key and keeps only a key derived from it for the transfers,
+     * if c_ratchet_message_keys is set
+     */
+    void start_message_key_ratchet();
+
+    /**
+     * makes the message use the message keys once they are there
+     */
+    void use_message_keys(Message& message)
+    {
+        if (message_key_ratchet.is_initialized())
+            message.key_ratchet = &message_key_ratchet;
+    }
+
     /**
      * check if session confirmation has been computed correctly
      */
@@ -484,6 +662,7 @@ class Session
         }
 
         // we need to check the signature of the message here
+        metrics.counters.signature_verifications++;
         if (!received_message.verify_message(participants[received_message.sender_nick].ephemeral_key))
             throw AuthenticationException();
     }
@@ -509,6 +688,8 @@ class Session
      */
     bool nobody_confirmed();
 
+    bool joins_along(const std::string& nickname) { return fellow_joiners.count(nickname) > 0; }
+
     /**
      * Simply checks the participant map  for every element be authed.
      */
@@ -534,8 +715,11 @@ class Session
        current user calls this to send participant info to joiner
        and others
        sid, ((U_1,y_i)...(U_{n+1},y_{i+1}), kc, z_joiner
+
+       kc is the confirmation to the joiner or, if several of them are
+       joining, a table of confirmations indexed like the joiner auth
     */
-    void send_view_auth_and_share(std::string joiner_id = std::string(""));
+    void send_view_auth_and_share(const std::vector<std::string>& joiner_ids = std::vector<std::string>());
 
   public:
     /**
@@ -568,13 +752,21 @@ class Session
      * When a session request the creation of a session it inform
      * the sessoin of the condition it has been created
      */
-    enum SessionConceiverCondition { CREATOR, JOINER, ACCEPTOR, PEER, STAYER };
+    enum SessionConceiverCondition { CREATOR, JOINER, ACCEPTOR, PEER, STAYER, RATCHETER };
 
   protected:
     // should only be changed in constructor or state transitor
     SessionState my_state = DEAD;
     typedef std::pair<SessionState, RoomAction> StateAndAction;
 
+    /**
+     * decides if the session agrees on its key by the ratchet tree it has
+     * inherited and who commits to it: the joiner, who is the only one
+     * without a leaf, or otherwise the participant the sid picks so the
+     * rekeys rotate among us.
+     */
+    void choose_key_agreement(SessionConceiverCondition conceiver);
+
     /**
      * sends session confirmation if everybody is contributed and authenticated
      * returns DEAD state if fails to decrypt the group key.
@@ -671,9 +863,20 @@ class Session
 
        change status to REPLIED_TO_NEW_JOIN
 
+       The joiner is added to the pending joiners, which are admitted
+       right away or, if AppOps::c_join_batch_interval is set, when the
+       interval is over.
+
      */
     StateAndAction init_a_session_with_new_user(Message received_message);
 
+    /**
+     * breeds the session admitting all pending joiners
+     *
+     * @return nullptr if we have already bred the very same session
+     */
+    Session* breed_admission_session(Message* conceiving_message);
+
     /**
        For the current user, calls it when receive PARTICIPANT_INFO which
        doesn't exists in its universe, this only happens when they are the
@@ -749,9 +952,50 @@ class Session
 
     /**
      * for immature leave when we don't have leave intention
+     *
+     * the leaver joins the zombies, which are shrunk out right away or, if
+     * AppOps::c_leave_batch_interval is set, when the interval is over
      */
     RoomAction shrink(std::string leaving_nick);
 
+    /**
+     * breeds the session without any of the zombies, abandoning the one
+     * we have bred without fewer of them
+     */
+    RoomAction breed_shrunk_session();
+
+    /**
+     * true if the resession can be agreed on by the material piggybacked on
+     * the in-session messages, see AppOps::c_in_band_resession
+     */
+    bool ratchets_in_band();
+
+    /**
+     * computes our material for the successor, which goes out with our
+     * next in-session message, or ack if we have nothing to say
+     */
+    void prepare_successor();
+
+    /**
+     * breeds the session which succeeds this one in the resession
+     */
+    Session* breed_successor();
+
+    /**
+     * records the successor material piggybacked on an in-session message
+     *
+     * @return NEW_PRIORITY_SESSION with the successor, already in session,
+     *         if the message completed the material of everybody
+     */
+    RoomAction receive_successor_material(const Message& received_message);
+
+    /**
+     * for the successor: computes the key out of the piggybacked shares and
+     * goes in session. The transcript hashes of the first messages confirm
+     * the key in place of SESSION_CONFIRMATIONs.
+     */
+    void establish_in_band(const std::map<std::string, SuccessorMaterial>& material);
+
     /**
        For the current/leaving user, calls it when receive FAREWELL
 
@@ -822,6 +1066,11 @@ class Session
         np1secFSMGraphTransitionMatrix[RE_SHARED][Message::JOINER_AUTH] =
             &Session::confirm_auth_add_update_share_repo;
 
+        // joiners admitted together authenticate to each other by their
+        // joiner auths
+        np1secFSMGraphTransitionMatrix[JOIN_REQUESTED][Message::JOINER_AUTH] =
+            &Session::confirm_auth_add_update_share_repo;
+
         np1secFSMGraphTransitionMatrix[RE_SHARED][Message::PARTICIPANTS_INFO] =
             &Session::confirm_auth_add_update_share_repo;
 
@@ -840,6 +1089,11 @@ class Session
         // it
         np1secFSMGraphTransitionMatrix[DEAD][Message::IN_SESSION_MESSAGE] = &Session::receive;
 
+        // chunks of transfers started in the session are delivered till the
+        // session is gone, like its in-session messages
+        np1secFSMGraphTransitionMatrix[IN_SESSION][Message::TRANSFER_CHUNK] = &Session::receive_transfer_chunk;
+        np1secFSMGraphTransitionMatrix[DEAD][Message::TRANSFER_CHUNK] = &Session::receive_transfer_chunk;
+
         // Leave should have priority over join because the leaving user
         // is not gonna confirm the session and as such the join will
         // fail any way.
@@ -858,6 +1112,7 @@ class Session
         // only reply to in session messages (for the reason of consistency check)
         // if you are leaving. receive drops user messages
         np1secFSMGraphTransitionMatrix[LEAVE_REQUESTED][Message::IN_SESSION_MESSAGE] = &Session::receive;
+        np1secFSMGraphTransitionMatrix[LEAVE_REQUESTED][Message::TRANSFER_CHUNK] = &Session::receive_transfer_chunk;
 
         // We don't accept join request while in farewelled state (for now at least) but the participants still can
         // talk: We actually do but:
@@ -881,6 +1136,21 @@ class Session
      */
     SessionState get_state() { return my_state; }
 
+    /**
+     * access function for the ack counters
+     */
+    const AckCounters& get_ack_counters() const { return ack_counters; }
+
+    /**
+     * access function for the handshake timing and protocol counters
+     */
+    const SessionMetrics& get_metrics() const { return metrics; }
+
+    /**
+     * roughly how many bytes the transcript chains of the session take
+     */
+    size_t transcript_footprint() const;
+
     /**
      * tells if rejoin is active
      */
@@ -903,6 +1173,15 @@ class Session
      */
     RoomAction state_handler(Message receivd_message);
 
+    /**
+     * tells if the FSM has a transition for the message type in the
+     * current state, otherwise state_handler would ignore such a message
+     */
+    bool has_transitor_for(Message::MessageType message_type)
+    {
+        return np1secFSMGraphTransitionMatrix[my_state][message_type] != nullptr;
+    }
+
     /**
      * change the state to DEAD. it is needed when we bread a new
      * session out of this session.
@@ -956,6 +1235,68 @@ class Session
      */
     void send(std::string message, Message::MessageSubType message_type);
 
+    /**
+     * sends a user message in as many individually signed fragments as it
+     * takes for each to fit in max_fragment_size. All fragments carry the
+     * same own message id and parent so they make one transcript entry.
+     *
+     * @return the transcript entry of the message: the concatenation of
+     *         the hashes of the fragments
+     */
+    std::string send_fragmented(const std::string& message, const HashStdBlock& transcript_hash);
+
+    /**
+     * adds a received fragment to the sender's reassembly buffer. Out of
+     * order fragments and messages exceeding c_max_reassembled_message_size
+     * are dropped.
+     *
+     * @return true if the fragment completed the message, in which case
+     *         the fragment is turned into the whole USER_MESSAGE with the
+     *         fragment hashes as its transcript entry
+     */
+    bool reassemble(Message& fragment);
+
+    /**
+     * the size of the chunks of a new transfer: c_transfer_chunk_size or
+     * less if a chunk wouldn't fit in max_fragment_size otherwise
+     */
+    size_t transfer_chunk_size();
+
+    /**
+     * @return the transfer of ours with the given id, throws if there is
+     *         no such transfer in this session
+     */
+    OutgoingTransfer& outgoing_transfer(const std::string& transfer_id);
+
+    /**
+     * seals the chunk under the key of the transfer and sends it as the
+     * next chunk of the transfer
+     */
+    void send_chunk(const std::string& transfer_id, OutgoingTransfer& transfer, bool last_chunk,
+                    const std::string& chunk);
+
+    /**
+     * Streamed transfers are for data too large to be sent as one user
+     * message, e.g. files. The data is sent out of the transcript in
+     * TRANSFER_CHUNK messages so the sender doesn't need to hold all of it
+     * and the receivers get it chunk by chunk through the receive_chunk op.
+     *
+     * @return the id of the new transfer
+     */
+    std::string begin_transfer();
+
+    /**
+     * streams data as the continuation of the transfer. Full chunks are
+     * sent right away, the rest when more data is written or the
+     * transfer is finished.
+     */
+    void write_transfer(const std::string& transfer_id, const std::string& data);
+
+    /**
+     * sends the rest of the data of the transfer as its last chunk
+     */
+    void finish_transfer(const std::string& transfer_id);
+
     // List ofc onstructors
     /* /\** */
     /*    constructor */
@@ -1027,7 +1368,8 @@ class Session
      */
     Session(SessionConceiverCondition conceiver, UserState* us, std::string room_name,
                   Cryptic* current_ephemeral_crypto, const ParticipantMap& current_participants = ParticipantMap(),
-                  const ParticipantMap& parent_plist = ParticipantMap(), Message* conceiving_message = nullptr);
+                  const ParticipantMap& parent_plist = ParticipantMap(), Message* conceiving_message = nullptr,
+                  const SessionId& parent_session_id = SessionId(), const RatchetTree& parent_key_tree = RatchetTree());
 
     // Session(UserState *us, std::string room_name,  Cryptic* current_ephemeral_crypto, Message
     // join_message, ParticipantMap current_authed_participants);
@@ -1044,6 +1386,12 @@ class Session
      */
     StateAndAction receive(Message encrypted_message);
 
+    /**
+     * opens the chunk of a peer's transfer and hands it to the app if it
+     * is the next chunk of the transfer, otherwise drops the transfer.
+     */
+    StateAndAction receive_transfer_chunk(Message received_message);
+
     /**
      * is called by the room to send "I'm leaving" message
      * it changs session state to LEAVE_REQUESTED
@@ -1064,6 +1412,8 @@ class Session
 
     friend void cb_rejoin(void* arg);
     friend void cb_re_session(void* arg);
+    friend void cb_admit_joiners(void* arg);
+    friend void cb_shrink_zombies(void* arg);
 
     friend Room;
 };
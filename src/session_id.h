@@ -92,6 +92,19 @@ class SessionId
         }
     }
 
+    /**
+     * the short index which replaces the sid in compact in-session
+     * messages. It is the head of the sid, so everybody who has
+     * confirmed the session knows it without further negotiation.
+     */
+    DTLength get_index()
+    {
+        DTLength index = 0;
+        if (is_set)
+            memcpy(&index, session_id_raw, sizeof(DTLength));
+        return index;
+    }
+
     bool operator==(const SessionId& rhs)
     {
         return (is_set == rhs.is_set && !compare_hash(session_id_raw, rhs.session_id_raw));
@@ -0,0 +1,206 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2014, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef SRC_SESSION_METRICS_H_
+#define SRC_SESSION_METRICS_H_
+
+#include <chrono>
+#include <cstdint>
+#include <initializer_list>
+
+#include "src/message.h"
+
+namespace np1sec
+{
+
+/**
+ * The phases a session goes through till it is established, in order.
+ * Only the joiner's session starts at JOIN_REQUESTED_PHASE, the sessions
+ * of the current participants start RE_SHARED.
+ */
+enum HandshakePhase {
+    JOIN_REQUESTED_PHASE,
+    RE_SHARED_PHASE,
+    GROUP_KEY_GENERATED_PHASE,
+    IN_SESSION_PHASE,
+    TOTAL_NO_OF_HANDSHAKE_PHASES // This should be always the last phase
+};
+
+struct MessageTraffic {
+    uint32_t messages_sent = 0;
+    uint32_t messages_received = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+
+    MessageTraffic& operator+=(const MessageTraffic& rhs)
+    {
+        messages_sent += rhs.messages_sent;
+        messages_received += rhs.messages_received;
+        bytes_sent += rhs.bytes_sent;
+        bytes_received += rhs.bytes_received;
+        return *this;
+    }
+};
+
+/**
+ * What the sessions of a room have sent, received and computed. Traffic
+ * is counted both by message type and by the phase the session was in.
+ */
+struct ProtocolCounters {
+    MessageTraffic by_type[Message::TOTAL_NO_OF_MESSAGE_TYPE]; // indexed by Message::MessageType
+    MessageTraffic by_phase[TOTAL_NO_OF_HANDSHAKE_PHASES];
+    uint32_t signature_verifications = 0;
+    uint32_t triple_dhs = 0;
+    uint32_t key_generations = 0; // ephemeral key pairs
+    uint32_t ack_failures = 0; // per participant who failed to ack a message
+    uint32_t consistency_failures = 0; // per transcript which did not match ours
+    uint32_t full_transcript_hashes_sent = 0; // by compact user messages, the others always carry it
+
+    ProtocolCounters& operator+=(const ProtocolCounters& rhs)
+    {
+        for (size_t i = 0; i < Message::TOTAL_NO_OF_MESSAGE_TYPE; i++)
+            by_type[i] += rhs.by_type[i];
+        for (size_t i = 0; i < TOTAL_NO_OF_HANDSHAKE_PHASES; i++)
+            by_phase[i] += rhs.by_phase[i];
+
+        signature_verifications += rhs.signature_verifications;
+        triple_dhs += rhs.triple_dhs;
+        key_generations += rhs.key_generations;
+        ack_failures += rhs.ack_failures;
+        consistency_failures += rhs.consistency_failures;
+        full_transcript_hashes_sent += rhs.full_transcript_hashes_sent;
+        return *this;
+    }
+
+    MessageTraffic total() const
+    {
+        MessageTraffic all_traffic;
+        for (auto& cur_traffic : by_phase)
+            all_traffic += cur_traffic;
+
+        return all_traffic;
+    }
+
+    void count_sent(Message::MessageType message_type, HandshakePhase phase, size_t size)
+    {
+        for (MessageTraffic* traffic : {&by_type[message_type], &by_phase[phase]}) {
+            traffic->messages_sent++;
+            traffic->bytes_sent += size;
+        }
+    }
+
+    void count_received(Message::MessageType message_type, HandshakePhase phase, size_t size)
+    {
+        for (MessageTraffic* traffic : {&by_type[message_type], &by_phase[phase]}) {
+            traffic->messages_received++;
+            traffic->bytes_received += size;
+        }
+    }
+};
+
+/**
+ * The counters of a session and when it reached each handshake phase.
+ */
+struct SessionMetrics {
+    ProtocolCounters counters;
+    std::chrono::steady_clock::time_point created_at = std::chrono::steady_clock::now();
+    // the epoch for the phases the session has not reached (or skipped)
+    std::chrono::steady_clock::time_point phase_reached_at[TOTAL_NO_OF_HANDSHAKE_PHASES];
+    HandshakePhase current_phase = JOIN_REQUESTED_PHASE;
+
+    bool reached(HandshakePhase phase) const { return phase_reached_at[phase].time_since_epoch().count() != 0; }
+
+    /**
+     * stamps the phase the first time the session reaches it
+     */
+    void reach(HandshakePhase phase)
+    {
+        if (!reached(phase))
+            phase_reached_at[phase] = std::chrono::steady_clock::now();
+        current_phase = phase;
+    }
+
+    /**
+     * milliseconds from the creation of the session to the phase, 0 if it
+     * has not reached it
+     */
+    uint32_t time_to(HandshakePhase phase) const
+    {
+        if (!reached(phase))
+            return 0;
+
+        return static_cast<uint32_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(phase_reached_at[phase] - created_at).count());
+    }
+
+    void count_sent(Message::MessageType message_type, size_t size)
+    {
+        counters.count_sent(message_type, current_phase, size);
+    }
+
+    void count_received(Message::MessageType message_type, size_t size)
+    {
+        counters.count_received(message_type, current_phase, size);
+    }
+};
+
+/**
+ * The counters of all the sessions a room has had, plus what the room
+ * did outside of them, and how long its sessions took to reach each
+ * phase.
+ */
+struct RoomMetrics {
+    ProtocolCounters counters;
+    uint32_t session_count = 0;
+    uint32_t phase_reached_count[TOTAL_NO_OF_HANDSHAKE_PHASES] = {};
+    uint64_t total_time_to_phase[TOTAL_NO_OF_HANDSHAKE_PHASES] = {}; // milliseconds, summed over the sessions
+
+    // milliseconds from our join request to our first session, 0 if we
+    // have not joined yet or created the room
+    uint32_t join_latency = 0;
+
+    // refreshed sessions in limbo recorded as seeds, and the seeds made
+    // into sessions once they were needed
+    uint32_t limbo_sessions_sown = 0;
+    uint32_t limbo_sessions_grown = 0;
+
+    RoomMetrics& operator+=(const SessionMetrics& session_metrics)
+    {
+        counters += session_metrics.counters;
+        session_count++;
+        for (size_t i = 0; i < TOTAL_NO_OF_HANDSHAKE_PHASES; i++) {
+            if (!session_metrics.reached(static_cast<HandshakePhase>(i)))
+                continue;
+
+            phase_reached_count[i]++;
+            total_time_to_phase[i] += session_metrics.time_to(static_cast<HandshakePhase>(i));
+        }
+
+        return *this;
+    }
+
+    double mean_time_to(HandshakePhase phase) const
+    {
+        return phase_reached_count[phase] ? static_cast<double>(total_time_to_phase[phase]) / phase_reached_count[phase]
+                                          : 0;
+    }
+};
+
+} // namespace np1sec
+
+#endif // SRC_SESSION_METRICS_H_
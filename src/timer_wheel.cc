@@ -0,0 +1,230 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2014, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <algorithm>
+
+#include "src/timer_wheel.h"
+
+namespace np1sec
+{
+
+// a handle is the index of the timer plus one in the low bits, so it is
+// never null, and the generation of the timer in the high bits
+static const unsigned c_handle_index_bits = sizeof(uintptr_t) >= 8 ? 32 : 20;
+static const uintptr_t c_handle_index_mask = (uintptr_t(1) << c_handle_index_bits) - 1;
+
+const unsigned TimerWheel::c_slot_bits;
+const uint32_t TimerWheel::c_slot_count;
+const uint32_t TimerWheel::c_level_count;
+const uint32_t TimerWheel::c_nil;
+
+/**
+ * the host timer of a self-driven wheel
+ */
+void cb_timer_wheel_tick(void* arg)
+{
+    TimerWheel* wheel = static_cast<TimerWheel*>(arg);
+    wheel->host_timer = nullptr;
+
+    // the host timer might fire late (or early), so we go by the clock
+    auto now = std::chrono::steady_clock::now();
+    uint64_t elapsed_ticks =
+        std::chrono::duration_cast<std::chrono::milliseconds>(now - wheel->last_host_tick).count() /
+        wheel->tick_interval;
+    wheel->last_host_tick += std::chrono::milliseconds(elapsed_ticks * wheel->tick_interval);
+
+    // the timers armed meanwhile do not arm the host timer, we do after
+    wheel->host_ticking = true;
+    for (; elapsed_ticks && wheel->armed_count; elapsed_ticks--)
+        wheel->tick();
+    wheel->current_tick += elapsed_ticks;
+    wheel->host_ticking = false;
+
+    if (wheel->armed_count)
+        wheel->arm_host_timer();
+}
+
+TimerWheel::TimerWheel(uint32_t tick_interval) : tick_interval(std::max(tick_interval, uint32_t(1)))
+{
+    std::fill(slots, slots + c_level_count * c_slot_count, c_nil);
+}
+
+TimerWheel::TimerWheel(uint32_t tick_interval, HostSetTimer host_set_timer, HostAxeTimer host_axe_timer,
+                       void* host_data)
+    : TimerWheel(tick_interval)
+{
+    this->host_set_timer = host_set_timer;
+    this->host_axe_timer = host_axe_timer;
+    this->host_data = host_data;
+}
+
+TimerWheel::~TimerWheel()
+{
+    if (host_timer)
+        host_axe_timer(host_timer, host_data);
+}
+
+void* TimerWheel::set_timer(TimerCallback timer_callback, void* opdata, uint32_t interval)
+{
+    uint32_t index = free_timers;
+    if (index == c_nil) {
+        index = timers.size();
+        timers.push_back(Timer());
+        timers[index].generation = 0;
+    } else {
+        free_timers = timers[index].next;
+    }
+
+    // rounded up, a timer never fires before its interval is over
+    timers[index].timer_callback = timer_callback;
+    timers[index].opdata = opdata;
+    timers[index].expiry = current_tick + std::max((uint64_t(interval) + tick_interval - 1) / tick_interval, uint64_t(1));
+    place(index);
+
+    if (!armed_count++ && host_set_timer && !host_ticking) {
+        last_host_tick = std::chrono::steady_clock::now();
+        arm_host_timer();
+    }
+
+    return handle(index);
+}
+
+void TimerWheel::axe_timer(void* to_be_defused_timer)
+{
+    uint32_t index = index_of(to_be_defused_timer);
+    if (index != c_nil)
+        release(index);
+
+    // an idle self-driven wheel keeps no host timer armed
+    if (!armed_count && host_timer) {
+        host_axe_timer(host_timer, host_data);
+        host_timer = nullptr;
+    }
+}
+
+void TimerWheel::tick()
+{
+    current_tick++;
+    for (uint32_t level = 1; level < c_level_count; level++) {
+        if (current_tick & ((uint64_t(1) << (c_slot_bits * level)) - 1))
+            break;
+        cascade(level, (current_tick >> (c_slot_bits * level)) & (c_slot_count - 1));
+    }
+
+    // the callbacks might arm and axe timers, but not in this slot as
+    // nothing is armed for less than a tick
+    uint32_t& due = slots[current_tick & (c_slot_count - 1)];
+    while (due != c_nil) {
+        uint32_t index = due;
+        TimerCallback timer_callback = timers[index].timer_callback;
+        void* opdata = timers[index].opdata;
+        release(index);
+        timer_callback(opdata);
+    }
+}
+
+void TimerWheel::advance(uint32_t elapsed)
+{
+    uint64_t elapsed_ticks = (uint64_t(elapsed_remainder) + elapsed) / tick_interval;
+    elapsed_remainder = (uint64_t(elapsed_remainder) + elapsed) % tick_interval;
+
+    for (; elapsed_ticks && armed_count; elapsed_ticks--)
+        tick();
+
+    // nothing to fire, the wheel just moves on
+    current_tick += elapsed_ticks;
+}
+
+void TimerWheel::place(uint32_t index)
+{
+    uint64_t expiry = timers[index].expiry;
+    uint64_t delta = expiry > current_tick ? expiry - current_tick : 0;
+
+    uint32_t level = 0;
+    while (level + 1 < c_level_count && (delta >> (c_slot_bits * (level + 1))))
+        level++;
+
+    // beyond the range of the wheel, it is placed again when it comes round
+    if (delta >> (c_slot_bits * c_level_count))
+        expiry = current_tick + (uint64_t(1) << (c_slot_bits * c_level_count)) - 1;
+
+    uint32_t slot = level * c_slot_count + ((expiry >> (c_slot_bits * level)) & (c_slot_count - 1));
+    timers[index].slot = slot;
+    timers[index].prev = c_nil;
+    timers[index].next = slots[slot];
+    if (slots[slot] != c_nil)
+        timers[slots[slot]].prev = index;
+    slots[slot] = index;
+}
+
+void TimerWheel::unlink(uint32_t index)
+{
+    Timer& timer = timers[index];
+    if (timer.prev != c_nil)
+        timers[timer.prev].next = timer.next;
+    else
+        slots[timer.slot] = timer.next;
+
+    if (timer.next != c_nil)
+        timers[timer.next].prev = timer.prev;
+}
+
+void TimerWheel::release(uint32_t index)
+{
+    unlink(index);
+    timers[index].slot = c_nil;
+    timers[index].generation++;
+    timers[index].next = free_timers;
+    free_timers = index;
+    armed_count--;
+}
+
+void TimerWheel::cascade(uint32_t level, uint32_t slot)
+{
+    uint32_t index = slots[level * c_slot_count + slot];
+    slots[level * c_slot_count + slot] = c_nil;
+    while (index != c_nil) {
+        uint32_t next = timers[index].next;
+        place(index);
+        index = next;
+    }
+}
+
+void* TimerWheel::handle(uint32_t index) const
+{
+    uintptr_t generation = timers[index].generation;
+    return reinterpret_cast<void*>((generation << c_handle_index_bits) | (uintptr_t(index) + 1));
+}
+
+uint32_t TimerWheel::index_of(void* timer_handle) const
+{
+    uintptr_t raw_handle = reinterpret_cast<uintptr_t>(timer_handle);
+    uintptr_t index = (raw_handle & c_handle_index_mask) - 1;
+    if (!(raw_handle & c_handle_index_mask) || index >= timers.size() || timers[index].slot == c_nil ||
+        timer_handle != handle(index))
+        return c_nil;
+
+    return index;
+}
+
+void TimerWheel::arm_host_timer()
+{
+    host_timer = host_set_timer(cb_timer_wheel_tick, this, tick_interval, host_data);
+}
+
+} // namespace np1sec
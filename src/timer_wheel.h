@@ -0,0 +1,151 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2014, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef SRC_TIMER_WHEEL_H_
+#define SRC_TIMER_WHEEL_H_
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+namespace np1sec
+{
+
+/**
+ * A hierarchical timing wheel which multiplexes the timers of any number
+ * of sessions, rooms and users onto a single tick. Set it as
+ * AppOps::timer_wheel and the library arms its timers on the wheel
+ * rather than through AppOps::set_timer.
+ *
+ * Level 0 has a slot per tick, each level above a slot per round of the
+ * level below. A timer goes to the lowest level whose range covers it and
+ * moves down a level each time the level below wraps to its slot, so
+ * arming and axing are O(1) and a tick costs O(1) plus the timers due.
+ *
+ * Tick-driven, the host calls tick() every tick_interval milliseconds or
+ * advance() with the time elapsed. Self-driven, the wheel keeps a single
+ * host timer armed through the set_timer and axe_timer it is given, for
+ * as long as any of its timers are.
+ *
+ * The handles are checked against the timer they were given for, so
+ * axing a timer which has fired or was axed already does nothing.
+ */
+class TimerWheel
+{
+  public:
+    typedef void (*TimerCallback)(void* opdata);
+    typedef void* (*HostSetTimer)(TimerCallback timer_callback, void* opdata, uint32_t interval, void* data);
+    typedef void (*HostAxeTimer)(void* to_be_defused_timer, void* data);
+
+    /**
+     * tick-driven wheel
+     *
+     * @param tick_interval the resolution of the wheel in milliseconds
+     */
+    explicit TimerWheel(uint32_t tick_interval = 10);
+
+    /**
+     * self-driven wheel ticking on the host timers, with the same
+     * signature as AppOps::set_timer and AppOps::axe_timer
+     */
+    TimerWheel(uint32_t tick_interval, HostSetTimer host_set_timer, HostAxeTimer host_axe_timer, void* host_data);
+
+    ~TimerWheel();
+
+    /**
+     * @return a handle to the timer which can be sent to axe_timer
+     */
+    void* set_timer(TimerCallback timer_callback, void* opdata, uint32_t interval);
+
+    void axe_timer(void* to_be_defused_timer);
+
+    /**
+     * moves one tick on and fires the timers due
+     */
+    void tick();
+
+    /**
+     * moves on by elapsed milliseconds, carrying over what is left of a
+     * tick to the next call
+     */
+    void advance(uint32_t elapsed);
+
+    /**
+     * number of timers armed
+     */
+    size_t size() const { return armed_count; }
+
+    uint32_t get_tick_interval() const { return tick_interval; }
+
+  protected:
+    static const unsigned c_slot_bits = 6;
+    static const uint32_t c_slot_count = 1 << c_slot_bits;
+    static const uint32_t c_level_count = 4;
+    static const uint32_t c_nil = UINT32_MAX;
+
+    struct Timer {
+        TimerCallback timer_callback;
+        void* opdata;
+        uint64_t expiry; // in ticks
+        uint32_t generation; // bumped when the timer is freed, so stale handles miss
+        uint32_t next;
+        uint32_t prev;
+        uint32_t slot; // c_nil when not armed
+    };
+
+    uint32_t tick_interval;
+    uint64_t current_tick = 0;
+    uint32_t elapsed_remainder = 0;
+
+    std::vector<Timer> timers;
+    uint32_t free_timers = c_nil;
+    size_t armed_count = 0;
+    uint32_t slots[c_level_count * c_slot_count];
+
+    HostSetTimer host_set_timer = nullptr;
+    HostAxeTimer host_axe_timer = nullptr;
+    void* host_data = nullptr;
+    void* host_timer = nullptr;
+    bool host_ticking = false;
+    std::chrono::steady_clock::time_point last_host_tick;
+
+    void place(uint32_t index);
+    void unlink(uint32_t index);
+    void release(uint32_t index);
+
+    /**
+     * moves the timers of slot of level down to the levels below
+     */
+    void cascade(uint32_t level, uint32_t slot);
+
+    void* handle(uint32_t index) const;
+
+    /**
+     * @return the index of the armed timer the handle was given for or
+     *         c_nil
+     */
+    uint32_t index_of(void* timer_handle) const;
+
+    void arm_host_timer();
+
+    friend void cb_timer_wheel_tick(void* arg);
+};
+
+} // namespace np1sec
+
+#endif // SRC_TIMER_WHEEL_H_
@@ -0,0 +1,32 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2014, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "src/tracepoints.h"
+
+#ifdef NP1SEC_HAVE_SDT
+
+// the tracer finds the semaphores through the notes of the tracepoints
+// and raises them in the .probes section while it is attached
+#define NP1SEC_DEFINE_TRACE_SEMAPHORE(name) \
+    unsigned short NP1SEC_TRACE_SEMAPHORE(name) __attribute__((section(".probes"))) = 0;
+
+extern "C" {
+NP1SEC_TRACEPOINTS(NP1SEC_DEFINE_TRACE_SEMAPHORE)
+}
+
+#endif // NP1SEC_HAVE_SDT
@@ -0,0 +1,140 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2014, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef SRC_TRACEPOINTS_H_
+#define SRC_TRACEPOINTS_H_
+
+#include <cstdint>
+
+/**
+ * USDT tracepoints of the np1sec provider, for bpftrace, perf or
+ * SystemTap to attach to on a live host, e.g.
+ *
+ *   bpftrace -e 'usdt:libnp1sec.so:np1sec:state_transition
+ *                { printf("%s %016lx %d -> %d\n", str(arg0), arg1, arg2, arg3); }'
+ *
+ * Configure finds sys/sdt.h and defines NP1SEC_HAVE_SDT, unless given
+ * --disable-tracepoints. Each tracepoint is a nop in the code and has a
+ * semaphore the tracer raises when it attaches, so the arguments are
+ * only worked out while somebody listens. Without sys/sdt.h they compile
+ * to nothing.
+ *
+ * message_receive    room, sender, size
+ * message_parse      room, ParseStatus, MessageType, size
+ * verify_begin       session id, MessageType, size of the signed part
+ * verify_end         session id, MessageType, 1 if the signature holds
+ * state_transition   room, session id, old SessionState, new SessionState, MessageType
+ * session_activate   room, session id, number of participants
+ * timer_arm          opdata, interval, handle
+ * timer_fire         room, session id, name of the timer
+ * send_bare          room, size, number of frames in it
+ *
+ * A session id is the first 8 bytes of the sid, so it reads as the head
+ * of the sid in hex.
+ */
+#define NP1SEC_TRACEPOINTS(TRACEPOINT) \
+    TRACEPOINT(message_receive)        \
+    TRACEPOINT(message_parse)          \
+    TRACEPOINT(verify_begin)           \
+    TRACEPOINT(verify_end)             \
+    TRACEPOINT(state_transition)       \
+    TRACEPOINT(session_activate)       \
+    TRACEPOINT(timer_arm)              \
+    TRACEPOINT(timer_fire)             \
+    TRACEPOINT(send_bare)
+
+#ifdef NP1SEC_HAVE_SDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define NP1SEC_TRACE_SEMAPHORE(name) np1sec_##name##_semaphore
+#define NP1SEC_DECLARE_TRACE_SEMAPHORE(name) extern unsigned short NP1SEC_TRACE_SEMAPHORE(name);
+
+extern "C" {
+NP1SEC_TRACEPOINTS(NP1SEC_DECLARE_TRACE_SEMAPHORE)
+}
+
+#define NP1SEC_TRACE_ENABLED(name) __builtin_expect(NP1SEC_TRACE_SEMAPHORE(name), 0)
+
+#define NP1SEC_TRACE1(name, a1)                                                                                        \
+    do {                                                                                                               \
+        if (NP1SEC_TRACE_ENABLED(name))                                                                                \
+            DTRACE_PROBE1(np1sec, name, a1);                                                                           \
+    } while (0)
+#define NP1SEC_TRACE2(name, a1, a2)                                                                                    \
+    do {                                                                                                               \
+        if (NP1SEC_TRACE_ENABLED(name))                                                                                \
+            DTRACE_PROBE2(np1sec, name, a1, a2);                                                                       \
+    } while (0)
+#define NP1SEC_TRACE3(name, a1, a2, a3)                                                                                \
+    do {                                                                                                               \
+        if (NP1SEC_TRACE_ENABLED(name))                                                                                \
+            DTRACE_PROBE3(np1sec, name, a1, a2, a3);                                                                   \
+    } while (0)
+#define NP1SEC_TRACE4(name, a1, a2, a3, a4)                                                                            \
+    do {                                                                                                               \
+        if (NP1SEC_TRACE_ENABLED(name))                                                                                \
+            DTRACE_PROBE4(np1sec, name, a1, a2, a3, a4);                                                               \
+    } while (0)
+#define NP1SEC_TRACE5(name, a1, a2, a3, a4, a5)                                                                        \
+    do {                                                                                                               \
+        if (NP1SEC_TRACE_ENABLED(name))                                                                                \
+            DTRACE_PROBE5(np1sec, name, a1, a2, a3, a4, a5);                                                           \
+    } while (0)
+
+#else
+
+#define NP1SEC_TRACE_ENABLED(name) false
+#define NP1SEC_TRACE1(name, a1) \
+    do {                        \
+    } while (0)
+#define NP1SEC_TRACE2(name, a1, a2) \
+    do {                            \
+    } while (0)
+#define NP1SEC_TRACE3(name, a1, a2, a3) \
+    do {                                \
+    } while (0)
+#define NP1SEC_TRACE4(name, a1, a2, a3, a4) \
+    do {                                    \
+    } while (0)
+#define NP1SEC_TRACE5(name, a1, a2, a3, a4, a5) \
+    do {                                        \
+    } while (0)
+
+#endif // NP1SEC_HAVE_SDT
+
+namespace np1sec
+{
+
+/**
+ * @return the first 8 bytes of the raw sid, big endian, or 0 for a
+ *         session whose sid is not set yet
+ */
+inline uint64_t trace_session_id(const uint8_t* session_id_raw)
+{
+    uint64_t head = 0;
+    for (unsigned i = 0; session_id_raw && i < sizeof(head); i++)
+        head = (head << 8) | session_id_raw[i];
+
+    return head;
+}
+
+} // namespace np1sec
+
+#endif // SRC_TRACEPOINTS_H_
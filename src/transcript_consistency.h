@@ -42,30 +42,170 @@ class MessageDigest
 };
 
 /**
- * Structure for ops data for waiting timer for receiving ack
- * from other participants
+ * The consistency state of one received message for all participants of
+ * the session, laid out as parallel arrays in a single allocation: the
+ * bitmap of participants whose ack we are still waiting for, their
+ * fixed size transcript hashes and the length of each hash. A length of
+ * 0 means we have no hash from that participant yet. It is shorter than
+ * c_hash_length when a compact message carried only the head of it.
  */
-struct AckTimerOps {
-    Session* session;
-    Participant* participant;
-    MessageId message_id;
+class ConsistencyBlock
+{
+  public:
+    explicit ConsistencyBlock(size_t participant_count)
+        : participant_count(participant_count),
+          storage(bitmap_words() + (participant_count * (c_hash_length + 1) + sizeof(uint64_t) - 1) / sizeof(uint64_t))
+    {
+    }
 
-    AckTimerOps() : session(nullptr), participant(nullptr){}; // This is to make [] of map
-    // working, but soon we'll move to another type
+    size_t size() const { return participant_count; }
+
+    bool has_hash(size_t index) const { return hash_lengths()[index]; }
+
+    HashStdBlock hash(size_t index) const
+    {
+        return HashStdBlock(reinterpret_cast<const char*>(hash_at(index)), hash_lengths()[index]);
+    }
 
-    AckTimerOps(Session* session, Participant* participant, uint32_t message_parent_id)
-        : session(session), participant(participant), message_id(message_parent_id)
+    void set_hash(size_t index, const HashStdBlock& transcript_hash)
     {
+        size_t length = std::min(transcript_hash.size(), c_hash_length);
+        memcpy(hash_at(index), transcript_hash.data(), length);
+        hash_lengths()[index] = static_cast<uint8_t>(length);
     }
+
+    void set_hash(size_t index, const HashBlock transcript_hash)
+    {
+        memcpy(hash_at(index), transcript_hash, c_hash_length);
+        hash_lengths()[index] = c_hash_length;
+    }
+
+    /**
+     * same as transcript_hash_matches on the hashes of the two participants
+     */
+    bool hash_matches(size_t ours, size_t theirs) const
+    {
+        uint8_t their_length = hash_lengths()[theirs];
+        return their_length <= hash_lengths()[ours] && !memcmp(hash_at(ours), hash_at(theirs), their_length) &&
+               (their_length || !hash_lengths()[ours]);
+    }
+
+    void expect_ack(size_t index) { storage[index / 64] |= uint64_t(1) << (index % 64); }
+
+    void clear_ack(size_t index) { storage[index / 64] &= ~(uint64_t(1) << (index % 64)); }
+
+    bool ack_pending(size_t index) const { return storage[index / 64] & (uint64_t(1) << (index % 64)); }
+
+    bool acks_pending() const
+    {
+        for (size_t i = 0; i < bitmap_words(); i++)
+            if (storage[i])
+                return true;
+        return false;
+    }
+
+    size_t footprint() const { return sizeof(*this) + storage.capacity() * sizeof(uint64_t); }
+
+  protected:
+    size_t participant_count;
+    std::vector<uint64_t> storage;
+
+    size_t bitmap_words() const { return (participant_count + 63) / 64; }
+
+    uint8_t* hash_at(size_t index)
+    {
+        return reinterpret_cast<uint8_t*>(&storage[bitmap_words()]) + index * c_hash_length;
+    }
+    const uint8_t* hash_at(size_t index) const
+    {
+        return reinterpret_cast<const uint8_t*>(&storage[bitmap_words()]) + index * c_hash_length;
+    }
+
+    uint8_t* hash_lengths() { return hash_at(participant_count); }
+    const uint8_t* hash_lengths() const { return hash_at(participant_count); }
 };
 
-struct ParticipantConsistencyBlock {
-    HashStdBlock transcript_hash;
+/**
+ * When the acks for a received message are due. All acks for a message
+ * share the deadline, the block of the message tells whose are pending.
+ */
+typedef std::pair<std::chrono::steady_clock::time_point, MessageId> AckDeadline;
+
+/**
+ * A message of ours on its way to the room: the hash it was sent with,
+ * when it was sent and the timer waiting for it to come back.
+ */
+struct SentConsistencyBlock {
+    HashBlock transcript_hash;
     void* consistency_timer;
-    AckTimerOps ack_timer_ops;
+    std::chrono::steady_clock::time_point sent_at;
+};
+
+/**
+ * compact messages may carry only the head of the transcript hash, so
+ * theirs matches ours if it is a prefix of it. Only an empty hash matches
+ * an empty one.
+ */
+inline bool transcript_hash_matches(const HashStdBlock& ours, const HashStdBlock& theirs)
+{
+    return theirs.size() <= ours.size() && !ours.compare(0, theirs.size(), theirs) &&
+           (!theirs.empty() || ours.empty());
+}
+
+/**
+ * Counts in-session frames put on the wire against the acks which rode
+ * on a user message instead of being sent on their own. The
+ * amplification factor is the number of standalone ack broadcasts a
+ * participant generates per user message it receives from others.
+ */
+struct AckCounters {
+    uint32_t user_messages_sent = 0;
+    uint32_t user_messages_received = 0;
+    uint32_t standalone_acks_sent = 0;
+    uint32_t piggybacked_acks = 0;
+
+    AckCounters& operator+=(const AckCounters& rhs)
+    {
+        user_messages_sent += rhs.user_messages_sent;
+        user_messages_received += rhs.user_messages_received;
+        standalone_acks_sent += rhs.standalone_acks_sent;
+        piggybacked_acks += rhs.piggybacked_acks;
+        return *this;
+    }
+
+    double amplification_factor() const
+    {
+        return user_messages_received ? static_cast<double>(standalone_acks_sent) / user_messages_received : 0;
+    }
 };
 
-typedef std::vector<ParticipantConsistencyBlock> ConsistencyBlockVector;
+/**
+ * Estimates how long it takes for a message we broadcast to come back to
+ * us the way TCP estimates its round trip time (RFC 6298), by a smoothed
+ * mean and mean deviation of the samples, in milliseconds. We allow a
+ * broadcast the mean plus four deviations.
+ */
+struct BroadcastLatencyEstimator {
+    uint32_t smoothed_round_trip = 0;
+    uint32_t round_trip_variation = 0;
+    uint32_t sample_count = 0;
+
+    void add_sample(uint32_t round_trip)
+    {
+        if (!sample_count++) {
+            smoothed_round_trip = round_trip;
+            round_trip_variation = round_trip / 2;
+            return;
+        }
+
+        uint32_t deviation = smoothed_round_trip > round_trip ? smoothed_round_trip - round_trip
+                                                              : round_trip - smoothed_round_trip;
+        round_trip_variation = (3 * uint64_t(round_trip_variation) + deviation) / 4;
+        smoothed_round_trip = (7 * uint64_t(smoothed_round_trip) + round_trip) / 8;
+    }
+
+    uint32_t allowance() const { return smoothed_round_trip + 4 * round_trip_variation; }
+};
 
 /* /\** */
 /*  * Callback function to manage sending of heartbeats */
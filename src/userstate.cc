@@ -23,6 +23,7 @@
 
 #include "src/interface.h"
 #include "src/userstate.h"
+#include "src/tracepoints.h"
 
 namespace np1sec
 {
@@ -46,7 +47,7 @@ namespace np1sec
 UserState::UserState(std::string name, AppOps* ops, uint8_t* key_pair) : myself(nullptr), ops(ops)
 {
     if (key_pair) {
-        logger.info("intitiating UserState with pre-generated key pair");
+        NP1SEC_LOG_INFO("intitiating UserState with pre-generated key pair");
         long_term_key_pair.set_key_pair(key_pair);
         // we also populate our id key to send it to other
         // during join.
@@ -87,7 +88,7 @@ bool UserState::init()
     if (long_term_key_pair.is_initiated()) {
         return true;
     }
-    logger.info("generating long term key for participant " + myself->nickname);
+    NP1SEC_LOG_INFO("generating long term key for participant " + myself->nickname);
     try {
         long_term_key_pair.generate();
         myself->set_fingerprint(public_key_to_stringbuff(long_term_key_pair.get_public_key()));
@@ -116,6 +117,8 @@ bool UserState::init()
  */
 bool UserState::join_room(std::string room_name, uint32_t room_size)
 {
+    OutboundFlush flush(this);
+
     // we can't join without id key
     if (!long_term_key_pair.is_initiated()) {
         logger.error(myself->nickname + "doesn't have sufficient credential to join room" + room_name +
@@ -161,6 +164,63 @@ void UserState::increment_room_size(std::string room_name)
     }
 }
 
+AckCounters UserState::ack_counters(std::string room_name)
+{
+    if (chatrooms.find(room_name) == chatrooms.end()) {
+        logger.error("no ack counter for room " + room_name + ". user " + myself->nickname + " is not in the room",
+                     __FUNCTION__, myself->nickname);
+        throw InvalidRoomException();
+    }
+
+    return chatrooms[room_name].ack_counters();
+}
+
+RoomMetrics UserState::room_metrics(std::string room_name)
+{
+    if (chatrooms.find(room_name) == chatrooms.end()) {
+        logger.error("no metrics for room " + room_name + ". user " + myself->nickname + " is not in the room",
+                     __FUNCTION__, myself->nickname);
+        throw InvalidRoomException();
+    }
+
+    return chatrooms[room_name].metrics();
+}
+
+SessionMetrics UserState::session_metrics(std::string room_name)
+{
+    if (chatrooms.find(room_name) == chatrooms.end()) {
+        logger.error("no session metrics for room " + room_name + ". user " + myself->nickname +
+                         " is not in the room",
+                     __FUNCTION__, myself->nickname);
+        throw InvalidRoomException();
+    }
+
+    return chatrooms[room_name].active_session_metrics();
+}
+
+size_t UserState::transcript_footprint(std::string room_name)
+{
+    if (chatrooms.find(room_name) == chatrooms.end()) {
+        logger.error("no transcript for room " + room_name + ". user " + myself->nickname + " is not in the room",
+                     __FUNCTION__, myself->nickname);
+        throw InvalidRoomException();
+    }
+
+    return chatrooms[room_name].transcript_footprint();
+}
+
+BroadcastLatencyEstimator UserState::broadcast_latency(std::string room_name)
+{
+    if (chatrooms.find(room_name) == chatrooms.end()) {
+        logger.error("no broadcast latency for room " + room_name + ". user " + myself->nickname +
+                         " is not in the room",
+                     __FUNCTION__, myself->nickname);
+        throw InvalidRoomException();
+    }
+
+    return chatrooms[room_name].get_broadcast_latency();
+}
+
 /**
  * The client informs the user state about leaving the room by calling this
  * function.
@@ -172,6 +232,8 @@ void UserState::increment_room_size(std::string room_name)
  */
 void UserState::leave_room(std::string room_name)
 {
+    OutboundFlush flush(this);
+
     // if there is no room, it was a mistake to give us the message
     if (chatrooms.find(room_name) == chatrooms.end()) {
         logger.error("unable to leave from room " + room_name + ". user " + myself->nickname + " is not in the room",
@@ -194,6 +256,8 @@ void UserState::leave_room(std::string room_name)
  */
 void UserState::shrink(std::string room_name, std::string leaving_user_id)
 {
+    OutboundFlush flush(this);
+
     // if there is no room, it was a mistake to give us the message
     if (chatrooms.find(room_name) == chatrooms.end()) {
         logger.error("unable to shrink room " + room_name + ". user " + myself->nickname + "is not in the room");
@@ -202,8 +266,8 @@ void UserState::shrink(std::string room_name, std::string leaving_user_id)
 
     // we really should start shrinking here. the other
     // session will take care of consistency
-    logger.info(leaving_user_id + " is leaving " + room_name, __FUNCTION__, myself->nickname);
-    logger.info(room_name + " shrinking", __FUNCTION__, myself->nickname);
+    NP1SEC_LOG_INFO(leaving_user_id + " is leaving " + room_name, __FUNCTION__, myself->nickname);
+    NP1SEC_LOG_INFO(room_name + " shrinking", __FUNCTION__, myself->nickname);
     chatrooms[room_name].shrink(leaving_user_id);
 }
 
@@ -226,19 +290,62 @@ void UserState::shrink(std::string room_name, std::string leaving_user_id)
 void UserState::receive_handler(std::string room_name, std::string sender_nickname, std::string received_message,
                                       uint32_t message_id)
 {
-    logger.debug("receiving message...", __FUNCTION__, myself->nickname);
+    OutboundFlush flush(this);
+
+    NP1SEC_TRACE3(message_receive, room_name.c_str(), sender_nickname.c_str(), received_message.size());
+    NP1SEC_LOG_DEBUG("receiving message...", __FUNCTION__, myself->nickname);
+    Message bundle;
+    if (!bundle.peek_header(received_message) || bundle.message_type != Message::BUNDLE) {
+        receive_frame(room_name, sender_nickname, received_message, message_id);
+        return;
+    }
+
+    if (bundle.parse(received_message) != PARSE_OK) {
+        NP1SEC_LOG_DEBUG("dropping malformed bundle", __FUNCTION__, myself->nickname);
+        return;
+    }
+
+    // the frames are independent messages, a bad one doesn't spoil the rest
+    for (auto& cur_frame : bundle.bundled_frames)
+        receive_frame(room_name, sender_nickname, cur_frame, message_id);
+}
+
+void UserState::receive_frame(std::string room_name, std::string sender_nickname, std::string received_message,
+                              uint32_t message_id)
+{
     try {
-        Message received(received_message, nullptr); // so no decryption key here
-        received.sender_nick = sender_nickname;
-        // in case the transport is providing the message id (if it is zero means to
-        // trust the global order
-        received.message_id = message_id;
+        // history replay, old sessions and others' handshakes are
+        // dropped before paying for the full decode
+        Message header;
+        if (!header.peek_header(received_message) || header.message_type == Message::BUNDLE) {
+            NP1SEC_LOG_DEBUG("discarding non-np1sec message", __FUNCTION__, myself->nickname);
+            return;
+        }
 
         // if there is no room, it was a mistake to give us the message
-        logger.assert_or_die(chatrooms.find(room_name) != chatrooms.end(),
+        NP1SEC_ASSERT_OR_DIE(chatrooms.find(room_name) != chatrooms.end(),
                              "np1sec can not receive messages from room " + room_name +
                                  " to which has not been informed to join");
 
+        if (!chatrooms[room_name].is_relevant(header)) {
+            NP1SEC_LOG_DEBUG("discarding irrelevant message from " + sender_nickname, __FUNCTION__, myself->nickname);
+            return;
+        }
+
+        Message received(nullptr); // so no decryption key here
+        ParseStatus parse_status = received.parse(received_message);
+        NP1SEC_TRACE4(message_parse, room_name.c_str(), static_cast<int>(parse_status),
+                      static_cast<int>(received.message_type), received_message.size());
+        if (parse_status != PARSE_OK) {
+            NP1SEC_LOG_DEBUG("dropping malformed message", __FUNCTION__, myself->nickname);
+            return;
+        }
+
+        received.sender_nick = sender_nickname;
+        // in case the transport is providing the message id (if it is zero means to
+        // trust the global order
+        received.message_id = message_id;
+
         chatrooms[room_name].receive_handler(received);
     } catch (std::exception& e) { // any unhandled error till here, we just
         // ignore as bad message
@@ -247,6 +354,73 @@ void UserState::receive_handler(std::string room_name, std::string sender_nickna
     }
 }
 
+void UserState::send_frame(std::string room_name, std::string frame)
+{
+    if (!ops->c_bundle_outbound_messages) {
+        NP1SEC_TRACE3(send_bare, room_name.c_str(), frame.size(), 1);
+        ops->send_bare(room_name, frame, ops->bare_sender_data);
+        return;
+    }
+
+    outbound_frames[room_name].push_back(frame);
+}
+
+void UserState::flush_outbound()
+{
+    // the queue is emptied even if the transport throws
+    std::map<std::string, std::vector<std::string>> flushed_frames;
+    flushed_frames.swap(outbound_frames);
+
+    for (auto& cur_room : flushed_frames) {
+        std::vector<std::string> bundled_frames;
+        size_t bundled_length = 0;
+        for (auto& cur_frame : cur_room.second) {
+            if (ops->c_max_message_size && !bundled_frames.empty() &&
+                Message::bundle_length(bundled_frames.size() + 1, bundled_length + cur_frame.size()) >
+                    ops->c_max_message_size) {
+                send_bundle(cur_room.first, bundled_frames);
+                bundled_frames.clear();
+                bundled_length = 0;
+            }
+
+            bundled_frames.push_back(cur_frame);
+            bundled_length += cur_frame.size();
+        }
+
+        send_bundle(cur_room.first, bundled_frames);
+    }
+}
+
+void* UserState::set_timer(timeout_callback timer_callback, void* opdata, uint32_t interval)
+{
+    void* timer = ops->timer_wheel ? ops->timer_wheel->set_timer(timer_callback, opdata, interval)
+                                   : ops->set_timer(timer_callback, opdata, interval, ops->bare_sender_data);
+    NP1SEC_TRACE3(timer_arm, opdata, interval, timer);
+
+    return timer;
+}
+
+void UserState::axe_timer(void* to_be_defused_timer)
+{
+    if (ops->timer_wheel)
+        ops->timer_wheel->axe_timer(to_be_defused_timer);
+    else
+        ops->axe_timer(to_be_defused_timer, ops->bare_sender_data);
+}
+
+void UserState::send_bundle(std::string room_name, const std::vector<std::string>& frames)
+{
+    if (frames.size() == 1) {
+        NP1SEC_TRACE3(send_bare, room_name.c_str(), frames[0].size(), 1);
+        ops->send_bare(room_name, frames[0], ops->bare_sender_data);
+    } else if (frames.size() > 1) {
+        Message bundle;
+        bundle.create_bundle_msg(frames);
+        NP1SEC_TRACE3(send_bare, room_name.c_str(), bundle.final_whole_message.size(), frames.size());
+        ops->send_bare(room_name, bundle.final_whole_message, ops->bare_sender_data);
+    }
+}
+
 /**
  * Exception:
  *
@@ -257,7 +431,9 @@ void UserState::receive_handler(std::string room_name, std::string sender_nickna
  */
 void UserState::send_handler(std::string room_name, std::string plain_message)
 {
-    logger.assert_or_die(chatrooms.find(room_name) != chatrooms.end(), "np1sec can not send messages to room " +
+    OutboundFlush flush(this);
+
+    NP1SEC_ASSERT_OR_DIE(chatrooms.find(room_name) != chatrooms.end(), "np1sec can not send messages to room " +
                                                                            room_name +
                                                                            " to which has not been informed to join");
     try {
@@ -269,6 +445,45 @@ void UserState::send_handler(std::string room_name, std::string plain_message)
     }
 }
 
+std::string UserState::begin_transfer(std::string room_name)
+{
+    OutboundFlush flush(this);
+
+    if (chatrooms.find(room_name) == chatrooms.end()) {
+        logger.error("unable to transfer to room " + room_name + ". user " + myself->nickname + " is not in the room",
+                     __FUNCTION__, myself->nickname);
+        throw InvalidRoomException();
+    }
+
+    return chatrooms[room_name].begin_transfer();
+}
+
+void UserState::write_transfer(std::string room_name, std::string transfer_id, std::string data)
+{
+    OutboundFlush flush(this);
+
+    if (chatrooms.find(room_name) == chatrooms.end()) {
+        logger.error("unable to transfer to room " + room_name + ". user " + myself->nickname + " is not in the room",
+                     __FUNCTION__, myself->nickname);
+        throw InvalidRoomException();
+    }
+
+    chatrooms[room_name].write_transfer(transfer_id, data);
+}
+
+void UserState::finish_transfer(std::string room_name, std::string transfer_id)
+{
+    OutboundFlush flush(this);
+
+    if (chatrooms.find(room_name) == chatrooms.end()) {
+        logger.error("unable to transfer to room " + room_name + ". user " + myself->nickname + " is not in the room",
+                     __FUNCTION__, myself->nickname);
+        throw InvalidRoomException();
+    }
+
+    chatrooms[room_name].finish_transfer(transfer_id);
+}
+
 } // namespace np1sec
 
 #endif // SRC_USERSTATE_CC_
@@ -21,6 +21,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 
 #include "src/common.h"
 #include "src/crypt.h"
@@ -49,6 +50,9 @@ class UserState
     RoomMap chatrooms;
     AppOps* ops;
 
+    // frames waiting for flush_outbound when bundling, indexed by room name
+    std::map<std::string, std::vector<std::string>> outbound_frames;
+
     /**
      * Constructor
      *
@@ -116,6 +120,21 @@ class UserState
      */
     void send_handler(std::string room_name, std::string plain_message);
 
+    /**
+     * Streams data too large for a message, e.g. a file, to the room. The
+     * client begins a transfer, writes the data to it in as many pieces
+     * as it likes and finishes it. Peers receive it through receive_chunk.
+     *
+     * Unlike send_handler, these throw if the room has no established
+     * session or if the session has changed since the transfer began, in
+     * which case the client needs to begin a new transfer.
+     *
+     * @return the id of the transfer
+     */
+    std::string begin_transfer(std::string room_name);
+    void write_transfer(std::string room_name, std::string transfer_id, std::string data);
+    void finish_transfer(std::string room_name, std::string transfer_id);
+
     /**
      * The client need to call this function whenever a message is received. This
      * function uses the content of the message and the status of the room to
@@ -155,6 +174,79 @@ class UserState
      */
     void increment_room_size(std::string room_name);
 
+    /**
+     * Reports how many standalone acks we have broadcasted in a room
+     * against how many acks rode on our user messages.
+     *
+     * @param room_name the chat room name
+     *
+     * throw an exception if the user isn't in the room.
+     */
+    AckCounters ack_counters(std::string room_name);
+
+    /**
+     * Reports the protocol counters of all the sessions we have had in a
+     * room and how long they took on average to reach each phase of their
+     * handshake.
+     *
+     * @param room_name the chat room name
+     *
+     * throw an exception if the user isn't in the room.
+     */
+    RoomMetrics room_metrics(std::string room_name);
+
+    /**
+     * Reports the protocol counters of the active session of a room and
+     * when it reached each phase of its handshake.
+     *
+     * @param room_name the chat room name
+     *
+     * throw an exception if the user isn't in the room.
+     */
+    SessionMetrics session_metrics(std::string room_name);
+
+    /**
+     * Reports roughly how many bytes the transcript of the active session
+     * of the room takes.
+     *
+     * @param room_name the chat room name
+     *
+     * throw an exception if the user isn't in the room.
+     */
+    size_t transcript_footprint(std::string room_name);
+
+    /**
+     * Reports the time our own messages take to come back to us in a room
+     * which c_adaptive_intervals derives the protocol intervals from.
+     *
+     * @param room_name the chat room name
+     *
+     * throw an exception if the user isn't in the room.
+     */
+    BroadcastLatencyEstimator broadcast_latency(std::string room_name);
+
+    /**
+     * hands a whole np1sec message to the transport, or queues it till
+     * the next flush_outbound if the app wants the messages bundled.
+     */
+    void send_frame(std::string room_name, std::string frame);
+
+    /**
+     * sends the queued messages of each room, as many in each BUNDLE as
+     * fit in c_max_message_size. A lone message is sent as it is.
+     */
+    void flush_outbound();
+
+    /**
+     * arms a timer on AppOps::timer_wheel if the app has given us one and
+     * through AppOps::set_timer otherwise
+     *
+     * @return a handle to the timer to be sent to axe_timer
+     */
+    void* set_timer(timeout_callback timer_callback, void* opdata, uint32_t interval);
+
+    void axe_timer(void* to_be_defused_timer);
+
     /**
      * Retrieve the session object associated with the given room name. To
      * allow sending and receiving of messages relative to that session
@@ -166,6 +258,41 @@ class UserState
     Session* retrieve_session(std::string room_name);
 
     ~UserState();
+
+  protected:
+    /**
+     * hands a message received directly or in a BUNDLE to its room
+     */
+    void receive_frame(std::string room_name, std::string sender_nickname, std::string received_message,
+                       uint32_t message_id);
+
+    /**
+     * sends the frames as one BUNDLE, or as it is if there is only one
+     */
+    void send_bundle(std::string room_name, const std::vector<std::string>& frames);
+};
+
+/**
+ * flushes the queued messages of the user state when the call from the
+ * app or the timer which has queued them returns, even if it throws
+ */
+class OutboundFlush
+{
+  protected:
+    UserState* us;
+
+  public:
+    explicit OutboundFlush(UserState* us) : us(us) {}
+
+    ~OutboundFlush()
+    {
+        try {
+            us->flush_outbound();
+        } catch (std::exception& e) {
+            logger.error(e.what(), __FUNCTION__, us->myself->nickname);
+            logger.error("unable to send bundled messages", __FUNCTION__, us->myself->nickname);
+        }
+    }
 };
 
 } // namespace np1sec
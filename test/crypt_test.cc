@@ -68,6 +68,101 @@ TEST_F(CryptTest, test_encrypt_decrypt)
     ASSERT_STREQ(test_text.c_str(), dec_text.c_str());
 }
 
+TEST_F(CryptTest, test_chunk_seal_open)
+{
+    np1secSymmetricKey session_key;
+    hash("session key", session_key);
+    ChunkCipher sender(session_key, "alice transfer");
+    ChunkCipher receiver(session_key, "alice transfer");
+    std::string chunk = "This is a chunk of a file";
+    std::string opened_chunk;
+
+    std::string sealed_chunk = sender.seal(3, false, chunk);
+    ASSERT_EQ(chunk.size() + c_chunk_tag_length, sealed_chunk.size());
+    ASSERT_TRUE(receiver.open(3, false, sealed_chunk, opened_chunk));
+    ASSERT_EQ(chunk, opened_chunk);
+
+    // moved, truncated or tampered chunks don't open
+    ASSERT_FALSE(receiver.open(4, false, sealed_chunk, opened_chunk));
+    ASSERT_FALSE(receiver.open(3, true, sealed_chunk, opened_chunk));
+    sealed_chunk[0] ^= 1;
+    ASSERT_FALSE(receiver.open(3, false, sealed_chunk, opened_chunk));
+
+    // nor do chunks of other transfers
+    ChunkCipher other(session_key, "bob transfer");
+    ASSERT_FALSE(other.open(0, true, sender.seal(0, true, chunk), opened_chunk));
+}
+
+TEST_F(CryptTest, test_tree_node_key_seal_open)
+{
+    HashStdBlock node_secret = hash("node secret", true);
+    HashStdBlock path_secret = hash("path secret", true);
+    HashStdBlock opened_secret;
+    TreeNodeKey node_key(node_secret);
+    std::string node_public_key = node_key.public_key();
+    ASSERT_EQ(c_tree_node_key_length, node_public_key.size());
+
+    std::string sealed_secret = TreeNodeKey::seal(node_public_key, path_secret, "sid");
+    ASSERT_EQ(c_sealed_path_secret_length, sealed_secret.size());
+    ASSERT_TRUE(node_key.open(sealed_secret, "sid", opened_secret));
+    ASSERT_EQ(path_secret, opened_secret);
+
+    // another context or another node gets garbage
+    ASSERT_TRUE(node_key.open(sealed_secret, "other sid", opened_secret));
+    ASSERT_NE(path_secret, opened_secret);
+    ASSERT_TRUE(TreeNodeKey(path_secret).open(sealed_secret, "sid", opened_secret));
+    ASSERT_NE(path_secret, opened_secret);
+
+    // and a truncated one nothing
+    ASSERT_FALSE(node_key.open(sealed_secret.substr(1), "sid", opened_secret));
+}
+
+TEST_F(CryptTest, test_message_key_ratchet)
+{
+    np1secSymmetricKey session_key;
+    hash("session key", session_key);
+    MessageKeyRatchet alice_ratchet, bob_ratchet;
+    alice_ratchet.init(session_key, 2, 0);
+    bob_ratchet.init(session_key, 2, 1);
+    std::string test_text = "This is a string to be encrypted";
+    std::string dec_text;
+
+    // bob can skip a message of alice, but it stays within his reach
+    std::string first_enc_text = alice_ratchet.encrypt(1, test_text);
+    std::string enc_text = alice_ratchet.encrypt(2, test_text);
+    ASSERT_TRUE(bob_ratchet.decrypt(0, 2, enc_text, dec_text));
+    ASSERT_EQ(test_text, dec_text);
+    ASSERT_TRUE(bob_ratchet.decrypt(0, 1, first_enc_text, dec_text));
+    ASSERT_EQ(test_text, dec_text);
+
+    // each sender has a chain of its own
+    ASSERT_TRUE(bob_ratchet.decrypt(1, 2, enc_text, dec_text));
+    ASSERT_NE(test_text, dec_text);
+
+    // the keys of the messages we are done with are gone, the message key
+    // stays for the rest of its fragments
+    bob_ratchet.forget_up_to(0, 2);
+    ASSERT_FALSE(bob_ratchet.decrypt(0, 1, first_enc_text, dec_text));
+    ASSERT_TRUE(bob_ratchet.decrypt(0, 2, enc_text, dec_text));
+    ASSERT_EQ(test_text, dec_text);
+    ASSERT_THROW(alice_ratchet.encrypt(1, test_text), CryptoException);
+
+    // and no one gets to make us hash a chain forever
+    ASSERT_FALSE(bob_ratchet.decrypt(0, 3 + MessageKeyRatchet::c_max_skipped_message_keys, enc_text, dec_text));
+
+    // a forged id within reach doesn't cost alice's next message its key
+    ASSERT_TRUE(bob_ratchet.decrypt(0, 2 + MessageKeyRatchet::c_max_skipped_message_keys, enc_text, dec_text));
+    ASSERT_NE(test_text, dec_text);
+    enc_text = alice_ratchet.encrypt(3, test_text);
+    ASSERT_TRUE(bob_ratchet.decrypt(0, 3, enc_text, dec_text));
+    ASSERT_EQ(test_text, dec_text);
+
+    // the reach is measured from the last authentic message
+    bob_ratchet.forget_up_to(0, 3);
+    ASSERT_TRUE(bob_ratchet.decrypt(0, 3 + MessageKeyRatchet::c_max_skipped_message_keys, enc_text, dec_text));
+    ASSERT_FALSE(bob_ratchet.decrypt(0, 4 + MessageKeyRatchet::c_max_skipped_message_keys, enc_text, dec_text));
+}
+
 TEST_F(CryptTest, test_sign_verify)
 {
     Cryptic cryptic;
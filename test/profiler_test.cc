@@ -0,0 +1,100 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2014, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <memory>
+#include <thread>
+
+#include "contrib/gtest/include/gtest/gtest.h"
+#include "src/profiler.h"
+
+using namespace np1sec;
+
+TEST(ProfilerTest, test_bucket_bounds)
+{
+    // every latency falls in a bucket whose ceiling is within 1/32 of it
+    for (uint64_t latency = 0; latency < (uint64_t(1) << 40); latency = latency * 5 / 4 + 1) {
+        unsigned bucket = LatencyHistogram::bucket_of(latency);
+        ASSERT_LT(bucket, LatencyHistogram::c_bucket_count);
+        uint64_t ceiling = LatencyHistogram::bucket_ceiling(bucket);
+        EXPECT_LE(latency, ceiling) << latency;
+        EXPECT_GE(latency + latency / LatencyHistogram::c_sub_bucket_count, ceiling) << latency;
+        if (bucket) {
+            EXPECT_LT(LatencyHistogram::bucket_ceiling(bucket - 1), latency) << latency;
+        }
+    }
+
+    EXPECT_EQ(LatencyHistogram::c_bucket_count - 1, LatencyHistogram::bucket_of(UINT64_MAX));
+}
+
+TEST(ProfilerTest, test_percentiles)
+{
+    std::unique_ptr<LatencyHistogram> histogram(new LatencyHistogram);
+    EXPECT_EQ(0u, histogram->summary().count);
+
+    // 1000 calls of 1 to 1000us and a stall of a second
+    for (uint64_t i = 1; i <= 1000; i++)
+        histogram->record(i * 1000);
+    histogram->record(1000000000);
+
+    LatencySummary latency_summary = histogram->summary();
+    EXPECT_EQ(1001u, latency_summary.count);
+    EXPECT_NEAR(500000, latency_summary.p50, 500000 / 32);
+    EXPECT_NEAR(990000, latency_summary.p99, 990000 / 32);
+    EXPECT_NEAR(1000000, latency_summary.p999, 1000000 / 32);
+    EXPECT_EQ(1000000000u, latency_summary.max);
+
+    std::unique_ptr<LatencyHistogram> merged(new LatencyHistogram);
+    merged->merge(*histogram);
+    merged->merge(*histogram);
+    EXPECT_EQ(2002u, merged->summary().count);
+    EXPECT_EQ(latency_summary.p50, merged->summary().p50);
+
+    histogram->reset();
+    EXPECT_EQ(0u, histogram->summary().count);
+    EXPECT_EQ(0u, histogram->summary().max);
+}
+
+#ifdef NP1SEC_PROFILING
+
+TEST(ProfilerTest, test_scoped_timers_across_threads)
+{
+    reset_profile();
+    {
+        NP1SEC_PROBE(PROBE_GROUP_ENC);
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+
+    // an exited thread leaves its latencies behind
+    std::thread([]() {
+        for (int i = 0; i < 10; i++) {
+            NP1SEC_PROBE(PROBE_GROUP_ENC);
+        }
+    }).join();
+
+    LatencySummary latency_summary = probe_summary(PROBE_GROUP_ENC);
+    EXPECT_EQ(11u, latency_summary.count);
+    EXPECT_LE(2000000u, latency_summary.max);
+    EXPECT_GT(2000000u, latency_summary.p50);
+    EXPECT_NE(std::string::npos, profile_report().find("Session::group_enc"));
+
+    reset_profile();
+    EXPECT_EQ(0u, probe_summary(PROBE_GROUP_ENC).count);
+    EXPECT_TRUE(profile_report().empty());
+}
+
+#endif // NP1SEC_PROFILING
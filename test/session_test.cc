@@ -78,6 +78,50 @@ class SessionTest : public ::testing::Test
         // mock_server.initialize_event_manager(base);
         // Configure the logger to write to `callback_log` for the sake of checking
     };
+
+    // the users of the multiparty tests, user i is nicks[i] and runs on
+    // user_mockops[i] which has to outlive it
+    std::vector<std::pair<ChatMocker*, string>> mock_aux_data;
+    std::vector<UserState*> user_states;
+    std::vector<pair<UserState*, ChatMocker*>> server_states;
+
+    /**
+     * makes a user of every nick and signs them all in to the mock server
+     */
+    void sign_in_users(const std::vector<std::string>& nicks, std::vector<AppOps>& user_mockops)
+    {
+        for (auto& cur_nick : nicks)
+            mock_aux_data.push_back(std::pair<ChatMocker*, string>(&mock_server, cur_nick));
+        for (size_t i = 0; i < nicks.size(); i++) {
+            user_mockops[i].bare_sender_data = static_cast<void*>(&mock_aux_data[i]);
+            user_states.push_back(new UserState(nicks[i], &user_mockops[i]));
+            user_states[i]->init();
+            server_states.push_back(pair<UserState*, ChatMocker*>(user_states[i], &mock_server));
+        }
+
+        for (size_t i = 0; i < nicks.size(); i++)
+            mock_server.sign_in(nicks[i], chat_mocker_np1sec_plugin_receive_handler,
+                                static_cast<void*>(&server_states[i]));
+    }
+
+    /**
+     * the signed in users join the room in order, each once the previous
+     * one is in
+     */
+    void join_one_by_one()
+    {
+        for (auto cur_state : user_states) {
+            mock_server.join(mock_room_name, cur_state->user_nick());
+            mock_server.receive();
+        }
+    }
+
+    void delete_users()
+    {
+        for (auto cur_state : user_states)
+            delete cur_state;
+        user_states.clear();
+    }
 };
 
 /*TEST_F(SessionTest, test_add_message_to_transcript) {
@@ -583,6 +627,47 @@ TEST_F(SessionTest, test_concurrent_join)
     delete charlie_state;
 }
 
+TEST_F(SessionTest, test_batched_admission)
+{
+    static uint32_t alice_sessions;
+    static std::vector<std::string> alice_view;
+    static std::string alice_received;
+    alice_sessions = 0;
+    alice_view.clear();
+    alice_received.clear();
+
+    std::vector<std::string> nicks = {"alice", "bob", "charlie", "david"};
+    std::vector<AppOps> user_mockops(nicks.size(), *mockops);
+    user_mockops[0].join = [](std::string, std::vector<std::string> plist, void*) {
+        alice_sessions++;
+        alice_view = plist;
+    };
+    user_mockops[0].display_message = [](std::string, std::string sender_nick, std::string message, void*) {
+        if (sender_nick == "david")
+            alice_received = message;
+    };
+
+    sign_in_users(nicks, user_mockops);
+
+    mock_server.join(mock_room_name, nicks[0]);
+    mock_server.receive();
+    ASSERT_EQ(1u, alice_sessions);
+
+    // everybody else rushes in at once and is admitted by a single session
+    for (size_t i = 1; i < nicks.size(); i++)
+        mock_server.join(mock_room_name, nicks[i]);
+    mock_server.receive();
+
+    EXPECT_EQ(2u, alice_sessions);
+    EXPECT_EQ(nicks, alice_view);
+
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Hello, batch", &server_states[3]);
+    mock_server.receive();
+    EXPECT_EQ("Hello, batch", alice_received);
+
+    delete_users();
+}
+
 TEST_F(SessionTest, test_concurrent_join_leave)
 {
 
@@ -663,3 +748,960 @@ TEST_F(SessionTest, test_concurrent_join_leave)
     delete charlie_state;
     delete david_state;
 }
+
+TEST_F(SessionTest, test_batched_leave)
+{
+    static const uint32_t c_test_leave_batch_interval = 4321;
+    static std::vector<std::pair<timeout_callback, void*>> leave_batch_timers;
+    static uint32_t group_shares_sent;
+    static std::string david_received;
+    leave_batch_timers.clear();
+    group_shares_sent = 0;
+    david_received.clear();
+
+    AppOps batch_mockops = *mockops;
+    batch_mockops.c_leave_batch_interval = c_test_leave_batch_interval;
+    batch_mockops.send_bare = [](std::string room_name, std::string message, void* data) {
+        Message header;
+        if (header.peek_header(message) && header.message_type == Message::GROUP_SHARE)
+            group_shares_sent++;
+        send_bare(room_name, message, data);
+    };
+    // the mocker neither fires the timers by itself nor hands out their
+    // handles, we fire the leave batch timers of the stayers when we see fit
+    batch_mockops.set_timer = [](timeout_callback timer_callback, void* opdata, uint32_t interval, void* data) {
+        if (interval != c_test_leave_batch_interval)
+            return set_timer(timer_callback, opdata, interval, data);
+
+        std::string setter = reinterpret_cast<std::pair<ChatMocker*, std::string>*>(data)->second;
+        if (setter == "alice" || setter == "david")
+            leave_batch_timers.push_back(std::pair<timeout_callback, void*>(timer_callback, opdata));
+        return static_cast<void*>(&leave_batch_timers);
+    };
+
+    std::vector<std::string> nicks = {"alice", "bob", "charlie", "david"};
+    std::vector<AppOps> user_mockops(nicks.size(), batch_mockops);
+    user_mockops[3].display_message = [](std::string, std::string sender_nick, std::string message, void*) {
+        if (sender_nick == "alice")
+            david_received = message;
+    };
+
+    sign_in_users(nicks, user_mockops);
+    join_one_by_one();
+
+    // bob and charlie drop out together, the stayers wait for the window
+    group_shares_sent = 0;
+    mock_server.leave(mock_room_name, "bob");
+    mock_server.leave(mock_room_name, "charlie");
+    mock_server.receive();
+    EXPECT_EQ(0u, group_shares_sent);
+    ASSERT_EQ(2u, leave_batch_timers.size());
+
+    // and then shrink them both out in one go
+    for (auto& cur_timer : leave_batch_timers)
+        cur_timer.first(cur_timer.second);
+    mock_server.receive();
+    EXPECT_EQ(2u, group_shares_sent);
+
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Hello, survivor", &server_states[0]);
+    mock_server.receive();
+    EXPECT_EQ("Hello, survivor", david_received);
+
+    delete_users();
+}
+
+TEST_F(SessionTest, test_lazy_refreshed_limbo_sessions)
+{
+    static const uint32_t c_test_session_life_span = 43210;
+    static std::map<std::string, std::pair<timeout_callback, void*>> life_timers;
+    static bool dropping_shares;
+    static bool alice_admitted;
+    static bool holding_alice_views;
+    static std::vector<std::string> held_alice_views;
+    static std::string bob_received;
+    life_timers.clear();
+    dropping_shares = false;
+    alice_admitted = false;
+    holding_alice_views = false;
+    held_alice_views.clear();
+    bob_received.clear();
+
+    AppOps lazy_mockops = *mockops;
+    lazy_mockops.c_session_life_span = c_test_session_life_span;
+    lazy_mockops.send_bare = [](std::string room_name, std::string message, void* data) {
+        Message header;
+        bool has_header = header.peek_header(message);
+        std::string sender = reinterpret_cast<std::pair<ChatMocker*, std::string>*>(data)->second;
+        if (dropping_shares && has_header && header.message_type == Message::GROUP_SHARE)
+            return;
+
+        if (holding_alice_views && sender == "alice" && has_header &&
+            header.message_type == Message::PARTICIPANTS_INFO) {
+            held_alice_views.push_back(message);
+            return;
+        }
+
+        send_bare(room_name, message, data);
+    };
+    // we fire the latest life timer of everybody when we see fit
+    lazy_mockops.set_timer = [](timeout_callback timer_callback, void* opdata, uint32_t interval, void* data) {
+        if (interval != c_test_session_life_span)
+            return set_timer(timer_callback, opdata, interval, data);
+
+        std::string setter = reinterpret_cast<std::pair<ChatMocker*, std::string>*>(data)->second;
+        life_timers[setter] = std::pair<timeout_callback, void*>(timer_callback, opdata);
+        return static_cast<void*>(&life_timers);
+    };
+
+    std::vector<std::string> nicks = {"alice", "bob", "charlie"};
+    std::vector<AppOps> user_mockops(nicks.size(), lazy_mockops);
+    // the room tells alice about a session before it refreshes the limbo
+    user_mockops[0].join = [](std::string room_name, std::vector<std::string> plist, void* aux_data) {
+        if (plist.size() == 3 && !alice_admitted) {
+            alice_admitted = true;
+            holding_alice_views = true;
+        }
+        new_session_announce(room_name, plist, aux_data);
+    };
+    user_mockops[1].display_message = [](std::string, std::string sender_nick, std::string message, void*) {
+        if (sender_nick == "alice")
+            bob_received = message;
+    };
+
+    sign_in_users(nicks, user_mockops);
+    for (size_t i = 0; i < 2; i++) {
+        mock_server.join(mock_room_name, nicks[i]);
+        mock_server.receive();
+    }
+
+    // alice and bob start resessioning but their shares get lost, so the
+    // resession is still in limbo when the admission of charlie goes first
+    dropping_shares = true;
+    for (size_t i = 0; i < 2; i++)
+        life_timers[nicks[i]].first(life_timers[nicks[i]].second);
+    dropping_shares = false;
+
+    mock_server.join(mock_room_name, "charlie");
+    mock_server.receive();
+
+    // both refresh the stale resession onto the admission but only sow it.
+    // alice, first in the view, grows hers at once to tell the others
+    RoomMetrics alice_room = user_states[0]->room_metrics(mock_room_name);
+    RoomMetrics bob_room = user_states[1]->room_metrics(mock_room_name);
+    EXPECT_EQ(1u, alice_room.limbo_sessions_sown);
+    EXPECT_EQ(1u, alice_room.limbo_sessions_grown);
+    EXPECT_EQ(1u, bob_room.limbo_sessions_sown);
+    EXPECT_EQ(0u, bob_room.limbo_sessions_grown);
+    EXPECT_EQ(0u, user_states[2]->room_metrics(mock_room_name).limbo_sessions_sown);
+    ASSERT_EQ(1u, held_alice_views.size());
+
+    // bob grows his once alice talks to it
+    holding_alice_views = false;
+    for (auto& cur_view : held_alice_views)
+        send_bare(mock_room_name, cur_view, &mock_aux_data[0]);
+    mock_server.receive();
+    EXPECT_EQ(1u, user_states[1]->room_metrics(mock_room_name).limbo_sessions_grown);
+
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Hello, Bob", &server_states[0]);
+    mock_server.receive();
+    EXPECT_EQ("Hello, Bob", bob_received);
+
+    delete_users();
+}
+
+TEST_F(SessionTest, test_piggybacked_acks)
+{
+    string alice = "alice";
+    AppOps alice_mockops = *mockops;
+    std::pair<ChatMocker*, string> mock_aux_alice_data(&mock_server, alice);
+    alice_mockops.bare_sender_data = static_cast<void*>(&mock_aux_alice_data);
+    UserState* alice_state = new UserState(alice, &alice_mockops);
+    alice_state->init();
+
+    AppOps bob_mockops = *mockops;
+    string bob = "bob";
+    std::pair<ChatMocker*, string> mock_aux_bob_data(&mock_server, bob);
+    bob_mockops.bare_sender_data = static_cast<void*>(&mock_aux_bob_data);
+    UserState* bob_state = new UserState(bob, &bob_mockops);
+    bob_state->init();
+
+    pair<UserState*, ChatMocker*> alice_server_state(alice_state, &mock_server);
+    pair<UserState*, ChatMocker*> bob_server_state(bob_state, &mock_server);
+
+    mock_server.sign_in(alice, chat_mocker_np1sec_plugin_receive_handler, static_cast<void*>(&alice_server_state));
+    mock_server.sign_in(bob, chat_mocker_np1sec_plugin_receive_handler, static_cast<void*>(&bob_server_state));
+
+    mock_server.join(mock_room_name, alice_state->user_nick());
+    mock_server.receive();
+
+    mock_server.join(mock_room_name, bob_state->user_nick());
+    mock_server.receive();
+
+    // alice speaks twice, bob answers once and his answer acks both
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Hello, I'm Alice!", &alice_server_state);
+    mock_server.receive();
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Anybody here?", &alice_server_state);
+    mock_server.receive();
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Hi Alice, Bob here.", &bob_server_state);
+    mock_server.receive();
+
+    AckCounters alice_counters = alice_state->ack_counters(mock_room_name);
+    AckCounters bob_counters = bob_state->ack_counters(mock_room_name);
+
+    EXPECT_EQ(2u, alice_counters.user_messages_sent);
+    EXPECT_EQ(1u, alice_counters.user_messages_received);
+    EXPECT_EQ(0u, alice_counters.piggybacked_acks);
+
+    EXPECT_EQ(1u, bob_counters.user_messages_sent);
+    EXPECT_EQ(2u, bob_counters.user_messages_received);
+    EXPECT_EQ(1u, bob_counters.piggybacked_acks);
+    EXPECT_EQ(0u, bob_counters.standalone_acks_sent);
+    EXPECT_EQ(0, bob_counters.amplification_factor());
+
+    delete alice_state;
+    delete bob_state;
+}
+
+TEST_F(SessionTest, test_in_band_resession)
+{
+    static const uint32_t c_test_session_life_span = 54321;
+    static std::vector<std::pair<timeout_callback, void*>> alice_life_timers;
+    static uint32_t handshake_messages_sent;
+    static uint32_t charlie_sessions;
+    static std::string charlie_received;
+    alice_life_timers.clear();
+    handshake_messages_sent = 0;
+    charlie_sessions = 0;
+    charlie_received.clear();
+
+    AppOps in_band_mockops = *mockops;
+    in_band_mockops.c_session_life_span = c_test_session_life_span;
+    in_band_mockops.c_in_band_resession = true;
+    in_band_mockops.send_bare = [](std::string room_name, std::string message, void* data) {
+        Message header;
+        if (header.peek_header(message) &&
+            (header.message_type == Message::GROUP_SHARE || header.message_type == Message::SESSION_CONFIRMATION))
+            handshake_messages_sent++;
+        send_bare(room_name, message, data);
+    };
+    // the mocker does not fire the timers by itself, we age the session of
+    // alice when we see fit
+    in_band_mockops.set_timer = [](timeout_callback timer_callback, void* opdata, uint32_t interval, void* data) {
+        std::string setter = reinterpret_cast<std::pair<ChatMocker*, std::string>*>(data)->second;
+        if (interval == c_test_session_life_span && setter == "alice")
+            alice_life_timers.push_back(std::pair<timeout_callback, void*>(timer_callback, opdata));
+        return set_timer(timer_callback, opdata, interval, data);
+    };
+
+    std::vector<std::string> nicks = {"alice", "bob", "charlie"};
+    std::vector<AppOps> user_mockops(nicks.size(), in_band_mockops);
+    user_mockops[2].join = [](std::string, std::vector<std::string>, void*) { charlie_sessions++; };
+    user_mockops[2].display_message = [](std::string, std::string sender_nick, std::string message, void*) {
+        if (sender_nick == "alice")
+            charlie_received = message;
+    };
+
+    sign_in_users(nicks, user_mockops);
+    join_one_by_one();
+    ASSERT_EQ(1u, charlie_sessions);
+
+    // the session of alice grows old, her next message carries her share of
+    // the next session and everybody's reply carries theirs. The second
+    // round runs on the ephemeral keys piggybacked in the first one
+    handshake_messages_sent = 0;
+    for (uint32_t round = 1; round <= 2; round++) {
+        alice_life_timers.back().first(alice_life_timers.back().second);
+        for (auto& cur_server_state : server_states) {
+            chat_mocker_np1sec_plugin_send(mock_room_name, "Ratchet!", &cur_server_state);
+            mock_server.receive();
+        }
+
+        EXPECT_EQ(1u + round, charlie_sessions);
+
+        chat_mocker_np1sec_plugin_send(mock_room_name, "Hello, next session", &server_states[0]);
+        mock_server.receive();
+        EXPECT_EQ("Hello, next session", charlie_received);
+        charlie_received.clear();
+    }
+
+    EXPECT_EQ(0u, handshake_messages_sent);
+
+    delete_users();
+}
+
+TEST_F(SessionTest, test_bounded_transcript)
+{
+    const size_t max_transcript_blocks = 16;
+    std::vector<std::string> user_nicks = {"alice", "bob", "charlie"};
+    std::vector<AppOps> user_mockops(user_nicks.size(), *mockops);
+    for (auto& cur_mockops : user_mockops)
+        cur_mockops.c_max_transcript_blocks = max_transcript_blocks;
+
+    sign_in_users(user_nicks, user_mockops);
+    join_one_by_one();
+
+    // everybody acks by talking, so the transcript is checkpointed as it goes
+    size_t chatting_footprint = 0;
+    for (uint32_t round = 0; round < 40; round++) {
+        if (round == 10)
+            chatting_footprint = user_states[0]->transcript_footprint(mock_room_name);
+
+        for (size_t i = 0; i < user_nicks.size(); i++) {
+            chat_mocker_np1sec_plugin_send(mock_room_name, "Hello from " + user_nicks[i], &server_states[i]);
+            mock_server.receive();
+        }
+    }
+
+    EXPECT_LT(0u, chatting_footprint);
+    EXPECT_GE(chatting_footprint, user_states[0]->transcript_footprint(mock_room_name));
+
+    // alice talks to herself, nobody acks and only the cap holds the
+    // transcript
+    size_t monologue_footprint = 0;
+    for (uint32_t i = 0; i < 4 * max_transcript_blocks; i++) {
+        if (i == 2 * max_transcript_blocks)
+            monologue_footprint = user_states[0]->transcript_footprint(mock_room_name);
+
+        chat_mocker_np1sec_plugin_send(mock_room_name, "Anybody here?", &server_states[0]);
+        mock_server.receive();
+    }
+
+    EXPECT_GE(monologue_footprint, user_states[0]->transcript_footprint(mock_room_name));
+
+    delete_users();
+}
+
+TEST_F(SessionTest, test_lost_own_message)
+{
+    // the transport loses one message of alice's, the next comes back
+    static bool drop_next_stanza;
+    static uint32_t lost_message_directives;
+    drop_next_stanza = false;
+    lost_message_directives = 0;
+
+    std::vector<AppOps> user_mockops(2, *mockops);
+    user_mockops[0].send_bare = [](std::string room_name, std::string message, void* data) {
+        if (drop_next_stanza) {
+            drop_next_stanza = false;
+            return;
+        }
+        send_bare(room_name, message, data);
+    };
+    user_mockops[0].display_message = [](std::string, std::string sender_nick, std::string message, void*) {
+        if (sender_nick == "np1sec directive" && message == "we did not receive our own sent message")
+            lost_message_directives++;
+    };
+
+    sign_in_users({"alice", "bob"}, user_mockops);
+    join_one_by_one();
+
+    drop_next_stanza = true;
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Lost in transit", &server_states[0]);
+    mock_server.receive();
+    EXPECT_EQ(0u, lost_message_directives);
+
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Made it", &server_states[0]);
+    mock_server.receive();
+    EXPECT_EQ(1u, lost_message_directives);
+    EXPECT_LE(1u, user_states[0]->session_metrics(mock_room_name).counters.consistency_failures);
+
+    // and it is only reported once
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Still here", &server_states[0]);
+    mock_server.receive();
+    EXPECT_EQ(1u, lost_message_directives);
+
+    delete_users();
+}
+
+/**
+ * Checks the consistency block of a 100 person room keeps the hashes and
+ * the pending acks apart per participant and prints how much smaller it
+ * is than a vector of per participant blocks with a heap allocated hash
+ * and a timer each.
+ */
+TEST_F(SessionTest, test_consistency_block_layout)
+{
+    const size_t room_size = 100;
+    ConsistencyBlock consistency_block(room_size);
+
+    HashBlock hb;
+    np1sec::hash("transcript", hb);
+    HashStdBlock full_hash = hash_to_string_buff(hb);
+    consistency_block.set_hash(0, hb);
+    consistency_block.set_hash(room_size - 1, full_hash.substr(0, c_truncated_transcript_hash_length));
+    consistency_block.set_hash(room_size / 2, HashStdBlock(c_hash_length, '\0'));
+
+    EXPECT_EQ(full_hash, consistency_block.hash(0));
+    EXPECT_FALSE(consistency_block.has_hash(1));
+    EXPECT_TRUE(consistency_block.hash_matches(0, room_size - 1));
+    EXPECT_FALSE(consistency_block.hash_matches(0, room_size / 2));
+    EXPECT_FALSE(consistency_block.hash_matches(0, 1));
+    EXPECT_TRUE(consistency_block.hash_matches(1, 2));
+
+    for (size_t i = 1; i < room_size; i++)
+        consistency_block.expect_ack(i);
+    for (size_t i = 1; i < room_size - 1; i++)
+        consistency_block.clear_ack(i);
+
+    EXPECT_FALSE(consistency_block.ack_pending(0));
+    EXPECT_TRUE(consistency_block.ack_pending(room_size - 1));
+    EXPECT_TRUE(consistency_block.acks_pending());
+    consistency_block.clear_ack(room_size - 1);
+    EXPECT_FALSE(consistency_block.acks_pending());
+
+    // a std::string holding a hash, a timer and its {session, participant, id} ops
+    size_t per_participant_footprint = sizeof(HashStdBlock) + c_hash_length + 1 + sizeof(void*) +
+                                       2 * sizeof(void*) + sizeof(MessageId);
+    EXPECT_GT(room_size * per_participant_footprint, 2 * consistency_block.footprint());
+
+    std::cout << "consistency state per message in a " << room_size << " person room: per participant blocks "
+              << room_size * per_participant_footprint << " bytes, consistency block "
+              << consistency_block.footprint() << " bytes" << std::endl;
+}
+
+/**
+ * Counts the host timers armed while eight participants chat. Each
+ * received message used to arm an ack timer per other participant, now
+ * a session keeps at most one armed for its earliest ack deadline.
+ */
+TEST_F(SessionTest, test_single_ack_deadline_timer)
+{
+    static bool counting;
+    static uint32_t timers_set;
+    static int armed_handle;
+    counting = false;
+    timers_set = 0;
+
+    AppOps counting_mockops = *mockops;
+    // the mocker never fires its timers and hands out null handles, which
+    // the sessions take as unarmed, so we hand out a real one while counting
+    counting_mockops.set_timer = [](timeout_callback timer_callback, void* opdata, uint32_t interval, void* data) {
+        if (!counting)
+            return set_timer(timer_callback, opdata, interval, data);
+
+        timers_set++;
+        return static_cast<void*>(&armed_handle);
+    };
+    counting_mockops.axe_timer = [](void* to_be_defused_timer, void* data) {
+        if (to_be_defused_timer != &armed_handle)
+            axe_timer(to_be_defused_timer, data);
+    };
+
+    std::vector<std::string> user_nicks = {"alice", "bob", "charlie", "david", "eve", "frank", "grace", "heidi"};
+    std::vector<AppOps> user_mockops(user_nicks.size(), counting_mockops);
+    sign_in_users(user_nicks, user_mockops);
+    join_one_by_one();
+
+    counting = true;
+    const uint32_t rounds = 10;
+    for (uint32_t round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < user_nicks.size(); i++) {
+            chat_mocker_np1sec_plugin_send(mock_room_name, "Hello from " + user_nicks[i], &server_states[i]);
+            mock_server.receive();
+        }
+    }
+    counting = false;
+
+    // the timer for our own message to come back, the send ack timer and
+    // the ack deadline timer, none of them per participant
+    uint32_t messages_sent = rounds * user_nicks.size();
+    EXPECT_LT(0u, timers_set);
+    EXPECT_GE(3 * messages_sent, timers_set);
+
+    std::cout << "host timers armed per message in a " << user_nicks.size()
+              << " person room: " << static_cast<double>(timers_set) / messages_sent << std::endl;
+
+    delete_users();
+}
+
+TEST_F(SessionTest, test_shared_timer_wheel)
+{
+    static uint32_t host_timers_set;
+    host_timers_set = 0;
+
+    TimerWheel wheel(10);
+    AppOps wheel_mockops = *mockops;
+    wheel_mockops.timer_wheel = &wheel;
+    wheel_mockops.set_timer = [](timeout_callback timer_callback, void* opdata, uint32_t interval, void* data) {
+        host_timers_set++;
+        return set_timer(timer_callback, opdata, interval, data);
+    };
+
+    std::vector<std::string> user_nicks = {"alice", "bob", "charlie"};
+    std::vector<AppOps> user_mockops(user_nicks.size(), wheel_mockops);
+    sign_in_users(user_nicks, user_mockops);
+    join_one_by_one();
+
+    for (size_t i = 0; i < user_nicks.size(); i++) {
+        chat_mocker_np1sec_plugin_send(mock_room_name, "Hello from " + user_nicks[i], &server_states[i]);
+        mock_server.receive();
+    }
+
+    // all the timers of all the users are on the wheel
+    EXPECT_EQ(0u, host_timers_set);
+    EXPECT_LT(0u, wheel.size());
+
+    delete_users();
+
+    EXPECT_EQ(0u, wheel.size());
+}
+
+TEST_F(SessionTest, test_broadcast_latency_estimator)
+{
+    BroadcastLatencyEstimator estimator;
+    estimator.add_sample(20);
+    EXPECT_EQ(20u, estimator.smoothed_round_trip);
+    EXPECT_EQ(60u, estimator.allowance());
+
+    for (uint32_t i = 0; i < 50; i++)
+        estimator.add_sample(20);
+    EXPECT_EQ(20u, estimator.smoothed_round_trip);
+    EXPECT_GT(30u, estimator.allowance());
+
+    // the server gets loaded, the allowance widens at once and settles later
+    estimator.add_sample(2000);
+    EXPECT_LT(2000u, estimator.allowance());
+    for (uint32_t i = 0; i < 50; i++)
+        estimator.add_sample(2000);
+    EXPECT_NEAR(2000, estimator.smoothed_round_trip, 10);
+    EXPECT_GT(2200u, estimator.allowance());
+}
+
+TEST_F(SessionTest, test_adaptive_intervals)
+{
+    AppOps adaptive_mockops = *mockops;
+    adaptive_mockops.c_adaptive_intervals = true;
+
+    std::vector<std::string> user_nicks = {"alice", "bob"};
+    std::vector<AppOps> user_mockops(user_nicks.size(), adaptive_mockops);
+    sign_in_users(user_nicks, user_mockops);
+    join_one_by_one();
+
+    EXPECT_EQ(0u, user_states[0]->broadcast_latency(mock_room_name).sample_count);
+    for (uint32_t i = 0; i < 10; i++) {
+        chat_mocker_np1sec_plugin_send(mock_room_name, "Hello", &server_states[0]);
+        mock_server.receive();
+    }
+
+    // the mocker delivers at once, so the allowance is well below the
+    // configured 2 * BROADCAST_LATENCY
+    BroadcastLatencyEstimator alice_latency = user_states[0]->broadcast_latency(mock_room_name);
+    EXPECT_EQ(10u, alice_latency.sample_count);
+    EXPECT_GT(2 * mockops->c_broadcast_latency, alice_latency.allowance());
+
+    delete_users();
+}
+
+TEST_F(SessionTest, test_handshake_metrics)
+{
+    static uint32_t activations;
+    static uint32_t activated_triple_dhs;
+    activations = 0;
+    activated_triple_dhs = 0;
+
+    AppOps metered_mockops = *mockops;
+    metered_mockops.session_activated = [](std::string, const SessionMetrics& metrics, void*) {
+        activations++;
+        activated_triple_dhs += metrics.counters.triple_dhs;
+        EXPECT_TRUE(metrics.reached(IN_SESSION_PHASE));
+    };
+
+    std::vector<std::string> user_nicks = {"alice", "bob"};
+    std::vector<AppOps> user_mockops(user_nicks.size(), metered_mockops);
+    sign_in_users(user_nicks, user_mockops);
+    join_one_by_one();
+
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Hello", &server_states[0]);
+    mock_server.receive();
+
+    // bob joined, so his session went through every phase, alice's
+    // started re-shared
+    SessionMetrics bob_session = user_states[1]->session_metrics(mock_room_name);
+    for (uint32_t phase = JOIN_REQUESTED_PHASE; phase < TOTAL_NO_OF_HANDSHAKE_PHASES; phase++)
+        EXPECT_TRUE(bob_session.reached(static_cast<HandshakePhase>(phase))) << phase;
+    EXPECT_LE(bob_session.time_to(RE_SHARED_PHASE), bob_session.time_to(IN_SESSION_PHASE));
+    EXPECT_EQ(1u, bob_session.counters.by_type[Message::SESSION_CONFIRMATION].messages_sent);
+    EXPECT_EQ(1u, bob_session.counters.by_type[Message::IN_SESSION_MESSAGE].messages_received);
+    EXPECT_LT(0u, bob_session.counters.by_phase[JOIN_REQUESTED_PHASE].bytes_received);
+    EXPECT_LT(0u, bob_session.counters.triple_dhs);
+    EXPECT_LT(0u, bob_session.counters.signature_verifications);
+
+    SessionMetrics alice_session = user_states[0]->session_metrics(mock_room_name);
+    EXPECT_FALSE(alice_session.reached(JOIN_REQUESTED_PHASE));
+    EXPECT_TRUE(alice_session.reached(IN_SESSION_PHASE));
+
+    // the room counts bob's join request and the sessions it has had
+    RoomMetrics bob_room = user_states[1]->room_metrics(mock_room_name);
+    EXPECT_EQ(1u, bob_room.counters.by_type[Message::JOIN_REQUEST].messages_sent);
+    EXPECT_LE(1u, bob_room.phase_reached_count[IN_SESSION_PHASE]);
+    EXPECT_EQ(0u, bob_room.counters.ack_failures);
+    EXPECT_EQ(0u, bob_room.counters.consistency_failures);
+    EXPECT_EQ(bob_room.counters.total().messages_sent, [&bob_room]() {
+        uint32_t messages_sent = 0;
+        for (auto& cur_traffic : bob_room.counters.by_type)
+            messages_sent += cur_traffic.messages_sent;
+        return messages_sent;
+    }());
+
+    // both were told of the session they share
+    EXPECT_LE(2u, activations);
+    EXPECT_LT(0u, activated_triple_dhs);
+    EXPECT_THROW(user_states[0]->room_metrics("no such room"), InvalidRoomException);
+
+    delete_users();
+}
+
+TEST_F(SessionTest, test_mixed_delta_session_views)
+{
+    // charlie doesn't take delta views, like a peer older than them, so
+    // nobody sends deltas while he's in the room
+    static uint32_t full_views;
+    static uint32_t delta_views;
+    full_views = 0;
+    delta_views = 0;
+
+    std::vector<AppOps> user_mockops(4, *mockops);
+    for (auto& cur_mockops : user_mockops) {
+        cur_mockops.c_delta_session_views = true;
+        cur_mockops.send_bare = [](std::string room_name, std::string message, void* data) {
+            Message header, view_message;
+            if (header.peek_header(message) && header.message_type == Message::PARTICIPANTS_INFO &&
+                view_message.parse(message) == PARSE_OK)
+                (view_message.has_delta_view() ? delta_views : full_views)++;
+            send_bare(room_name, message, data);
+        };
+    }
+    user_mockops[3].c_delta_session_views = false;
+
+    sign_in_users({"alice", "bob", "dave", "charlie"}, user_mockops);
+
+    // alice answers bob and dave with the full view, bob answers dave with a delta
+    for (size_t i = 0; i < 3; i++) {
+        mock_server.join(mock_room_name, user_states[i]->user_nick());
+        mock_server.receive();
+    }
+    EXPECT_EQ(2u, full_views);
+    EXPECT_EQ(1u, delta_views);
+
+    // alice, bob and dave answer charlie with the full view
+    mock_server.join(mock_room_name, "charlie");
+    mock_server.receive();
+    EXPECT_EQ(5u, full_views);
+    EXPECT_EQ(1u, delta_views);
+
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Hello, Charlie", &server_states[0]);
+    mock_server.receive();
+    EXPECT_EQ(1u, user_states[3]->ack_counters(mock_room_name).user_messages_received);
+
+    delete_users();
+}
+
+TEST_F(SessionTest, test_compact_in_session_messages)
+{
+    // alice sends compact in-session messages, bob sticks to v1
+    string alice = "alice";
+    AppOps alice_mockops = *mockops;
+    alice_mockops.c_in_session_protocol_version = c_np1sec_compact_protocol_version;
+    std::pair<ChatMocker*, string> mock_aux_alice_data(&mock_server, alice);
+    alice_mockops.bare_sender_data = static_cast<void*>(&mock_aux_alice_data);
+    UserState* alice_state = new UserState(alice, &alice_mockops);
+    alice_state->init();
+
+    AppOps bob_mockops = *mockops;
+    string bob = "bob";
+    std::pair<ChatMocker*, string> mock_aux_bob_data(&mock_server, bob);
+    bob_mockops.bare_sender_data = static_cast<void*>(&mock_aux_bob_data);
+    UserState* bob_state = new UserState(bob, &bob_mockops);
+    bob_state->init();
+
+    pair<UserState*, ChatMocker*> alice_server_state(alice_state, &mock_server);
+    pair<UserState*, ChatMocker*> bob_server_state(bob_state, &mock_server);
+
+    mock_server.sign_in(alice, chat_mocker_np1sec_plugin_receive_handler, static_cast<void*>(&alice_server_state));
+    mock_server.sign_in(bob, chat_mocker_np1sec_plugin_receive_handler, static_cast<void*>(&bob_server_state));
+
+    mock_server.join(mock_room_name, alice_state->user_nick());
+    mock_server.receive();
+
+    mock_server.join(mock_room_name, bob_state->user_nick());
+    mock_server.receive();
+
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Hello, I'm Alice!", &alice_server_state);
+    mock_server.receive();
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Hi Alice, Bob here.", &bob_server_state);
+    mock_server.receive();
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Nice to meet you Bob.", &alice_server_state);
+    mock_server.receive();
+
+    EXPECT_EQ(2u, bob_state->ack_counters(mock_room_name).user_messages_received);
+    EXPECT_EQ(1u, alice_state->ack_counters(mock_room_name).user_messages_received);
+
+    delete alice_state;
+    delete bob_state;
+}
+
+TEST_F(SessionTest, test_full_transcript_hash_period)
+{
+    // bob and alice take turns, so each of alice's messages acks bob's
+    std::vector<AppOps> user_mockops(2, *mockops);
+    for (auto& cur_mockops : user_mockops)
+        cur_mockops.c_in_session_protocol_version = c_np1sec_compact_protocol_version;
+
+    sign_in_users({"alice", "bob"}, user_mockops);
+    join_one_by_one();
+
+    for (uint32_t i = 0; i < 2 * c_full_transcript_hash_period; i++) {
+        chat_mocker_np1sec_plugin_send(mock_room_name, "Bob's turn", &server_states[1]);
+        mock_server.receive();
+        chat_mocker_np1sec_plugin_send(mock_room_name, "Alice's turn", &server_states[0]);
+        mock_server.receive();
+
+        EXPECT_EQ(i + 1, user_states[0]->ack_counters(mock_room_name).piggybacked_acks);
+        EXPECT_EQ((i + 1) / c_full_transcript_hash_period,
+                  user_states[0]->session_metrics(mock_room_name).counters.full_transcript_hashes_sent);
+    }
+
+    delete_users();
+}
+
+TEST_F(SessionTest, test_ratcheted_message_keys)
+{
+    // alice sends compact in-session messages, bob and charlie v1, all of
+    // them under message keys of their own
+    std::vector<std::string> user_nicks = {"alice", "bob", "charlie"};
+    std::vector<AppOps> user_mockops(user_nicks.size(), *mockops);
+    user_mockops[0].c_in_session_protocol_version = c_np1sec_compact_protocol_version;
+    for (auto& cur_mockops : user_mockops)
+        cur_mockops.c_ratchet_message_keys = true;
+
+    sign_in_users(user_nicks, user_mockops);
+    join_one_by_one();
+
+    const uint32_t no_of_rounds = 3;
+    for (uint32_t round = 0; round < no_of_rounds; round++)
+        for (size_t i = 0; i < user_nicks.size(); i++) {
+            chat_mocker_np1sec_plugin_send(mock_room_name, "Hello from " + user_nicks[i], &server_states[i]);
+            mock_server.receive();
+        }
+
+    for (size_t i = 0; i < user_nicks.size(); i++)
+        EXPECT_EQ(no_of_rounds * (user_nicks.size() - 1),
+                  user_states[i]->ack_counters(mock_room_name).user_messages_received);
+
+    delete_users();
+}
+
+TEST_F(SessionTest, test_fragmented_user_message)
+{
+    // every stanza of the room has to fit in what the transport carries
+    const size_t max_message_size = 512;
+    static size_t longest_stanza;
+    static std::string bob_received;
+    longest_stanza = 0;
+    bob_received.clear();
+
+    std::vector<AppOps> user_mockops(2, *mockops);
+    user_mockops[0].c_max_message_size = max_message_size;
+    user_mockops[0].send_bare = [](std::string room_name, std::string message, void* data) {
+        longest_stanza = std::max(longest_stanza, message.size());
+        send_bare(room_name, message, data);
+    };
+    user_mockops[1].display_message = [](std::string, std::string sender_nick, std::string message, void*) {
+        if (sender_nick == "alice")
+            bob_received = message;
+    };
+
+    sign_in_users({"alice", "bob"}, user_mockops);
+    join_one_by_one();
+
+    // join messages are not fragmented, only measure the user messages
+    longest_stanza = 0;
+    std::string paste;
+    for (unsigned int i = 0; paste.size() < 5000; i++)
+        paste += "line " + std::to_string(i) + " of a long paste\n";
+
+    chat_mocker_np1sec_plugin_send(mock_room_name, paste, &server_states[0]);
+    mock_server.receive();
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Got it.", &server_states[1]);
+    mock_server.receive();
+
+    EXPECT_EQ(paste, bob_received);
+    EXPECT_LE(longest_stanza, max_message_size);
+
+    // the fragments make one transcript entry
+    EXPECT_EQ(1u, user_states[1]->ack_counters(mock_room_name).user_messages_received);
+    EXPECT_EQ(1u, user_states[0]->ack_counters(mock_room_name).user_messages_received);
+
+    delete_users();
+}
+
+TEST_F(SessionTest, test_streamed_transfer)
+{
+    // chunks have to fit in what the transport carries too
+    const size_t max_message_size = 1024;
+    static size_t longest_stanza;
+    static std::string bob_received;
+    static uint32_t bob_chunks;
+    static bool bob_got_last_chunk;
+    longest_stanza = 0;
+    bob_received.clear();
+    bob_chunks = 0;
+    bob_got_last_chunk = false;
+
+    string alice = "alice";
+    AppOps alice_mockops = *mockops;
+    alice_mockops.c_max_message_size = max_message_size;
+    alice_mockops.send_bare = [](std::string room_name, std::string message, void* data) {
+        longest_stanza = std::max(longest_stanza, message.size());
+        send_bare(room_name, message, data);
+    };
+    std::pair<ChatMocker*, string> mock_aux_alice_data(&mock_server, alice);
+    alice_mockops.bare_sender_data = static_cast<void*>(&mock_aux_alice_data);
+    UserState* alice_state = new UserState(alice, &alice_mockops);
+    alice_state->init();
+
+    AppOps bob_mockops = *mockops;
+    string bob = "bob";
+    bob_mockops.receive_chunk = [](std::string, std::string sender_nick, std::string, uint32_t chunk_index,
+                                   std::string chunk, bool last_chunk, void*) {
+        EXPECT_EQ("alice", sender_nick);
+        EXPECT_EQ(bob_chunks, chunk_index);
+        EXPECT_FALSE(bob_got_last_chunk);
+        bob_received += chunk;
+        bob_chunks++;
+        bob_got_last_chunk = last_chunk;
+    };
+    std::pair<ChatMocker*, string> mock_aux_bob_data(&mock_server, bob);
+    bob_mockops.bare_sender_data = static_cast<void*>(&mock_aux_bob_data);
+    UserState* bob_state = new UserState(bob, &bob_mockops);
+    bob_state->init();
+
+    pair<UserState*, ChatMocker*> alice_server_state(alice_state, &mock_server);
+    pair<UserState*, ChatMocker*> bob_server_state(bob_state, &mock_server);
+
+    mock_server.sign_in(alice, chat_mocker_np1sec_plugin_receive_handler, static_cast<void*>(&alice_server_state));
+    mock_server.sign_in(bob, chat_mocker_np1sec_plugin_receive_handler, static_cast<void*>(&bob_server_state));
+
+    mock_server.join(mock_room_name, alice_state->user_nick());
+    mock_server.receive();
+
+    mock_server.join(mock_room_name, bob_state->user_nick());
+    mock_server.receive();
+
+    longest_stanza = 0;
+    std::string file;
+    for (unsigned int i = 0; file.size() < 20000; i++)
+        file += "line " + std::to_string(i) + " of a file\n";
+
+    // the app writes the file as it reads it, in pieces unrelated to chunks
+    std::string transfer_id = alice_state->begin_transfer(mock_room_name);
+    for (size_t written = 0; written < file.size(); written += 777) {
+        alice_state->write_transfer(mock_room_name, transfer_id, file.substr(written, 777));
+        mock_server.receive();
+    }
+    alice_state->finish_transfer(mock_room_name, transfer_id);
+    mock_server.receive();
+
+    EXPECT_EQ(file, bob_received);
+    EXPECT_TRUE(bob_got_last_chunk);
+    EXPECT_LT(1u, bob_chunks);
+    EXPECT_LE(longest_stanza, max_message_size);
+
+    // the transfer is over
+    EXPECT_THROW(alice_state->write_transfer(mock_room_name, transfer_id, "more"), InvalidDataException);
+
+    delete alice_state;
+    delete bob_state;
+}
+
+TEST_F(SessionTest, test_bundled_outbound_messages)
+{
+    const size_t max_message_size = 4096;
+    static uint32_t stanzas_sent;
+    static uint32_t bundles_sent;
+    static size_t longest_stanza;
+    static std::string charlie_received;
+    stanzas_sent = 0;
+    bundles_sent = 0;
+    longest_stanza = 0;
+    charlie_received.clear();
+
+    AppOps bundling_mockops = *mockops;
+    bundling_mockops.c_bundle_outbound_messages = true;
+    bundling_mockops.c_max_message_size = max_message_size;
+    bundling_mockops.send_bare = [](std::string room_name, std::string message, void* data) {
+        Message header;
+        stanzas_sent++;
+        if (header.peek_header(message) && header.message_type == Message::BUNDLE)
+            bundles_sent++;
+        longest_stanza = std::max(longest_stanza, message.size());
+        send_bare(room_name, message, data);
+    };
+
+    std::vector<std::string> nicks = {"alice", "bob", "charlie"};
+    std::vector<AppOps> user_mockops(nicks.size(), bundling_mockops);
+    user_mockops[2].display_message = [](std::string, std::string sender_nick, std::string message, void*) {
+        if (sender_nick == "alice")
+            charlie_received = message;
+    };
+
+    sign_in_users(nicks, user_mockops);
+    join_one_by_one();
+
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Hello, bundled room", &server_states[0]);
+    mock_server.receive();
+
+    // the handshakes send several messages per received one
+    EXPECT_LT(0u, bundles_sent);
+    EXPECT_LE(longest_stanza, max_message_size);
+    EXPECT_EQ("Hello, bundled room", charlie_received);
+
+    delete_users();
+}
+
+TEST_F(SessionTest, test_tree_key_agreement)
+{
+    static uint32_t group_shares_sent;
+    static std::string eve_received;
+    group_shares_sent = 0;
+    eve_received.clear();
+
+    AppOps tree_mockops = *mockops;
+    tree_mockops.c_tree_key_agreement_threshold = 3;
+    tree_mockops.send_bare = [](std::string room_name, std::string message, void* data) {
+        Message header;
+        if (header.peek_header(message) && header.message_type == Message::GROUP_SHARE)
+            group_shares_sent++;
+        send_bare(room_name, message, data);
+    };
+
+    std::vector<std::string> nicks = {"alice", "bob", "charlie", "david", "eve"};
+    std::vector<AppOps> user_mockops(nicks.size(), tree_mockops);
+    user_mockops[4].display_message = [](std::string, std::string sender_nick, std::string message, void*) {
+        if (sender_nick == "alice")
+            eve_received = message;
+    };
+
+    sign_in_users(nicks, user_mockops);
+
+    // from charlie on the joiners commit to the tree
+    join_one_by_one();
+
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Hello, tree", &server_states[0]);
+    mock_server.receive();
+    EXPECT_EQ("Hello, tree", eve_received);
+
+    // the leave is keyed by the sponsor alone
+    group_shares_sent = 0;
+    mock_server.intend_to_leave(mock_room_name, "charlie");
+    mock_server.receive();
+    mock_server.leave(mock_room_name, "charlie");
+    mock_server.receive();
+    EXPECT_EQ(1u, group_shares_sent);
+
+    chat_mocker_np1sec_plugin_send(mock_room_name, "Hello, smaller tree", &server_states[0]);
+    mock_server.receive();
+    EXPECT_EQ("Hello, smaller tree", eve_received);
+
+    delete_users();
+}
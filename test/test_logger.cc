@@ -18,7 +18,9 @@
 
 /* This test provides example usage for the logger */
 
+#include <chrono>
 #include <cstdio>
+#include <string>
 
 #include "contrib/gtest/include/gtest/gtest.h"
 #include "src/logger.h"
@@ -63,3 +65,46 @@ TEST_F(LoggerTest, test_logging)
     // Do not leave the log file lying around
     remove(log_file.c_str());
 }
+
+static uint32_t messages_made;
+
+static std::string make_message(std::string message)
+{
+    messages_made++;
+    return message;
+}
+
+TEST_F(LoggerTest, test_lazy_logging)
+{
+    messages_made = 0;
+    logger.set_threshold(WARN);
+
+    // below the threshold the message is never made
+    NP1SEC_LOG_DEBUG(make_message("This should not be made"), __FUNCTION__);
+    NP1SEC_LOG_INFO(make_message("This should not be made"), __FUNCTION__, "nobody");
+    NP1SEC_ASSERT_OR_DIE(true, make_message("This should not be made"));
+    EXPECT_EQ(0u, messages_made);
+    EXPECT_FALSE(logger.enabled(DEBUG));
+    EXPECT_TRUE(logger.enabled(ERROR));
+
+    NP1SEC_LOG_WARN(make_message("This should make it out"), __FUNCTION__);
+    EXPECT_EQ(1u, messages_made);
+
+    // against the eager call, which makes the message whatever the level
+    const uint32_t rounds = 100000;
+    auto eager_start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < rounds; i++)
+        logger.debug("own ctr before send: " + std::to_string(i), __FUNCTION__, "alice");
+    auto eager_time = std::chrono::steady_clock::now() - eager_start;
+
+    auto lazy_start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < rounds; i++)
+        NP1SEC_LOG_DEBUG("own ctr before send: " + std::to_string(i), __FUNCTION__, "alice");
+    auto lazy_time = std::chrono::steady_clock::now() - lazy_start;
+
+    std::cout << rounds << " debug logs below the threshold: eager "
+              << std::chrono::duration_cast<std::chrono::microseconds>(eager_time).count() << "us, lazy "
+              << std::chrono::duration_cast<std::chrono::microseconds>(lazy_time).count() << "us" << std::endl;
+
+    logger.set_threshold(default_log_level);
+}
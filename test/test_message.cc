@@ -16,6 +16,9 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <chrono>
+#include <vector>
+
 #include "contrib/gtest/include/gtest/gtest.h"
 //#include "contrib/gtest/gtest.h"
 #include "src/session.h"
@@ -82,6 +85,264 @@ TEST_F(MessageTest, test_user_message)
 
     // ASSERT_EQ(true, false);
 }
+
+TEST_F(MessageTest, test_peek_header)
+{
+    HashBlock sid;
+    np1sec::hash("mydummyhash", sid);
+    SessionId session_id(sid);
+    Cryptic cryptic;
+    cryptic.init();
+
+    Message outbound(&cryptic);
+    outbound.create_group_share_msg(session_id, hash_to_string_buff(sid));
+
+    Message header;
+    ASSERT_TRUE(header.peek_header(outbound.final_whole_message));
+    EXPECT_EQ(Message::GROUP_SHARE, header.message_type);
+    EXPECT_EQ(session_id.get_as_stringbuff(), header.session_id.get_as_stringbuff());
+
+    // the header is all we need, the rest can be missing
+    std::string header_quads = outbound.final_whole_message.substr(0, c_np1sec_protocol_name.size() + 48);
+    Message truncated_header;
+    ASSERT_TRUE(truncated_header.peek_header(header_quads));
+    EXPECT_EQ(session_id.get_as_stringbuff(), truncated_header.session_id.get_as_stringbuff());
+
+    Message too_short, not_np1sec;
+    EXPECT_FALSE(too_short.peek_header(header_quads.substr(0, header_quads.size() - 4)));
+    EXPECT_FALSE(not_np1sec.peek_header("Hello, I'm Alice!"));
+}
+
+/**
+ * Compares the per message overhead of the v1 and compact in-session
+ * formats for the same user message and checks the compact one
+ * round-trips.
+ */
+TEST_F(MessageTest, test_compact_in_session_message)
+{
+    HashBlock sid;
+    np1sec::hash("mydummyhash", sid);
+    SessionId session_id(sid);
+    Cryptic cryptic;
+    cryptic.init();
+    std::string user_message = "This is a test message";
+    HashStdBlock transcript_hash = hash_to_string_buff(sid);
+
+    Message v1_message(&cryptic);
+    v1_message.create_in_session_msg(session_id, 2, 17, 40, transcript_hash, Message::USER_MESSAGE, user_message);
+
+    Message compact_message(&cryptic);
+    compact_message.protocol_version = c_np1sec_compact_protocol_version;
+    compact_message.create_in_session_msg(session_id, 2, 17, 40,
+                                          transcript_hash.substr(0, c_truncated_transcript_hash_length),
+                                          Message::USER_MESSAGE, user_message);
+
+    Message header;
+    ASSERT_TRUE(header.peek_header(compact_message.final_whole_message));
+    EXPECT_TRUE(header.is_compact());
+    EXPECT_EQ(session_id.get_index(), header.session_index);
+
+    Message received(&cryptic);
+    ASSERT_EQ(PARSE_OK, received.parse(compact_message.final_whole_message));
+    EXPECT_EQ(2u, received.sender_index);
+    EXPECT_EQ(17u, received.sender_message_id);
+    EXPECT_EQ(40u, received.parent_id);
+    EXPECT_EQ(user_message, received.user_message);
+    EXPECT_TRUE(transcript_hash_matches(transcript_hash, received.transcript_chain_hash));
+
+    size_t v1_overhead = v1_message.final_whole_message.size() - user_message.size();
+    size_t compact_overhead = compact_message.final_whole_message.size() - user_message.size();
+    EXPECT_LT(compact_overhead, v1_overhead);
+
+    std::cout << "in-session overhead: v1 " << v1_overhead << " bytes/msg, compact " << compact_overhead
+              << " bytes/msg" << std::endl;
+}
+
+/**
+ * Checks the length of a cooked in-session message, known before it is
+ * signed and encrypted, is the length it has once sealed.
+ */
+TEST_F(MessageTest, test_sealed_length)
+{
+    HashBlock sid;
+    np1sec::hash("mydummyhash", sid);
+    SessionId session_id(sid);
+    Cryptic cryptic;
+    cryptic.init();
+    HashStdBlock transcript_hash = hash_to_string_buff(sid);
+
+    for (DTShort protocol_version : {c_np1sec_protocol_version, c_np1sec_compact_protocol_version}) {
+        for (size_t message_length : {0, 1, 2, 3, 1000}) {
+            Message message(&cryptic);
+            message.protocol_version = protocol_version;
+            message.cook_in_session_msg(session_id, 2, 300, 40, transcript_hash, Message::USER_MESSAGE,
+                                        std::string(message_length, 'm'));
+            size_t sealed_length = message.sealed_length();
+            message.append_msg_end(true);
+            EXPECT_EQ(message.final_whole_message.size(), sealed_length);
+        }
+    }
+}
+
+/**
+ * Compares the PARTICIPANTS_INFO traffic of a join into a 200 person room
+ * with full and delta session views and checks the delta expands to the
+ * full view.
+ */
+TEST_F(MessageTest, test_participant_info_delta)
+{
+    const size_t room_size = 200;
+    Cryptic cryptic;
+    cryptic.init();
+
+    UnauthenticatedParticipantList parent_view;
+    for (size_t i = 0; i < room_size - 1; i++) {
+        std::string nick = "p" + std::to_string(i);
+        parent_view.push_back(UnauthenticatedParticipant(ParticipantId(nick, np1sec::hash(nick + "fingerprint")),
+                                                         np1sec::hash(nick + "ephemeral"), true));
+    }
+
+    UnauthenticatedParticipantList changed_participants;
+    changed_participants.push_back(
+        UnauthenticatedParticipant(ParticipantId("joiner", np1sec::hash("joinerfingerprint")),
+                                   np1sec::hash("joinerephemeral"), false));
+    UnauthenticatedParticipantList joined_view = parent_view;
+    joined_view.push_back(changed_participants.front());
+
+    auto view_to_session_id = [](const UnauthenticatedParticipantList& view) {
+        ParticipantMap plist;
+        for (auto& cur_participant : view)
+            plist.insert(std::make_pair(cur_participant.participant_id.nickname, Participant(cur_participant)));
+        return SessionId(plist);
+    };
+    SessionId parent_session_id = view_to_session_id(parent_view);
+    SessionId session_id = view_to_session_id(joined_view);
+
+    std::string key_confirmation = np1sec::hash("key confirmation");
+    HashStdBlock z_sender = np1sec::hash("z sender");
+
+    Message full_view_message(&cryptic);
+    full_view_message.create_participant_info_msg(session_id, joined_view, key_confirmation, z_sender);
+
+    Message delta_view_message(&cryptic);
+    delta_view_message.create_participant_info_delta_msg(session_id, parent_session_id, changed_participants,
+                                                         std::vector<std::string>(), key_confirmation, z_sender);
+
+    Message received(nullptr);
+    ASSERT_EQ(PARSE_OK, received.parse(delta_view_message.final_whole_message));
+    ASSERT_TRUE(received.has_delta_view());
+    EXPECT_EQ(parent_session_id.get_as_stringbuff(), received.parent_session_id.get_as_stringbuff());
+    EXPECT_EQ(key_confirmation, received.key_confirmation);
+    EXPECT_THROW(received.get_session_view(), MessageFormatException);
+
+    // only the participants taking delta views are sent those
+    Message delta_view_header, full_view_header;
+    ASSERT_TRUE(delta_view_header.peek_header(delta_view_message.final_whole_message));
+    EXPECT_TRUE(delta_view_header.is_delta_view_capable());
+    ASSERT_TRUE(full_view_header.peek_header(full_view_message.final_whole_message));
+    EXPECT_FALSE(full_view_header.is_delta_view_capable());
+
+    // a view which doesn't match the sender's doesn't hash to the sid
+    UnauthenticatedParticipantList wrong_parent_view = parent_view;
+    wrong_parent_view.pop_back();
+    EXPECT_FALSE(received.apply_session_view_delta(wrong_parent_view));
+
+    ASSERT_TRUE(received.apply_session_view_delta(parent_view));
+    EXPECT_FALSE(received.has_delta_view());
+    EXPECT_EQ(room_size, received.get_session_view().size());
+
+    // every member replies to the join, only one of them with the full view
+    size_t full_view_traffic = (room_size - 1) * full_view_message.final_whole_message.size();
+    size_t delta_view_traffic =
+        full_view_message.final_whole_message.size() + (room_size - 2) * delta_view_message.final_whole_message.size();
+    EXPECT_GT(full_view_traffic, 10 * delta_view_traffic);
+
+    std::cout << "participant info traffic of a join into " << room_size << " person room: full views "
+              << full_view_traffic << " bytes, delta views " << delta_view_traffic << " bytes" << std::endl;
+}
+
+/**
+ * Checks a joiner tells it takes delta session views in the last byte of
+ * its join request, which older peers don't read.
+ */
+TEST_F(MessageTest, test_join_request_takes_delta_views)
+{
+    UnauthenticatedParticipant joiner(ParticipantId("joiner", np1sec::hash("joinerfingerprint")),
+                                      np1sec::hash("joinerephemeral"), true);
+    std::string plain_entry = joiner.unauthed_participant_to_stringbuffer();
+    joiner.takes_delta_views = true;
+
+    Message join_message;
+    join_message.create_join_request_msg(joiner);
+
+    Message received(nullptr);
+    ASSERT_EQ(PARSE_OK, received.parse(join_message.final_whole_message));
+    UnauthenticatedParticipant received_joiner(received.joiner_info);
+    EXPECT_TRUE(received_joiner.takes_delta_views);
+    EXPECT_TRUE(received_joiner.authenticated);
+    EXPECT_EQ(plain_entry.substr(0, plain_entry.size() - 1),
+              received.joiner_info.substr(0, received.joiner_info.size() - 1));
+
+    // entries without the flag stay as they were
+    EXPECT_EQ(1, plain_entry.back());
+    EXPECT_FALSE(UnauthenticatedParticipant(plain_entry).takes_delta_views);
+}
+
+/**
+ * Benchmarks rejecting a storm of malformed messages through the
+ * exception-free parse() against the throwing constructor.
+ */
+TEST_F(MessageTest, test_malformed_input_storm)
+{
+    HashBlock sid;
+    np1sec::hash("mydummyhash", sid);
+    SessionId session_id(sid);
+    Cryptic cryptic;
+    cryptic.init();
+
+    Message outbound(&cryptic);
+    outbound.create_group_share_msg(session_id, hash_to_string_buff(sid));
+    std::string b64ed_message = outbound.final_whole_message.substr(c_np1sec_protocol_name.size());
+
+    // truncated messages, a wrong version and a plain text message
+    std::vector<std::string> malformed_messages;
+    for (size_t quads = 1; quads * 4 < b64ed_message.size(); quads++)
+        malformed_messages.push_back(c_np1sec_protocol_name + b64ed_message.substr(0, quads * 4));
+    malformed_messages.push_back(c_np1sec_protocol_name + "AAIN" + b64ed_message.substr(4));
+    malformed_messages.push_back("Hello, I'm Alice!");
+
+    const unsigned int storm_size = 20000;
+    logger.set_threshold(WARN); // not to measure the debug output
+
+    unsigned int parse_rejects = 0;
+    auto parse_start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < storm_size; i++) {
+        Message received(nullptr);
+        if (received.parse(malformed_messages[i % malformed_messages.size()]) != PARSE_OK)
+            parse_rejects++;
+    }
+    std::chrono::duration<double> parse_time = std::chrono::steady_clock::now() - parse_start;
+
+    unsigned int exception_rejects = 0;
+    auto exception_start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < storm_size; i++) {
+        try {
+            Message received(malformed_messages[i % malformed_messages.size()], nullptr);
+        } catch (std::exception& e) {
+            exception_rejects++;
+        }
+    }
+    std::chrono::duration<double> exception_time = std::chrono::steady_clock::now() - exception_start;
+
+    logger.set_threshold(default_log_level);
+
+    EXPECT_EQ(storm_size, parse_rejects);
+    EXPECT_EQ(storm_size, exception_rejects);
+
+    std::cout << "malformed input storm: parse() rejects " << static_cast<uint64_t>(storm_size / parse_time.count())
+              << " msg/s, throwing constructor rejects " << static_cast<uint64_t>(storm_size / exception_time.count())
+              << " msg/s" << std::endl;
+}
 /*
 TEST_F(MessageTest, test_join_auth){
   std::string room_name = "test_room_name";
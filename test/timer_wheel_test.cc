@@ -0,0 +1,227 @@
+/**
+ * Multiparty Off-the-Record Messaging library
+ * Copyright (C) 2014, eQualit.ie
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of version 3 of the GNU Lesser General
+ * Public License as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <chrono>
+#include <utility>
+#include <vector>
+
+#include <event2/event.h>
+
+#include "contrib/gtest/include/gtest/gtest.h"
+#include "src/timer_wheel.h"
+
+using namespace np1sec;
+
+class TimerWheelTest : public ::testing::Test
+{
+  protected:
+    static std::vector<uint32_t> fired;
+
+    static void record_fire(void* opdata)
+    {
+        fired.push_back(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(opdata)));
+    }
+
+    static void host_fire(evutil_socket_t, short, void*) {}
+
+    static void* as_opdata(uint32_t id) { return reinterpret_cast<void*>(static_cast<uintptr_t>(id)); }
+
+    virtual void SetUp() { fired.clear(); }
+};
+
+std::vector<uint32_t> TimerWheelTest::fired;
+
+TEST_F(TimerWheelTest, test_fire_in_order)
+{
+    TimerWheel wheel(10);
+    wheel.set_timer(record_fire, as_opdata(3), 300);
+    wheel.set_timer(record_fire, as_opdata(1), 5);
+    wheel.set_timer(record_fire, as_opdata(2), 20);
+    EXPECT_EQ(3u, wheel.size());
+
+    // nothing fires before its interval is over
+    wheel.tick();
+    EXPECT_EQ(std::vector<uint32_t>({1}), fired);
+    wheel.advance(15);
+    EXPECT_EQ(std::vector<uint32_t>({1, 2}), fired);
+    wheel.advance(269);
+    EXPECT_EQ(2u, fired.size());
+    wheel.advance(6);
+    EXPECT_EQ(std::vector<uint32_t>({1, 2, 3}), fired);
+    EXPECT_EQ(0u, wheel.size());
+}
+
+TEST_F(TimerWheelTest, test_axe_and_stale_handles)
+{
+    TimerWheel wheel(1);
+    void* axed = wheel.set_timer(record_fire, as_opdata(1), 10);
+    void* fires = wheel.set_timer(record_fire, as_opdata(2), 10);
+    wheel.axe_timer(axed);
+    wheel.advance(10);
+    EXPECT_EQ(std::vector<uint32_t>({2}), fired);
+
+    // the freed slots are reused, the old handles must not hit the new timers
+    void* reused = wheel.set_timer(record_fire, as_opdata(3), 10);
+    wheel.set_timer(record_fire, as_opdata(4), 10);
+    wheel.axe_timer(axed);
+    wheel.axe_timer(fires);
+    wheel.axe_timer(nullptr);
+    EXPECT_EQ(2u, wheel.size());
+    wheel.axe_timer(reused);
+    wheel.advance(10);
+    EXPECT_EQ(std::vector<uint32_t>({2, 4}), fired);
+}
+
+TEST_F(TimerWheelTest, test_cascade_through_levels)
+{
+    TimerWheel wheel(1);
+    std::vector<uint32_t> intervals = {1, 63, 64, 65, 4095, 4096, 4097, 262143, 262144, 300000, 20000000};
+    for (auto interval : intervals)
+        wheel.set_timer(record_fire, as_opdata(interval), interval);
+
+    // tick by tick, so we see each of them fire exactly on time
+    uint64_t now = 0;
+    for (size_t i = 0; i < intervals.size(); i++) {
+        for (; now < intervals[i] - 1; now++)
+            wheel.tick();
+        EXPECT_EQ(i, fired.size()) << intervals[i];
+        wheel.tick();
+        now++;
+        ASSERT_EQ(i + 1, fired.size());
+        EXPECT_EQ(intervals[i], fired.back());
+    }
+
+    EXPECT_EQ(intervals, fired);
+}
+
+TEST_F(TimerWheelTest, test_rearm_from_callback)
+{
+    static TimerWheel* rearming_wheel;
+    static uint32_t rounds;
+    TimerWheel wheel(10);
+    rearming_wheel = &wheel;
+    rounds = 0;
+
+    wheel.set_timer(
+        [](void*) {
+            if (++rounds < 5)
+                rearming_wheel->set_timer([](void*) {}, nullptr, 0);
+        },
+        nullptr, 10);
+    wheel.advance(10);
+    EXPECT_EQ(1u, rounds);
+    EXPECT_EQ(1u, wheel.size());
+    wheel.advance(10);
+    EXPECT_EQ(0u, wheel.size());
+}
+
+TEST_F(TimerWheelTest, test_self_driven)
+{
+    static std::vector<std::pair<TimerWheel::TimerCallback, void*>> host_timers;
+    static int host_handle;
+    host_timers.clear();
+
+    TimerWheel wheel(
+        1,
+        [](TimerWheel::TimerCallback timer_callback, void* opdata, uint32_t, void*) {
+            host_timers.push_back(std::make_pair(timer_callback, opdata));
+            return static_cast<void*>(&host_handle);
+        },
+        [](void*, void*) { host_timers.clear(); }, nullptr);
+
+    // one host timer however many timers the wheel has
+    for (uint32_t i = 0; i < 100; i++)
+        wheel.set_timer(record_fire, as_opdata(i), 2);
+    EXPECT_EQ(1u, host_timers.size());
+
+    auto due = std::chrono::steady_clock::now() + std::chrono::milliseconds(3);
+    while (std::chrono::steady_clock::now() < due)
+        ;
+    auto host_tick = host_timers.back();
+    host_timers.pop_back();
+    host_tick.first(host_tick.second);
+    EXPECT_EQ(100u, fired.size());
+
+    // and none while it is idle
+    EXPECT_TRUE(host_timers.empty());
+    void* timer = wheel.set_timer(record_fire, nullptr, 10);
+    EXPECT_EQ(1u, host_timers.size());
+    wheel.axe_timer(timer);
+    EXPECT_TRUE(host_timers.empty());
+}
+
+/**
+ * Arms the ack, farewell, rejoin and session life timers of 10k sessions,
+ * then rearms their ack timers as if they were chatting and axes them all,
+ * once on the wheel and once straight on libevent, the way a host would
+ * implement set_timer.
+ */
+TEST_F(TimerWheelTest, test_wheel_vs_host_timers_benchmark)
+{
+    const uint32_t session_count = 10000;
+    const uint32_t timers_per_session = 4;
+    const uint32_t rounds = 10;
+    const uint32_t intervals[timers_per_session] = {100, 1000, 3000, 60000};
+    uint64_t timer_ops = 0;
+
+    TimerWheel wheel(10);
+    std::vector<void*> wheel_timers(session_count * timers_per_session);
+    auto wheel_start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < wheel_timers.size(); i++, timer_ops++)
+        wheel_timers[i] = wheel.set_timer(record_fire, nullptr, intervals[i % timers_per_session]);
+    for (uint32_t round = 0; round < rounds; round++) {
+        for (uint32_t i = 0; i < wheel_timers.size(); i += timers_per_session, timer_ops += 2) {
+            wheel.axe_timer(wheel_timers[i]);
+            wheel_timers[i] = wheel.set_timer(record_fire, nullptr, intervals[0]);
+        }
+        wheel.advance(10);
+    }
+    for (auto cur_timer : wheel_timers)
+        wheel.axe_timer(cur_timer);
+    auto wheel_time = std::chrono::steady_clock::now() - wheel_start;
+    EXPECT_EQ(0u, wheel.size());
+    EXPECT_TRUE(fired.empty());
+
+    struct event_base* base = event_base_new();
+    std::vector<struct event*> host_timers(session_count * timers_per_session);
+    auto host_start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < host_timers.size(); i++) {
+        struct timeval timeout = {intervals[i % timers_per_session] / 1000,
+                                  static_cast<long>(intervals[i % timers_per_session] % 1000) * 1000};
+        host_timers[i] = evtimer_new(base, host_fire, nullptr);
+        evtimer_add(host_timers[i], &timeout);
+    }
+    for (uint32_t round = 0; round < rounds; round++) {
+        for (uint32_t i = 0; i < host_timers.size(); i += timers_per_session) {
+            struct timeval timeout = {0, static_cast<long>(intervals[0]) * 1000};
+            event_free(host_timers[i]);
+            host_timers[i] = evtimer_new(base, host_fire, nullptr);
+            evtimer_add(host_timers[i], &timeout);
+        }
+        event_base_loop(base, EVLOOP_NONBLOCK);
+    }
+    for (auto cur_timer : host_timers)
+        event_free(cur_timer);
+    auto host_time = std::chrono::steady_clock::now() - host_start;
+    event_base_free(base);
+
+    std::cout << "timer ops for " << session_count << " sessions: " << timer_ops << ", wheel "
+              << std::chrono::duration_cast<std::chrono::microseconds>(wheel_time).count() << "us, host timers "
+              << std::chrono::duration_cast<std::chrono::microseconds>(host_time).count() << "us, "
+              << session_count * timers_per_session << " host timers live vs 1" << std::endl;
+}